@@ -0,0 +1,25 @@
+#pragma once
+
+#include <geometry/pixel_format.hpp>
+#include <geometry/thread_pool.hpp>
+
+#include <cstdint>
+
+// Block compression encoders used when baking textures. Blocks are read from
+// tightly packed RGBA8 texels, 16 per block in row order.
+
+// BC7 mode 6: one subset with 7.7.7.7 endpoints, per-endpoint p-bits and
+// 4-bit indices. Endpoints follow the block's principal axis.
+void encode_bc7_block(const uint8_t rgba[64], uint8_t out[16]);
+
+// BC4 of one channel (0-3) of the block, 8 bytes
+void encode_bc4_block(const uint8_t rgba[64], int channel, uint8_t out[8]);
+
+// BC5 from the red and green channels, 16 bytes
+void encode_bc5_block(const uint8_t rgba[64], uint8_t out[16]);
+
+// Encodes a width x height RGBA8 image to format (bc4_unorm, bc5_unorm or
+// bc7_*), splitting rows of blocks across pool. Edge blocks repeat the last
+// row and column. Writes get_level_size(format, width, height) bytes.
+void encode_bc_image(const uint8_t *rgba, uint32_t width, uint32_t height,
+                     PixelFormat format, uint8_t *out, ThreadPool &pool);
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <geometry/thread_pool.hpp>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Axis-aligned bounding box, empty until grown
+struct Aabb {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+    void grow(const glm::vec3 &point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void grow(const Aabb &box) {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+
+    float surface_area() const {
+        const glm::vec3 extent = max - min;
+        if (extent.x < 0.0f) {
+            return 0.0f;
+        }
+        return 2.0f *
+               (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+};
+
+// 32-byte node, stored depth-first so an interior node's left child follows
+// it and only the right child needs an index
+struct BvhNode {
+    glm::vec3 min;
+    uint32_t offset; // right child, or first entry of indices for leaves
+    glm::vec3 max;
+    uint32_t count; // primitives in a leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+enum class BvhSplit {
+    sah,    // binned surface area heuristic
+    median, // median centroid along the longest axis
+};
+
+// Bounding volume hierarchy over primitive boxes. Nodes are split with a
+// binned SAH (Wald, "On fast Construction of SAH-based Bounding Volume
+// Hierarchies", 2007). Subtrees above a size threshold become tasks on a
+// ThreadPool, and the finished tree is flattened depth-first into nodes.
+class Bvh {
+  public:
+    static constexpr uint32_t bins = 16;
+    static constexpr uint32_t max_leaf_size = 8;
+    // Deepest a tree gets, enough for a traversal stack
+    static constexpr uint32_t max_depth = 64;
+    // Smallest subtree built as its own task
+    static constexpr uint32_t task_threshold = 4096;
+    // SAH costs relative to one primitive intersection
+    static constexpr float traversal_cost = 1.0f;
+    static constexpr float intersection_cost = 1.0f;
+
+    std::vector<BvhNode> nodes;
+    // Primitive indices referenced by the leaves, in leaf order
+    std::vector<uint32_t> indices;
+
+  private:
+    struct BuildNode;
+    struct BuildState;
+    std::unique_ptr<BuildState> state;
+
+    void build_node(BuildNode &node, uint32_t begin, uint32_t end,
+                    uint32_t depth);
+    uint32_t flatten(const BuildNode &node);
+
+  public:
+    Bvh();
+    ~Bvh();
+    Bvh(Bvh &&other) noexcept;
+    Bvh &operator=(Bvh &&other) noexcept;
+
+    // Builds on the calling thread, or splits into tasks on pool if given.
+    // Waits for pool to go idle, so must not run on one of its threads.
+    void build(const std::vector<Aabb> &boxes, ThreadPool *pool = nullptr,
+               BvhSplit split = BvhSplit::sah);
+
+    // Builds in the background on pool, so several trees can share it.
+    // Call finish_build() once pool->wait_idle() returns.
+    void start_build(std::vector<Aabb> boxes, ThreadPool &pool,
+                     BvhSplit split = BvhSplit::sah);
+    void finish_build();
+
+    bool empty() const { return nodes.empty(); }
+
+    // Visits the leaves a ray overlaps within [tmin, tmax], nearer children
+    // first. leaf(first, count) tests indices[first, first + count) and
+    // returns the new tmax, e.g. the closest hit so far. Returning less than
+    // tmin stops the traversal.
+    template <typename LeafFunction>
+    void traverse(const glm::vec3 &origin, const glm::vec3 &inv_direction,
+                  float tmin, float tmax, LeafFunction &&leaf) const;
+
+    // Visits the leaves within sqrt(max_distance2) of point, nearer children
+    // first. leaf(first, count) returns the new squared distance bound.
+    template <typename LeafFunction>
+    void traverse_nearest(const glm::vec3 &point, float max_distance2,
+                          LeafFunction &&leaf) const;
+
+    // Expected cost of a ray that hits the root, as used by the builder:
+    // node surface areas relative to the root, weighted by traversal_cost
+    // for interior nodes and intersection_cost per primitive for leaves
+    float sah_cost() const;
+};
+
+// Slab test, returns the entry distance or max float if the ray misses the
+// box within [tmin, tmax]
+inline float intersect_aabb(const glm::vec3 &min, const glm::vec3 &max,
+                            const glm::vec3 &origin,
+                            const glm::vec3 &inv_direction, float tmin,
+                            float tmax) {
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (min[axis] - origin[axis]) * inv_direction[axis];
+        float t1 = (max[axis] - origin[axis]) * inv_direction[axis];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmin > tmax) {
+            return std::numeric_limits<float>::max();
+        }
+    }
+    return tmin;
+}
+
+// Squared distance from point to the box, 0 inside it
+inline float distance2_aabb(const glm::vec3 &min, const glm::vec3 &max,
+                            const glm::vec3 &point) {
+    const glm::vec3 d = glm::max(glm::max(min - point, point - max),
+                                 glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+template <typename LeafFunction>
+void Bvh::traverse(const glm::vec3 &origin, const glm::vec3 &inv_direction,
+                   float tmin, float tmax, LeafFunction &&leaf) const {
+    constexpr float miss = std::numeric_limits<float>::max();
+    if (nodes.empty() || intersect_aabb(nodes[0].min, nodes[0].max, origin,
+                                        inv_direction, tmin, tmax) == miss) {
+        return;
+    }
+
+    // Far children with their entry distance, skipped once a closer hit
+    // is found
+    struct Entry {
+        uint32_t node;
+        float t;
+    };
+    Entry stack[max_depth];
+    uint32_t stack_size = 0;
+    uint32_t node_index = 0;
+    while (true) {
+        const BvhNode &node = nodes[node_index];
+        if (node.is_leaf()) {
+            tmax = leaf(node.offset, node.count);
+            if (tmax < tmin) {
+                return;
+            }
+        } else {
+            uint32_t near_child = node_index + 1;
+            uint32_t far_child = node.offset;
+            float near_t =
+                intersect_aabb(nodes[near_child].min, nodes[near_child].max,
+                               origin, inv_direction, tmin, tmax);
+            float far_t =
+                intersect_aabb(nodes[far_child].min, nodes[far_child].max,
+                               origin, inv_direction, tmin, tmax);
+            if (far_t < near_t) {
+                std::swap(near_child, far_child);
+                std::swap(near_t, far_t);
+            }
+            if (near_t != miss) {
+                if (far_t != miss) {
+                    stack[stack_size++] = {far_child, far_t};
+                }
+                node_index = near_child;
+                continue;
+            }
+        }
+        do {
+            if (stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while (stack[stack_size].t > tmax);
+        node_index = stack[stack_size].node;
+    }
+}
+
+template <typename LeafFunction>
+void Bvh::traverse_nearest(const glm::vec3 &point, float max_distance2,
+                           LeafFunction &&leaf) const {
+    if (nodes.empty() ||
+        distance2_aabb(nodes[0].min, nodes[0].max, point) > max_distance2) {
+        return;
+    }
+
+    struct Entry {
+        uint32_t node;
+        float distance2;
+    };
+    Entry stack[max_depth];
+    uint32_t stack_size = 0;
+    uint32_t node_index = 0;
+    while (true) {
+        const BvhNode &node = nodes[node_index];
+        if (node.is_leaf()) {
+            max_distance2 = leaf(node.offset, node.count);
+        } else {
+            uint32_t near_child = node_index + 1;
+            uint32_t far_child = node.offset;
+            float near_d = distance2_aabb(nodes[near_child].min,
+                                          nodes[near_child].max, point);
+            float far_d = distance2_aabb(nodes[far_child].min,
+                                         nodes[far_child].max, point);
+            if (far_d < near_d) {
+                std::swap(near_child, far_child);
+                std::swap(near_d, far_d);
+            }
+            if (near_d <= max_distance2) {
+                if (far_d <= max_distance2) {
+                    stack[stack_size++] = {far_child, far_d};
+                }
+                node_index = near_child;
+                continue;
+            }
+        }
+        do {
+            if (stack_size == 0) {
+                return;
+            }
+            stack_size--;
+        } while (stack[stack_size].distance2 > max_distance2);
+        node_index = stack[stack_size].node;
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <geometry/geometry.hpp>
+#include <geometry/scene_bvh.hpp>
+#include <renderer/camera.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Time and work of one CpuTracer::render()
+struct CpuRenderStats {
+    double ms = 0.0;
+    uint64_t samples = 0; // pixel samples
+    uint64_t rays = 0;    // every traced ray, shadow rays included
+    size_t tiles = 0;
+    size_t steals = 0; // tiles rendered by a thread they were not dealt to
+    unsigned int threads = 0;
+
+    double samples_per_second() const {
+        return ms > 0.0 ? samples / (ms / 1e3) : 0.0;
+    }
+};
+
+// Reference path tracer on the CPU. Runs the algorithm of shader.rgen,
+// shader.rchit and shader.rmiss against a SceneBvh, so images can be compared
+// against the GPU with texture LOD off. Textures are sampled bilinearly from
+// their top level.
+class CpuTracer {
+  public:
+    static constexpr uint32_t tile_size = 16;
+    static constexpr uint32_t max_depth = 5; // as in shader.rchit
+
+  private:
+    // MaterialData with the flags spelled out
+    struct SurfaceMaterial {
+        glm::vec4 base_color_factor = glm::vec4(1.0f);
+        glm::vec3 emissive_factor = glm::vec3(0.0f);
+        float metallic_factor = 0.0f;
+        float roughness_factor = 1.0f;
+        float transmission = 0.0f;
+        float alpha_cutoff = 0.5f;
+        float normal_scale = 1.0f;
+        int32_t base_color_texture = -1;
+        int32_t normal_texture = -1;
+        int32_t metallic_roughness_texture = -1;
+        int32_t emissive_texture = -1;
+        bool alpha_mask = false;
+        bool alpha_blend = false;
+        bool double_sided = false;
+    };
+
+    struct SurfaceTexture {
+        std::shared_ptr<TextureMap> map;
+        SamplerState sampler;
+        bool srgb;
+    };
+
+    // Shading data of a SceneBvh instance
+    struct Instance {
+        const Primitive *primitive;
+        glm::mat4 to_world;     // gl_ObjectToWorldEXT
+        glm::mat3 normal_world; // transpose of mat3(gl_WorldToObjectEXT)
+        uint32_t material;
+    };
+
+    // RayPayload of payload.glsl without the ray cone, which only feeds
+    // texture LOD
+    struct Payload {
+        glm::vec4 color;
+        uint32_t depth;
+        bool hit;
+        float t;
+        float transmission;
+    };
+
+    // Per-sample state the shaders read from builtins and push constants
+    struct SampleState {
+        uint32_t x;
+        uint32_t y;
+        uint32_t rand;
+        float rmin;
+        float rmax;
+        uint64_t rays;
+    };
+
+    std::vector<SurfaceMaterial> materials;
+    std::vector<SurfaceTexture> textures;
+    std::vector<Instance> instances;
+    std::unique_ptr<SceneBvh> bvh;
+
+    glm::vec4 sample_texture(int32_t index, glm::vec2 uv) const;
+
+    void trace(SampleState &state, Payload &payload, const glm::vec3 &origin,
+               float tmin, const glm::vec3 &direction, float tmax) const;
+
+    void closest_hit(SampleState &state, Payload &payload,
+                     const glm::vec3 &origin, const glm::vec3 &direction,
+                     const RayHit &hit) const;
+
+    void miss(Payload &payload, const glm::vec3 &direction) const;
+
+    // One sample of shader.rgen, tonemapped as it is before accumulation
+    glm::vec3 render_sample(SampleState &state, const RTCamera &camera,
+                            uint32_t width, uint32_t height) const;
+
+  public:
+    // Decodes the scene's textures and builds the BVH over every object
+    explicit CpuTracer(Scene &scene);
+
+    // Renders samples per pixel into rgba (RGBA8, top row first) on
+    // num_threads threads, 0 for one per hardware thread. Sample i uses the
+    // i-th random number the renderer draws after set_random_seed(seed), so
+    // it traces the same rays as the GPU's i-th frame.
+    CpuRenderStats render(const RTCamera &camera, uint32_t width,
+                          uint32_t height, uint32_t samples, uint32_t seed,
+                          unsigned int num_threads,
+                          std::vector<uint8_t> &rgba) const;
+};
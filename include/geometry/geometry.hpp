@@ -2,6 +2,8 @@
 
 #include <renderer/vulkan.hpp>
 
+#include <geometry/texture.hpp>
+
 #include <GLFW/glfw3.h>
 #include <cstddef>
 #include <filesystem>
@@ -9,56 +11,38 @@
 #include <iostream>
 #include <string>
 #include <tiny_gltf.h>
+#include <unordered_map>
 #include <vector>
 
-class TextureMap {
-    std::vector<unsigned char> map;
-    int w = 0, h = 0, c = 0;
-
+class Material {
   public:
-    enum TextureType {
-        baseColorTexture,
-        normalTexture,
-        emissiveTexture,
-        occlusionTexture,
-        metallicRoughnessTexture,
-    };
-
-    TextureMap() = default;
-    TextureMap(tinygltf::Image &image, TextureType texture_type);
-    TextureMap(glm::vec4 value, TextureType texture_type);
-
-    uint8_t *data() { return map.data(); }
-    int height() { return h; }
-    int width() { return w; }
-    int channels() { return c; }
-
-    void free_texture_map();
-
-    TextureType type() { return texture_type; }
+    enum class AlphaMode { opaque, mask, blend };
 
   private:
-    TextureType texture_type;
-};
-
-class Material {
     std::string name;
-    std::filesystem::path dir;
 
     double base_color[4];
-    double emissive[3];
+    double emissive[3]; // includes KHR_materials_emissive_strength
     double metallic;
     double roughness;
     double transmission;
+    double normal_scale;
 
-    std::vector<TextureMap> textures;
+    AlphaMode alpha_mode;
+    double alpha_cutoff;
+    bool double_sided;
+
+    // Indices into the scene texture table, -1 if the slot has no texture
+    int32_t base_color_texture;
+    int32_t normal_texture;
+    int32_t emissive_texture;
+    int32_t metallic_roughness_texture;
 
   public:
     Material() = default;
 
     Material(tinygltf::Material &material, tinygltf::Model &model,
-             std::filesystem::path base_directory)
-        : dir(base_directory) {
+             TextureRegistry &textures) {
         name = material.name;
 
         memcpy(base_color, material.pbrMetallicRoughness.baseColorFactor.data(),
@@ -67,6 +51,7 @@ class Material {
 
         roughness = material.pbrMetallicRoughness.roughnessFactor;
         metallic = material.pbrMetallicRoughness.metallicFactor;
+        normal_scale = material.normalTexture.scale;
 
         const auto &it = material.extensions.find("KHR_materials_transmission");
         if (it != material.extensions.end()) {
@@ -75,101 +60,80 @@ class Material {
             transmission = 0;
         }
 
-        std::cout << name << ": \n";
-        if (material.pbrMetallicRoughness.baseColorTexture.index >= 0) {
-            uint32_t texture_index =
-                material.pbrMetallicRoughness.baseColorTexture.index;
-            uint32_t i = model.textures[texture_index].source;
-            std::string file_path = (dir / model.images[i].uri).string();
-            if (model.images[i].component != 4) {
-                throw std::runtime_error(
-                    "Base color texture must have 4 channels");
+        const auto &strength =
+            material.extensions.find("KHR_materials_emissive_strength");
+        if (strength != material.extensions.end() &&
+            strength->second.Has("emissiveStrength")) {
+            const double value =
+                strength->second.Get("emissiveStrength").GetNumberAsDouble();
+            for (double &channel : emissive) {
+                channel *= value;
             }
-            textures.push_back(TextureMap(
-                model.images[i], TextureMap::TextureType::baseColorTexture));
-            std::cout << "\tBase color: " << model.images[i].uri << std::endl;
-        } else {
-            // Create a 1x1 texture with the base color
-            glm::vec4 base_color_vec(base_color[0], base_color[1],
-                                     base_color[2], base_color[3]);
-            textures.push_back(TextureMap(
-                base_color_vec, TextureMap::TextureType::baseColorTexture));
         }
 
-        if (material.normalTexture.index >= 0) {
-            uint32_t texture_index = material.normalTexture.index;
-            uint32_t i = model.textures[texture_index].source;
-
-            std::string file_path = (dir / model.images[i].uri).string();
-            if (model.images[i].component != 4) {
-                throw std::runtime_error("Normal texture must have 4 channels");
-            }
-            textures.push_back(TextureMap(
-                model.images[i], TextureMap::TextureType::normalTexture));
-            std::cout << "\tNormal Texture: " << model.images[i].uri
-                      << std::endl;
+        if (material.alphaMode == "MASK") {
+            alpha_mode = AlphaMode::mask;
+        } else if (material.alphaMode == "BLEND") {
+            alpha_mode = AlphaMode::blend;
         } else {
-            glm::vec4 normal_map_vec(0.0f, 0.0f, 1.0f, 0.0f);
-            textures.push_back(TextureMap(
-                normal_map_vec, TextureMap::TextureType::normalTexture));
+            alpha_mode = AlphaMode::opaque;
         }
+        alpha_cutoff = material.alphaCutoff;
+        double_sided = material.doubleSided;
+
+        base_color_texture = textures.acquire(
+            model, material.pbrMetallicRoughness.baseColorTexture.index,
+            TextureMap::TextureType::baseColorTexture);
+        normal_texture =
+            textures.acquire(model, material.normalTexture.index,
+                             TextureMap::TextureType::normalTexture);
+        emissive_texture =
+            textures.acquire(model, material.emissiveTexture.index,
+                             TextureMap::TextureType::emissiveTexture);
+        metallic_roughness_texture = textures.acquire(
+            model, material.pbrMetallicRoughness.metallicRoughnessTexture.index,
+            TextureMap::TextureType::metallicRoughnessTexture);
 
-        if (material.emissiveTexture.index >= 0) {
-            uint32_t texture_index = material.emissiveTexture.index;
-            uint32_t i = model.textures[texture_index].source;
-
-            std::string file_path = (dir / model.images[i].uri).string();
-
-            if (model.images[i].component == 4 ||
-                model.images[i].component == 3) {
-                textures.push_back(TextureMap(
-                    model.images[i], TextureMap::TextureType::emissiveTexture));
-            }
-            else {
-                std::cout << "Component: " << model.images[i].component
-                          << std::endl;
-                throw std::runtime_error(
-                    "Emissive texture must have 3 or 4 channels");
-            }
-
-            std::cout << "\tEmissive Texture: " << model.images[i].uri
-                      << std::endl;
-        } else {
-            glm::vec4 emissive_vec(emissive[0], emissive[1], emissive[2], 0.0f);
-            textures.push_back(TextureMap(
-                emissive_vec, TextureMap::TextureType::emissiveTexture));
-        }
+        std::cout << name << ": \n";
+        std::cout << "\tBase color texture: " << base_color_texture << "\n";
+        std::cout << "\tNormal texture: " << normal_texture << "\n";
+        std::cout << "\tEmissive texture: " << emissive_texture << "\n";
+        std::cout << "\tMetallic roughness texture: "
+                  << metallic_roughness_texture << std::endl;
+    }
 
-        if (material.pbrMetallicRoughness.metallicRoughnessTexture.index >= 0) {
-            uint32_t texture_index =
-                material.pbrMetallicRoughness.metallicRoughnessTexture.index;
-            uint32_t i = model.textures[texture_index].source;
-            std::string file_path = (dir / model.images[i].uri).string();
-
-            textures.push_back(
-                TextureMap(model.images[i],
-                           TextureMap::TextureType::metallicRoughnessTexture));
-            std::cout << "\tMetallic Roughness Texture: " << model.images[i].uri
-                      << std::endl;
-        } else {
-            glm::vec4 metallic_roughness_vec(metallic, roughness, 0.0f, 0.0f);
-            textures.push_back(
-                TextureMap(metallic_roughness_vec,
-                           TextureMap::TextureType::metallicRoughnessTexture));
-        }
+    glm::vec4 get_base_color() {
+        return glm::vec4(base_color[0], base_color[1], base_color[2],
+                         base_color[3]);
     }
 
-    void cleanup() {
-        for (auto &texture : textures) {
-            texture.free_texture_map();
-        }
+    glm::vec3 get_emissive() {
+        return glm::vec3(emissive[0], emissive[1], emissive[2]);
     }
 
+    double get_metallic() { return metallic; }
+
+    double get_roughness() { return roughness; }
+
     double get_transmission() { return transmission; }
 
-    auto begin() { return textures.begin(); }
+    double get_normal_scale() { return normal_scale; }
+
+    AlphaMode get_alpha_mode() { return alpha_mode; }
+
+    double get_alpha_cutoff() { return alpha_cutoff; }
+
+    bool is_double_sided() { return double_sided; }
 
-    auto end() { return textures.end(); }
+    int32_t get_base_color_texture() { return base_color_texture; }
+
+    int32_t get_normal_texture() { return normal_texture; }
+
+    int32_t get_emissive_texture() { return emissive_texture; }
+
+    int32_t get_metallic_roughness_texture() {
+        return metallic_roughness_texture;
+    }
 };
 
 struct Vertex {
@@ -181,6 +145,9 @@ struct Vertex {
     float padding2;
     glm::vec2 uvmap;
     glm::vec2 padding3;
+    // xyz in object space, w is the bitangent sign. Zero for primitives
+    // without a normal map.
+    glm::vec4 tangent;
 
     static VkVertexInputBindingDescription getBindingDescription() {
         VkVertexInputBindingDescription bindingDescription{};
@@ -191,9 +158,9 @@ struct Vertex {
         return bindingDescription;
     }
 
-    static std::array<VkVertexInputAttributeDescription, 4>
+    static std::array<VkVertexInputAttributeDescription, 5>
     getAttributeDescriptions() {
-        std::array<VkVertexInputAttributeDescription, 4>
+        std::array<VkVertexInputAttributeDescription, 5>
             attributeDescriptions{};
 
         attributeDescriptions[0].binding = 0;
@@ -216,6 +183,11 @@ struct Vertex {
         attributeDescriptions[3].format = VK_FORMAT_R32G32_SFLOAT;
         attributeDescriptions[3].offset = offsetof(Vertex, uvmap);
 
+        attributeDescriptions[4].binding = 0;
+        attributeDescriptions[4].location = 4;
+        attributeDescriptions[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        attributeDescriptions[4].offset = offsetof(Vertex, tangent);
+
         return attributeDescriptions;
     }
 
@@ -238,26 +210,51 @@ class Mesh {
     uint32_t mesh_id;
 };
 
+// A glTF node flattened into Scene::nodes. Nodes are stored parents-first so
+// world matrices can be resolved in a single forward pass.
+struct SceneNode {
+    int32_t parent; // index into Scene::nodes, -1 for root nodes
+    int32_t mesh;   // index into the scene meshes, -1 if the node has none
+    glm::mat4 local_transformation;
+    glm::mat4 global_transformation;
+    bool dirty;
+};
+
 struct Object {
     const Mesh *mesh;
     glm::mat4 transformation;
     glm::mat4 global_transformation;
+    uint32_t node_index;
+};
+
+// Wall time of the stages of Scene's constructor. Texture decoding is not
+// included, it runs later on the registry's pool.
+struct SceneLoadStats {
+    double parse_ms = 0.0;    // glTF parsing and reading image files
+    double geometry_ms = 0.0; // vertex and index data
+    double tangent_ms = 0.0;  // generated tangents
+    size_t vertices = 0;
+    size_t indices = 0;
 };
 
 class Scene {
   private:
     std::vector<Mesh> geometries;
+    std::vector<SceneNode> nodes;
     std::vector<Object> objects;
     std::vector<Material> materials;
+    TextureRegistry textures;
 
     uint32_t primitive_id;
+    SceneLoadStats load_stats;
+
+    void flatten_nodes(const tinygltf::Model &model);
 
   public:
-    Scene(const std::string &filename);
-    ~Scene() {
-        for (auto material : materials)
-            material.cleanup();
-    }
+    // decode_threads is the number of texture decoding threads, 0 uses one
+    // per hardware thread. use_baked picks up textures written by rt_bake.
+    Scene(const std::string &filename, unsigned int decode_threads = 0,
+          bool use_baked = true);
 
     bool empty() { return geometries.empty() || objects.empty(); }
 
@@ -285,5 +282,23 @@ class Scene {
 
     std::vector<Material> &get_materials() { return materials; }
 
+    TextureRegistry &get_textures() { return textures; }
+
+    const std::vector<SceneNode> &get_nodes() { return nodes; }
+
+    // Replaces the local transform of a node. World matrices of the node and
+    // its descendants are recomputed on the next update_transforms().
+    void set_node_transform(size_t i, const glm::mat4 &transformation) {
+        nodes[i].local_transformation = transformation;
+        nodes[i].dirty = true;
+    }
+
+    // Recomputes world matrices of dirty nodes and their descendants and
+    // refreshes the objects that reference them. Returns true if any object
+    // transform changed.
+    bool update_transforms();
+
     uint32_t num_primitives() { return primitive_id; }
+
+    const SceneLoadStats &get_load_stats() const { return load_stats; }
 };
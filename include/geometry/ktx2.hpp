@@ -0,0 +1,63 @@
+#pragma once
+
+#include <geometry/pixel_format.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Header and level index of a KTX2 file, see
+// https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+struct Ktx2Info {
+    enum Supercompression : uint32_t {
+        none = 0,
+        basis_lz = 1,
+        zstandard = 2,
+        zlib = 3,
+    };
+
+    struct Level {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    uint32_t vk_format; // 0 for Basis Universal payloads
+    uint32_t width;
+    uint32_t height;
+    uint32_t supercompression;
+    std::vector<Level> levels; // level 0 is the full-resolution image
+
+    // Format of the payload if it can be uploaded as is
+    std::optional<PixelFormat> native_format() const;
+
+    // BasisLZ (ETC1S) or UASTC, which need transcoding
+    bool is_basis() const { return vk_format == 0; }
+};
+
+bool is_ktx2(const unsigned char *bytes, size_t size);
+
+// Parses the header and level index, returns false and sets error if the file
+// is malformed or not a single-layer 2D texture
+bool parse_ktx2(const unsigned char *bytes, size_t size, Ktx2Info &info,
+                std::string &error);
+
+// Writes a non-supercompressed KTX2 file in a block compressed format
+// (bc4_unorm, bc5_unorm or bc7_*). levels[0] is the full-resolution image.
+bool write_ktx2(const std::filesystem::path &path, PixelFormat format,
+                uint32_t width, uint32_t height,
+                const std::vector<std::vector<uint8_t>> &levels,
+                std::string &error);
+
+// Whether Basis Universal payloads can be transcoded, i.e. the renderer was
+// built with RT_RENDER_BASISU_DIR
+bool basisu_transcoder_available();
+
+// Transcodes the first level_offsets.size() levels of a Basis Universal KTX2
+// file to format, which must be rgba8_*, bc5_unorm or bc7_*. Level i is
+// written at out + level_offsets[i].
+void basisu_transcode(const unsigned char *bytes, size_t size,
+                      PixelFormat format,
+                      const std::vector<size_t> &level_offsets,
+                      unsigned char *out);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Host port of shaders/include/pbr.glsl, kept line by line so the CPU
+// reference evaluates the same model as the shaders
+namespace pbr {
+
+constexpr float pi = 3.14159265358979323846f;
+
+inline float D_GGX(float NoH, float a) {
+    float a2 = a * a;
+    float f = (NoH * a2 - NoH) * NoH + 1.0f;
+    return a2 / (pi * f * f);
+}
+
+inline glm::vec3 F_Schlick(float u, const glm::vec3 &f0) {
+    return f0 + (glm::vec3(1.0f) - f0) * std::pow(1.0f - u, 5.0f);
+}
+
+inline float V_SmithGGXCorrelated(float NoV, float NoL, float a) {
+    float a2 = a * a;
+    float GGXL = NoV * std::sqrt((-NoL * a2 + NoL) * NoL + a2);
+    float GGXV = NoL * std::sqrt((-NoV * a2 + NoV) * NoV + a2);
+    return 0.5f / (GGXV + GGXL);
+}
+
+inline float Fd_Lambert() { return 1.0f / pi; }
+
+inline glm::vec3 BRDF_Filament(const glm::vec3 &n, const glm::vec3 &l,
+                               const glm::vec3 &v, float roughness,
+                               float metalness, const glm::vec3 &f0,
+                               const glm::vec3 &base_color,
+                               const glm::vec3 &light_color) {
+    glm::vec3 h = glm::normalize(v + l);
+
+    float NoV = std::abs(glm::dot(n, v)) + 1e-5f;
+    float NoL = glm::clamp(glm::dot(n, l), 0.0f, 1.0f);
+    float NoH = glm::clamp(glm::dot(n, h), 0.0f, 1.0f);
+    float LoH = glm::clamp(glm::dot(l, h), 0.0f, 1.0f);
+
+    float alpha = roughness * roughness;
+
+    float D = D_GGX(NoH, roughness);
+    glm::vec3 F = F_Schlick(LoH, f0);
+    float V = V_SmithGGXCorrelated(NoV, NoL, alpha);
+
+    glm::vec3 Fr = (D * V) * F;
+
+    glm::vec3 diffuse = base_color * (1.0f - metalness);
+    glm::vec3 Fd = diffuse * Fd_Lambert();
+
+    return (Fd + Fr) * light_color * NoL;
+}
+
+// http://www.jcgt.org/published/0009/03/02/, wraps like GLSL uints
+inline glm::vec3 random_pcg3d(uint32_t x, uint32_t y, uint32_t z) {
+    x = x * 1664525u + 1013904223u;
+    y = y * 1664525u + 1013904223u;
+    z = z * 1664525u + 1013904223u;
+    x += y * z;
+    y += z * x;
+    z += x * y;
+    x ^= x >> 16u;
+    y ^= y >> 16u;
+    z ^= z >> 16u;
+    x += y * z;
+    y += z * x;
+    z += x * y;
+    const float scale = 1.0f / static_cast<float>(0xffffffffu);
+    return glm::vec3(static_cast<float>(x) * scale,
+                     static_cast<float>(y) * scale,
+                     static_cast<float>(z) * scale);
+}
+
+inline glm::vec3 sampleGGX(const glm::vec2 &Xi, float roughness,
+                           const glm::vec3 &N) {
+    float a = roughness * roughness;
+
+    float phi = 2.0f * pi * Xi.x;
+    float cosTheta = std::sqrt((1.0f - Xi.y) / (1.0f + (a * a - 1.0f) * Xi.y));
+    float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+
+    glm::vec3 H;
+    H.x = sinTheta * std::cos(phi);
+    H.y = sinTheta * std::sin(phi);
+    H.z = cosTheta;
+
+    glm::vec3 up = std::abs(N.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f)
+                                          : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 tangent = glm::normalize(glm::cross(up, N));
+    glm::vec3 bitangent = glm::cross(N, tangent);
+
+    return glm::normalize(tangent * H.x + bitangent * H.y + N * H.z);
+}
+
+inline glm::vec3 importanceSampleGGX(const glm::vec3 &N, const glm::vec3 &V,
+                                     float roughness, const glm::vec2 &Xi,
+                                     const glm::vec3 &F0,
+                                     glm::vec3 &contribution) {
+    glm::vec3 H = sampleGGX(Xi, roughness, N);
+
+    glm::vec3 L = glm::reflect(-V, H);
+
+    float NoL = glm::dot(N, L);
+    float NoH = glm::dot(N, H);
+    float VoH = glm::dot(V, H);
+
+    if (NoL > 0.0f && NoH > 0.0f) {
+        glm::vec3 F = F_Schlick(VoH, F0);
+        float NoV = std::max(glm::dot(N, V), 0.0001f);
+
+        float G = V_SmithGGXCorrelated(NoV, NoL, roughness * roughness);
+
+        float D = D_GGX(NoH, roughness);
+        float weight = (VoH * G * D) / (NoV * NoH);
+
+        contribution = F * weight;
+    } else {
+        contribution = glm::vec3(0.0f);
+    }
+
+    return L;
+}
+
+} // namespace pbr
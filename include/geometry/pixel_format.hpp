@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Texel formats textures are uploaded in. The renderer maps them to Vulkan
+// formats, KTX2 files map their VkFormat to them.
+enum class PixelFormat : uint8_t {
+    rgba8_unorm,
+    rgba8_srgb,
+    rg8_unorm,
+    bc1_unorm,
+    bc1_srgb,
+    bc3_unorm,
+    bc3_srgb,
+    bc4_unorm,
+    bc5_unorm,
+    bc7_unorm,
+    bc7_srgb,
+};
+
+struct PixelFormatInfo {
+    uint32_t block_dim;   // 4 for BCn, 1 for uncompressed formats
+    uint32_t block_bytes; // bytes per block (texel if uncompressed)
+};
+
+inline PixelFormatInfo get_pixel_format_info(PixelFormat format) {
+    switch (format) {
+    case PixelFormat::rgba8_unorm:
+    case PixelFormat::rgba8_srgb:
+        return {1, 4};
+    case PixelFormat::rg8_unorm:
+        return {1, 2};
+    case PixelFormat::bc1_unorm:
+    case PixelFormat::bc1_srgb:
+    case PixelFormat::bc4_unorm:
+        return {4, 8};
+    default:
+        return {4, 16};
+    }
+}
+
+// The sRGB or UNORM variant of format, which only differ in how the
+// sampler decodes the texels. Formats without one are returned as they are.
+inline PixelFormat with_srgb(PixelFormat format, bool srgb) {
+    switch (format) {
+    case PixelFormat::rgba8_unorm:
+    case PixelFormat::rgba8_srgb:
+        return srgb ? PixelFormat::rgba8_srgb : PixelFormat::rgba8_unorm;
+    case PixelFormat::bc1_unorm:
+    case PixelFormat::bc1_srgb:
+        return srgb ? PixelFormat::bc1_srgb : PixelFormat::bc1_unorm;
+    case PixelFormat::bc3_unorm:
+    case PixelFormat::bc3_srgb:
+        return srgb ? PixelFormat::bc3_srgb : PixelFormat::bc3_unorm;
+    case PixelFormat::bc7_unorm:
+    case PixelFormat::bc7_srgb:
+        return srgb ? PixelFormat::bc7_srgb : PixelFormat::bc7_unorm;
+    default:
+        return format;
+    }
+}
+
+inline bool is_block_compressed(PixelFormat format) {
+    return get_pixel_format_info(format).block_dim > 1;
+}
+
+// Bytes of one tightly packed mip level
+inline size_t get_level_size(PixelFormat format, uint32_t width,
+                             uint32_t height) {
+    auto info = get_pixel_format_info(format);
+    size_t blocks_x = (std::max(width, 1u) + info.block_dim - 1) / info.block_dim;
+    size_t blocks_y =
+        (std::max(height, 1u) + info.block_dim - 1) / info.block_dim;
+    return blocks_x * blocks_y * info.block_bytes;
+}
+
+// Bytes of the first levels mips of a width x height image
+inline size_t get_image_size(PixelFormat format, uint32_t width,
+                             uint32_t height, uint32_t levels) {
+    size_t size = 0;
+    for (uint32_t level = 0; level < levels; level++) {
+        size += get_level_size(format, std::max(width >> level, 1u),
+                               std::max(height >> level, 1u));
+    }
+    return size;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <geometry/bvh.hpp>
+#include <geometry/geometry.hpp>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Ray as the kernels take it, with the reciprocal direction for box tests
+struct KernelRay {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    glm::vec3 inv_direction;
+    float tmin;
+
+    KernelRay(const glm::vec3 &origin, const glm::vec3 &direction,
+              float tmin = 0.0f)
+        : origin(origin), direction(direction),
+          inv_direction(1.0f / direction), tmin(tmin) {}
+};
+
+// Closest triangle hit, t is also the upper bound of the next test
+struct KernelHit {
+    float t;
+    float u; // barycentric weights of vertices 1 and 2
+    float v;
+    uint32_t index; // of the triangle in its primitive
+};
+
+// W triangles in structure-of-arrays layout, one array per coordinate. Unused
+// lanes are zero, which is degenerate and never hit.
+template <int W> struct alignas(32) TriangleBlock {
+    float v0[3][W] = {};
+    float edge1[3][W] = {};
+    float edge2[3][W] = {};
+    uint32_t index[W] = {};
+
+    void set(int lane, const glm::vec3 &p0, const glm::vec3 &p1,
+             const glm::vec3 &p2, uint32_t triangle) {
+        for (int axis = 0; axis < 3; axis++) {
+            v0[axis][lane] = p0[axis];
+            edge1[axis][lane] = p1[axis] - p0[axis];
+            edge2[axis][lane] = p2[axis] - p0[axis];
+        }
+        index[lane] = triangle;
+    }
+};
+
+// W boxes in structure-of-arrays layout. Unused lanes are empty boxes.
+template <int W> struct alignas(32) BoxBlock {
+    float min[3][W];
+    float max[3][W];
+
+    BoxBlock() {
+        for (int lane = 0; lane < W; lane++) {
+            set(lane, Aabb{});
+        }
+    }
+
+    void set(int lane, const Aabb &box) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis][lane] = box.min[axis];
+            max[axis][lane] = box.max[axis];
+        }
+    }
+};
+
+// Packs the triangles of a primitive W to a block, in index order
+template <int W>
+std::vector<TriangleBlock<W>> make_triangle_blocks(const Primitive &primitive);
+
+enum class SimdLevel {
+    scalar,
+    sse,  // SSE2, 4 lanes
+    avx2, // 8 lanes, width 4 runs on SSE
+};
+
+const char *get_simd_level_name(SimdLevel level);
+
+// Best level the CPU supports
+SimdLevel get_simd_level();
+
+bool is_simd_level_supported(SimdLevel level);
+
+// One ray against a block at a time. Triangle kernels update hit with the
+// closest triangle in [ray.tmin, hit.t) and return true if there was one,
+// both faces count. Box kernels return a mask of the boxes the ray overlaps
+// within [ray.tmin, tmax] and write their entry distances to t.
+struct RayKernels {
+    SimdLevel level;
+    bool (*intersect_triangles4)(const TriangleBlock<4> &block,
+                                 const KernelRay &ray, KernelHit &hit);
+    bool (*intersect_triangles8)(const TriangleBlock<8> &block,
+                                 const KernelRay &ray, KernelHit &hit);
+    uint32_t (*intersect_boxes4)(const BoxBlock<4> &block,
+                                 const KernelRay &ray, float tmax, float *t);
+    uint32_t (*intersect_boxes8)(const BoxBlock<8> &block,
+                                 const KernelRay &ray, float tmax, float *t);
+};
+
+// Kernels of a level, which must be supported
+const RayKernels &get_ray_kernels(SimdLevel level);
+
+// Kernels of the best supported level, selected once
+const RayKernels &get_ray_kernels();
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <geometry/bvh.hpp>
+#include <geometry/geometry.hpp>
+#include <geometry/ray_kernels.hpp>
+#include <geometry/thread_pool.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Closest hit of a ray, in the terms of the closest hit shader
+struct RayHit {
+    float t;        // gl_HitTEXT, in units of the ray direction
+    glm::vec2 bary; // hitAttributeEXT, weights of vertices 1 and 2
+    uint32_t instance;
+    uint32_t triangle; // gl_PrimitiveID, index into the primitive
+};
+
+// BVH over the triangles of one Primitive in object space, shared by every
+// object that places it. Triangles are copied in leaf order so leaves read
+// them sequentially, and packed again into 4-wide blocks per leaf for the
+// SIMD kernels of ray_kernels.hpp.
+class MeshBvh {
+  public:
+    struct Triangle {
+        glm::vec3 v0;
+        glm::vec3 edge1;
+        glm::vec3 edge2;
+        uint32_t index; // in the primitive
+    };
+
+  private:
+    const Primitive *primitive;
+    Bvh bvh;
+    std::vector<Triangle> triangles;
+    // Leaf triangles, every leaf padded to whole blocks
+    std::vector<TriangleBlock<4>> blocks;
+    // First block of the leaf starting at each triangle
+    std::vector<uint32_t> leaf_blocks;
+
+  public:
+    explicit MeshBvh(const Primitive &primitive) : primitive(&primitive) {}
+
+    // Builds in the background on pool, see Bvh::start_build()
+    void start_build(ThreadPool &pool, BvhSplit split = BvhSplit::sah);
+    void finish_build();
+
+    // Updates hit with a hit closer than hit.t, returns true if there was one
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+                   float tmin, RayHit &hit) const;
+
+    // True if any triangle is hit within [tmin, tmax]
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                  float tmin, float tmax) const;
+
+    const Primitive &get_primitive() const { return *primitive; }
+
+    const Bvh &get_bvh() const { return bvh; }
+
+    size_t size() const { return triangles.size(); }
+
+    // In the order of the leaves, see Bvh::indices
+    const std::vector<Triangle> &get_triangles() const { return triangles; }
+
+    // Object-space bounds, empty without triangles
+    Aabb get_bounds() const {
+        return bvh.empty() ? Aabb{} : Aabb{bvh.nodes[0].min, bvh.nodes[0].max};
+    }
+};
+
+// Wall time of a SceneBvh build
+struct SceneBvhStats {
+    double mesh_ms = 0.0; // every MeshBvh, in parallel
+    double top_ms = 0.0;
+};
+
+// Two-level BVH over a Scene, the host counterpart of the TLAS: a MeshBvh per
+// distinct primitive and a top-level BVH over one instance per primitive of
+// every object, placed with the object's global_transformation.
+class SceneBvh {
+  public:
+    struct Instance {
+        uint32_t mesh;   // index into the mesh BVHs
+        uint32_t object; // index of the Object in the scene
+        glm::mat4 to_world;
+        glm::mat4 to_object;
+        Aabb bounds; // world space
+    };
+
+  private:
+    std::vector<MeshBvh> meshes;
+    std::vector<Instance> instances;
+    Bvh top;
+    SceneBvhStats stats;
+
+  public:
+    // Builds every MeshBvh at once on pool, then the top level. Instances
+    // of primitives without triangles are left out.
+    SceneBvh(Scene &scene, ThreadPool &pool, BvhSplit split = BvhSplit::sah);
+
+    SceneBvh(const SceneBvh &) = delete;
+    SceneBvh &operator=(const SceneBvh &) = delete;
+
+    // Closest hit within [tmin, tmax], both faces count
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+                   float tmin, float tmax, RayHit &hit) const;
+
+    // Any hit within [tmin, tmax], stops at the first one found
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                  float tmin, float tmax) const;
+
+    const Instance &get_instance(size_t i) const { return instances[i]; }
+
+    size_t num_instances() const { return instances.size(); }
+
+    const MeshBvh &get_mesh(size_t i) const { return meshes[i]; }
+
+    size_t num_meshes() const { return meshes.size(); }
+
+    const Bvh &get_top() const { return top; }
+
+    const SceneBvhStats &get_stats() const { return stats; }
+};
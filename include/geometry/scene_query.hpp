@@ -0,0 +1,61 @@
+#pragma once
+
+#include <geometry/geometry.hpp>
+#include <geometry/scene_bvh.hpp>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+// Result of a SceneQuery, in world space
+struct SceneHit {
+    // Along the normalized ray for raycast(), from the query point for
+    // closest_point()
+    float distance;
+    glm::vec3 position;
+    glm::vec3 normal; // of the triangle, facing the ray or the query point
+    glm::vec2 bary;   // weights of vertices 1 and 2
+    uint32_t object;  // index of the Object, see Scene::node()
+    uint32_t primitive_id;
+    uint32_t triangle;      // in the primitive
+    int32_t material_index; // -1 for the default material
+};
+
+// Ray casts, occlusion tests and closest point queries against a Scene on
+// the host, e.g. for picking and autofocus. Uses a SceneBvh built at
+// construction, so later transform changes are not seen.
+class SceneQuery {
+  private:
+    std::unique_ptr<SceneBvh> bvh;
+    double build_ms = 0.0;
+
+    // Fills in everything but distance, normal facing toward
+    SceneHit make_hit(uint32_t instance, uint32_t triangle, glm::vec2 bary,
+                      const glm::vec3 &toward) const;
+
+  public:
+    // Builds the BVH on threads threads, 0 uses one per hardware thread
+    explicit SceneQuery(Scene &scene, unsigned int threads = 0);
+
+    // Closest hit of a ray within [tmin, tmax], both faces count.
+    // direction need not be normalized, distances are along its unit vector.
+    bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                 SceneHit &hit, float tmin = 0.0f,
+                 float tmax = std::numeric_limits<float>::max()) const;
+
+    // True if anything blocks the ray within [tmin, tmax]
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                  float tmin = 0.0f,
+                  float tmax = std::numeric_limits<float>::max()) const;
+
+    // Closest surface point within max_distance of point
+    bool closest_point(const glm::vec3 &point, SceneHit &hit,
+                       float max_distance =
+                           std::numeric_limits<float>::max()) const;
+
+    const SceneBvh &get_bvh() const { return *bvh; }
+
+    double get_build_ms() const { return build_ms; }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <geometry/ktx2.hpp>
+#include <geometry/pixel_format.hpp>
+#include <geometry/thread_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tiny_gltf.h>
+#include <unordered_map>
+#include <vector>
+
+// Decoded 8-bit pixels of an image, always stored as RGBA
+class TextureMap {
+    std::vector<unsigned char> map;
+    int w = 0, h = 0, c = 0;
+
+  public:
+    enum TextureType {
+        baseColorTexture,
+        normalTexture,
+        emissiveTexture,
+        occlusionTexture,
+        metallicRoughnessTexture,
+    };
+
+    TextureMap() = default;
+    TextureMap(std::vector<unsigned char> &&pixels, int width, int height)
+        : map(std::move(pixels)), w(width), h(height), c(4) {}
+
+    uint8_t *data() { return map.data(); }
+    int height() { return h; }
+    int width() { return w; }
+    int channels() { return c; }
+
+    // Releases the host copy of the pixels, e.g. once they are on the GPU
+    void free_texture_map();
+};
+
+// How the texels of a texture are interpreted. An image used in several
+// color spaces gets a table entry, upload format and bake per color space.
+enum class ColorSpace : uint8_t {
+    srgb,   // base color and emissive
+    linear, // occlusion, metallic-roughness
+    normal, // tangent space normals, stored in two channels
+};
+
+inline ColorSpace get_color_space(TextureMap::TextureType type) {
+    switch (type) {
+    case TextureMap::baseColorTexture:
+    case TextureMap::emissiveTexture:
+        return ColorSpace::srgb;
+    case TextureMap::normalTexture:
+        return ColorSpace::normal;
+    default:
+        return ColorSpace::linear;
+    }
+}
+
+inline const char *get_color_space_name(ColorSpace space) {
+    switch (space) {
+    case ColorSpace::srgb:
+        return "srgb";
+    case ColorSpace::normal:
+        return "normal";
+    default:
+        return "linear";
+    }
+}
+
+// Expands tightly packed RGB pixels to RGBA with opaque alpha. Uses SSSE3 or
+// NEON when the CPU supports it.
+void expand_rgb_to_rgba(const uint8_t *rgb, uint8_t *rgba, size_t pixels);
+
+// Filtering and addressing state of a glTF sampler. Textures with equal state
+// share one sampler object on the GPU.
+struct SamplerState {
+    int mag_filter = TINYGLTF_TEXTURE_FILTER_LINEAR;
+    int min_filter = TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_LINEAR;
+    int wrap_s = TINYGLTF_TEXTURE_WRAP_REPEAT;
+    int wrap_t = TINYGLTF_TEXTURE_WRAP_REPEAT;
+
+    bool operator==(const SamplerState &other) const = default;
+
+    struct Hasher {
+        size_t operator()(const SamplerState &state) const {
+            size_t h = std::hash<int>()(state.mag_filter);
+            h = h * 31 + std::hash<int>()(state.min_filter);
+            h = h * 31 + std::hash<int>()(state.wrap_s);
+            h = h * 31 + std::hash<int>()(state.wrap_t);
+            return h;
+        }
+    };
+};
+
+using DecodedImage = std::shared_future<std::shared_ptr<TextureMap>>;
+
+// Encoded image file contents (PNG, JPEG, KTX2, ...) with the size from its
+// header
+struct EncodedImage {
+    std::vector<unsigned char> bytes;
+    int width;
+    int height;
+    std::optional<Ktx2Info> ktx2; // set for KTX2 files
+};
+
+// How a texture is laid out in staging memory and on the GPU
+struct TextureLayout {
+    PixelFormat format = PixelFormat::rgba8_unorm;
+    // Levels written by decode_into(), from level 0 down
+    std::vector<size_t> level_offsets;
+    size_t size = 0;
+    // Blit the rest of the mip chain from level 0 on the GPU
+    bool generate_mips = false;
+
+    uint32_t stored_levels() const {
+        return static_cast<uint32_t>(level_offsets.size());
+    }
+
+    // Layout of a width x height texture with only base_level and below,
+    // i.e. what decode_into() writes for a partially resident texture.
+    // Generated chains store the one level the rest is blitted from.
+    TextureLayout from_level(uint32_t base_level, uint32_t width,
+                             uint32_t height) const;
+};
+
+// Entry of the scene texture table, one per distinct glTF image, sampler
+// and color space
+struct Texture {
+    int32_t image;
+    int32_t sampler;
+    SamplerState sampler_state;
+    ColorSpace color_space;
+    int width;
+    int height;
+    // Shared between entries using the same image, null once released
+    std::shared_ptr<const EncodedImage> encoded;
+    // Plain image to use if encoded is a KTX2 file the device cannot use
+    std::shared_ptr<const EncodedImage> fallback;
+    // Set by TextureRegistry::choose_layouts()
+    TextureLayout layout;
+};
+
+// Host decoding done by a TextureRegistry so far
+struct DecodeStats {
+    size_t images = 0;
+    uint64_t pixels = 0;
+    double wall_ms = 0.0;   // from the first submit to the last finish
+    double decode_ms = 0.0; // summed over worker threads
+    unsigned int threads = 0;
+};
+
+// Scene-level texture table. Materials reference textures by index so an
+// image shared between materials is only decoded and uploaded once.
+//
+// Loading only keeps the encoded image files: tinygltf hands them to
+// load_image_data(), which parses the header. Pixels are decoded on a worker
+// pool when requested, either into host memory or straight into a caller
+// provided buffer such as mapped staging memory.
+class TextureRegistry {
+    std::vector<Texture> textures;
+    std::unordered_map<uint64_t, int32_t> lookup;
+
+    // Indexed by glTF image, only kept while materials are being loaded
+    std::vector<std::shared_ptr<const EncodedImage>> images;
+
+    // Images written by rt_bake, by the glTF image they were baked from and
+    // the color space they were baked for
+    struct BakedImage {
+        size_t source_size; // bytes of the source image file
+        std::shared_ptr<const EncodedImage> image;
+    };
+    std::map<std::pair<int, ColorSpace>, BakedImage> baked;
+
+    // Decode statistics
+    std::chrono::steady_clock::time_point first_submit;
+    std::atomic<int64_t> last_finish_ns{0};
+    std::atomic<int64_t> decode_ns{0};
+    std::atomic<uint64_t> decoded_pixels{0};
+    size_t submitted = 0;
+
+    // Declared last so workers are joined before the state they touch is
+    // destroyed
+    std::unique_ptr<ThreadPool> pool;
+
+    void record_decode(std::chrono::steady_clock::time_point start,
+                       size_t pixels);
+
+    // Decodes a plain image into out as RGBA, or as RG with channels 2
+    void decode_plain(const EncodedImage &image, uint32_t channels,
+                      uint8_t *out);
+
+    // Writes image in layout to out, runs on the pool
+    void decode_layout(const EncodedImage &image, const TextureLayout &layout,
+                       uint8_t *out);
+
+    // Layout image can be uploaded in for a texture in color_space, if any
+    static std::optional<TextureLayout>
+    plan_layout(const EncodedImage &image, ColorSpace color_space,
+                bool block_compression);
+
+  public:
+    // 0 threads uses one per hardware thread
+    explicit TextureRegistry(unsigned int decode_threads = 0);
+
+    TextureRegistry(const TextureRegistry &) = delete;
+    TextureRegistry &operator=(const TextureRegistry &) = delete;
+
+    // Directory rt_bake writes the textures of a glTF file to, with a
+    // manifest listing "<glTF image> <color space> <source bytes> <KTX2
+    // file>" per line
+    static std::filesystem::path baked_directory(const std::string &gltf) {
+        return gltf + ".baked";
+    }
+    static constexpr const char *baked_manifest = "manifest.txt";
+
+    // Loads the KTX2 files of a baked directory before the glTF is loaded.
+    // acquire() then prefers them over the images they were baked from, which
+    // become the fallback. Returns the number of baked images.
+    size_t load_baked(const std::filesystem::path &directory);
+
+    // tinygltf::LoadImageDataFunction, user_pointer is the registry
+    static bool load_image_data(tinygltf::Image *image, const int image_index,
+                                std::string *err, std::string *warn,
+                                int req_width, int req_height,
+                                const unsigned char *bytes, int size,
+                                void *user_pointer);
+
+    // Returns the table index for glTF texture texture_index used in the
+    // color space of texture_type, adding it on first use. Returns -1 if
+    // texture_index is -1.
+    int32_t acquire(tinygltf::Model &model, int texture_index,
+                    TextureMap::TextureType texture_type);
+
+    // Drops the registry's references to encoded images, so they are only
+    // kept alive by table entries. Call once all materials are loaded.
+    void finish_acquiring() { images.clear(); }
+
+    // Picks the source and GPU layout of every texture. Color textures use
+    // sRGB formats and normal maps two channels. KTX2 sources are preferred
+    // when the device supports their format (block_compression for BCn),
+    // otherwise the texture falls back to its plain image.
+    void choose_layouts(bool block_compression);
+
+    // Decodes texture i to RGBA8 in host memory on the worker pool. Only
+    // plain images and Basis Universal KTX2 files can be decoded on the host.
+    DecodedImage decode(size_t i);
+
+    // Decodes or transcodes texture i on the worker pool, writing
+    // Texture::layout.from_level(base_level, ...).size bytes to out, which
+    // must stay valid until the future is ready. Levels above base_level are
+    // dropped, or filtered away on the host for generated chains.
+    std::future<void> decode_into(size_t i, uint8_t *out,
+                                  uint32_t base_level = 0);
+
+    // Frees the encoded image of texture i once no other entry shares it
+    void release(size_t i) {
+        textures[i].encoded.reset();
+        textures[i].fallback.reset();
+    }
+
+    size_t size() { return textures.size(); }
+
+    Texture &operator[](size_t i) { return textures[i]; }
+
+    auto begin() { return textures.begin(); }
+
+    auto end() { return textures.end(); }
+
+    // Waits for all pending decodes
+    DecodeStats get_decode_stats();
+
+    // Waits for all pending decodes and prints timing for the thread count
+    void print_decode_stats();
+};
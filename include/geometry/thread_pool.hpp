@@ -0,0 +1,177 @@
+#pragma once
+#include <utils/cpu_profiler.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size pool of worker threads running submitted tasks in FIFO order
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable idle;
+    size_t active = 0;
+    bool stopping = false;
+
+    void work() {
+        RT_PROFILE_THREAD("worker");
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock,
+                               [this] { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+                active++;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+            }
+            idle.notify_all();
+        }
+    }
+
+  public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(unsigned int num_threads = 0) {
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned int i = 0; i < num_threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    // Finishes all queued tasks before returning
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Blocks until the queue is empty and no task is running
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return tasks.empty() && active == 0; });
+    }
+
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F &&function) {
+        using R = std::invoke_result_t<F>;
+        // std::function needs a copyable target
+        auto task =
+            std::make_shared<std::packaged_task<R()>>(std::forward<F>(function));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([task] { (*task)(); });
+        }
+        condition.notify_one();
+        return future;
+    }
+};
+
+// Runs a fixed set of tasks on short-lived threads with work stealing. Each
+// thread starts with a contiguous block of task indices, pops from the front
+// of its own deque and, once that is empty, steals from the back of the
+// others. Suited to tasks of uneven cost that do not spawn more tasks, such
+// as image tiles.
+class WorkStealingScheduler {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+  public:
+    // Calls function(task, thread) once for every task in [0, count) and
+    // returns the number of tasks that were stolen. 0 threads means one per
+    // hardware thread.
+    template <typename F>
+    static size_t run(size_t count, unsigned int num_threads, F &&function) {
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        std::vector<Queue> queues(num_threads);
+        for (unsigned int i = 0; i < num_threads; i++) {
+            const size_t begin = count * i / num_threads;
+            const size_t end = count * (i + 1) / num_threads;
+            for (size_t task = begin; task < end; task++) {
+                queues[i].tasks.push_back(task);
+            }
+        }
+
+        std::atomic<size_t> steals{0};
+        auto work = [&](unsigned int thread) {
+            while (true) {
+                size_t task = 0;
+                bool found = false;
+                {
+                    auto &own = queues[thread];
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    if (!own.tasks.empty()) {
+                        task = own.tasks.front();
+                        own.tasks.pop_front();
+                        found = true;
+                    }
+                }
+                // No task adds more, so finding every queue empty once
+                // means the work is done
+                for (unsigned int i = 1; !found && i < num_threads; i++) {
+                    auto &victim = queues[(thread + i) % num_threads];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (!victim.tasks.empty()) {
+                        task = victim.tasks.back();
+                        victim.tasks.pop_back();
+                        found = true;
+                        steals.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                if (!found) {
+                    return;
+                }
+                function(task, thread);
+            }
+        };
+
+        // The calling thread works as thread 0
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < num_threads; i++) {
+            threads.emplace_back([&work, i] {
+                RT_PROFILE_THREAD("worker");
+                work(i);
+            });
+        }
+        work(0);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        return steals.load();
+    }
+};
@@ -57,8 +57,35 @@ struct MeshData {
     uint32_t material_id;
 };
 
+// Bits of MaterialData::flags, mirrored in common.glsl
+enum MaterialFlags : uint32_t {
+    material_alpha_mask = 1u << 0,
+    material_alpha_blend = 1u << 1,
+    material_double_sided = 1u << 2,
+    // Texture slots that can change the result. A slot whose factor zeroes
+    // it out is left unset, so the shader skips the fetch.
+    material_base_color_texture = 1u << 3,
+    material_normal_texture = 1u << 4,
+    material_metallic_roughness_texture = 1u << 5,
+    material_emissive_texture = 1u << 6,
+    material_textured = 1u << 7, // any of the above, gates ray cone LOD
+};
+
+// Matches the Material struct in shader.rchit (scalar layout)
 struct MaterialData {
+    glm::vec4 base_color_factor;
+    glm::vec3 emissive_factor;
+    float metallic_factor;
+    float roughness_factor;
     float transmission;
+    float alpha_cutoff;
+    float normal_scale;
+    // Indices into the texture array, -1 if the material has no texture
+    int32_t base_color_texture;
+    int32_t normal_texture;
+    int32_t metallic_roughness_texture;
+    int32_t emissive_texture;
+    uint32_t flags;
 };
 
 struct InstanceData {
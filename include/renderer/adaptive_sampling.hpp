@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+// Adaptive sampling keeps a running mean and variance of every pixel's
+// luminance. Once a pass has completed, each frame starts with a compute
+// pass (shaders/adaptive.comp) that estimates the relative standard error
+// of every pixel, reduces it per tile and compacts the tiles that have not
+// converged into a list. The frame then traces only those tiles with one
+// indirect traceRaysKHR, a launch layer per tile.
+struct AdaptiveSettings {
+    bool enabled = false;
+    // Relative standard error of the mean luminance every pixel of a tile
+    // must reach before the tile is skipped
+    float threshold = 0.02f;
+    // Samples per pixel before a tile may be skipped, the error estimate is
+    // unreliable below a few
+    uint32_t min_samples = 16;
+};
+
+// Square tiles of the mask, one workgroup each. Mirrored in adaptive.glsl.
+constexpr uint32_t adaptive_tile_size = 16;
+
+// Start of the adaptive tile buffer, mirrored in adaptive.glsl. The first
+// three members are the VkTraceRaysIndirectCommandKHR of the frame.
+struct AdaptiveHeader {
+    uint32_t trace_width;
+    uint32_t trace_height;
+    uint32_t active_tiles; // launch depth
+    uint32_t active_pixels;
+    uint32_t region_origin[2];
+    uint32_t region_end[2];
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint32_t padding[2];
+};
+
+// Entry i holds the i-th active tile of the compacted list and the error
+// and samples of tile i
+struct AdaptiveTile {
+    uint32_t active_tile;
+    float error; // summed over the tile's pixels
+    float max_error;
+    uint32_t samples;
+};
+
+struct AdaptivePushConstant {
+    float threshold;
+    uint32_t min_samples;
+};
+
+// Convergence of the region as of the start of a frame, summed over the
+// tiles of its mask
+struct AdaptiveStats {
+    bool valid = false; // the frame ran the mask pass
+    uint32_t tiles = 0;
+    uint32_t active_tiles = 0;
+    uint64_t pixels = 0;
+    uint64_t samples = 0;
+    double mean_error = 0.0; // relative, averaged over pixels
+    double max_error = 0.0;
+
+    static AdaptiveStats compute(const AdaptiveHeader &header,
+                                 const AdaptiveTile *tiles) {
+        AdaptiveStats stats;
+        stats.valid = true;
+        stats.tiles = header.tiles_x * header.tiles_y;
+        stats.active_tiles = header.active_tiles;
+        stats.pixels =
+            uint64_t(header.region_end[0] - header.region_origin[0]) *
+            (header.region_end[1] - header.region_origin[1]);
+        double error = 0.0;
+        for (uint32_t i = 0; i < stats.tiles; i++) {
+            error += tiles[i].error;
+            stats.samples += tiles[i].samples;
+            stats.max_error =
+                std::max(stats.max_error, double(tiles[i].max_error));
+        }
+        stats.mean_error = stats.pixels > 0 ? error / stats.pixels : 0.0;
+        return stats;
+    }
+};
+
+// Uniform sampling through the same passes, for measuring what adaptive
+// sampling saves
+inline AdaptiveSettings get_uniform_settings(AdaptiveSettings settings) {
+    settings.enabled = true;
+    settings.min_samples = std::numeric_limits<uint32_t>::max();
+    return settings;
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <functional>
 #include <iostream>
+#include <utils/cpu_profiler.hpp>
 #include <renderer/frame_constants.hpp>
 #include <renderer/utils.hpp>
 
@@ -27,6 +28,7 @@ class App {
         set_exit_function(exit_function);
 
         while (!exit) {
+            RT_PROFILE_SCOPE("frame");
 
             // accumulate delta time
             auto new_time = utils::get_time();
@@ -41,6 +43,7 @@ class App {
 
             // timestep integration
             while (accumulator > fixed_delta_time) {
+                RT_PROFILE_SCOPE("fixed_update");
                 fixed_update(frame_constants);
                 accumulator -= fixed_delta_time;
             }
@@ -48,6 +51,7 @@ class App {
             // 0.0-1.0 blend factor
             frame_constants.alpha = accumulator / fixed_delta_time;
 
+            RT_PROFILE_SCOPE("render_update");
             render_update(frame_constants);
         }
     }
@@ -16,6 +16,11 @@ class RTCamera {
     float min;
     float max;
     float aspect_ratio;
+    // Thin lens radius in world units, 0 for a pinhole, and the distance
+    // along direction that is in focus
+    float aperture = 0.0f;
+    float focus_distance = 1.0f;
+    glm::vec2 padding;
 
     void set_position(const glm::vec3 &pos) { position = glm::vec4(pos, 0.0f); }
 
@@ -37,4 +42,20 @@ class RTCamera {
         min = rmin;
         max = rmax;
     }
+
+    void set_lens(float radius, float distance) {
+        aperture = radius;
+        focus_distance = distance;
+    }
+
+    // Pinhole ray through uv in [0, 1]^2 of the image, y down, as in
+    // shader.rgen
+    glm::vec3 get_ray_direction(const glm::vec2 &uv) const {
+        const glm::vec3 forward(direction);
+        const glm::vec3 side(right);
+        const float scale = glm::tan(fov * 0.5f);
+        const glm::vec3 view_up = glm::cross(side, forward);
+        return glm::normalize((uv.x - 0.5f) * aspect_ratio * scale * side -
+                              (uv.y - 0.5f) * scale * view_up + forward);
+    }
 };
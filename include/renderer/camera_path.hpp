@@ -0,0 +1,99 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Camera pose of one frame
+struct CameraPose {
+    glm::vec3 position;
+    glm::vec3 direction;
+};
+
+// Camera poses recorded once per frame of an interactive session and
+// replayed by the path benchmark. Stored as text, one pose per line:
+// position xyz followed by direction xyz.
+class CameraPath {
+    std::vector<CameraPose> poses;
+
+  public:
+    void add(const CameraPose &pose) { poses.push_back(pose); }
+
+    size_t size() const { return poses.size(); }
+
+    bool empty() const { return poses.empty(); }
+
+    const CameraPose &operator[](size_t i) const { return poses[i]; }
+
+    void save(const std::filesystem::path &path) const {
+        std::ofstream out(path);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        // Enough digits to read back the exact floats
+        out << std::setprecision(std::numeric_limits<float>::max_digits10);
+        for (const auto &pose : poses) {
+            out << pose.position.x << " " << pose.position.y << " "
+                << pose.position.z << " " << pose.direction.x << " "
+                << pose.direction.y << " " << pose.direction.z << "\n";
+        }
+    }
+
+    static CameraPath load(const std::filesystem::path &path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        CameraPath camera_path;
+        CameraPose pose;
+        while (in >> pose.position.x >> pose.position.y >> pose.position.z >>
+               pose.direction.x >> pose.direction.y >> pose.direction.z) {
+            camera_path.add(pose);
+        }
+        if (!in.eof()) {
+            throw std::runtime_error("Malformed camera path " + path.string());
+        }
+        return camera_path;
+    }
+};
+
+// Summary of per-frame times in milliseconds, percentiles are nearest-rank
+struct FrameTimeStats {
+    double average = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+
+    static FrameTimeStats compute(std::vector<double> ms) {
+        FrameTimeStats stats;
+        if (ms.empty()) {
+            return stats;
+        }
+        std::sort(ms.begin(), ms.end());
+        const auto percentile = [&](double p) {
+            const size_t rank =
+                static_cast<size_t>(std::ceil(p / 100.0 * ms.size()));
+            return ms[std::clamp<size_t>(rank, 1, ms.size()) - 1];
+        };
+        double sum = 0.0;
+        for (double t : ms) {
+            sum += t;
+        }
+        stats.average = sum / ms.size();
+        stats.p50 = percentile(50.0);
+        stats.p95 = percentile(95.0);
+        stats.p99 = percentile(99.0);
+        stats.min = ms.front();
+        stats.max = ms.back();
+        return stats;
+    }
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <renderer/rt_pipeline.hpp>
+#include <renderer/vulkan.hpp>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A compute shader with its own layout over existing descriptor set layouts,
+// which must list the compute stage for the bindings it uses
+class ComputePipeline {
+  public:
+    vk::Device &device;
+    vk::Pipeline pipeline;
+    vk::PipelineLayout layout;
+
+    ComputePipeline(vk::Device &device,
+                    const std::vector<vk::DescriptorSetLayout> &set_layouts,
+                    uint32_t push_constant_size, const std::string &path)
+        : device(device) {
+        vk::PushConstantRange push_constant_range;
+        push_constant_range.offset = 0;
+        push_constant_range.size = push_constant_size;
+        push_constant_range.stageFlags = vk::ShaderStageFlagBits::eCompute;
+
+        vk::PipelineLayoutCreateInfo layout_info;
+        layout_info.setLayoutCount = static_cast<uint32_t>(set_layouts.size());
+        layout_info.pSetLayouts = set_layouts.data();
+        layout_info.pushConstantRangeCount = push_constant_size > 0 ? 1 : 0;
+        layout_info.pPushConstantRanges = &push_constant_range;
+        if (device.createPipelineLayout(&layout_info, nullptr, &layout) !=
+            vk::Result::eSuccess) {
+            throw std::runtime_error("Failed to create compute pipeline "
+                                     "layout");
+        }
+
+        vk::ShaderModule module = load_shader_module(device, path);
+        vk::ComputePipelineCreateInfo pipeline_info;
+        pipeline_info.stage = vk::PipelineShaderStageCreateInfo(
+            vk::PipelineShaderStageCreateFlags(),
+            vk::ShaderStageFlagBits::eCompute, module, "main");
+        pipeline_info.layout = layout;
+        auto ret = device.createComputePipeline(nullptr, pipeline_info);
+        device.destroyShaderModule(module);
+        if (ret.result != vk::Result::eSuccess) {
+            throw std::runtime_error("Failed to create compute pipeline: " +
+                                     path);
+        }
+        pipeline = ret.value;
+    }
+
+    ~ComputePipeline() {
+        device.destroyPipeline(pipeline);
+        device.destroyPipelineLayout(layout);
+    }
+
+    ComputePipeline(const ComputePipeline &) = delete;
+    ComputePipeline &operator=(const ComputePipeline &) = delete;
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+
+// The denoiser filters the accumulated image before it is blitted, guided
+// by the G-buffer of the first hits (shaders/include/gbuffer.glsl). A
+// compute pass (shaders/denoise.comp) divides the albedo out of the image
+// and estimates every pixel's variance from its sample statistics, then
+// iterations edge-avoiding a-trous passes blur it with growing steps, and
+// the last one multiplies the albedo back in. The accumulation, reprojected
+// while the camera moves, stands in for SVGF's temporal filter.
+struct DenoiseSettings {
+    bool enabled = false;
+    uint32_t iterations = 4; // filter passes, steps of 1, 2, 4, ... pixels
+    float sigma_normal = 128.0f;   // exponent of the normal weight
+    float sigma_depth = 0.05f;     // relative depth difference per pixel
+    float sigma_luminance = 4.0f;  // standard deviations of the luminance
+};
+
+constexpr uint32_t max_denoise_iterations = 8;
+
+// Mirrored in denoise.comp
+enum DenoiseMode : uint32_t {
+    denoise_prepare = 0,
+    denoise_filter = 1,
+};
+
+struct DenoisePushConstant {
+    uint32_t mode;
+    uint32_t step;
+    uint32_t source; // ping-pong image read
+    uint32_t last;
+    float sigma_normal;
+    float sigma_depth;
+    float sigma_luminance;
+};
+
+// Profiler scope of each filter pass
+inline const char *get_denoise_pass_name(uint32_t pass) {
+    static const char *names[max_denoise_iterations] = {
+        "denoise pass 1", "denoise pass 2", "denoise pass 3",
+        "denoise pass 4", "denoise pass 5", "denoise pass 6",
+        "denoise pass 7", "denoise pass 8"};
+    return names[pass];
+}
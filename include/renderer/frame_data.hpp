@@ -1,6 +1,10 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <renderer/adaptive_sampling.hpp>
 #include <renderer/camera.hpp>
+#include <renderer/texture_streaming.hpp>
 #include <renderer/vulkan.hpp>
 
 
@@ -43,6 +47,13 @@ class CommonFrameData {
     }
 };
 
+// A per-frame storage image with its view
+struct FrameImage {
+    vk::Image image;
+    vk::ImageView view;
+    VmaAllocation allocation;
+};
+
 // Contains frame-specific Vulkan data
 // wrt. the swapchain images (e.g. 3 frames in flight)
 class FrameData {
@@ -53,6 +64,9 @@ class FrameData {
     int height;
     int frame_index;
 
+    // Command buffers of a frame's later submissions, see TileSettings
+    std::vector<vk::CommandBuffer> extra_command_buffers;
+
   public:
     vk::CommandBuffer command_buffer;
     vk::Fence fence;
@@ -62,7 +76,29 @@ class FrameData {
     vk::ImageView rt_image_view;
     VmaAllocation rt_image_allocation;
 
-    // Camera UBO
+    // Per pixel sample statistics, see adaptive.glsl
+    vk::Image sample_stats;
+    vk::ImageView sample_stats_view;
+    VmaAllocation sample_stats_allocation;
+
+    // Adaptive sampling header and tiles, and the mapped copy read back
+    // after frames that ran the mask pass
+    vk::Buffer adaptive_buffer;
+    VmaAllocation adaptive_allocation;
+    vk::Buffer adaptive_readback;
+    VmaAllocation adaptive_readback_allocation;
+    const AdaptiveHeader *adaptive_header;
+    const AdaptiveTile *adaptive_tiles;
+    vk::DeviceSize adaptive_size;
+    uint32_t adaptive_tile_count; // of the whole image
+    bool adaptive_frame;   // the last frame recorded ran the mask pass
+    bool adaptive_pending; // its traced pixels are not counted yet
+
+    // Camera UBO, followed by the camera of the previous frame at
+    // previous_camera_offset
+    static constexpr vk::DeviceSize previous_camera_offset = 256;
+    static_assert(sizeof(RTCamera) <= previous_camera_offset);
+    RTCamera rendered_camera{}; // uploaded by the last frame recorded
     vk::Buffer camera_buffer;
     VmaAllocation camera_allocation;
 
@@ -70,8 +106,37 @@ class FrameData {
     vk::Buffer staging_buffer;
     VmaAllocation staging_buffer_allocation;
 
-    // We'll later need more images for denoising and for output which
-    // gets blitted to the swapchain image
+    // Shader counters followed by the texture streaming feedback, one uint per
+    // texture. Cleared and written on the device, then copied to the mapped
+    // readback buffer.
+    vk::Buffer feedback_buffer;
+    VmaAllocation feedback_allocation;
+    vk::Buffer feedback_readback;
+    VmaAllocation feedback_readback_allocation;
+    const ShaderCounters *counters;
+    const uint32_t *feedback;
+    vk::DeviceSize feedback_size;
+    uint64_t frame_number; // frame the command buffer was last recorded for
+
+    // Heap element of every texture, uploaded from staging_buffer at
+    // texture_slots_staging_offset whenever the renderer's table changed
+    static constexpr vk::DeviceSize texture_slots_staging_offset = 1024;
+    static_assert(previous_camera_offset + sizeof(RTCamera) <=
+                  texture_slots_staging_offset);
+    vk::Buffer texture_slot_buffer;
+    VmaAllocation texture_slot_allocation;
+    vk::DeviceSize texture_slots_size;
+    uint64_t texture_slots_version; // of the table last uploaded
+
+    // First hit G-buffer, see gbuffer.glsl, cleared with the image
+    FrameImage gbuffer_albedo;
+    FrameImage gbuffer_normal;
+    FrameImage gbuffer_motion;
+    // Ping-pong images of the denoiser passes and the denoised image, which
+    // is blitted to the swapchain image instead of rt_image when the
+    // denoiser is on, see denoiser.hpp
+    std::array<FrameImage, 2> denoise_images;
+    FrameImage denoised;
 
     // Semaphores for synchronization
     vk::Semaphore sem;
@@ -84,13 +149,20 @@ class FrameData {
         descriptor_sets;
 
     bool camera_changed;
+    bool region_changed; // restart accumulation without clearing
     uint32_t sample_index;
-    ;
+    // Progress through the tiles of the current pass and the random number
+    // all of them are traced with
+    uint32_t next_tile;
+    uint32_t pass_random;
 
     FrameData(std::shared_ptr<CommonFrameData> common_data, int width,
-              int height, int frame_index)
+              int height, int frame_index, uint32_t feedback_entries)
         : common_data(common_data), device(common_data->device), width(width),
-          height(height), frame_index(frame_index), camera_changed(true) {
+          height(height), frame_index(frame_index), frame_number(0),
+          texture_slots_version(0),
+          adaptive_frame(false), adaptive_pending(false), camera_changed(true),
+          region_changed(false), next_tile(0), pass_random(0) {
 
         vk::CommandBufferAllocateInfo info{};
         info.level = vk::CommandBufferLevel::ePrimary;
@@ -143,9 +215,44 @@ class FrameData {
 
         rt_image_view = device.createImageView(view_info);
 
+        // Sample statistics, cleared with the image
+        image_info.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        image_info.usage =
+            VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        vmaCreateImage(common_data->allocator, &image_info, &alloc_info,
+                       reinterpret_cast<VkImage *>(&sample_stats),
+                       &sample_stats_allocation, nullptr);
+        view_info.image = sample_stats;
+        view_info.format = vk::Format::eR32G32B32A32Sfloat;
+        sample_stats_view = device.createImageView(view_info);
+
+        const auto create_image = [&](vk::Format format,
+                                      VkImageUsageFlags usage,
+                                      FrameImage &frame_image) {
+            image_info.format = static_cast<VkFormat>(format);
+            image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | usage;
+            vmaCreateImage(common_data->allocator, &image_info, &alloc_info,
+                           reinterpret_cast<VkImage *>(&frame_image.image),
+                           &frame_image.allocation, nullptr);
+            view_info.image = frame_image.image;
+            view_info.format = format;
+            frame_image.view = device.createImageView(view_info);
+        };
+        create_image(vk::Format::eR16G16B16A16Sfloat,
+                     VK_IMAGE_USAGE_TRANSFER_DST_BIT, gbuffer_albedo);
+        create_image(vk::Format::eR16G16B16A16Sfloat,
+                     VK_IMAGE_USAGE_TRANSFER_DST_BIT, gbuffer_normal);
+        create_image(vk::Format::eR16G16B16A16Sfloat,
+                     VK_IMAGE_USAGE_TRANSFER_DST_BIT, gbuffer_motion);
+        for (auto &denoise_image : denoise_images) {
+            create_image(vk::Format::eR16G16B16A16Sfloat, 0, denoise_image);
+        }
+        create_image(vk::Format::eR8G8B8A8Unorm,
+                     VK_IMAGE_USAGE_TRANSFER_SRC_BIT, denoised);
+
         // Create camera buffer
         vk::BufferCreateInfo buffer_info{};
-        buffer_info.size = sizeof(RTCamera);
+        buffer_info.size = previous_camera_offset + sizeof(RTCamera);
         buffer_info.usage = vk::BufferUsageFlagBits::eUniformBuffer |
                             vk::BufferUsageFlagBits::eTransferDst;
         buffer_info.sharingMode = vk::SharingMode::eExclusive;
@@ -181,29 +288,109 @@ class FrameData {
             reinterpret_cast<VkBuffer *>(&staging_buffer),
             &staging_buffer_allocation, nullptr);
 
+        // Create streaming feedback buffers
+        feedback_size = sizeof(ShaderCounters) +
+                        sizeof(uint32_t) * std::max(feedback_entries, 1u);
+        vk::BufferCreateInfo feedback_info{};
+        feedback_info.size = feedback_size;
+        feedback_info.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                              vk::BufferUsageFlagBits::eTransferSrc |
+                              vk::BufferUsageFlagBits::eTransferDst;
+        feedback_info.sharingMode = vk::SharingMode::eExclusive;
+
+        VmaAllocationCreateInfo feedback_alloc_info{};
+        feedback_alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+
+        vmaCreateBuffer(common_data->allocator,
+                        reinterpret_cast<VkBufferCreateInfo *>(&feedback_info),
+                        &feedback_alloc_info,
+                        reinterpret_cast<VkBuffer *>(&feedback_buffer),
+                        &feedback_allocation, nullptr);
+
+        feedback_info.usage = vk::BufferUsageFlagBits::eTransferDst;
+        VmaAllocationCreateInfo readback_alloc_info{};
+        readback_alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+        readback_alloc_info.flags =
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+            VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+        VmaAllocationInfo readback_info;
+        vmaCreateBuffer(common_data->allocator,
+                        reinterpret_cast<VkBufferCreateInfo *>(&feedback_info),
+                        &readback_alloc_info,
+                        reinterpret_cast<VkBuffer *>(&feedback_readback),
+                        &feedback_readback_allocation, &readback_info);
+        counters = static_cast<const ShaderCounters *>(readback_info.pMappedData);
+        feedback = reinterpret_cast<const uint32_t *>(counters + 1);
+
+        // Texture slots, written like the camera
+        texture_slots_size = sizeof(uint32_t) * std::max(feedback_entries, 1u);
+        vk::BufferCreateInfo slot_info{};
+        slot_info.size = texture_slots_size;
+        slot_info.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                          vk::BufferUsageFlagBits::eTransferDst;
+        slot_info.sharingMode = vk::SharingMode::eExclusive;
+        vmaCreateBuffer(common_data->allocator,
+                        reinterpret_cast<VkBufferCreateInfo *>(&slot_info),
+                        &feedback_alloc_info,
+                        reinterpret_cast<VkBuffer *>(&texture_slot_buffer),
+                        &texture_slot_allocation, nullptr);
+
+        // Adaptive sampling tiles, the indirect trace reads its launch size
+        // from the header
+        adaptive_tile_count =
+            ((width + adaptive_tile_size - 1) / adaptive_tile_size) *
+            ((height + adaptive_tile_size - 1) / adaptive_tile_size);
+        adaptive_size = sizeof(AdaptiveHeader) +
+                        sizeof(AdaptiveTile) * adaptive_tile_count;
+        vk::BufferCreateInfo adaptive_info{};
+        adaptive_info.size = adaptive_size;
+        adaptive_info.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                              vk::BufferUsageFlagBits::eIndirectBuffer |
+                              vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                              vk::BufferUsageFlagBits::eTransferSrc |
+                              vk::BufferUsageFlagBits::eTransferDst;
+        adaptive_info.sharingMode = vk::SharingMode::eExclusive;
+        vmaCreateBuffer(common_data->allocator,
+                        reinterpret_cast<VkBufferCreateInfo *>(&adaptive_info),
+                        &feedback_alloc_info,
+                        reinterpret_cast<VkBuffer *>(&adaptive_buffer),
+                        &adaptive_allocation, nullptr);
+
+        adaptive_info.usage = vk::BufferUsageFlagBits::eTransferDst;
+        vmaCreateBuffer(common_data->allocator,
+                        reinterpret_cast<VkBufferCreateInfo *>(&adaptive_info),
+                        &readback_alloc_info,
+                        reinterpret_cast<VkBuffer *>(&adaptive_readback),
+                        &adaptive_readback_allocation, &readback_info);
+        adaptive_header =
+            static_cast<const AdaptiveHeader *>(readback_info.pMappedData);
+        adaptive_tiles =
+            reinterpret_cast<const AdaptiveTile *>(adaptive_header + 1);
+
         // Create semaphore
         vk::SemaphoreCreateInfo sem_info{};
         device.createSemaphore(&sem_info, nullptr, &sem);
         device.createSemaphore(&sem_info, nullptr, &sc_image_available);
 
         // Descriptor pool creation
-        // We'll try using one pool per frame for all pipeline layouts
+        // Only per-frame resources, scene descriptors live in a shared set
         vk::DescriptorPoolSize pool_size{};
-        pool_size.type = vk::DescriptorType::eAccelerationStructureKHR;
-        pool_size.descriptorCount = 1;
+        pool_size.type = vk::DescriptorType::eStorageImage;
+        pool_size.descriptorCount = 11;
 
         vk::DescriptorPoolSize pool_size2{};
-        pool_size2.type = vk::DescriptorType::eStorageImage;
-        pool_size2.descriptorCount = 1;
+        pool_size2.type = vk::DescriptorType::eUniformBuffer;
+        pool_size2.descriptorCount = 2;
 
         vk::DescriptorPoolSize pool_size3{};
-        pool_size3.type = vk::DescriptorType::eCombinedImageSampler;
-        pool_size3.descriptorCount = 1024;
+        pool_size3.type = vk::DescriptorType::eStorageBuffer;
+        pool_size3.descriptorCount = 3;
 
         const auto pool_sizes = std::array{pool_size, pool_size2, pool_size3};
 
         vk::DescriptorPoolCreateInfo descriptor_pool_info{};
-        descriptor_pool_info.maxSets = 10;
+        descriptor_pool_info.maxSets = 1;
         descriptor_pool_info.poolSizeCount = 3;
         descriptor_pool_info.pPoolSizes = pool_sizes.data();
 
@@ -221,13 +408,57 @@ class FrameData {
         device.destroySemaphore(sc_image_available);
         device.destroySemaphore(sem);
         device.destroyImageView(rt_image_view);
+        device.destroyImageView(sample_stats_view);
         vmaDestroyBuffer(common_data->allocator, camera_buffer,
                          camera_allocation);
         vmaDestroyBuffer(common_data->allocator, staging_buffer,
                          staging_buffer_allocation);
+        vmaDestroyBuffer(common_data->allocator, feedback_buffer,
+                         feedback_allocation);
+        vmaDestroyBuffer(common_data->allocator, feedback_readback,
+                         feedback_readback_allocation);
+        vmaDestroyBuffer(common_data->allocator, texture_slot_buffer,
+                         texture_slot_allocation);
+        vmaDestroyBuffer(common_data->allocator, adaptive_buffer,
+                         adaptive_allocation);
+        vmaDestroyBuffer(common_data->allocator, adaptive_readback,
+                         adaptive_readback_allocation);
         vmaDestroyImage(common_data->allocator, rt_image, rt_image_allocation);
+        vmaDestroyImage(common_data->allocator, sample_stats,
+                        sample_stats_allocation);
+        for (FrameImage *frame_image :
+             {&gbuffer_albedo, &gbuffer_normal, &gbuffer_motion,
+              &denoise_images[0], &denoise_images[1], &denoised}) {
+            device.destroyImageView(frame_image->view);
+            vmaDestroyImage(common_data->allocator, frame_image->image,
+                            frame_image->allocation);
+        }
 
         device.destroyFence(fence);
         device.freeCommandBuffers(common_data->command_pool, command_buffer);
+        if (!extra_command_buffers.empty()) {
+            device.freeCommandBuffers(common_data->command_pool,
+                                      extra_command_buffers);
+        }
+    }
+
+    // Command buffer of the frame's submission'th submission, allocated on
+    // first use
+    vk::CommandBuffer &get_command_buffer(uint32_t submission) {
+        if (submission == 0) {
+            return command_buffer;
+        }
+        if (extra_command_buffers.size() < submission) {
+            vk::CommandBufferAllocateInfo info{};
+            info.level = vk::CommandBufferLevel::ePrimary;
+            info.commandPool = common_data->command_pool;
+            const auto allocated =
+                static_cast<uint32_t>(extra_command_buffers.size());
+            info.commandBufferCount = submission - allocated;
+            const auto buffers = device.allocateCommandBuffers(info);
+            extra_command_buffers.insert(extra_command_buffers.end(),
+                                         buffers.begin(), buffers.end());
+        }
+        return extra_command_buffers[submission - 1];
     }
 };
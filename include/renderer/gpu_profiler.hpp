@@ -0,0 +1,302 @@
+#pragma once
+#include <renderer/vulkan.hpp>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Times named scopes of GPU work with timestamp queries. Every slot owns a
+// query pool and is used by one submission at a time: one slot per frame in
+// flight plus a few for load-time work. A slot's results are read when it is
+// reused, after its fence has signalled, so resolving never stalls.
+//
+// Pipeline statistics queries are not collected. Vulkan has no counters for
+// the ray tracing stages, where frames spend their time, and the compute
+// passes (adaptive mask, denoiser) run one invocation per tile or pixel, so
+// their counts follow from the dispatch sizes and timestamps cover them.
+class GpuProfiler {
+  public:
+    static constexpr uint32_t max_scopes = 64; // per slot and submission
+    static constexpr size_t average_window = 128;
+    static constexpr size_t max_trace_events = 1 << 16;
+
+    // Rolling statistics of one scope name
+    struct ScopeStats {
+        std::array<double, average_window> samples{}; // ms
+        size_t next = 0;
+        size_t count = 0; // total samples, the window holds the last ones
+        double total_ms = 0.0;
+
+        double average() const {
+            const size_t n = std::min(count, average_window);
+            double sum = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                sum += samples[i];
+            }
+            return n > 0 ? sum / n : 0.0;
+        }
+    };
+
+  private:
+    struct Scope {
+        std::string name;
+        bool closed;
+    };
+
+    struct Slot {
+        vk::QueryPool pool;
+        std::vector<Scope> scopes;
+        bool recorded = false; // has queries waiting to be resolved
+    };
+
+    struct TraceEvent {
+        std::string name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        uint32_t track; // 0 frames, 1 load-time work
+    };
+
+    vk::Device device;
+    double timestamp_period; // ns per tick
+    uint64_t timestamp_mask;
+    bool supported;
+
+    uint32_t frame_slots;
+    std::vector<Slot> slots;
+    uint32_t current = 0;
+
+    std::map<std::string, ScopeStats> frame_stats;
+    std::map<std::string, ScopeStats> load_stats;
+    std::vector<TraceEvent> trace;
+    uint64_t trace_origin = 0;
+    bool has_origin = false;
+    size_t dropped_events = 0;
+
+    static void add_sample(ScopeStats &stats, double ms) {
+        stats.samples[stats.next] = ms;
+        stats.next = (stats.next + 1) % average_window;
+        stats.count++;
+        stats.total_ms += ms;
+    }
+
+    // Reads the timestamps of a finished slot's closed scopes, skipping any
+    // the device has not made available. A scope left open has no end
+    // timestamp, so scopes are read one at a time and it can't hold back the
+    // rest of the slot.
+    void resolve(Slot &slot, uint32_t track) {
+        if (!slot.recorded) {
+            return;
+        }
+        slot.recorded = false;
+
+        auto &stats = track == 0 ? frame_stats : load_stats;
+        for (size_t i = 0; i < slot.scopes.size(); i++) {
+            const auto &scope = slot.scopes[i];
+            if (!scope.closed) {
+                continue;
+            }
+            std::array<uint64_t, 2> ticks{};
+            const auto result = device.getQueryPoolResults(
+                slot.pool, static_cast<uint32_t>(i) * 2, 2,
+                sizeof(ticks), ticks.data(), sizeof(uint64_t),
+                vk::QueryResultFlagBits::e64);
+            if (result != vk::Result::eSuccess) {
+                continue;
+            }
+            const uint64_t begin = ticks[0] & timestamp_mask;
+            const uint64_t end = ticks[1] & timestamp_mask;
+            const uint64_t duration_ns = static_cast<uint64_t>(
+                static_cast<double>(end >= begin ? end - begin : 0) *
+                timestamp_period);
+            const uint64_t start_ns =
+                static_cast<uint64_t>(static_cast<double>(begin) *
+                                      timestamp_period);
+            add_sample(stats[scope.name], duration_ns / 1e6);
+
+            if (!has_origin || start_ns < trace_origin) {
+                trace_origin = start_ns;
+                has_origin = true;
+            }
+            if (trace.size() < max_trace_events) {
+                trace.push_back({scope.name, start_ns, duration_ns, track});
+            } else {
+                dropped_events++;
+            }
+        }
+    }
+
+  public:
+    GpuProfiler(vk::Device device, vk::PhysicalDevice physical_device,
+                uint32_t queue_family_index, uint32_t frame_slots,
+                uint32_t load_slots)
+        : device(device), frame_slots(frame_slots) {
+        const auto properties = physical_device.getProperties();
+        const auto queue_families =
+            physical_device.getQueueFamilyProperties();
+        const uint32_t valid_bits =
+            queue_family_index < queue_families.size()
+                ? queue_families[queue_family_index].timestampValidBits
+                : 0;
+        timestamp_period = properties.limits.timestampPeriod;
+        timestamp_mask =
+            valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+        supported = valid_bits > 0 && timestamp_period > 0.0;
+        if (!supported) {
+            std::cout << "GPU timestamps are not supported, profiling is off"
+                      << std::endl;
+            return;
+        }
+
+        slots.resize(frame_slots + load_slots);
+        for (auto &slot : slots) {
+            vk::QueryPoolCreateInfo info{};
+            info.queryType = vk::QueryType::eTimestamp;
+            info.queryCount = max_scopes * 2;
+            slot.pool = device.createQueryPool(info);
+        }
+    }
+
+    ~GpuProfiler() {
+        for (auto &slot : slots) {
+            device.destroyQueryPool(slot.pool);
+        }
+    }
+
+    GpuProfiler(const GpuProfiler &) = delete;
+    GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+    bool is_supported() const { return supported; }
+
+    double get_timestamp_period() const { return timestamp_period; }
+
+    uint64_t get_timestamp_mask() const { return timestamp_mask; }
+
+    uint32_t get_load_slot(uint32_t i) const { return frame_slots + i; }
+
+    // Starts recording into a slot. The slot's previous submission must have
+    // completed, its results are resolved here.
+    void begin_frame(uint32_t slot_index, vk::CommandBuffer command_buffer) {
+        if (!supported) {
+            return;
+        }
+        auto &slot = slots[slot_index];
+        resolve(slot, slot_index < frame_slots ? 0 : 1);
+        slot.scopes.clear();
+        command_buffer.resetQueryPool(slot.pool, 0, max_scopes * 2);
+        current = slot_index;
+    }
+
+    // Returns the scope index to pass to end(), or max_scopes if the slot is
+    // full
+    uint32_t begin(vk::CommandBuffer command_buffer, const char *name) {
+        if (!supported) {
+            return max_scopes;
+        }
+        auto &slot = slots[current];
+        if (slot.scopes.size() >= max_scopes) {
+            return max_scopes;
+        }
+        const uint32_t scope = static_cast<uint32_t>(slot.scopes.size());
+        slot.scopes.push_back({name, false});
+        slot.recorded = true;
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                      slot.pool, scope * 2);
+        return scope;
+    }
+
+    void end(vk::CommandBuffer command_buffer, uint32_t scope) {
+        if (!supported || scope >= max_scopes) {
+            return;
+        }
+        auto &slot = slots[current];
+        slot.scopes[scope].closed = true;
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                      slot.pool, scope * 2 + 1);
+    }
+
+    // Resolves every slot, the device must be idle
+    void resolve_all() {
+        for (uint32_t i = 0; i < slots.size(); i++) {
+            resolve(slots[i], i < frame_slots ? 0 : 1);
+        }
+    }
+
+    const std::map<std::string, ScopeStats> &get_frame_stats() const {
+        return frame_stats;
+    }
+
+    const std::map<std::string, ScopeStats> &get_load_stats() const {
+        return load_stats;
+    }
+
+    // Per scope rolling average for frames, totals for load-time work
+    void print_stats() const {
+        if (!supported) {
+            return;
+        }
+        std::cout << std::fixed << std::setprecision(3);
+        for (const auto &[name, stats] : load_stats) {
+            std::cout << "GPU load " << name << ": " << stats.total_ms
+                      << " ms in " << stats.count << " scopes" << std::endl;
+        }
+        for (const auto &[name, stats] : frame_stats) {
+            std::cout << "GPU " << name << ": " << stats.average()
+                      << " ms (last "
+                      << std::min(stats.count, average_window) << " frames)"
+                      << std::endl;
+        }
+        std::cout << std::defaultfloat;
+    }
+
+    // Writes the recorded scopes as Chrome trace events (chrome://tracing,
+    // Perfetto), one track for frames and one for load-time work
+    void write_chrome_trace(const std::filesystem::path &path) const {
+        std::ofstream out(path);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+               "\"args\":{\"name\":\"GPU frames\"}},\n";
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+               "\"args\":{\"name\":\"GPU load\"}}";
+        for (const auto &event : trace) {
+            out << ",\n{\"name\":\"" << event.name
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.track
+                << ",\"ts\":" << (event.start_ns - trace_origin) / 1e3
+                << ",\"dur\":" << event.duration_ns / 1e3 << "}";
+        }
+        out << "\n]}\n";
+        std::cout << "Wrote " << trace.size() << " GPU events to " << path;
+        if (dropped_events > 0) {
+            std::cout << " (" << dropped_events << " dropped)";
+        }
+        std::cout << std::endl;
+    }
+};
+
+// Times the commands recorded during its lifetime
+class GpuScope {
+    GpuProfiler &profiler;
+    vk::CommandBuffer command_buffer;
+    uint32_t scope;
+
+  public:
+    GpuScope(GpuProfiler &profiler, vk::CommandBuffer command_buffer,
+             const char *name)
+        : profiler(profiler), command_buffer(command_buffer),
+          scope(profiler.begin(command_buffer, name)) {}
+
+    ~GpuScope() { profiler.end(command_buffer, scope); }
+
+    GpuScope(const GpuScope &) = delete;
+    GpuScope &operator=(const GpuScope &) = delete;
+};
@@ -1,5 +1,7 @@
 #include <geometry/geometry.hpp>
 #include <renderer/vulkan.hpp>
+#include <algorithm>
+#include <unordered_map>
 #include <vector>
 
 
@@ -7,27 +9,39 @@ class ImageStorage {
   public:
     struct Textures {
         vk::Image image;
-        vk::DeviceSize size;
+        vk::DeviceSize size; // all mip levels
+        uint32_t mip_levels;
         VmaAllocation memory;
         vk::ImageView view;
-        vk::Sampler sampler;
+        vk::Sampler sampler; // owned by samplers
     };
 
-    std::vector<Textures> base_color_textures;
-    std::vector<Textures> normal_textures;
-    std::vector<Textures> metallic_roughness_textures;
-    std::vector<Textures> emissive_textures;
-    std::vector<Textures> occlusion_textures;
+    // Indexed like the scene texture table
+    std::vector<Textures> textures;
+
+    // Samplers are shared by all textures with the same state
+    std::unordered_map<SamplerState, vk::Sampler, SamplerState::Hasher>
+        samplers;
+
+    // Full mip chain down to 1x1
+    static uint32_t get_mip_levels(uint32_t width, uint32_t height) {
+        uint32_t levels = 1;
+        while ((std::max(width, height) >> levels) > 0) {
+            levels++;
+        }
+        return levels;
+    }
 
     vk::ImageCreateInfo get_create_info(uint32_t width, uint32_t height,
-                                        vk::Format format) {
+                                        vk::Format format,
+                                        uint32_t mip_levels = 1) {
         vk::ImageCreateInfo imageInfo{};
         imageInfo.sType = vk::StructureType::eImageCreateInfo;
         imageInfo.imageType = vk::ImageType::e2D;
         imageInfo.extent.width = width;
         imageInfo.extent.height = height;
         imageInfo.extent.depth = 1;
-        imageInfo.mipLevels = 1;
+        imageInfo.mipLevels = mip_levels;
         imageInfo.arrayLayers = 1;
         imageInfo.format = format;
         imageInfo.tiling = vk::ImageTiling::eOptimal;
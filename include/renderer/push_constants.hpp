@@ -1,7 +1,28 @@
 #pragma once
 #include <stdint.h>
 
+// Bits of PushConstant::flags, mirrored in the shaders
+enum PushConstantFlags : uint32_t {
+    push_constant_texture_lod = 1u << 0, // ray cone mip selection
+    // Skip texture slots the material flags mark as unused
+    push_constant_material_fast_paths = 1u << 1,
+    // Count hits, misses and texture fetches
+    push_constant_shader_counters = 1u << 2,
+    // Launch layers are the active tiles of the adaptive sampling mask
+    push_constant_adaptive = 1u << 3,
+    // Accumulate onto the previous frame's image, reprojected if the camera
+    // moved
+    push_constant_reprojection = 1u << 4,
+    push_constant_camera_moved = 1u << 5,
+    // Write the G-buffer of the first hits, only the denoiser reads it
+    push_constant_gbuffer = 1u << 6,
+};
+
 struct PushConstant {
     uint32_t sample_index;
     uint32_t random_num;
+    uint32_t flags;
+    // Pixel of launch ID 0, traceRaysKHR is called per tile
+    uint32_t offset_x;
+    uint32_t offset_y;
 };
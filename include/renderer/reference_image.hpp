@@ -0,0 +1,60 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Difference of an RGBA8 image to a reference over the color channels, in
+// 8-bit steps
+struct ImageError {
+    double rmse = 0.0;
+    double psnr = std::numeric_limits<double>::infinity(); // dB
+};
+
+// Mean of single-sample RGBA8 images, summed on the host in double
+// precision. The renderer accumulates into its RGBA8 image, which stops
+// changing once a sample would move a pixel by less than half a step, so
+// high sample counts are only meaningful summed here. Benchmarks restart
+// accumulation every frame and add each frame's image.
+struct ReferenceImage {
+    std::vector<double> sum; // RGB per pixel
+    uint32_t samples = 0;
+
+    void add(const std::vector<uint8_t> &image) {
+        if (sum.empty()) {
+            sum.resize(image.size() / 4 * 3, 0.0);
+        } else if (sum.size() != image.size() / 4 * 3) {
+            throw std::runtime_error("Reference images differ in size");
+        }
+        for (size_t i = 0, j = 0; i < image.size(); i++) {
+            if (i % 4 != 3) {
+                sum[j++] += image[i];
+            }
+        }
+        samples++;
+    }
+};
+
+inline ImageError compare_images(const std::vector<uint8_t> &image,
+                                 const ReferenceImage &reference) {
+    if (image.size() / 4 * 3 != reference.sum.size() || image.empty() ||
+        reference.samples == 0) {
+        throw std::runtime_error("Compared images differ in size");
+    }
+    double sum = 0.0;
+    for (size_t i = 0, j = 0; i < image.size(); i++) {
+        if (i % 4 == 3) {
+            continue;
+        }
+        const double delta =
+            double(image[i]) - reference.sum[j++] / reference.samples;
+        sum += delta * delta;
+    }
+    ImageError error;
+    error.rmse = std::sqrt(sum / reference.sum.size());
+    if (error.rmse > 0.0) {
+        error.psnr = 20.0 * std::log10(255.0 / error.rmse);
+    }
+    return error;
+}
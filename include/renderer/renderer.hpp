@@ -8,14 +8,30 @@
 
 
 #include <geometry/geometry.hpp>
+#include <renderer/adaptive_sampling.hpp>
+#include <renderer/compute_pipeline.hpp>
 #include <renderer/frame_constants.hpp>
+#include <renderer/denoiser.hpp>
 #include <renderer/frame_data.hpp>
+#include <renderer/gpu_profiler.hpp>
 #include <renderer/rt_pipeline.hpp>
 #include <renderer/acceleration_structure.hpp>
 #include <renderer/image.hpp>
-
-
+#include <renderer/staging.hpp>
+#include <renderer/texture_streaming.hpp>
+#include <renderer/tiles.hpp>
+#include <utils/cpu_profiler.hpp>
+
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <random>
 #include <unordered_map>
 
 class ShaderBindingTable {
@@ -28,18 +44,53 @@ class ShaderBindingTable {
     vk::StridedDeviceAddressRegionKHR callable_region;
 };
 
+// Wall time of the stages of Renderer::load_scene, including the GPU work
+// each waits for
+struct RendererLoadStats {
+    double scene_ms = 0.0;   // Scene construction
+    double buffer_ms = 0.0;  // vertex, index, instance and mesh data buffers
+    double blas_ms = 0.0;
+    double tlas_ms = 0.0;
+    double texture_ms = 0.0; // decode and upload, which overlap
+    double total_ms = 0.0;
+};
+
+// When an unchanging image counts as converged, so frames need not be
+// traced until something changes. Reaching either target is enough.
+struct ConvergenceTarget {
+    uint32_t samples = 0; // per pixel, 0 for no sample target
+    float error = 0.0f;   // mean relative error, needs adaptive sampling
+};
+
 class Renderer {
   private:
     // hard code the dimensions for now
     static constexpr int r_width = 1280;
     static constexpr int r_height = 720;
+    // upper bound of the bindless texture heap, whatever the device allows
+    static constexpr uint32_t max_bindless_textures = 1u << 16;
+    // descriptor sets, see create_rt_pipeline()
+    static constexpr uint32_t scene_set = 0;
+    static constexpr uint32_t frame_set = 1;
+    // size of each of the two texture upload staging arenas
+    static constexpr vk::DeviceSize staging_arena_size = 64ull * 1024 * 1024;
+    // textures are loaded with the first level no larger than this, finer
+    // levels are streamed in on request
+    static constexpr uint32_t streaming_initial_size = 128;
+    static constexpr size_t max_stream_jobs = 4;
+    // frames without a sample before a texture may be evicted
+    static constexpr uint64_t eviction_age = 120;
+    // share of the device-local budget textures may grow into
+    static constexpr double texture_budget_share = 0.9;
+    // frames in flight without a swapchain
+    static constexpr uint32_t headless_frames = 2;
 
   public:
     std::pair<int, int> get_dimensions() { return {r_width, r_height}; }
 
   private:
     WindowHandle window;
-    WindowSystemGLFW *window_system;
+    WindowSystemGLFW *window_system; // null when headless
 
     vk::detail::DispatchLoaderDynamic dl;
     vk::Instance instance;
@@ -76,10 +127,71 @@ class Renderer {
     uint32_t current_frame;
 
     std::unique_ptr<RTPipeline> pipeline;
+    // Mask pass of adaptive sampling, see adaptive_sampling.hpp
+    std::unique_ptr<ComputePipeline> adaptive_pipeline;
+    // Passes of the denoiser, see denoiser.hpp
+    std::unique_ptr<ComputePipeline> denoise_pipeline;
+
+    // Scene resources shared by all frames, written once after loading
+    vk::DescriptorPool scene_descriptor_pool;
+    vk::DescriptorSet scene_descriptor_set;
+    // Size of the texture heap, from the device's update-after-bind limits
+    uint32_t texture_capacity;
+
+    // Texture streaming, indexed like the scene texture table
+    std::vector<TextureResidency> residency;
+    std::vector<StreamJob> stream_jobs;
+    // Heap element each texture is sampled from, i or i + texture count.
+    // Streamed images go into the element no frame in flight uses, and
+    // every frame uploads the table before it is recorded.
+    std::vector<uint32_t> texture_slots;
+    uint64_t texture_slots_version;
+    std::deque<RetiredTexture> retired_textures;
+    StreamingStats streaming_stats;
+    uint64_t frame_number;
+    // Fixed texture budget in bytes, 0 follows the VMA heap budgets
+    uint64_t texture_budget_override;
+    bool memory_budget; // VK_EXT_memory_budget is enabled
+
+    RendererLoadStats load_stats;
+
+    // Timestamps of frames and load-time work. Every load phase has its own
+    // slots, one per texture upload batch in flight.
+    enum ProfilerLoadSlot : uint32_t {
+        profiler_buffer_slot,
+        profiler_blas_slot,
+        profiler_tlas_slot,
+        profiler_texture_slot, // and the next one
+        profiler_load_slots = profiler_texture_slot + 2,
+    };
+    std::unique_ptr<GpuProfiler> profiler;
+
+    // How traceRaysKHR is split up, see TileSettings
+    TileSettings tile_settings;
+    // Part of the image traced, the whole image unless set_region() crops it
+    Tile region;
+    std::vector<Tile> tiles;
+    std::unique_ptr<TileTimer> tile_timer;
+    uint64_t traced_pixels = 0; // one sample each, over all frames
+    AdaptiveSettings adaptive;
+    bool trace_rays_indirect; // needed by adaptive sampling
+    ConvergenceTarget convergence;
+    // Temporal reprojection, each frame accumulates onto the previous one
+    bool reprojection = false;
+    bool history_valid = false; // the previous frame has a history to read
+    DenoiseSettings denoiser;
+
+    // Seeds the per-frame random number of the shaders
+    std::minstd_rand random;
 
     bool averaging;
+    bool texture_lod;
+    bool material_fast_paths;
+    bool shader_counters;
+    bool block_compression;
 
     void setup_vulkan() {
+        RT_PROFILE_FUNCTION();
         vk::ApplicationInfo app_info(
             "Vulkan Path Tracer", VK_MAKE_VERSION(1, 0, 0), nullptr,
             VK_MAKE_VERSION(1, 0, 0), VK_API_VERSION_1_3);
@@ -87,11 +199,15 @@ class Renderer {
         const std::vector<const char *> validation_layers = {
             "VK_LAYER_KHRONOS_validation"};
 
-        uint32_t extension_count = 0;
-        const auto glfw_extensions =
-            glfwGetRequiredInstanceExtensions(&extension_count);
-        std::vector<const char *> extensions(glfw_extensions,
-                                             glfw_extensions + extension_count);
+        // Headless rendering needs no surface extensions
+        std::vector<const char *> extensions;
+        if (window_system) {
+            uint32_t extension_count = 0;
+            const auto glfw_extensions =
+                glfwGetRequiredInstanceExtensions(&extension_count);
+            extensions.assign(glfw_extensions,
+                              glfw_extensions + extension_count);
+        }
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
         extensions.push_back(
             VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
@@ -124,18 +240,35 @@ class Renderer {
         }
 
         // Create surface
-        auto glfw_window = window_system->get(window);
-        glfwCreateWindowSurface(instance, glfw_window, nullptr,
-                                reinterpret_cast<VkSurfaceKHR *>(&surface));
+        if (window_system) {
+            auto glfw_window = window_system->get(window);
+            glfwCreateWindowSurface(instance, glfw_window, nullptr,
+                                    reinterpret_cast<VkSurfaceKHR *>(&surface));
+        }
 
         // Create device with basic features, swapchain, and ray tracing enabled
-        const std::vector<const char *> device_extensions = {
-            VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+        std::vector<const char *> device_extensions = {
             VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
             VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
             VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
             VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
         };
+        if (window_system) {
+            device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        }
+
+        // Memory budgets let texture streaming follow what the driver
+        // actually grants, without them VMA estimates from the heap sizes
+        memory_budget = false;
+        for (const auto &extension :
+             physical_device.enumerateDeviceExtensionProperties()) {
+            if (std::string(extension.extensionName.data()) ==
+                VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) {
+                memory_budget = true;
+                device_extensions.push_back(
+                    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            }
+        }
         float queue_priority = 1.0f;
         vk::DeviceQueueCreateInfo queue_create_info({}, 0, 1, &queue_priority);
 
@@ -150,7 +283,9 @@ class Renderer {
                 graphics_queue_family_index = static_cast<int>(i);
             }
 
-            if (physical_device.getSurfaceSupportKHR(i, surface)) {
+            // Headless frames are never presented
+            if (!window_system ||
+                physical_device.getSurfaceSupportKHR(i, surface)) {
                 present_queue_family_index = static_cast<int>(i);
             }
 
@@ -180,6 +315,16 @@ class Renderer {
         vk::PhysicalDeviceRayTracingPipelineFeaturesKHR
             physical_device_ray_tracing_pipeline_features{};
         physical_device_ray_tracing_pipeline_features.rayTracingPipeline = true;
+        // Indirect traces are optional, adaptive sampling is off without them
+        auto ray_tracing_features = physical_device.getFeatures2<
+            vk::PhysicalDeviceFeatures2,
+            vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>();
+        trace_rays_indirect =
+            ray_tracing_features
+                .get<vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>()
+                .rayTracingPipelineTraceRaysIndirect == VK_TRUE;
+        physical_device_ray_tracing_pipeline_features
+            .rayTracingPipelineTraceRaysIndirect = trace_rays_indirect;
 
         // Buffer device addresses (for acceleration structures)
         vk::PhysicalDeviceBufferDeviceAddressFeatures address_features;
@@ -191,19 +336,71 @@ class Renderer {
         acc_features.accelerationStructure = true;
         acc_features.pNext = &address_features;
 
-        // For bindless descriptors
+        // For bindless descriptors. The texture heap is updated while frames
+        // using it are in flight, which needs the update-after-bind features.
+        const auto supported_indexing =
+            physical_device
+                .getFeatures2<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceDescriptorIndexingFeatures>()
+                .get<vk::PhysicalDeviceDescriptorIndexingFeatures>();
+        const std::pair<vk::Bool32, const char *> required_indexing[] = {
+            {supported_indexing.shaderSampledImageArrayNonUniformIndexing,
+             "shaderSampledImageArrayNonUniformIndexing"},
+            {supported_indexing.runtimeDescriptorArray,
+             "runtimeDescriptorArray"},
+            {supported_indexing.descriptorBindingVariableDescriptorCount,
+             "descriptorBindingVariableDescriptorCount"},
+            {supported_indexing.descriptorBindingPartiallyBound,
+             "descriptorBindingPartiallyBound"},
+            {supported_indexing.descriptorBindingSampledImageUpdateAfterBind,
+             "descriptorBindingSampledImageUpdateAfterBind"},
+            {supported_indexing.descriptorBindingUpdateUnusedWhilePending,
+             "descriptorBindingUpdateUnusedWhilePending"},
+        };
+        for (const auto &[supported, name] : required_indexing) {
+            if (supported != VK_TRUE) {
+                throw std::runtime_error(
+                    std::string("Device does not support descriptor "
+                                "indexing feature ") +
+                    name);
+            }
+        }
         vk::PhysicalDeviceDescriptorIndexingFeatures indexing_features = {};
         indexing_features.shaderSampledImageArrayNonUniformIndexing = true;
         indexing_features.runtimeDescriptorArray = true;
         indexing_features.descriptorBindingVariableDescriptorCount = true;
         indexing_features.descriptorBindingPartiallyBound = true;
+        indexing_features.descriptorBindingSampledImageUpdateAfterBind = true;
+        indexing_features.descriptorBindingUpdateUnusedWhilePending = true;
         indexing_features.pNext = &acc_features;
 
+        // The texture heap is as large as update-after-bind sets allow
+        auto properties = physical_device.getProperties2<
+            vk::PhysicalDeviceProperties2,
+            vk::PhysicalDeviceDescriptorIndexingProperties>();
+        const auto &indexing_properties =
+            properties.get<vk::PhysicalDeviceDescriptorIndexingProperties>();
+        texture_capacity = std::min(
+            {max_bindless_textures,
+             indexing_properties.maxDescriptorSetUpdateAfterBindSampledImages,
+             indexing_properties.maxDescriptorSetUpdateAfterBindSamplers,
+             indexing_properties
+                 .maxPerStageDescriptorUpdateAfterBindSampledImages,
+             indexing_properties.maxPerStageDescriptorUpdateAfterBindSamplers});
+        std::cout << "Texture heap holds up to " << texture_capacity
+                  << " textures" << std::endl;
+
         // nv ray tracing validation
         // vk::PhysicalDeviceRayTracingValidationFeaturesNV validation_features;
         // validation_features.pNext = &indexing_features;
 
+        // Block compressed textures are optional, textures fall back to
+        // uncompressed formats without them
+        block_compression =
+            physical_device.getFeatures().textureCompressionBC == VK_TRUE;
+
         vk::PhysicalDeviceFeatures2 device_features2;
+        device_features2.features.textureCompressionBC = block_compression;
         device_features2.pNext = &indexing_features;
 
         vk::DeviceCreateInfo device_create_info(
@@ -225,66 +422,101 @@ class Renderer {
         allocator_info.device = device;
         allocator_info.instance = instance;
         allocator_info.flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+        if (memory_budget) {
+            allocator_info.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+        }
         vmaCreateAllocator(&allocator_info, &allocator);
     }
 
     void create_rt_pipeline() {
-
-        // Create descriptor set bindings
-        std::vector<vk::DescriptorSetLayoutBinding> bindings = {
-            {0, vk::DescriptorType::eAccelerationStructureKHR, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR},
-            {1, vk::DescriptorType::eStorageImage, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR},
-            {2, vk::DescriptorType::eUniformBuffer, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR},
+        RT_PROFILE_FUNCTION();
+        const auto stages = vk::ShaderStageFlagBits::eRaygenKHR |
+                            vk::ShaderStageFlagBits::eMissKHR |
+                            vk::ShaderStageFlagBits::eClosestHitKHR;
+
+        // Set 0: the scene, written once and shared by all frames. The
+        // texture heap is variable-sized and partially bound.
+        DescriptorSetBindings scene_bindings;
+        scene_bindings.bindings = {
+            {0, vk::DescriptorType::eAccelerationStructureKHR, 1, stages},
+            {1, vk::DescriptorType::eStorageBuffer, 1, stages}, // mesh data
+            {2, vk::DescriptorType::eStorageBuffer, 1,
+             stages}, // instance data
             {3, vk::DescriptorType::eStorageBuffer, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // mesh data
+             stages}, // material data
+            {4, vk::DescriptorType::eCombinedImageSampler, texture_capacity,
+             stages}, // texture heap
+        };
+        scene_bindings.flags.resize(scene_bindings.bindings.size());
+        scene_bindings.flags.back() =
+            vk::DescriptorBindingFlagBits::ePartiallyBound |
+            vk::DescriptorBindingFlagBits::eVariableDescriptorCount |
+            vk::DescriptorBindingFlagBits::eUpdateAfterBind |
+            vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending;
+
+        // Set 1: per-frame output image, camera, streaming feedback, the
+        // sample statistics and tiles of adaptive sampling, the history of
+        // the previous frame, the G-buffer, the denoiser images and the
+        // texture slots
+        DescriptorSetBindings frame_bindings;
+        frame_bindings.bindings = {
+            {0, vk::DescriptorType::eStorageImage, 1,
+             stages | vk::ShaderStageFlagBits::eCompute},
+            {1, vk::DescriptorType::eUniformBuffer, 1, stages},
+            {2, vk::DescriptorType::eStorageBuffer, 1, stages},
+            {3, vk::DescriptorType::eStorageImage, 1,
+             stages | vk::ShaderStageFlagBits::eCompute},
             {4, vk::DescriptorType::eStorageBuffer, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // instance data
-            {5, vk::DescriptorType::eStorageBuffer, 1,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // material data
-            {6, vk::DescriptorType::eCombinedImageSampler, 128,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // color texture data
-            {7, vk::DescriptorType::eCombinedImageSampler, 128,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // normal texture
-                                                           // data
-            {8, vk::DescriptorType::eCombinedImageSampler, 128,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // metallic roughness
-                                                           // texture data
-            {9, vk::DescriptorType::eCombinedImageSampler, 128,
-             vk::ShaderStageFlagBits::eRaygenKHR |
-                 vk::ShaderStageFlagBits::eMissKHR |
-                 vk::ShaderStageFlagBits::eClosestHitKHR}, // emissive texture
-                                                           // data
+             stages | vk::ShaderStageFlagBits::eCompute},
+            // Image, statistics and camera of the previous frame
+            {5, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eRaygenKHR},
+            {6, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eRaygenKHR},
+            {7, vk::DescriptorType::eUniformBuffer, 1,
+             vk::ShaderStageFlagBits::eRaygenKHR},
+            // Albedo, normal and depth, and motion of the first hits
+            {8, vk::DescriptorType::eStorageImage, 1,
+             stages | vk::ShaderStageFlagBits::eCompute},
+            {9, vk::DescriptorType::eStorageImage, 1,
+             stages | vk::ShaderStageFlagBits::eCompute},
+            {10, vk::DescriptorType::eStorageImage, 1,
+             stages | vk::ShaderStageFlagBits::eCompute},
+            // Ping-pong images and output of the denoiser
+            {11, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eCompute},
+            {12, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eCompute},
+            {13, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eCompute},
+            // Heap element of every texture
+            {14, vk::DescriptorType::eStorageBuffer, 1,
+             vk::ShaderStageFlagBits::eClosestHitKHR},
+            // Albedo of the previous frame
+            {15, vk::DescriptorType::eStorageImage, 1,
+             vk::ShaderStageFlagBits::eRaygenKHR},
         };
 
         // Create pipeline
         pipeline = std::make_unique<RTPipeline>(
-            device, allocator, dl, bindings, "shaders/shader.rgen.spv",
+            device, allocator, dl,
+            std::vector<DescriptorSetBindings>{scene_bindings, frame_bindings},
+            "shaders/shader.rgen.spv",
             "shaders/shader.rmiss.spv", "shaders/shader.rchit.spv");
+        adaptive_pipeline = std::make_unique<ComputePipeline>(
+            device, pipeline->descriptor_set_layouts,
+            static_cast<uint32_t>(sizeof(AdaptivePushConstant)),
+            "shaders/adaptive.comp.spv");
+        denoise_pipeline = std::make_unique<ComputePipeline>(
+            device, pipeline->descriptor_set_layouts,
+            static_cast<uint32_t>(sizeof(DenoisePushConstant)),
+            "shaders/denoise.comp.spv");
     }
 
     void cleanup_vulkan() {
         vmaDestroyBuffer(allocator, sbt.buffer, sbt.allocation);
+        adaptive_pipeline.reset();
+        denoise_pipeline.reset();
         pipeline.reset();
         device.destroyCommandPool(general_command_pool);
         vmaDestroyAllocator(allocator);
@@ -392,7 +624,12 @@ class Renderer {
         begin_info.flags = vk::CommandBufferUsageFlagBits::eSimultaneousUse;
 
         cmd_buffer.begin(begin_info);
-        cmd_buffer.copyBuffer(staging_buffer, buffer, 1, &copy_region);
+        profiler->begin_frame(profiler->get_load_slot(profiler_buffer_slot),
+                              cmd_buffer);
+        {
+            GpuScope scope(*profiler, cmd_buffer, "buffer upload");
+            cmd_buffer.copyBuffer(staging_buffer, buffer, 1, &copy_region);
+        }
         cmd_buffer.end();
         auto q = device.getQueue(graphics_queue_family_index, 0);
         vk::SubmitInfo submit_info;
@@ -412,60 +649,108 @@ class Renderer {
 
     void create_TLAS(TopLevelAccelerationStructure *tlas);
 
-    vk::Format get_vk_format(TextureMap::TextureType format) {
+    vk::Format get_vk_format(PixelFormat format) {
         switch (format) {
-        case TextureMap::TextureType::baseColorTexture:
-            return vk::Format::eR8G8B8A8Unorm;
-        case TextureMap::TextureType::normalTexture:
-            return vk::Format::eR8G8B8A8Unorm;
-        case TextureMap::TextureType::metallicRoughnessTexture:
-            return vk::Format::eR8G8B8A8Unorm;
-        case TextureMap::TextureType::emissiveTexture:
+        case PixelFormat::rgba8_unorm:
             return vk::Format::eR8G8B8A8Unorm;
+        case PixelFormat::rgba8_srgb:
+            return vk::Format::eR8G8B8A8Srgb;
+        case PixelFormat::rg8_unorm:
+            return vk::Format::eR8G8Unorm;
+        case PixelFormat::bc1_unorm:
+            return vk::Format::eBc1RgbaUnormBlock;
+        case PixelFormat::bc1_srgb:
+            return vk::Format::eBc1RgbaSrgbBlock;
+        case PixelFormat::bc3_unorm:
+            return vk::Format::eBc3UnormBlock;
+        case PixelFormat::bc3_srgb:
+            return vk::Format::eBc3SrgbBlock;
+        case PixelFormat::bc4_unorm:
+            return vk::Format::eBc4UnormBlock;
+        case PixelFormat::bc5_unorm:
+            return vk::Format::eBc5UnormBlock;
+        case PixelFormat::bc7_unorm:
+            return vk::Format::eBc7UnormBlock;
+        case PixelFormat::bc7_srgb:
+            return vk::Format::eBc7SrgbBlock;
         default:
             throw std::runtime_error("Unsupported texture format");
         }
     }
 
-    void verify_format(TextureMap &map, vk::Format format) {
-        if (map.type() == TextureMap::TextureType::baseColorTexture) {
-            if (map.channels() != 4) {
-                throw std::runtime_error(
-                    "Base color texture must have 4 channels");
-            }
-        } else if (map.type() == TextureMap::TextureType::normalTexture) {
-            if (map.channels() != 4) {
-                throw std::runtime_error("Normal texture must have 4 channels");
-            }
-        } else if (map.type() ==
-                   TextureMap::TextureType::metallicRoughnessTexture) {
-            if (map.channels() != 4) {
-                throw std::runtime_error(
-                    "Metallic roughness texture must have 4 channels");
-            }
-        } else if (map.type() == TextureMap::TextureType::emissiveTexture) {
-            if (map.channels() != 4) {
-                throw std::runtime_error(
-                    "Emissive texture must have 4 channel");
-            }
+    vk::Sampler get_sampler(const SamplerState &state) {
+        auto it = images.samplers.find(state);
+        if (it != images.samplers.end()) {
+            return it->second;
         }
-    }
 
-    ImageStorage::Textures create_image(TextureMap &uvmap) {
+        auto address_mode = [](int wrap) {
+            switch (wrap) {
+            case TINYGLTF_TEXTURE_WRAP_CLAMP_TO_EDGE:
+                return vk::SamplerAddressMode::eClampToEdge;
+            case TINYGLTF_TEXTURE_WRAP_MIRRORED_REPEAT:
+                return vk::SamplerAddressMode::eMirroredRepeat;
+            default:
+                return vk::SamplerAddressMode::eRepeat;
+            }
+        };
 
-        auto texture_format = get_vk_format(uvmap.type());
-        verify_format(uvmap, texture_format);
+        vk::PhysicalDeviceProperties properties =
+            physical_device.getProperties();
+        vk::SamplerCreateInfo sampler_info{};
+        sampler_info.sType = vk::StructureType::eSamplerCreateInfo;
+        sampler_info.magFilter =
+            state.mag_filter == TINYGLTF_TEXTURE_FILTER_NEAREST
+                ? vk::Filter::eNearest
+                : vk::Filter::eLinear;
+        sampler_info.minFilter =
+            (state.min_filter == TINYGLTF_TEXTURE_FILTER_NEAREST ||
+             state.min_filter ==
+                 TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_NEAREST ||
+             state.min_filter == TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_LINEAR)
+                ? vk::Filter::eNearest
+                : vk::Filter::eLinear;
+        sampler_info.mipmapMode =
+            (state.min_filter ==
+                 TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_NEAREST ||
+             state.min_filter == TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_NEAREST)
+                ? vk::SamplerMipmapMode::eNearest
+                : vk::SamplerMipmapMode::eLinear;
+        sampler_info.addressModeU = address_mode(state.wrap_s);
+        sampler_info.addressModeV = address_mode(state.wrap_t);
+        sampler_info.addressModeW = vk::SamplerAddressMode::eRepeat;
+        sampler_info.mipLodBias = 0.0f;
+        sampler_info.minLod = 0.0f;
+        // glTF minification filters without a mipmap mode only read the top
+        // level
+        sampler_info.maxLod =
+            (state.min_filter == TINYGLTF_TEXTURE_FILTER_NEAREST ||
+             state.min_filter == TINYGLTF_TEXTURE_FILTER_LINEAR)
+                ? 0.25f
+                : VK_LOD_CLAMP_NONE;
+        sampler_info.compareOp = vk::CompareOp::eNever;
+        sampler_info.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+        // sampler_info.anisotropyEnable = VK_TRUE;
+        sampler_info.borderColor = vk::BorderColor::eFloatOpaqueBlack;
 
-        VkDeviceSize size = uvmap.width() * uvmap.height() * uvmap.channels();
+        auto sampler = device.createSampler(sampler_info);
+        images.samplers[state] = sampler;
+        return sampler;
+    }
 
-        auto [staging_buffer, staging_allocation] =
-            create_staging_buffer_with_data(
-                uvmap.data(), size, vk::BufferUsageFlagBits::eTransferSrc);
+    // Creates a device-local texture image and its view, contents undefined
+    ImageStorage::Textures create_texture_image(uint32_t width, uint32_t height,
+                                                PixelFormat format,
+                                                uint32_t mip_levels) {
         ImageStorage::Textures current_memory;
+        current_memory.mip_levels = mip_levels;
+        const vk::Format texture_format = get_vk_format(format);
 
         vk::ImageCreateInfo create_info = images.get_create_info(
-            uvmap.width(), uvmap.height(), texture_format);
-        create_info.usage = vk::ImageUsageFlagBits::eTransferDst |
+            width, height, texture_format, current_memory.mip_levels);
+        // Mips are blitted from the level above
+        create_info.usage = vk::ImageUsageFlagBits::eTransferSrc |
+                            vk::ImageUsageFlagBits::eTransferDst |
                             vk::ImageUsageFlagBits::eSampled;
 
         VmaAllocationCreateInfo allocInfo{};
@@ -479,131 +764,907 @@ class Renderer {
             throw std::runtime_error("Failed to create image with VMA!");
         }
 
-        vk::CommandBuffer command_buffer =
-            device
-                .allocateCommandBuffers(vk::CommandBufferAllocateInfo(
-                    general_command_pool, vk::CommandBufferLevel::ePrimary, 1))
-                .front();
+        // Create image view
+        vk::ImageViewCreateInfo view_create_info;
+        view_create_info.sType = vk::StructureType::eImageViewCreateInfo;
+        view_create_info.viewType = vk::ImageViewType::e2D;
+        view_create_info.format = texture_format;
+        view_create_info.image = current_memory.image;
+        view_create_info.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0,
+                                             current_memory.mip_levels, 0, 1};
+        current_memory.view = device.createImageView(view_create_info);
+        current_memory.size =
+            get_image_size(format, width, height, current_memory.mip_levels);
 
-        command_buffer.begin(vk::CommandBufferBeginInfo(
-            vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+        return current_memory;
+    }
 
-        // Transition texture image to transfer destination optimal
+    // Records the copy of the levels stored at offset in buffer into image.
+    // If the layout asks for it the rest of the chain is then blitted level by
+    // level from mip 0. Leaves all levels ready for sampling.
+    void record_texture_upload(vk::CommandBuffer command_buffer,
+                               vk::Buffer buffer, vk::DeviceSize offset,
+                               const ImageStorage::Textures &texture_image,
+                               uint32_t width, uint32_t height,
+                               const TextureLayout &layout) {
+        const vk::Image image = texture_image.image;
+        const uint32_t mip_levels = texture_image.mip_levels;
+
+        // Transition all levels to transfer destination optimal
         vk::ImageMemoryBarrier pre_barrier;
         pre_barrier.oldLayout = vk::ImageLayout::eUndefined;
         pre_barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
-        pre_barrier.image = current_memory.image;
-        pre_barrier.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1,
-                                        0, 1};
+        pre_barrier.image = image;
+        pre_barrier.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0,
+                                        mip_levels, 0, 1};
         pre_barrier.srcAccessMask = vk::AccessFlagBits::eNone;
         pre_barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
 
         command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
-                                       vk::PipelineStageFlagBits::eAllCommands,
-                                       {}, {}, {}, {pre_barrier});
-
-        vk::BufferImageCopy region{};
-        region.bufferOffset = 0;
-        region.bufferRowLength = 0;
-        region.bufferImageHeight = 0;
-        region.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = 1;
-        region.imageOffset = vk::Offset3D{0, 0, 0};
-        region.imageExtent =
-            vk::Extent3D{static_cast<uint32_t>(uvmap.width()),
-                         static_cast<uint32_t>(uvmap.height()), 1};
-
-        std::vector<vk::BufferImageCopy> regions = {region};
-        command_buffer.copyBufferToImage(staging_buffer, current_memory.image,
+                                       vk::PipelineStageFlagBits::eTransfer, {},
+                                       {}, {}, {pre_barrier});
+
+        std::vector<vk::BufferImageCopy> regions;
+        for (uint32_t level = 0; level < layout.stored_levels(); level++) {
+            vk::BufferImageCopy region{};
+            region.bufferOffset = offset + layout.level_offsets[level];
+            region.bufferRowLength = 0;
+            region.bufferImageHeight = 0;
+            region.imageSubresource.aspectMask =
+                vk::ImageAspectFlagBits::eColor;
+            region.imageSubresource.mipLevel = level;
+            region.imageSubresource.baseArrayLayer = 0;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = vk::Offset3D{0, 0, 0};
+            region.imageExtent = vk::Extent3D{std::max(width >> level, 1u),
+                                              std::max(height >> level, 1u),
+                                              1};
+            regions.push_back(region);
+        }
+        command_buffer.copyBufferToImage(buffer, image,
                                          vk::ImageLayout::eTransferDstOptimal,
                                          regions.size(), regions.data());
 
-        vk::ImageMemoryBarrier pos_barrier;
-        pos_barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-        pos_barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-        pos_barrier.image = current_memory.image;
-        pos_barrier.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1,
-                                        0, 1};
-        pos_barrier.srcAccessMask = vk::AccessFlagBits::eNone;
-        pos_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-        ;
+        // Each level becomes a blit source once written, then is handed to
+        // the shaders after the level below has been blitted from it
+        vk::ImageMemoryBarrier barrier;
+        barrier.image = image;
+        barrier.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                                    1};
+        uint32_t generated = 0;
+        int32_t level_width = static_cast<int32_t>(width);
+        int32_t level_height = static_cast<int32_t>(height);
+        for (uint32_t level = 1; layout.generate_mips && level < mip_levels;
+             level++) {
+            barrier.subresourceRange.baseMipLevel = level - 1;
+            barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+            barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+            barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+            command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                           vk::PipelineStageFlagBits::eTransfer,
+                                           {}, {}, {}, {barrier});
+
+            const int32_t next_width = std::max(level_width / 2, 1);
+            const int32_t next_height = std::max(level_height / 2, 1);
+            vk::ImageBlit blit(
+                vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor,
+                                           level - 1, 0, 1),
+                {vk::Offset3D{0, 0, 0},
+                 vk::Offset3D{level_width, level_height, 1}},
+                vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor,
+                                           level, 0, 1),
+                {vk::Offset3D{0, 0, 0},
+                 vk::Offset3D{next_width, next_height, 1}});
+            command_buffer.blitImage(image, vk::ImageLayout::eTransferSrcOptimal,
+                                     image,
+                                     vk::ImageLayout::eTransferDstOptimal, 1,
+                                     &blit, vk::Filter::eLinear);
+
+            barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+            barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+            barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+            command_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, {}, {},
+                {barrier});
+
+            level_width = next_width;
+            level_height = next_height;
+            generated = level;
+        }
 
-        command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
-                                       vk::PipelineStageFlagBits::eAllCommands,
-                                       {}, {}, {}, {pos_barrier});
+        // Levels that were only written
+        barrier.subresourceRange.baseMipLevel = generated;
+        barrier.subresourceRange.levelCount = mip_levels - generated;
+        barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+        barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+        command_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, {}, {},
+            {barrier});
+    }
+
+    // Block compressed copies need offsets aligned to the block size
+    vk::DeviceSize get_staging_alignment() {
+        return std::max<vk::DeviceSize>(
+            16, physical_device.getProperties()
+                    .limits.optimalBufferCopyOffsetAlignment);
+    }
 
-        command_buffer.end();
+    // Decodes the scene textures from their resident base level straight
+    // into mapped staging memory and uploads them in batches. Two arenas
+    // alternate, so one batch is decoded while the previous one is copied.
+    // Textures larger than an arena get a batch and arena of their own. The
+    // encoded images are kept for streaming.
+    void upload_textures(TextureRegistry &textures) {
+        RT_PROFILE_FUNCTION();
+        struct Batch {
+            std::unique_ptr<StagingArena> arena;
+            vk::CommandBuffer command_buffer;
+            vk::Fence fence;
+            std::vector<size_t> textures;
+            std::vector<TextureLayout> layouts;
+        };
+
+        const vk::DeviceSize alignment = get_staging_alignment();
+        std::array<Batch, 2> batches;
+        for (auto &batch : batches) {
+            batch.arena = std::make_unique<StagingArena>(
+                allocator, staging_arena_size, alignment);
+            batch.fence = device.createFence(vk::FenceCreateInfo{});
+        }
 
         auto q = device.getQueue(graphics_queue_family_index, 0);
-        vk::SubmitInfo submit_info;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-        q.submit(1, &submit_info, nullptr);
-        q.waitIdle();
-        device.freeCommandBuffers(general_command_pool, 1, &command_buffer);
 
-        vmaDestroyBuffer(allocator, staging_buffer, staging_allocation);
+        // Frees the fences and command buffers however the upload ends, a
+        // failed decode leaves a batch in flight
+        struct BatchRelease {
+            vk::Device device;
+            vk::CommandPool pool;
+            vk::Queue queue;
+            std::array<Batch, 2> &batches;
+            ~BatchRelease() {
+                for (auto &batch : batches) {
+                    if (batch.command_buffer) {
+                        queue.waitIdle();
+                        device.freeCommandBuffers(pool, 1,
+                                                  &batch.command_buffer);
+                    }
+                    device.destroyFence(batch.fence);
+                }
+            }
+        } release{device, general_command_pool, q, batches};
 
-        // Create sampler
-        vk::PhysicalDeviceProperties properties =
-            physical_device.getProperties();
-        vk::SamplerCreateInfo sampler_info{};
-        sampler_info.sType = vk::StructureType::eSamplerCreateInfo;
-        sampler_info.magFilter = vk::Filter::eLinear;
-        sampler_info.minFilter = vk::Filter::eLinear;
-        sampler_info.mipmapMode = vk::SamplerMipmapMode::eLinear;
-        sampler_info.addressModeU = vk::SamplerAddressMode::eRepeat;
-        sampler_info.addressModeV = vk::SamplerAddressMode::eRepeat;
-        sampler_info.addressModeW = vk::SamplerAddressMode::eRepeat;
-        sampler_info.mipLodBias = 0.0f;
-        sampler_info.compareOp = vk::CompareOp::eNever;
-        sampler_info.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
-        // sampler_info.anisotropyEnable = VK_TRUE;
-        sampler_info.borderColor = vk::BorderColor::eFloatOpaqueBlack;
+        // Waits for a batch's copies and frees what it staged
+        auto retire = [&](Batch &batch) {
+            if (!batch.command_buffer) {
+                return;
+            }
+            if (device.waitForFences(1, &batch.fence, VK_TRUE, UINT64_MAX) !=
+                vk::Result::eSuccess) {
+                throw std::runtime_error("Failed waiting for texture upload");
+            }
+            device.resetFences(1, &batch.fence);
+            device.freeCommandBuffers(general_command_pool, 1,
+                                      &batch.command_buffer);
+            batch.command_buffer = nullptr;
+            batch.textures.clear();
+            batch.layouts.clear();
+            batch.arena->reset();
+            if (batch.arena->get_capacity() != staging_arena_size) {
+                batch.arena = std::make_unique<StagingArena>(
+                    allocator, staging_arena_size, alignment);
+            }
+        };
+
+        images.textures.resize(textures.size());
+        size_t next = 0;
+        size_t num_batches = 0;
+        while (next < textures.size()) {
+            Batch &batch = batches[num_batches % batches.size()];
+            retire(batch);
+
+            // Fill the arena, decoding on the worker pool
+            std::vector<vk::DeviceSize> offsets;
+            std::vector<std::future<void>> decodes;
+            while (next < textures.size()) {
+                auto &texture = textures[next];
+                const uint32_t base = residency[next].resident_base;
+                const auto layout =
+                    texture.layout.from_level(base, texture.width,
+                                              texture.height);
+                if (layout.size > batch.arena->get_capacity()) {
+                    if (!batch.textures.empty()) {
+                        break;
+                    }
+                    batch.arena = std::make_unique<StagingArena>(
+                        allocator, layout.size, alignment);
+                }
+                auto offset = batch.arena->allocate(layout.size);
+                if (offset == static_cast<vk::DeviceSize>(-1)) {
+                    break;
+                }
+                images.textures[next] = create_texture_image(
+                    std::max(texture.width >> base, 1),
+                    std::max(texture.height >> base, 1), layout.format,
+                    residency[next].levels - base);
+                images.textures[next].sampler =
+                    get_sampler(texture.sampler_state);
+                decodes.push_back(textures.decode_into(
+                    next, batch.arena->data(offset), base));
+                offsets.push_back(offset);
+                batch.textures.push_back(next);
+                batch.layouts.push_back(layout);
+                next++;
+            }
+            if (batch.textures.empty()) {
+                continue;
+            }
 
-        current_memory.sampler = device.createSampler(sampler_info);
+            // Let every decode finish writing the arena before rethrowing
+            // any errors
+            for (auto &decode : decodes) {
+                decode.wait();
+            }
+            for (auto &decode : decodes) {
+                decode.get();
+            }
+            batch.arena->flush();
+
+            batch.command_buffer =
+                device
+                    .allocateCommandBuffers(vk::CommandBufferAllocateInfo(
+                        general_command_pool, vk::CommandBufferLevel::ePrimary,
+                        1))
+                    .front();
+            batch.command_buffer.begin(vk::CommandBufferBeginInfo(
+                vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+            profiler->begin_frame(
+                profiler->get_load_slot(profiler_texture_slot +
+                                        num_batches % batches.size()),
+                batch.command_buffer);
+            const uint32_t scope =
+                profiler->begin(batch.command_buffer, "texture upload");
+            for (size_t j = 0; j < batch.textures.size(); j++) {
+                const size_t i = batch.textures[j];
+                const uint32_t base = residency[i].resident_base;
+                record_texture_upload(
+                    batch.command_buffer, batch.arena->get_buffer(),
+                    offsets[j], images.textures[i],
+                    std::max(textures[i].width >> base, 1),
+                    std::max(textures[i].height >> base, 1), batch.layouts[j]);
+            }
+            profiler->end(batch.command_buffer, scope);
+            batch.command_buffer.end();
+
+            vk::SubmitInfo submit_info;
+            submit_info.commandBufferCount = 1;
+            submit_info.pCommandBuffers = &batch.command_buffer;
+            q.submit(1, &submit_info, batch.fence);
+            num_batches++;
+        }
 
-        // Create image view
-        vk::ImageViewCreateInfo view_create_info;
-        view_create_info.sType = vk::StructureType::eImageViewCreateInfo;
-        view_create_info.viewType = vk::ImageViewType::e2D;
-        view_create_info.format = texture_format; // vk::Format::eR8G8B8A8Unorm;
-        view_create_info.image = current_memory.image;
-        view_create_info.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0,
-                                             1, 0, 1};
-        current_memory.view = device.createImageView(view_create_info);
+        for (auto &batch : batches) {
+            retire(batch);
+        }
 
-        // images.images_memory.push_back(current_memory);
-        return current_memory;
+        constexpr double mib = 1024.0 * 1024.0;
+        std::cout << "Uploaded " << textures.size() << " textures in "
+                  << num_batches << " batches through "
+                  << batches.size() * staging_arena_size / mib
+                  << " MiB of staging memory" << std::endl;
+    }
+
+    // Descriptor updates issued by create_scene_descriptors() and
+    // frame_setup(), and the time spent allocating and writing sets
+    struct DescriptorStats {
+        uint32_t scene_descriptors = 0;
+        uint32_t frame_descriptors = 0;
+        uint32_t writes = 0;
+        std::chrono::steady_clock::duration time{};
+    } descriptor_stats;
+
+    uint32_t
+    update_descriptor_sets(const std::vector<vk::WriteDescriptorSet> &writes) {
+        uint32_t descriptors = 0;
+        for (const auto &write : writes) {
+            descriptors += write.descriptorCount;
+        }
+        descriptor_stats.writes += static_cast<uint32_t>(writes.size());
+        device.updateDescriptorSets(writes, nullptr);
+        return descriptors;
+    }
+
+    // Allocates the scene set and writes the acceleration structure, scene
+    // buffers and every texture once
+    void create_scene_descriptors() {
+        RT_PROFILE_FUNCTION();
+        auto start = std::chrono::steady_clock::now();
+
+        const auto pool_sizes = std::array{
+            vk::DescriptorPoolSize{
+                vk::DescriptorType::eAccelerationStructureKHR, 1},
+            vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer, 3},
+            vk::DescriptorPoolSize{vk::DescriptorType::eCombinedImageSampler,
+                                   texture_capacity},
+        };
+        vk::DescriptorPoolCreateInfo pool_info{};
+        pool_info.flags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
+        pool_info.maxSets = 1;
+        pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+        pool_info.pPoolSizes = pool_sizes.data();
+        scene_descriptor_pool = device.createDescriptorPool(pool_info);
+
+        // Allocate the whole heap so textures can be added later
+        vk::DescriptorSetVariableDescriptorCountAllocateInfo variable_info{};
+        variable_info.descriptorSetCount = 1;
+        variable_info.pDescriptorCounts = &texture_capacity;
+
+        vk::DescriptorSetAllocateInfo alloc_info{};
+        alloc_info.descriptorPool = scene_descriptor_pool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &pipeline->descriptor_set_layouts[scene_set];
+        alloc_info.pNext = &variable_info;
+        scene_descriptor_set = device.allocateDescriptorSets(alloc_info).front();
+
+        // Acceleration Structure
+        vk::WriteDescriptorSetAccelerationStructureKHR acc_list;
+        acc_list.accelerationStructureCount = 1;
+        acc_list.pAccelerationStructures = &tlas->structure;
+        vk::WriteDescriptorSet acc_desc_write;
+        acc_desc_write.dstSet = scene_descriptor_set;
+        acc_desc_write.dstBinding = 0;
+        acc_desc_write.descriptorType =
+            vk::DescriptorType::eAccelerationStructureKHR;
+        acc_desc_write.descriptorCount = 1;
+        acc_desc_write.pNext = &acc_list;
+
+        // Mesh, instance and material data
+        const std::array<vk::DescriptorBufferInfo, 3> buffer_infos = {
+            vk::DescriptorBufferInfo{tlas->mesh_data_buffer, 0,
+                                     sizeof(MeshData) *
+                                         tlas->mesh_data.size()},
+            vk::DescriptorBufferInfo{tlas->instance_data_buffer, 0,
+                                     sizeof(InstanceData) *
+                                         tlas->instance_data.size()},
+            vk::DescriptorBufferInfo{tlas->material_data_buffer, 0,
+                                     sizeof(MaterialData) *
+                                         tlas->material_data.size()},
+        };
+        vk::WriteDescriptorSet buffer_desc_write;
+        buffer_desc_write.dstSet = scene_descriptor_set;
+        buffer_desc_write.dstBinding = 1; // consecutive bindings 1-3
+        buffer_desc_write.descriptorType = vk::DescriptorType::eStorageBuffer;
+        buffer_desc_write.descriptorCount =
+            static_cast<uint32_t>(buffer_infos.size());
+        buffer_desc_write.pBufferInfo = buffer_infos.data();
+
+        // Texture heap
+        std::vector<vk::DescriptorImageInfo> tex_infos;
+        for (auto &image : images.textures) {
+            tex_infos.push_back(vk::DescriptorImageInfo(
+                image.sampler, image.view,
+                vk::ImageLayout::eShaderReadOnlyOptimal));
+        }
+        vk::WriteDescriptorSet texture_desc_write;
+        texture_desc_write.dstSet = scene_descriptor_set;
+        texture_desc_write.dstBinding = 4;
+        texture_desc_write.descriptorType =
+            vk::DescriptorType::eCombinedImageSampler;
+        texture_desc_write.descriptorCount =
+            static_cast<uint32_t>(tex_infos.size());
+        texture_desc_write.pImageInfo = tex_infos.data();
+
+        std::vector<vk::WriteDescriptorSet> writes = {acc_desc_write,
+                                                      buffer_desc_write};
+        if (!tex_infos.empty()) {
+            writes.push_back(texture_desc_write);
+        }
+        descriptor_stats.scene_descriptors += update_descriptor_sets(writes);
+        descriptor_stats.time += std::chrono::steady_clock::now() - start;
+    }
+
+    void print_descriptor_stats() {
+        const size_t frames = frame_data.size();
+        std::cout << "Descriptor setup: " << descriptor_stats.writes
+                  << " writes, " << descriptor_stats.scene_descriptors
+                  << " scene descriptors shared by " << frames << " frames + "
+                  << descriptor_stats.frame_descriptors
+                  << " per-frame descriptors in "
+                  << std::chrono::duration<double, std::milli>(
+                         descriptor_stats.time)
+                         .count()
+                  << " ms" << std::endl;
+        std::cout << "A full set per frame would have written "
+                  << frames * descriptor_stats.scene_descriptors +
+                         descriptor_stats.frame_descriptors
+                  << " descriptors" << std::endl;
+    }
+
+    // Bytes textures may occupy: a fixed budget if one was set, otherwise a
+    // share of the device-local heap budgets minus everything else in them
+    uint64_t get_texture_budget() {
+        if (texture_budget_override > 0) {
+            return texture_budget_override;
+        }
+        const auto memory_properties = physical_device.getMemoryProperties();
+        std::vector<VmaBudget> budgets(memory_properties.memoryHeapCount);
+        vmaGetHeapBudgets(allocator, budgets.data());
+
+        uint64_t budget = 0;
+        uint64_t usage = 0;
+        for (uint32_t heap = 0; heap < memory_properties.memoryHeapCount;
+             heap++) {
+            if (memory_properties.memoryHeaps[heap].flags &
+                vk::MemoryHeapFlagBits::eDeviceLocal) {
+                budget += budgets[heap].budget;
+                usage += budgets[heap].usage;
+            }
+        }
+
+        uint64_t texture_usage = streaming_stats.resident_bytes;
+        for (const auto &job : stream_jobs) {
+            texture_usage += job.image.size;
+        }
+        for (const auto &retired : retired_textures) {
+            texture_usage += retired.image.size;
+        }
+        const uint64_t other = usage > texture_usage ? usage - texture_usage : 0;
+        const auto share = static_cast<uint64_t>(budget * texture_budget_share);
+        return share > other ? share - other : 0;
+    }
+
+    // Starts decoding texture i at base on the worker pool, into an image of
+    // its own that replaces the resident one once uploaded
+    void launch_stream_job(size_t i, uint32_t base, bool eviction) {
+        auto &texture = scene->get_textures()[i];
+
+        StreamJob job;
+        job.texture = i;
+        job.base = base;
+        job.eviction = eviction;
+        job.layout =
+            texture.layout.from_level(base, texture.width, texture.height);
+        job.staging = std::make_unique<StagingArena>(
+            allocator, job.layout.size, get_staging_alignment());
+        job.staging->allocate(job.layout.size);
+        job.image = create_texture_image(std::max(texture.width >> base, 1),
+                                         std::max(texture.height >> base, 1),
+                                         job.layout.format,
+                                         residency[i].levels - base);
+        job.image.sampler = images.textures[i].sampler;
+        job.decode = scene->get_textures().decode_into(
+            i, job.staging->data(0), base);
+        job.fence = device.createFence(vk::FenceCreateInfo{});
+
+        residency[i].pending = true;
+        stream_jobs.push_back(std::move(job));
+    }
+
+    void destroy_stream_job(StreamJob &job) {
+        if (job.decode.valid()) {
+            job.decode.wait();
+        }
+        if (job.command_buffer) {
+            device.freeCommandBuffers(general_command_pool, 1,
+                                      &job.command_buffer);
+        }
+        device.destroyFence(job.fence);
+        job.staging.reset();
+    }
+
+    void destroy_texture_image(ImageStorage::Textures &image) {
+        device.destroyImageView(image.view);
+        vmaDestroyImage(allocator, image.image, image.memory);
+    }
+
+    // Called once the frame's fence has signalled, before it is recorded
+    // again. Reads the feedback the frame left, uploads decoded jobs, swaps
+    // in finished ones and starts new stream-ins and evictions.
+    void update_streaming(FrameData &frame) {
+        RT_PROFILE_FUNCTION();
+        frame_number++;
+        streaming_stats.uploads = 0;
+        streaming_stats.evictions = 0;
+        auto &textures = scene->get_textures();
+        auto queue = device.getQueue(graphics_queue_family_index, 0);
+
+        // Frames are recorded in slot order, so with this frame's fence
+        // passed every frame recorded get_num_frames() or more frames ago
+        // has finished. A replaced image is destroyed once that includes
+        // every frame recorded before its swap, without waiting on fences.
+        while (!retired_textures.empty() &&
+               retired_textures.front().frame_number + get_num_frames() <=
+                   frame_number + 1) {
+            auto &retired = retired_textures.front();
+            destroy_texture_image(retired.image);
+            residency[retired.texture].pending = false;
+            retired_textures.pop_front();
+        }
+
+        // Feedback is relative to the image the frame sampled, so skip
+        // textures swapped since then
+        if (frame.frame_number > 0) {
+            vmaInvalidateAllocation(allocator,
+                                    frame.feedback_readback_allocation, 0,
+                                    VK_WHOLE_SIZE);
+            for (size_t i = 0; i < residency.size(); i++) {
+                auto &texture_residency = residency[i];
+                const uint32_t value = frame.feedback[i];
+                if (value == streaming_feedback_unused ||
+                    texture_residency.changed > frame.frame_number) {
+                    continue;
+                }
+                const int64_t wanted =
+                    static_cast<int64_t>(texture_residency.resident_base) +
+                    value - streaming_feedback_bias;
+                texture_residency.wanted_base = static_cast<uint32_t>(
+                    std::clamp<int64_t>(wanted, 0,
+                                        texture_residency.levels - 1));
+                texture_residency.last_used = frame.frame_number;
+            }
+        }
+        frame.frame_number = frame_number;
+
+        // Upload decoded jobs and collect the ones whose upload finished
+        std::vector<size_t> finished;
+        std::vector<size_t> failed;
+        for (size_t j = 0; j < stream_jobs.size(); j++) {
+            auto &job = stream_jobs[j];
+            if (job.command_buffer) {
+                if (device.getFenceStatus(job.fence) == vk::Result::eSuccess) {
+                    finished.push_back(j);
+                }
+                continue;
+            }
+            if (job.decode.wait_for(std::chrono::seconds(0)) !=
+                std::future_status::ready) {
+                continue;
+            }
+            try {
+                job.decode.get();
+            } catch (const std::exception &e) {
+                std::cerr << "Failed to stream texture " << job.texture
+                          << ": " << e.what() << std::endl;
+                failed.push_back(j);
+                continue;
+            }
+            job.staging->flush();
+
+            auto &texture = textures[job.texture];
+            job.command_buffer =
+                device
+                    .allocateCommandBuffers(vk::CommandBufferAllocateInfo(
+                        general_command_pool, vk::CommandBufferLevel::ePrimary,
+                        1))
+                    .front();
+            job.command_buffer.begin(vk::CommandBufferBeginInfo(
+                vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+            record_texture_upload(job.command_buffer,
+                                  job.staging->get_buffer(), 0, job.image,
+                                  std::max(texture.width >> job.base, 1),
+                                  std::max(texture.height >> job.base, 1),
+                                  job.layout);
+            job.command_buffer.end();
+
+            vk::SubmitInfo submit_info;
+            submit_info.commandBufferCount = 1;
+            submit_info.pCommandBuffers = &job.command_buffer;
+            queue.submit(1, &submit_info, job.fence);
+        }
+
+        // Frames in flight may sample the texture's current heap element,
+        // so the new image goes into its other one, which nothing uses since
+        // the previous swap retired. Frames recorded from now on sample it.
+        if (!finished.empty()) {
+            std::vector<vk::DescriptorImageInfo> image_infos;
+            image_infos.reserve(finished.size());
+            std::vector<vk::WriteDescriptorSet> writes;
+            for (auto j : finished) {
+                auto &job = stream_jobs[j];
+                const size_t i = job.texture;
+                destroy_stream_job(job);
+
+                streaming_stats.resident_bytes +=
+                    job.image.size - images.textures[i].size;
+                retired_textures.push_back(
+                    {frame_number, i, images.textures[i]});
+                images.textures[i] = job.image;
+                const auto count = static_cast<uint32_t>(residency.size());
+                texture_slots[i] = texture_slots[i] < count
+                                       ? static_cast<uint32_t>(i) + count
+                                       : static_cast<uint32_t>(i);
+
+                auto &texture_residency = residency[i];
+                texture_residency.resident_base = job.base;
+                texture_residency.changed = frame_number;
+                (job.eviction ? streaming_stats.evictions
+                              : streaming_stats.uploads)++;
+
+                image_infos.push_back(vk::DescriptorImageInfo(
+                    job.image.sampler, job.image.view,
+                    vk::ImageLayout::eShaderReadOnlyOptimal));
+                vk::WriteDescriptorSet write;
+                write.dstSet = scene_descriptor_set;
+                write.dstBinding = 4;
+                write.dstArrayElement = texture_slots[i];
+                write.descriptorType =
+                    vk::DescriptorType::eCombinedImageSampler;
+                write.descriptorCount = 1;
+                write.pImageInfo = &image_infos.back();
+                writes.push_back(write);
+            }
+            device.updateDescriptorSets(writes, nullptr);
+            texture_slots_version++;
+        }
+
+        // Keep failed textures at what is resident instead of retrying
+        for (auto j : failed) {
+            auto &job = stream_jobs[j];
+            destroy_stream_job(job);
+            destroy_texture_image(job.image);
+            residency[job.texture].pending = false;
+            residency[job.texture].wanted_base =
+                residency[job.texture].resident_base;
+        }
+
+        finished.insert(finished.end(), failed.begin(), failed.end());
+        std::sort(finished.rbegin(), finished.rend());
+        for (auto j : finished) {
+            stream_jobs.erase(stream_jobs.begin() + j);
+        }
+
+        // Textures wanting finer levels, largest gap and most recent first
+        std::vector<size_t> requests;
+        for (size_t i = 0; i < residency.size(); i++) {
+            if (!residency[i].pending &&
+                residency[i].wanted_base < residency[i].resident_base) {
+                requests.push_back(i);
+            }
+        }
+        std::sort(requests.begin(), requests.end(), [&](size_t a, size_t b) {
+            const uint32_t gap_a =
+                residency[a].resident_base - residency[a].wanted_base;
+            const uint32_t gap_b =
+                residency[b].resident_base - residency[b].wanted_base;
+            return gap_a != gap_b ? gap_a > gap_b
+                                  : residency[a].last_used >
+                                        residency[b].last_used;
+        });
+
+        // Eviction candidates drop one level at a time, least recently used
+        // first. Only textures that are unused or finer than requested go.
+        std::vector<size_t> victims;
+        for (size_t i = 0; i < residency.size(); i++) {
+            const auto &texture_residency = residency[i];
+            if (!texture_residency.pending &&
+                texture_residency.resident_base + 1 <
+                    texture_residency.levels &&
+                (texture_residency.last_used + eviction_age < frame_number ||
+                 texture_residency.wanted_base >
+                     texture_residency.resident_base)) {
+                victims.push_back(i);
+            }
+        }
+        std::sort(victims.begin(), victims.end(), [&](size_t a, size_t b) {
+            return residency[a].last_used > residency[b].last_used;
+        });
+
+        const uint64_t budget = get_texture_budget();
+        streaming_stats.budget_bytes = budget;
+        auto texture_usage = [&] {
+            uint64_t usage = streaming_stats.resident_bytes;
+            for (const auto &job : stream_jobs) {
+                usage += job.image.size;
+            }
+            for (const auto &retired : retired_textures) {
+                usage += retired.image.size;
+            }
+            return usage;
+        };
+        auto evict_one = [&] {
+            if (victims.empty() || stream_jobs.size() >= max_stream_jobs) {
+                return false;
+            }
+            const size_t i = victims.back();
+            victims.pop_back();
+            launch_stream_job(i, residency[i].resident_base + 1, true);
+            return true;
+        };
+
+        // Over budget, e.g. because other allocations grew
+        uint64_t usage = texture_usage();
+        while (usage > budget && evict_one()) {
+            usage = texture_usage();
+        }
+
+        for (size_t i : requests) {
+            if (stream_jobs.size() >= max_stream_jobs) {
+                break;
+            }
+            const auto &texture = textures[i];
+            const uint32_t base = residency[i].wanted_base;
+            const uint64_t size = get_image_size(
+                texture.layout.format, std::max(texture.width >> base, 1),
+                std::max(texture.height >> base, 1),
+                residency[i].levels - base);
+            // The old image stays until the new one is swapped in
+            if (texture_usage() + size > budget) {
+                victims.erase(std::remove(victims.begin(), victims.end(), i),
+                              victims.end());
+                evict_one();
+                break;
+            }
+            victims.erase(std::remove(victims.begin(), victims.end(), i),
+                          victims.end());
+            launch_stream_job(i, base, false);
+        }
+
+        streaming_stats.pending = static_cast<uint32_t>(stream_jobs.size());
+        for (size_t i : requests) {
+            streaming_stats.pending += residency[i].pending ? 0 : 1;
+        }
+    }
+
+    // Alpha and feature flags of a material. Texture slots whose factors
+    // make the fetch irrelevant are left out.
+    static uint32_t get_material_flags(Material &material,
+                                       const MaterialData &data) {
+        uint32_t flags = 0;
+        switch (material.get_alpha_mode()) {
+        case Material::AlphaMode::mask:
+            flags |= material_alpha_mask;
+            break;
+        case Material::AlphaMode::blend:
+            flags |= material_alpha_blend;
+            break;
+        default:
+            break;
+        }
+        if (material.is_double_sided()) {
+            flags |= material_double_sided;
+        }
+
+        const bool alpha_tested =
+            flags & (material_alpha_mask | material_alpha_blend);
+        if (data.base_color_texture >= 0 &&
+            (alpha_tested ||
+             glm::vec3(data.base_color_factor) != glm::vec3(0.0f))) {
+            flags |= material_base_color_texture;
+        }
+        if (data.normal_texture >= 0 && data.normal_scale != 0.0f) {
+            flags |= material_normal_texture;
+        }
+        if (data.metallic_roughness_texture >= 0 &&
+            (data.metallic_factor != 0.0f || data.roughness_factor != 0.0f)) {
+            flags |= material_metallic_roughness_texture;
+        }
+        if (data.emissive_texture >= 0 &&
+            data.emissive_factor != glm::vec3(0.0f)) {
+            flags |= material_emissive_texture;
+        }
+        if (flags & (material_base_color_texture | material_normal_texture |
+                     material_metallic_roughness_texture |
+                     material_emissive_texture)) {
+            flags |= material_textured;
+        }
+        return flags;
     }
 
     void create_textures() {
-        // TextureMap uvmap;
-        uint32_t n_material = 0;
-        for (; n_material < scene->material_size(); n_material++) {
-            for (auto &texture : scene->material(n_material)) {
-                // uvmap = texture;
-                if (texture.type() ==
-                    TextureMap::TextureType::baseColorTexture) {
-                    images.base_color_textures.push_back(create_image(texture));
-                } else if (texture.type() ==
-                           TextureMap::TextureType::normalTexture) {
-                    images.normal_textures.push_back(create_image(texture));
-                } else if (texture.type() ==
-                           TextureMap::TextureType::metallicRoughnessTexture) {
-                    images.metallic_roughness_textures.push_back(
-                        create_image(texture));
-                } else if (texture.type() ==
-                           TextureMap::TextureType::emissiveTexture) {
-                    images.emissive_textures.push_back(create_image(texture));
-                } else {
-                    std::cout << "Unknown texture type" << std::endl;
+        RT_PROFILE_FUNCTION();
+        auto &textures = scene->get_textures();
+
+        // Every texture has two heap elements to stream into
+        if (textures.size() > texture_capacity / 2) {
+            throw std::runtime_error("Scene has more than " +
+                                     std::to_string(texture_capacity / 2) +
+                                     " textures");
+        }
+        texture_slots.resize(textures.size());
+        for (size_t i = 0; i < textures.size(); i++) {
+            texture_slots[i] = static_cast<uint32_t>(i);
+        }
+        texture_slots_version = 1;
+
+        textures.choose_layouts(block_compression);
+
+        // Mips are generated with linear blits, formats that cannot be
+        // blitted from and to are uploaded with their stored levels only
+        const vk::FormatFeatureFlags blit_features =
+            vk::FormatFeatureFlagBits::eSampledImageFilterLinear |
+            vk::FormatFeatureFlagBits::eBlitSrc |
+            vk::FormatFeatureFlagBits::eBlitDst;
+        std::map<vk::Format, bool> blittable;
+        for (auto &texture : textures) {
+            if (!texture.layout.generate_mips) {
+                continue;
+            }
+            const vk::Format format = get_vk_format(texture.layout.format);
+            auto it = blittable.find(format);
+            if (it == blittable.end()) {
+                const auto features =
+                    physical_device.getFormatProperties(format)
+                        .optimalTilingFeatures;
+                it = blittable
+                         .emplace(format,
+                                  (features & blit_features) == blit_features)
+                         .first;
+                if (!it->second) {
+                    std::cout << "Texture format " << vk::to_string(format)
+                              << " does not support linear blits, uploading "
+                                 "without mips"
+                              << std::endl;
                 }
             }
+            texture.layout.generate_mips = it->second;
+        }
+
+        // Start every texture at its level of about streaming_initial_size
+        residency.assign(textures.size(), TextureResidency{});
+        for (size_t i = 0; i < textures.size(); i++) {
+            const auto &texture = textures[i];
+            auto &texture_residency = residency[i];
+            texture_residency.levels =
+                texture.layout.generate_mips
+                    ? ImageStorage::get_mip_levels(texture.width,
+                                                   texture.height)
+                    : texture.layout.stored_levels();
+            uint32_t base = 0;
+            while (base + 1 < texture_residency.levels &&
+                   (std::max(texture.width, texture.height) >> base) >
+                       static_cast<int>(streaming_initial_size)) {
+                base++;
+            }
+            texture_residency.resident_base = base;
+            texture_residency.wanted_base = base;
+        }
+
+        upload_textures(textures);
+        textures.print_decode_stats();
+
+        streaming_stats.resident_bytes = 0;
+        for (const auto &image : images.textures) {
+            streaming_stats.resident_bytes += image.size;
+        }
+
+        // Per-material data, texture slots without a texture use the factors
+        vk::DeviceSize per_slot_bytes = 0;
+        for (auto &material : scene->get_materials()) {
+            MaterialData data{};
+            data.base_color_factor = material.get_base_color();
+            data.emissive_factor = material.get_emissive();
+            data.metallic_factor = static_cast<float>(material.get_metallic());
+            data.roughness_factor =
+                static_cast<float>(material.get_roughness());
+            data.transmission = static_cast<float>(material.get_transmission());
+            data.alpha_cutoff = static_cast<float>(material.get_alpha_cutoff());
+            data.normal_scale = static_cast<float>(material.get_normal_scale());
+            data.base_color_texture = material.get_base_color_texture();
+            data.normal_texture = material.get_normal_texture();
+            data.metallic_roughness_texture =
+                material.get_metallic_roughness_texture();
+            data.emissive_texture = material.get_emissive_texture();
+            data.flags = get_material_flags(material, data);
+            tlas->material_data.push_back(data);
+
+            // What one image per material slot (with 1x1 defaults) would cost
+            for (auto index :
+                 {data.base_color_texture, data.normal_texture,
+                  data.metallic_roughness_texture, data.emissive_texture}) {
+                per_slot_bytes += index >= 0 ? images.textures[index].size : 4;
+            }
+        }
+
+        if (tlas->material_data.empty()) {
+            // Keep the material buffer valid for scenes without materials
             tlas->material_data.push_back(MaterialData{
-                (float)scene->material(n_material).get_transmission()});
+                glm::vec4(1.0f), glm::vec3(0.0f), 0.0f, 1.0f, 0.0f, 0.5f, 1.0f,
+                -1, -1, -1, -1, 0});
         }
 
         // copy material data to device buffer
@@ -615,127 +1676,225 @@ class Renderer {
         tlas->material_data_buffer = mat_buf;
         tlas->material_data_allocation = mat_alloc;
 
-        std::cout << "Created " << images.base_color_textures.size()
-                  << " base color textures" << std::endl;
-        std::cout << "Created " << images.normal_textures.size()
-                  << " normal textures" << std::endl;
-        std::cout << "Created " << images.metallic_roughness_textures.size()
-                  << " metallic textures" << std::endl;
-        std::cout << "Created " << images.emissive_textures.size()
-                  << " emissive textures" << std::endl;
+        // Compare against uploading every texture as RGBA8
+        vk::DeviceSize texture_bytes = 0;
+        vk::DeviceSize rgba8_bytes = 0;
+        vk::DeviceSize full_bytes = 0;
+        size_t compressed = 0;
+        for (size_t i = 0; i < images.textures.size(); i++) {
+            const auto &texture = textures[i];
+            const uint32_t base = residency[i].resident_base;
+            texture_bytes += images.textures[i].size;
+            rgba8_bytes += get_image_size(
+                PixelFormat::rgba8_unorm, std::max(texture.width >> base, 1),
+                std::max(texture.height >> base, 1),
+                images.textures[i].mip_levels);
+            full_bytes += get_image_size(texture.layout.format, texture.width,
+                                         texture.height, residency[i].levels);
+            compressed += is_block_compressed(texture.layout.format) ? 1 : 0;
+        }
+        constexpr double mib = 1024.0 * 1024.0;
+        std::cout << "Created " << images.textures.size() << " textures ("
+                  << compressed << " block compressed, "
+                  << texture_bytes / mib << " MiB) and "
+                  << images.samplers.size() << " samplers, "
+                  << full_bytes / mib << " MiB when fully resident"
+                  << std::endl;
+        if (rgba8_bytes > 0) {
+            std::cout << "RGBA8 textures would have been " << rgba8_bytes / mib
+                      << " MiB, " << 32.0 * texture_bytes / rgba8_bytes
+                      << " bits per texel fetched instead of 32" << std::endl;
+        }
+        std::cout << "Per-material textures would have been "
+                  << 4 * scene->material_size() << " textures ("
+                  << per_slot_bytes / mib << " MiB)" << std::endl;
     }
 
   public:
+    // Without a window system the renderer is headless: frames are traced
+    // but never presented
     Renderer(WindowHandle window, WindowSystemGLFW *window_system, const std::filesystem::path & scene_path)
         : window(window), window_system(window_system) {
 
         graphics_queue_family_index = -1;
         present_queue_family_index = -1;
         averaging = true;
+        texture_lod = true;
+        material_fast_paths = true;
+        shader_counters = false;
+        frame_number = 0;
+        texture_slots_version = 0;
+        texture_budget_override = 0;
+        region = {0, 0, r_width, r_height};
         setup_vulkan();
 
-        swapchain = std::make_unique<Swapchain>(
-            physical_device, device, window_system->get(window), surface);
+        if (window_system) {
+            swapchain = std::make_unique<Swapchain>(
+                physical_device, device, window_system->get(window), surface);
+        }
+        profiler = std::make_unique<GpuProfiler>(
+            device, physical_device, graphics_queue_family_index,
+            get_num_frames(), profiler_load_slots);
 
         create_rt_pipeline();
         create_sbt();
         std::cout << "Loading scene at: " << scene_path << std::endl;
         load_scene(scene_path.string());
 
+        create_scene_descriptors();
         frame_setup();
-        set_camera_changed(true);
+        print_descriptor_stats();
+        set_tile_settings(tile_settings);
 
-        std::cout << "Renderer created" << std::endl;
+        std::cout << "Renderer created" << (swapchain ? "" : " (headless)")
+                  << std::endl;
     }
 
+    explicit Renderer(const std::filesystem::path &scene_path)
+        : Renderer(WindowHandle{}, nullptr, scene_path) {}
+
     ~Renderer() {
         frame_cleanup();
+        device.destroyDescriptorPool(scene_descriptor_pool);
+        for (auto &job : stream_jobs) {
+            destroy_stream_job(job);
+            destroy_texture_image(job.image);
+        }
+        stream_jobs.clear();
+        for (auto &retired : retired_textures) {
+            destroy_texture_image(retired.image);
+        }
+        retired_textures.clear();
         if (swapchain) {
             swapchain.reset();
         }
         tlas.reset();
         scene.reset();
-        for (auto &image : images.base_color_textures) {
-            device.destroyImageView(image.view);
-            device.destroySampler(image.sampler);
-            vmaDestroyImage(allocator, image.image, image.memory);
-        }
-        for (auto &image : images.normal_textures) {
-            device.destroyImageView(image.view);
-            device.destroySampler(image.sampler);
-            vmaDestroyImage(allocator, image.image, image.memory);
-        }
-        for (auto &image : images.metallic_roughness_textures) {
-            device.destroyImageView(image.view);
-            device.destroySampler(image.sampler);
-            vmaDestroyImage(allocator, image.image, image.memory);
-        }
-        for (auto &image : images.emissive_textures) {
-            device.destroyImageView(image.view);
-            device.destroySampler(image.sampler);
-            vmaDestroyImage(allocator, image.image, image.memory);
+        tile_timer.reset();
+        profiler.reset();
+        for (auto &image : images.textures) {
+            destroy_texture_image(image);
+        }
+        for (auto &[state, sampler] : images.samplers) {
+            device.destroySampler(sampler);
         }
         cleanup_vulkan();
         std::cout << "Renderer destroyed" << std::endl;
     }
 
+    // Frames in flight, one per swapchain image
+    uint32_t get_num_frames() const {
+        return swapchain ? swapchain->get_num_images() : headless_frames;
+    }
+
     void set_camera_changed(bool changed) {
         for (auto &frame : frame_data) {
             frame->camera_changed = changed;
         }
     }
 
+    // Restarts accumulation inside the region only, the image outside keeps
+    // its samples. The first sample overwrites the old pixels, so unlike a
+    // camera change nothing is cleared.
+    void restart_region() {
+        for (auto &frame : frame_data) {
+            frame->region_changed = true;
+        }
+    }
+
+    // Covers the region with tiles, frames in flight must have finished
+    void make_region_tiles() {
+        device.waitIdle();
+        tiles = make_tiles(region, tile_settings.tile_size,
+                           tile_settings.order);
+        tile_timer = std::make_unique<TileTimer>(
+            device, *profiler, get_num_frames(),
+            static_cast<uint32_t>(tiles.size()));
+    }
+
+    // Splits traceRaysKHR into tiles, restarting accumulation
+    void set_tile_settings(const TileSettings &settings) {
+        if ((adaptive.enabled || reprojection) &&
+            settings.tiles_per_frame > 0) {
+            throw std::runtime_error("Tile budgets do not work with adaptive "
+                                     "sampling or reprojection");
+        }
+        tile_settings = settings;
+        tile_settings.submits = std::max(tile_settings.submits, 1u);
+        make_region_tiles();
+        set_camera_changed(true);
+    }
+
+    const TileSettings &get_tile_settings() const { return tile_settings; }
+
+    // Only traces the pixels of a rectangle, clipped to the image, and
+    // restarts accumulation there. The rest of the image keeps what it has
+    // converged to until the camera changes, which clears all of it.
+    void set_region(const Tile &rectangle) {
+        const uint32_t x = std::min<uint32_t>(rectangle.x, r_width);
+        const uint32_t y = std::min<uint32_t>(rectangle.y, r_height);
+        const uint32_t width = std::min<uint32_t>(rectangle.width, r_width - x);
+        const uint32_t height =
+            std::min<uint32_t>(rectangle.height, r_height - y);
+        if (width == 0 || height == 0) {
+            throw std::runtime_error("Region is outside the image");
+        }
+        region = {x, y, width, height};
+        make_region_tiles();
+        restart_region();
+    }
+
+    // Traces the whole image again, restarting accumulation everywhere
+    void clear_region() {
+        region = {0, 0, r_width, r_height};
+        make_region_tiles();
+        restart_region();
+    }
+
+    bool has_region() const {
+        return region.width < r_width || region.height < r_height;
+    }
+
+    const Tile &get_region() const { return region; }
+
     void load_scene(std::string file_path);
 
     void create_sbt();
 
     // Set up common and frame-specific data
     void frame_setup() {
+        RT_PROFILE_FUNCTION();
 
         // You'll need to recreate all this if the swapchain changes
         common_data = std::make_shared<CommonFrameData>(
-            device, allocator, swapchain->get_num_images(),
-            graphics_queue_family_index);
+            device, allocator, get_num_frames(), graphics_queue_family_index);
         current_frame = 0;
-        // frame_data.resize(swapchain->get_num_images());
-        for (int i = 0; i < swapchain->get_num_images(); i++) {
-            frame_data.emplace_back(
-                std::make_unique<FrameData>(common_data, r_width, r_height, i));
+        for (uint32_t i = 0; i < get_num_frames(); i++) {
+            frame_data.emplace_back(std::make_unique<FrameData>(
+                common_data, r_width, r_height, i,
+                static_cast<uint32_t>(residency.size())));
         }
 
-        // Create descriptor sets for the pipeline
-
-        for (int i = 0; i < swapchain->get_num_images(); i++) {
+        // Per-frame sets only hold the output image and camera, the scene
+        // set is shared
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < get_num_frames(); i++) {
+            const auto &layout = pipeline->descriptor_set_layouts[frame_set];
 
             vk::DescriptorSetAllocateInfo alloc_info{};
             alloc_info.descriptorPool = frame_data[i]->descriptor_pool;
             alloc_info.descriptorSetCount = 1;
-            alloc_info.pSetLayouts = &pipeline->descriptor_set_layout;
+            alloc_info.pSetLayouts = &layout;
 
             vk::DescriptorSet descriptor_set;
             device.allocateDescriptorSets(&alloc_info, &descriptor_set);
 
-            frame_data[i]->descriptor_sets[pipeline->descriptor_set_layout] =
-                descriptor_set;
-
-            // Fill descriptor set
-
-            // Acceleration Structure
-            vk::WriteDescriptorSet acc_desc_write;
-            acc_desc_write.dstSet = descriptor_set;
-            acc_desc_write.dstBinding = 0;
-            acc_desc_write.descriptorType =
-                vk::DescriptorType::eAccelerationStructureKHR;
-            acc_desc_write.descriptorCount = 1;
-            vk::WriteDescriptorSetAccelerationStructureKHR acc_list;
-            acc_list.accelerationStructureCount = 1;
-            acc_list.pAccelerationStructures = &tlas->structure;
-            acc_desc_write.pNext = &acc_list;
+            frame_data[i]->descriptor_sets[layout] = descriptor_set;
 
             // RT image descriptor
             vk::WriteDescriptorSet img_desc_write;
             img_desc_write.dstSet = descriptor_set;
-            img_desc_write.dstBinding = 1;
+            img_desc_write.dstBinding = 0;
             img_desc_write.descriptorType = vk::DescriptorType::eStorageImage;
             img_desc_write.descriptorCount = 1;
 
@@ -747,7 +1906,7 @@ class Renderer {
             // Camera UBO descriptor
             vk::WriteDescriptorSet cam_desc_write;
             cam_desc_write.dstSet = descriptor_set;
-            cam_desc_write.dstBinding = 2;
+            cam_desc_write.dstBinding = 1;
             cam_desc_write.descriptorType = vk::DescriptorType::eUniformBuffer;
             cam_desc_write.descriptorCount = 1;
 
@@ -758,119 +1917,97 @@ class Renderer {
 
             cam_desc_write.pBufferInfo = &cb_info;
 
-            // Mesh data descriptor
-            vk::WriteDescriptorSet mesh_desc_write;
-            mesh_desc_write.dstSet = descriptor_set;
-            mesh_desc_write.dstBinding = 3;
-            mesh_desc_write.descriptorType = vk::DescriptorType::eStorageBuffer;
-            mesh_desc_write.descriptorCount = 1;
-            vk::DescriptorBufferInfo mesh_info;
-            mesh_info.buffer = tlas->mesh_data_buffer;
-            mesh_info.offset = 0;
-            mesh_info.range = sizeof(MeshData) * tlas->mesh_data.size();
-            mesh_desc_write.pBufferInfo = &mesh_info;
-
-            // Instance data descriptor
-            vk::WriteDescriptorSet instance_desc_write;
-            instance_desc_write.dstSet = descriptor_set;
-            instance_desc_write.dstBinding = 4;
-            instance_desc_write.descriptorType =
+            // Streaming feedback descriptor
+            vk::WriteDescriptorSet feedback_desc_write;
+            feedback_desc_write.dstSet = descriptor_set;
+            feedback_desc_write.dstBinding = 2;
+            feedback_desc_write.descriptorType =
                 vk::DescriptorType::eStorageBuffer;
-            instance_desc_write.descriptorCount = 1;
-            vk::DescriptorBufferInfo instance_info;
-            instance_info.buffer = tlas->instance_data_buffer;
-            instance_info.offset = 0;
-            instance_info.range =
-                sizeof(InstanceData) * tlas->instance_data.size();
-            instance_desc_write.pBufferInfo = &instance_info;
-
-            // Instance data descriptor
-            vk::WriteDescriptorSet material_desc_write;
-            material_desc_write.dstSet = descriptor_set;
-            material_desc_write.dstBinding = 5;
-            material_desc_write.descriptorType =
-                vk::DescriptorType::eStorageBuffer;
-            material_desc_write.descriptorCount = 1;
-            vk::DescriptorBufferInfo mat_info;
-            mat_info.buffer = tlas->material_data_buffer;
-            mat_info.offset = 0;
-            mat_info.range = sizeof(MaterialData) * tlas->material_data.size();
-            material_desc_write.pBufferInfo = &mat_info;
-
-            // Base color texture descriptor
-            vk::WriteDescriptorSet texture_desc_write;
-            texture_desc_write.dstSet = descriptor_set;
-            texture_desc_write.dstBinding = 6;
-            texture_desc_write.descriptorType =
-                vk::DescriptorType::eCombinedImageSampler;
-
-            std::vector<vk::DescriptorImageInfo> tex_infos;
-            for (auto &image : images.base_color_textures) {
-                tex_infos.push_back(vk::DescriptorImageInfo(
-                    image.sampler, image.view,
-                    vk::ImageLayout::eShaderReadOnlyOptimal));
-            }
-
-            texture_desc_write.pImageInfo = tex_infos.data();
-            texture_desc_write.descriptorCount =
-                static_cast<uint32_t>(tex_infos.size());
-
-            // Normal texture descriptor
-            vk::WriteDescriptorSet normal_desc_write;
-            normal_desc_write.dstSet = descriptor_set;
-            normal_desc_write.dstBinding = 7;
-            normal_desc_write.descriptorType =
-                vk::DescriptorType::eCombinedImageSampler;
-            std::vector<vk::DescriptorImageInfo> normal_tex_infos;
-            for (auto &image : images.normal_textures) {
-                normal_tex_infos.push_back(vk::DescriptorImageInfo(
-                    image.sampler, image.view,
-                    vk::ImageLayout::eShaderReadOnlyOptimal));
-            }
-            normal_desc_write.pImageInfo = normal_tex_infos.data();
-            normal_desc_write.descriptorCount =
-                static_cast<uint32_t>(images.normal_textures.size());
-
-            // Metallic roughness texture descriptor
-            vk::WriteDescriptorSet metallic_desc_write;
-            metallic_desc_write.dstSet = descriptor_set;
-            metallic_desc_write.dstBinding = 8;
-            metallic_desc_write.descriptorType =
-                vk::DescriptorType::eCombinedImageSampler;
-            std::vector<vk::DescriptorImageInfo> metallic_tex_infos;
-            for (auto &image : images.metallic_roughness_textures) {
-                metallic_tex_infos.push_back(vk::DescriptorImageInfo(
-                    image.sampler, image.view,
-                    vk::ImageLayout::eShaderReadOnlyOptimal));
-            }
-            metallic_desc_write.pImageInfo = metallic_tex_infos.data();
-            metallic_desc_write.descriptorCount = static_cast<uint32_t>(
-                images.metallic_roughness_textures.size());
-
-            // Emissive texture descriptor
-            vk::WriteDescriptorSet emissive_desc_write;
-            emissive_desc_write.dstSet = descriptor_set;
-            emissive_desc_write.dstBinding = 9;
-            emissive_desc_write.descriptorType =
-                vk::DescriptorType::eCombinedImageSampler;
-            std::vector<vk::DescriptorImageInfo> emissive_tex_infos;
-            for (auto &image : images.emissive_textures) {
-                emissive_tex_infos.push_back(vk::DescriptorImageInfo(
-                    image.sampler, image.view,
-                    vk::ImageLayout::eShaderReadOnlyOptimal));
+            feedback_desc_write.descriptorCount = 1;
+
+            vk::DescriptorBufferInfo feedback_info;
+            feedback_info.buffer = frame_data[i]->feedback_buffer;
+            feedback_info.offset = 0;
+            feedback_info.range = frame_data[i]->feedback_size;
+            feedback_desc_write.pBufferInfo = &feedback_info;
+
+            // Adaptive sampling descriptors
+            vk::WriteDescriptorSet stats_desc_write = img_desc_write;
+            stats_desc_write.dstBinding = 3;
+            vk::DescriptorImageInfo stats_info = img_info;
+            stats_info.imageView = frame_data[i]->sample_stats_view;
+            stats_desc_write.pImageInfo = &stats_info;
+
+            vk::WriteDescriptorSet adaptive_desc_write = feedback_desc_write;
+            adaptive_desc_write.dstBinding = 4;
+            vk::DescriptorBufferInfo adaptive_info;
+            adaptive_info.buffer = frame_data[i]->adaptive_buffer;
+            adaptive_info.offset = 0;
+            adaptive_info.range = frame_data[i]->adaptive_size;
+            adaptive_desc_write.pBufferInfo = &adaptive_info;
+
+            // Previous frame descriptors, frames are rendered in slot order
+            const auto &previous =
+                *frame_data[(i + get_num_frames() - 1) % get_num_frames()];
+            vk::WriteDescriptorSet previous_img_desc_write = img_desc_write;
+            previous_img_desc_write.dstBinding = 5;
+            vk::DescriptorImageInfo previous_img_info = img_info;
+            previous_img_info.imageView = previous.rt_image_view;
+            previous_img_desc_write.pImageInfo = &previous_img_info;
+
+            vk::WriteDescriptorSet previous_stats_desc_write = img_desc_write;
+            previous_stats_desc_write.dstBinding = 6;
+            vk::DescriptorImageInfo previous_stats_info = img_info;
+            previous_stats_info.imageView = previous.sample_stats_view;
+            previous_stats_desc_write.pImageInfo = &previous_stats_info;
+
+            vk::WriteDescriptorSet previous_cam_desc_write = cam_desc_write;
+            previous_cam_desc_write.dstBinding = 7;
+            vk::DescriptorBufferInfo previous_cb_info = cb_info;
+            previous_cb_info.offset = FrameData::previous_camera_offset;
+            previous_cam_desc_write.pBufferInfo = &previous_cb_info;
+
+            vk::WriteDescriptorSet previous_albedo_desc_write = img_desc_write;
+            previous_albedo_desc_write.dstBinding = 15;
+            vk::DescriptorImageInfo previous_albedo_info = img_info;
+            previous_albedo_info.imageView = previous.gbuffer_albedo.view;
+            previous_albedo_desc_write.pImageInfo = &previous_albedo_info;
+
+            vk::WriteDescriptorSet slot_desc_write = feedback_desc_write;
+            slot_desc_write.dstBinding = 14;
+            vk::DescriptorBufferInfo slot_info;
+            slot_info.buffer = frame_data[i]->texture_slot_buffer;
+            slot_info.offset = 0;
+            slot_info.range = frame_data[i]->texture_slots_size;
+            slot_desc_write.pBufferInfo = &slot_info;
+
+            // G-buffer and denoiser descriptors, bindings 8 to 13
+            const std::array<const FrameImage *, 6> frame_images = {
+                &frame_data[i]->gbuffer_albedo,
+                &frame_data[i]->gbuffer_normal,
+                &frame_data[i]->gbuffer_motion,
+                &frame_data[i]->denoise_images[0],
+                &frame_data[i]->denoise_images[1],
+                &frame_data[i]->denoised};
+            std::array<vk::DescriptorImageInfo, 6> frame_image_infos;
+            std::vector<vk::WriteDescriptorSet> writes = {
+                img_desc_write, cam_desc_write, feedback_desc_write,
+                stats_desc_write, adaptive_desc_write, previous_img_desc_write,
+                previous_stats_desc_write, previous_cam_desc_write,
+                previous_albedo_desc_write, slot_desc_write};
+            for (size_t j = 0; j < frame_images.size(); j++) {
+                frame_image_infos[j] = img_info;
+                frame_image_infos[j].imageView = frame_images[j]->view;
+                vk::WriteDescriptorSet write = img_desc_write;
+                write.dstBinding = static_cast<uint32_t>(8 + j);
+                write.pImageInfo = &frame_image_infos[j];
+                writes.push_back(write);
             }
-            emissive_desc_write.pImageInfo = emissive_tex_infos.data();
-            emissive_desc_write.descriptorCount =
-                static_cast<uint32_t>(images.emissive_textures.size());
 
-            // Update descriptor set
-            vk::WriteDescriptorSet writes[] = {
-                acc_desc_write,     img_desc_write,      cam_desc_write,
-                mesh_desc_write,    instance_desc_write, material_desc_write,
-                texture_desc_write, normal_desc_write,   metallic_desc_write,
-                emissive_desc_write};
-            device.updateDescriptorSets(10, writes, 0, nullptr);
+            descriptor_stats.frame_descriptors +=
+                update_descriptor_sets(writes);
         }
+        descriptor_stats.time += std::chrono::steady_clock::now() - start;
 
         // Create empty acceleration structure
     }
@@ -888,200 +2025,650 @@ class Renderer {
         common_data.reset();
     }
 
-    void render(const FrameConstants &frame_constants) {
-
-        // set up work for the current frame
-        // std::cout << "Waiting for command buffer" << std::endl;
-        device.waitForFences(1, &frame_data[current_frame]->fence, VK_TRUE,
-                             UINT64_MAX);
-        device.resetFences(1, &frame_data[current_frame]->fence);
-
-        // acquire next swapchain image
-        uint32_t swapchain_image_index;
-        auto ret_acquire = device.acquireNextImageKHR(
-            swapchain->get_swapchain(), UINT64_MAX,
-            frame_data[current_frame]->sc_image_available, nullptr,
-            &swapchain_image_index);
-        if (ret_acquire == vk::Result::eErrorOutOfDateKHR) {
-            // TODO: recreate swapchain
-            return;
-        } else if (ret_acquire != vk::Result::eSuccess &&
-                   ret_acquire != vk::Result::eSuboptimalKHR) {
-            throw std::runtime_error("Failed to acquire swapchain image");
-        }
-
-        // Start recording command buffer
-        auto &cmd_buffer = frame_data[current_frame]->command_buffer;
-        cmd_buffer.reset(vk::CommandBufferResetFlags());
-        vk::CommandBufferBeginInfo begin_info{};
-        begin_info.flags = vk::CommandBufferUsageFlagBits::eSimultaneousUse;
-        cmd_buffer.begin(begin_info);
+    // Blits the frame's output, rt_image or the denoised image, into a
+    // swapchain image and transitions it for presenting
+    void record_blit(vk::CommandBuffer cmd_buffer, vk::Image output,
+                     uint32_t swapchain_image_index) {
+        const uint32_t scope = profiler->begin(cmd_buffer, "blit");
+        vk::ImageBlit blit(
+            vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0,
+                                       1),
+            {vk::Offset3D{0, 0, 0}, vk::Offset3D{r_width, r_height, 1}},
+            vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0,
+                                       1),
+            {vk::Offset3D{0, 0, 0}, vk::Offset3D{r_width, r_height, 1}});
+        vk::ImageSubresourceRange subresource_range_dst(
+            vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+        vk::ImageMemoryBarrier barrier_dst(
+            vk::AccessFlagBits::eMemoryRead, vk::AccessFlagBits::eTransferWrite,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+            swapchain->get_image(swapchain_image_index), subresource_range_dst);
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                   vk::PipelineStageFlagBits::eTransfer,
+                                   vk::DependencyFlags(), nullptr, nullptr,
+                                   barrier_dst);
+        cmd_buffer.blitImage(output, vk::ImageLayout::eTransferSrcOptimal,
+                             swapchain->get_image(swapchain_image_index),
+                             vk::ImageLayout::eTransferDstOptimal, 1, &blit,
+                             vk::Filter::eNearest);
+        barrier_dst = vk::ImageMemoryBarrier(
+            vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eMemoryRead,
+            vk::ImageLayout::eTransferDstOptimal,
+            vk::ImageLayout::ePresentSrcKHR, VK_QUEUE_FAMILY_IGNORED,
+            VK_QUEUE_FAMILY_IGNORED,
+            swapchain->get_image(swapchain_image_index), subresource_range_dst);
+        // Transition swapchain image to present layout
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eBottomOfPipe,
+                                   vk::DependencyFlags(), nullptr, nullptr,
+                                   barrier_dst);
+        profiler->end(cmd_buffer, scope);
+    }
 
-        // std::cout << "Recorded command buffer" << std::endl;
+    // Clears the image if the camera changed, uploads the camera and clears
+    // the feedback, before any tile of the frame is traced
+    void record_frame_setup(FrameData &frame, vk::CommandBuffer cmd_buffer) {
+        // The next frame reads this frame's image and statistics, so their
+        // writes wait for the reads of the frame before
+        if (reprojection) {
+            const vk::MemoryBarrier history_barrier(
+                vk::AccessFlagBits::eShaderWrite,
+                vk::AccessFlagBits::eShaderRead |
+                    vk::AccessFlagBits::eShaderWrite |
+                    vk::AccessFlagBits::eTransferWrite);
+            cmd_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+                    vk::PipelineStageFlagBits::eTransfer,
+                vk::DependencyFlags(), history_barrier, nullptr, nullptr);
+        }
 
         // Clear rt_image with red (for testing)
         vk::ClearColorValue clear_color(
             std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f});
         vk::ImageSubresourceRange subresource_range(
             vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+        // The image is left in the general layout by the last frame, its
+        // samples must survive unless it is cleared
         vk::ImageMemoryBarrier barrier(
             vk::AccessFlagBits::eMemoryWrite,
-            vk::AccessFlagBits::eTransferWrite, vk::ImageLayout::eUndefined,
+            vk::AccessFlagBits::eTransferWrite,
+            frame.camera_changed ? vk::ImageLayout::eUndefined
+                                 : vk::ImageLayout::eGeneral,
             vk::ImageLayout::eTransferDstOptimal, VK_QUEUE_FAMILY_IGNORED,
-            VK_QUEUE_FAMILY_IGNORED, frame_data[current_frame]->rt_image,
-            subresource_range);
+            VK_QUEUE_FAMILY_IGNORED, frame.rt_image, subresource_range);
+        uint32_t scope = profiler->begin(cmd_buffer, "clear");
         cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
                                    vk::PipelineStageFlagBits::eTransfer,
                                    vk::DependencyFlags(), nullptr, nullptr,
                                    barrier);
-        if (frame_data[current_frame]->camera_changed) {
-            cmd_buffer.clearColorImage(frame_data[current_frame]->rt_image,
+        if (frame.camera_changed) {
+            cmd_buffer.clearColorImage(frame.rt_image,
                                        vk::ImageLayout::eTransferDstOptimal,
                                        clear_color, subresource_range);
         }
         barrier = vk::ImageMemoryBarrier(
             vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead,
             vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eGeneral,
-            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-            frame_data[current_frame]->rt_image, subresource_range);
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, frame.rt_image,
+            subresource_range);
         cmd_buffer.pipelineBarrier(
             vk::PipelineStageFlagBits::eTransfer,
             vk::PipelineStageFlagBits::eRayTracingShaderKHR,
             vk::DependencyFlags(), nullptr, nullptr, barrier);
+        // The statistics and G-buffer are cleared with the image, so pixels
+        // outside the region hold no history the next frame could reproject
+        // and nothing the denoiser could take for a surface
+        if (frame.camera_changed) {
+            for (vk::Image image :
+                 {frame.sample_stats, frame.gbuffer_albedo.image,
+                  frame.gbuffer_normal.image, frame.gbuffer_motion.image}) {
+                barrier = vk::ImageMemoryBarrier(
+                    vk::AccessFlagBits::eNone,
+                    vk::AccessFlagBits::eTransferWrite,
+                    vk::ImageLayout::eUndefined,
+                    vk::ImageLayout::eTransferDstOptimal,
+                    VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image,
+                    subresource_range);
+                cmd_buffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTopOfPipe,
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::DependencyFlags(), nullptr, nullptr, barrier);
+                cmd_buffer.clearColorImage(
+                    image, vk::ImageLayout::eTransferDstOptimal,
+                    vk::ClearColorValue(
+                        std::array<float, 4>{0.0f, 0.0f, 0.0f, 0.0f}),
+                    subresource_range);
+                barrier = vk::ImageMemoryBarrier(
+                    vk::AccessFlagBits::eTransferWrite,
+                    vk::AccessFlagBits::eShaderRead |
+                        vk::AccessFlagBits::eShaderWrite,
+                    vk::ImageLayout::eTransferDstOptimal,
+                    vk::ImageLayout::eGeneral, VK_QUEUE_FAMILY_IGNORED,
+                    VK_QUEUE_FAMILY_IGNORED, image, subresource_range);
+                cmd_buffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+                        vk::PipelineStageFlagBits::eComputeShader,
+                    vk::DependencyFlags(), nullptr, nullptr, barrier);
+            }
+        }
+        profiler->end(cmd_buffer, scope);
 
         // Update camera buffer (parameters updated externally)
         void *mapped_data = nullptr;
-        vmaMapMemory(allocator,
-                     frame_data[current_frame]->staging_buffer_allocation,
-                     &mapped_data);
+        vmaMapMemory(allocator, frame.staging_buffer_allocation, &mapped_data);
+        const auto &previous =
+            *frame_data[(current_frame + get_num_frames() - 1) %
+                        get_num_frames()];
         std::memcpy(mapped_data, &camera, sizeof(RTCamera));
-        vmaUnmapMemory(allocator,
-                       frame_data[current_frame]->staging_buffer_allocation);
+        std::memcpy(static_cast<char *>(mapped_data) +
+                        FrameData::previous_camera_offset,
+                    &previous.rendered_camera, sizeof(RTCamera));
+        const bool upload_slots =
+            frame.texture_slots_version != texture_slots_version &&
+            !texture_slots.empty();
+        if (upload_slots) {
+            std::memcpy(static_cast<char *>(mapped_data) +
+                            FrameData::texture_slots_staging_offset,
+                        texture_slots.data(),
+                        sizeof(uint32_t) * texture_slots.size());
+            frame.texture_slots_version = texture_slots_version;
+        }
+        vmaUnmapMemory(allocator, frame.staging_buffer_allocation);
+        frame.rendered_camera = camera;
 
         vk::BufferCopy copy_region{};
         copy_region.srcOffset = 0;
         copy_region.dstOffset = 0;
-        copy_region.size = sizeof(RTCamera);
+        copy_region.size = FrameData::previous_camera_offset + sizeof(RTCamera);
 
-        cmd_buffer.copyBuffer(frame_data[current_frame]->staging_buffer,
-                              frame_data[current_frame]->camera_buffer,
+        scope = profiler->begin(cmd_buffer, "camera and feedback upload");
+        cmd_buffer.copyBuffer(frame.staging_buffer, frame.camera_buffer,
                               copy_region);
         // Add a pipeline barrier to ensure the copy operation is complete
         // before ray tracing
-        vk::BufferMemoryBarrier buffer_barrier(
-            vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead,
+        std::vector<vk::BufferMemoryBarrier> buffer_barriers = {
+            vk::BufferMemoryBarrier(
+                vk::AccessFlagBits::eTransferWrite,
+                vk::AccessFlagBits::eShaderRead, VK_QUEUE_FAMILY_IGNORED,
+                VK_QUEUE_FAMILY_IGNORED, frame.camera_buffer, 0,
+                VK_WHOLE_SIZE)};
+        if (upload_slots) {
+            cmd_buffer.copyBuffer(
+                frame.staging_buffer, frame.texture_slot_buffer,
+                vk::BufferCopy(FrameData::texture_slots_staging_offset, 0,
+                               sizeof(uint32_t) * texture_slots.size()));
+            buffer_barriers.push_back(vk::BufferMemoryBarrier(
+                vk::AccessFlagBits::eTransferWrite,
+                vk::AccessFlagBits::eShaderRead, VK_QUEUE_FAMILY_IGNORED,
+                VK_QUEUE_FAMILY_IGNORED, frame.texture_slot_buffer, 0,
+                VK_WHOLE_SIZE));
+        }
+        cmd_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::DependencyFlags(), nullptr, buffer_barriers, nullptr);
+
+        // Clear the counters and streaming feedback for this frame's samples
+        cmd_buffer.fillBuffer(frame.feedback_buffer, 0, sizeof(ShaderCounters),
+                              0);
+        cmd_buffer.fillBuffer(frame.feedback_buffer, sizeof(ShaderCounters),
+                              VK_WHOLE_SIZE, streaming_feedback_unused);
+        vk::BufferMemoryBarrier feedback_barrier(
+            vk::AccessFlagBits::eTransferWrite,
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
             VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-            frame_data[current_frame]->camera_buffer, 0, sizeof(RTCamera));
+            frame.feedback_buffer, 0, VK_WHOLE_SIZE);
         cmd_buffer.pipelineBarrier(
             vk::PipelineStageFlagBits::eTransfer,
             vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-            vk::DependencyFlags(), nullptr, buffer_barrier, nullptr);
+            vk::DependencyFlags(), nullptr, feedback_barrier, nullptr);
+        profiler->end(cmd_buffer, scope);
+    }
 
-        // Ray tracing commands ....
+    // Traces tiles [begin, end) of the current pass. Tiles write disjoint
+    // pixels, so they need no barriers between them.
+    void record_tiles(FrameData &frame, vk::CommandBuffer cmd_buffer,
+                      PushConstant pc, size_t begin, size_t end) {
+        bind_rt_pipeline(frame, cmd_buffer);
+        const auto stages = vk::ShaderStageFlagBits::eRaygenKHR |
+                            vk::ShaderStageFlagBits::eMissKHR |
+                            vk::ShaderStageFlagBits::eClosestHitKHR;
+        for (size_t i = begin; i < end; i++) {
+            const Tile &tile = tiles[i];
+            pc.offset_x = tile.x;
+            pc.offset_y = tile.y;
+            cmd_buffer.pushConstants(pipeline->layout, stages, 0,
+                                     sizeof(PushConstant), &pc);
+            const uint32_t query =
+                tile_timer->begin(cmd_buffer, static_cast<uint32_t>(i));
+            cmd_buffer.traceRaysKHR(&sbt.raygen_region, &sbt.miss_region,
+                                    &sbt.hit_region, &sbt.callable_region,
+                                    tile.width, tile.height, 1, dl);
+            tile_timer->end(cmd_buffer, query);
+        }
+    }
+
+    void bind_rt_pipeline(FrameData &frame, vk::CommandBuffer cmd_buffer) {
         cmd_buffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR,
                                 pipeline->pipeline);
-        cmd_buffer.bindDescriptorSets(
-            vk::PipelineBindPoint::eRayTracingKHR, pipeline->layout, 0,
-            frame_data[current_frame]
-                ->descriptor_sets[pipeline->descriptor_set_layout],
-            nullptr);
+        const std::array<vk::DescriptorSet, 2> descriptor_sets = {
+            scene_descriptor_set,
+            frame.descriptor_sets[pipeline->descriptor_set_layouts[frame_set]]};
+        cmd_buffer.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR,
+                                      pipeline->layout, scene_set,
+                                      descriptor_sets, nullptr);
+    }
 
-        if (frame_data[current_frame]->camera_changed) {
-            frame_data[current_frame]->sample_index = 0;
-            frame_data[current_frame]->camera_changed = false;
-        }
+    // Builds the mask of the region's unconverged tiles from the sample
+    // statistics and traces only those, with one indirect launch whose size
+    // the mask pass writes
+    void record_adaptive_trace(FrameData &frame, vk::CommandBuffer cmd_buffer,
+                               PushConstant pc) {
+        const uint32_t tiles_x =
+            (region.width + adaptive_tile_size - 1) / adaptive_tile_size;
+        const uint32_t tiles_y =
+            (region.height + adaptive_tile_size - 1) / adaptive_tile_size;
+        const AdaptiveHeader header{
+            adaptive_tile_size,
+            adaptive_tile_size,
+            0,
+            0,
+            {region.x, region.y},
+            {region.x + region.width, region.y + region.height},
+            tiles_x,
+            tiles_y,
+            {0, 0}};
+
+        uint32_t scope = profiler->begin(cmd_buffer, "adaptive mask");
+        cmd_buffer.updateBuffer(frame.adaptive_buffer, 0, sizeof(header),
+                                &header);
+        // Also orders the statistics after the last frame's samples
+        vk::MemoryBarrier barrier(vk::AccessFlagBits::eShaderWrite |
+                                      vk::AccessFlagBits::eTransferWrite,
+                                  vk::AccessFlagBits::eShaderRead |
+                                      vk::AccessFlagBits::eShaderWrite);
+        cmd_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+                vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(),
+            barrier, nullptr, nullptr);
 
-        PushConstant pc{frame_data[current_frame]->sample_index, rand() % 1000};
+        cmd_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                adaptive_pipeline->pipeline);
+        cmd_buffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute, adaptive_pipeline->layout,
+            frame_set,
+            frame.descriptor_sets[pipeline->descriptor_set_layouts[frame_set]],
+            nullptr);
+        const AdaptivePushConstant adaptive_pc{adaptive.threshold,
+                                               adaptive.min_samples};
+        cmd_buffer.pushConstants(adaptive_pipeline->layout,
+                                 vk::ShaderStageFlagBits::eCompute, 0,
+                                 sizeof(AdaptivePushConstant), &adaptive_pc);
+        cmd_buffer.dispatch(tiles_x, tiles_y, 1);
+
+        barrier = vk::MemoryBarrier(vk::AccessFlagBits::eShaderWrite,
+                                    vk::AccessFlagBits::eIndirectCommandRead |
+                                        vk::AccessFlagBits::eShaderRead |
+                                        vk::AccessFlagBits::eShaderWrite);
+        cmd_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eDrawIndirect |
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::DependencyFlags(), barrier, nullptr, nullptr);
+        profiler->end(cmd_buffer, scope);
+
+        bind_rt_pipeline(frame, cmd_buffer);
+        pc.flags |= push_constant_adaptive;
+        pc.offset_x = region.x;
+        pc.offset_y = region.y;
         cmd_buffer.pushConstants(pipeline->layout,
                                  vk::ShaderStageFlagBits::eRaygenKHR |
                                      vk::ShaderStageFlagBits::eMissKHR |
                                      vk::ShaderStageFlagBits::eClosestHitKHR,
                                  0, sizeof(PushConstant), &pc);
+        cmd_buffer.traceRaysIndirectKHR(
+            &sbt.raygen_region, &sbt.miss_region, &sbt.hit_region,
+            &sbt.callable_region, get_device_address(frame.adaptive_buffer),
+            dl);
+    }
 
-        if (averaging) {
-            frame_data[current_frame]->sample_index++;
+    // Adds the pixels traced by the frame's last adaptive trace, once its
+    // fence has signalled
+    void collect_adaptive_pixels(FrameData &frame) {
+        if (!frame.adaptive_pending) {
+            return;
         }
+        vmaInvalidateAllocation(allocator, frame.adaptive_readback_allocation,
+                                0, sizeof(AdaptiveHeader));
+        traced_pixels += frame.adaptive_header->active_pixels;
+        frame.adaptive_pending = false;
+    }
 
-        cmd_buffer.traceRaysKHR(&sbt.raygen_region, &sbt.miss_region,
-                                &sbt.hit_region, &sbt.callable_region, r_width,
-                                r_height, 1, dl);
-
-        // After ray tracing is done, transition the image to a transfer source
-        // layout
-        barrier = vk::ImageMemoryBarrier(
+    // Reads the feedback back and blits the image, after the frame's last
+    // tile
+    void record_frame_finish(FrameData &frame, vk::CommandBuffer cmd_buffer,
+                             uint32_t swapchain_image_index) {
+        // Read the feedback back once the frame's fence has signalled
+        const uint32_t scope = profiler->begin(cmd_buffer, "feedback readback");
+        vk::BufferMemoryBarrier feedback_barrier(
             vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eTransferRead,
-            vk::ImageLayout::eGeneral, vk::ImageLayout::eTransferSrcOptimal,
             VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-            frame_data[current_frame]->rt_image, subresource_range);
+            frame.feedback_buffer, 0, VK_WHOLE_SIZE);
         cmd_buffer.pipelineBarrier(
             vk::PipelineStageFlagBits::eRayTracingShaderKHR,
             vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags(),
-            nullptr, nullptr, barrier);
+            nullptr, feedback_barrier, nullptr);
+        cmd_buffer.copyBuffer(frame.feedback_buffer, frame.feedback_readback,
+                              vk::BufferCopy(0, 0, frame.feedback_size));
+        if (frame.adaptive_frame) {
+            feedback_barrier = vk::BufferMemoryBarrier(
+                vk::AccessFlagBits::eShaderWrite,
+                vk::AccessFlagBits::eTransferRead, VK_QUEUE_FAMILY_IGNORED,
+                VK_QUEUE_FAMILY_IGNORED, frame.adaptive_buffer, 0,
+                VK_WHOLE_SIZE);
+            cmd_buffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags(),
+                nullptr, feedback_barrier, nullptr);
+            cmd_buffer.copyBuffer(frame.adaptive_buffer,
+                                  frame.adaptive_readback,
+                                  vk::BufferCopy(0, 0, frame.adaptive_size));
+        }
+        const vk::MemoryBarrier host_barrier(vk::AccessFlagBits::eTransferWrite,
+                                             vk::AccessFlagBits::eHostRead);
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eHost,
+                                   vk::DependencyFlags(), host_barrier,
+                                   nullptr, nullptr);
+        profiler->end(cmd_buffer, scope);
+
+        // The denoiser filters the image into its own output, which is
+        // shown instead
+        vk::Image output = frame.rt_image;
+        vk::PipelineStageFlags output_stage =
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+        if (denoiser.enabled) {
+            record_denoise(frame, cmd_buffer);
+            output = frame.denoised.image;
+            output_stage = vk::PipelineStageFlagBits::eComputeShader;
+        }
 
-        // Blit rt_image into swapchain image
-        vk::ImageBlit blit(
-            vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0,
-                                       1),
-            {vk::Offset3D{0, 0, 0}, vk::Offset3D{r_width, r_height, 1}},
-            vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0,
-                                       1),
-            {vk::Offset3D{0, 0, 0}, vk::Offset3D{r_width, r_height, 1}});
-        vk::ImageSubresourceRange subresource_range_dst(
+        // After ray tracing is done, transition the image to a transfer source
+        // layout
+        vk::ImageSubresourceRange subresource_range(
             vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
-        vk::ImageMemoryBarrier barrier_dst(
-            vk::AccessFlagBits::eMemoryRead, vk::AccessFlagBits::eTransferWrite,
-            vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal,
-            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-            swapchain->get_image(swapchain_image_index), subresource_range_dst);
-        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+        vk::ImageMemoryBarrier barrier(
+            vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eTransferRead,
+            vk::ImageLayout::eGeneral, vk::ImageLayout::eTransferSrcOptimal,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, output,
+            subresource_range);
+        cmd_buffer.pipelineBarrier(output_stage,
                                    vk::PipelineStageFlagBits::eTransfer,
                                    vk::DependencyFlags(), nullptr, nullptr,
-                                   barrier_dst);
-        cmd_buffer.blitImage(frame_data[current_frame]->rt_image,
-                             vk::ImageLayout::eTransferSrcOptimal,
-                             swapchain->get_image(swapchain_image_index),
-                             vk::ImageLayout::eTransferDstOptimal, 1, &blit,
-                             vk::Filter::eNearest);
-        barrier_dst = vk::ImageMemoryBarrier(
-            vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eMemoryRead,
-            vk::ImageLayout::eTransferDstOptimal,
-            vk::ImageLayout::ePresentSrcKHR, VK_QUEUE_FAMILY_IGNORED,
-            VK_QUEUE_FAMILY_IGNORED,
-            swapchain->get_image(swapchain_image_index), subresource_range_dst);
-        // Transition swapchain image to present layout
+                                   barrier);
+
+        if (swapchain) {
+            record_blit(cmd_buffer, output, swapchain_image_index);
+        }
+
+        // Back to the general layout, where the next frame may read it
+        barrier = vk::ImageMemoryBarrier(
+            vk::AccessFlagBits::eTransferRead, vk::AccessFlagBits::eShaderRead,
+            vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eGeneral,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, output,
+            subresource_range);
         cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
-                                   vk::PipelineStageFlagBits::eBottomOfPipe,
-                                   vk::DependencyFlags(), nullptr, nullptr,
-                                   barrier_dst);
+                                   output_stage, vk::DependencyFlags(),
+                                   nullptr, nullptr, barrier);
+    }
 
-        // End command buffer
-        cmd_buffer.end();
+    // Filters the frame's image into frame.denoised with a prepare pass and
+    // denoiser.iterations a-trous passes, each timed as its own scope
+    void record_denoise(FrameData &frame, vk::CommandBuffer cmd_buffer) {
+        const uint32_t denoise_scope = profiler->begin(cmd_buffer, "denoise");
+        // The passes read what the trace wrote. The ping-pong images and the
+        // output are rewritten whole every frame.
+        vk::ImageSubresourceRange subresource_range(
+            vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+        std::vector<vk::ImageMemoryBarrier> barriers;
+        for (vk::Image image :
+             {frame.denoise_images[0].image, frame.denoise_images[1].image,
+              frame.denoised.image}) {
+            barriers.emplace_back(
+                vk::AccessFlagBits::eNone, vk::AccessFlagBits::eShaderWrite,
+                vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral,
+                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image,
+                subresource_range);
+        }
+        const vk::MemoryBarrier trace_barrier(vk::AccessFlagBits::eShaderWrite,
+                                              vk::AccessFlagBits::eShaderRead);
+        cmd_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(),
+            trace_barrier, nullptr, barriers);
+
+        cmd_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                denoise_pipeline->pipeline);
+        cmd_buffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute, denoise_pipeline->layout,
+            frame_set,
+            frame.descriptor_sets[pipeline->descriptor_set_layouts[frame_set]],
+            nullptr);
+
+        // Pass i reads the ping-pong image pass i - 1 wrote, with taps 2^i
+        // pixels apart
+        DenoisePushConstant pc{denoise_prepare,
+                               1,
+                               0,
+                               0,
+                               denoiser.sigma_normal,
+                               denoiser.sigma_depth,
+                               denoiser.sigma_luminance};
+        const vk::MemoryBarrier pass_barrier(
+            vk::AccessFlagBits::eShaderWrite,
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+        for (uint32_t pass = 0; pass <= denoiser.iterations; pass++) {
+            if (pass > 0) {
+                pc.mode = denoise_filter;
+                pc.step = 1u << (pass - 1);
+                pc.source = (pass - 1) % 2;
+                pc.last = pass == denoiser.iterations ? 1 : 0;
+                cmd_buffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eComputeShader,
+                    vk::PipelineStageFlagBits::eComputeShader,
+                    vk::DependencyFlags(), pass_barrier, nullptr, nullptr);
+            }
+            const uint32_t scope = profiler->begin(
+                cmd_buffer, pass == 0 ? "denoise prepare"
+                                      : get_denoise_pass_name(pass - 1));
+            cmd_buffer.pushConstants(denoise_pipeline->layout,
+                                     vk::ShaderStageFlagBits::eCompute, 0,
+                                     sizeof(DenoisePushConstant), &pc);
+            cmd_buffer.dispatch((r_width + 15) / 16, (r_height + 15) / 16, 1);
+            profiler->end(cmd_buffer, scope);
+        }
+        profiler->end(cmd_buffer, denoise_scope);
+    }
+
+    void render(const FrameConstants &frame_constants) {
+        RT_PROFILE_FUNCTION();
+
+        auto &frame = *frame_data[current_frame];
+
+        // set up work for the current frame
+        // std::cout << "Waiting for command buffer" << std::endl;
+        {
+            RT_PROFILE_SCOPE("wait for frame fence");
+            device.waitForFences(1, &frame.fence, VK_TRUE, UINT64_MAX);
+        }
+        collect_adaptive_pixels(frame);
+        update_streaming(frame);
+        device.resetFences(1, &frame.fence);
+
+        // acquire next swapchain image
+        uint32_t swapchain_image_index = 0;
+        if (swapchain) {
+            auto ret_acquire = device.acquireNextImageKHR(
+                swapchain->get_swapchain(), UINT64_MAX,
+                frame.sc_image_available, nullptr, &swapchain_image_index);
+            if (ret_acquire == vk::Result::eErrorOutOfDateKHR) {
+                // TODO: recreate swapchain
+                return;
+            } else if (ret_acquire != vk::Result::eSuccess &&
+                       ret_acquire != vk::Result::eSuboptimalKHR) {
+                throw std::runtime_error("Failed to acquire swapchain image");
+            }
+        }
+
+        // Tiles of the current pass traced this frame, a frame never runs
+        // into the next pass
+        const bool restart = frame.camera_changed || frame.region_changed;
+        const size_t first_tile = restart ? 0 : frame.next_tile;
+        size_t tile_count = tiles.size() - first_tile;
+        if (tile_settings.tiles_per_frame > 0) {
+            tile_count = std::min<size_t>(tile_count,
+                                          tile_settings.tiles_per_frame);
+        }
+        uint32_t submissions = static_cast<uint32_t>(
+            std::min<size_t>(tile_settings.submits, tile_count));
+
+        uint32_t flags = 0;
+        if (texture_lod) {
+            flags |= push_constant_texture_lod;
+        }
+        if (material_fast_paths) {
+            flags |= push_constant_material_fast_paths;
+        }
+        if (shader_counters) {
+            flags |= push_constant_shader_counters;
+        }
+        if (denoiser.enabled) {
+            flags |= push_constant_gbuffer;
+        }
+        // A restart of the region drops the history, camera changes
+        // reproject it
+        const auto &previous =
+            *frame_data[(current_frame + get_num_frames() - 1) %
+                        get_num_frames()];
+        if (reprojection && history_valid && averaging &&
+            !frame.region_changed) {
+            flags |= push_constant_reprojection;
+            // RTCamera is plain data, copied whole
+            if (std::memcmp(&camera, &previous.rendered_camera,
+                            sizeof(RTCamera)) != 0) {
+                flags |= push_constant_camera_moved;
+            }
+        }
+        // One random number per pass, a tiled pass traces the same rays as a
+        // whole frame would
+        if (restart) {
+            frame.sample_index = 0;
+        }
+        // Adaptive frames need every pixel to have a sample, and trace the
+        // active tiles in one submission
+        frame.adaptive_frame = adaptive.enabled && frame.sample_index > 0;
+        if (frame.adaptive_frame) {
+            submissions = 1;
+        }
+        if (first_tile == 0) {
+            frame.pass_random = static_cast<uint32_t>(random() % 1000);
+        }
+        const PushConstant pc{frame.sample_index, frame.pass_random, flags,
+                              0, 0};
 
-        // submit to queue
-        vk::SubmitInfo submit_info{};
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &cmd_buffer;
-        submit_info.waitSemaphoreCount = 1;
-        const vk::PipelineStageFlags wait_stage =
-            vk::PipelineStageFlagBits::eTransfer;
-        submit_info.pWaitDstStageMask = &wait_stage;
-        submit_info.pWaitSemaphores =
-            &frame_data[current_frame]->sc_image_available;
-        submit_info.signalSemaphoreCount = 1;
-        submit_info.pSignalSemaphores = &frame_data[current_frame]->sem;
         auto queue = device.getQueue(graphics_queue_family_index, 0);
-        queue.submit(1, &submit_info, frame_data[current_frame]->fence);
+        uint32_t frame_scope = GpuProfiler::max_scopes;
+        uint32_t trace_scope = GpuProfiler::max_scopes;
+        for (uint32_t submission = 0; submission < submissions; submission++) {
+            const bool first = submission == 0;
+            const bool last = submission + 1 == submissions;
+
+            // Start recording command buffer
+            auto &cmd_buffer = frame.get_command_buffer(submission);
+            cmd_buffer.reset(vk::CommandBufferResetFlags());
+            vk::CommandBufferBeginInfo begin_info{};
+            begin_info.flags =
+                vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+            cmd_buffer.begin(begin_info);
+
+            if (first) {
+                profiler->begin_frame(current_frame, cmd_buffer);
+                tile_timer->begin_frame(current_frame, cmd_buffer);
+                frame_scope = profiler->begin(cmd_buffer, "frame");
+                record_frame_setup(frame, cmd_buffer);
+                frame.camera_changed = false;
+                frame.region_changed = false;
+                trace_scope = profiler->begin(cmd_buffer, "trace rays");
+            }
+
+            if (frame.adaptive_frame) {
+                record_adaptive_trace(frame, cmd_buffer, pc);
+            } else {
+                record_tiles(frame, cmd_buffer, pc,
+                             first_tile + tile_count * submission / submissions,
+                             first_tile +
+                                 tile_count * (submission + 1) / submissions);
+            }
+
+            if (last) {
+                profiler->end(cmd_buffer, trace_scope);
+                record_frame_finish(frame, cmd_buffer, swapchain_image_index);
+                profiler->end(cmd_buffer, frame_scope);
+            }
+
+            // End command buffer
+            cmd_buffer.end();
+
+            // submit to queue, only the last submission touches the
+            // swapchain image and signals the fence
+            vk::SubmitInfo submit_info{};
+            submit_info.commandBufferCount = 1;
+            submit_info.pCommandBuffers = &cmd_buffer;
+            const vk::PipelineStageFlags wait_stage =
+                vk::PipelineStageFlagBits::eTransfer;
+            if (swapchain && last) {
+                submit_info.waitSemaphoreCount = 1;
+                submit_info.pWaitDstStageMask = &wait_stage;
+                submit_info.pWaitSemaphores = &frame.sc_image_available;
+                submit_info.signalSemaphoreCount = 1;
+                submit_info.pSignalSemaphores = &frame.sem;
+            }
+            queue.submit(1, &submit_info, last ? frame.fence : vk::Fence());
+        }
+
+        history_valid = reprojection;
+        if (frame.adaptive_frame) {
+            frame.adaptive_pending = true;
+            frame.next_tile = static_cast<uint32_t>(tiles.size());
+        } else {
+            for (size_t i = first_tile; i < first_tile + tile_count; i++) {
+                traced_pixels += uint64_t(tiles[i].width) * tiles[i].height;
+            }
+            frame.next_tile = static_cast<uint32_t>(first_tile + tile_count);
+        }
+        if (frame.next_tile == tiles.size()) {
+            frame.next_tile = 0;
+            if (averaging) {
+                frame.sample_index++;
+            }
+        }
 
         // Prepare for present
-        vk::PresentInfoKHR present_info{};
-        present_info.waitSemaphoreCount = 1;
-        present_info.pWaitSemaphores = &frame_data[current_frame]->sem;
-        present_info.swapchainCount = 1;
-        present_info.pSwapchains = &swapchain->get_swapchain();
-        present_info.pImageIndices = &swapchain_image_index;
-        queue.presentKHR(present_info);
+        if (swapchain) {
+            vk::PresentInfoKHR present_info{};
+            present_info.waitSemaphoreCount = 1;
+            present_info.pWaitSemaphores = &frame.sem;
+            present_info.swapchainCount = 1;
+            present_info.pSwapchains = &swapchain->get_swapchain();
+            present_info.pImageIndices = &swapchain_image_index;
+            queue.presentKHR(present_info);
+        }
 
-        current_frame = (current_frame + 1) % swapchain->get_num_images();
+        current_frame = (current_frame + 1) % get_num_frames();
     }
 
     void toggle_averaging() {
@@ -1092,5 +2679,351 @@ class Renderer {
         set_camera_changed(true);
     }
 
+    // Switches between ray cone mip selection and always sampling mip 0
+    void set_texture_lod(bool enabled) {
+        texture_lod = enabled;
+        restart_region();
+    }
+
+    bool get_texture_lod() const { return texture_lod; }
+
+    // Switches between skipping texture slots the material flags mark as
+    // unused and sampling every texture a material has
+    void set_material_fast_paths(bool enabled) {
+        material_fast_paths = enabled;
+        restart_region();
+    }
+
+    bool get_material_fast_paths() const { return material_fast_paths; }
+
+    // Counting hits, misses and texture fetches costs an atomic per event,
+    // so it is off unless asked for
+    void set_shader_counters(bool enabled) { shader_counters = enabled; }
+
+    // Counters of the most recently submitted frame, call wait_idle() first
+    ShaderCounters read_shader_counters() {
+        auto &frame =
+            *frame_data[(current_frame + frame_data.size() - 1) %
+                        frame_data.size()];
+        vmaInvalidateAllocation(allocator, frame.feedback_readback_allocation,
+                                0, VK_WHOLE_SIZE);
+        return *frame.counters;
+    }
+
+    // Restarts the random numbers of the shaders, frames rendered after the
+    // same seed from the same cameras trace the same rays
+    void set_random_seed(uint32_t seed) { random.seed(seed); }
+
+    std::string get_device_name() const {
+        return physical_device.getProperties().deviceName.data();
+    }
+
+    // Blocks until all submitted frames have finished
+    void wait_idle() {
+        device.waitIdle();
+        for (auto &frame : frame_data) {
+            collect_adaptive_pixels(*frame);
+        }
+    }
+
+    // Sets when is_converged() reports the image as done
+    void set_convergence_target(const ConvergenceTarget &target) {
+        if (target.error > 0.0f && !adaptive.enabled) {
+            throw std::runtime_error("An error target needs adaptive "
+                                     "sampling");
+        }
+        convergence = target;
+    }
+
+    const ConvergenceTarget &get_convergence_target() const {
+        return convergence;
+    }
+
+    // Whether the image of every frame in flight has reached the
+    // convergence target, so more frames would only repeat it. Never true
+    // without a target, after a restart or while textures stream in.
+    bool is_converged() {
+        if (convergence.samples == 0 && convergence.error <= 0.0f) {
+            return false;
+        }
+        if (streaming_stats.pending > 0) {
+            return false;
+        }
+        for (auto &frame : frame_data) {
+            if (frame->camera_changed || frame->region_changed) {
+                return false;
+            }
+            if (convergence.samples > 0 &&
+                frame->sample_index >= convergence.samples) {
+                continue;
+            }
+            if (convergence.error > 0.0f &&
+                get_frame_error(*frame) <= convergence.error) {
+                continue;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Mean relative error measured by the frame's last mask pass, infinite
+    // until one has finished
+    double get_frame_error(FrameData &frame) {
+        if (!adaptive.enabled || !frame.adaptive_frame ||
+            device.getFenceStatus(frame.fence) != vk::Result::eSuccess) {
+            return std::numeric_limits<double>::infinity();
+        }
+        vmaInvalidateAllocation(allocator, frame.adaptive_readback_allocation,
+                                0, VK_WHOLE_SIZE);
+        return AdaptiveStats::compute(*frame.adaptive_header,
+                                      frame.adaptive_tiles)
+            .mean_error;
+    }
+
+    // GPU time of all frames so far in ms, 0 without timestamp queries
+    double get_gpu_busy_ms() {
+        const auto &stats = get_gpu_frame_stats();
+        const auto it = stats.find("frame");
+        return it != stats.end() ? it->second.total_ms : 0.0;
+    }
+
+    // GPU time of every frame scope so far, empty without timestamp queries
+    const std::map<std::string, GpuProfiler::ScopeStats> &
+    get_gpu_frame_stats() {
+        device.waitIdle();
+        profiler->resolve_all();
+        return profiler->get_frame_stats();
+    }
+
+    bool supports_adaptive_sampling() const { return trace_rays_indirect; }
+
+    // Accumulates every frame onto the previous one instead of its own
+    // image. When the camera moves, the previous frame's samples are
+    // reprojected through each pixel's surface and kept where the same
+    // surface was visible, so only disoccluded pixels start over.
+    void set_reprojection(bool enabled) {
+        if (enabled &&
+            (adaptive.enabled || tile_settings.tiles_per_frame > 0)) {
+            throw std::runtime_error("Reprojection needs every pixel traced "
+                                     "every frame");
+        }
+        reprojection = enabled;
+        history_valid = false;
+        set_camera_changed(true);
+    }
+
+    bool get_reprojection() const { return reprojection; }
+
+    // Shows every frame through the denoiser, the accumulated samples stay
+    // unfiltered
+    void set_denoiser(const DenoiseSettings &settings) {
+        if (settings.iterations < 1 ||
+            settings.iterations > max_denoise_iterations) {
+            throw std::runtime_error(
+                "Denoiser iterations must be 1 to " +
+                std::to_string(max_denoise_iterations));
+        }
+        // The G-buffer is only written while the denoiser is on, its
+        // albedo has no history yet
+        if (settings.enabled && !denoiser.enabled) {
+            history_valid = false;
+            set_camera_changed(true);
+        }
+        denoiser = settings;
+    }
+
+    const DenoiseSettings &get_denoiser() const { return denoiser; }
+
+    // Samples per pixel of the most recently submitted frame's image
+    uint32_t get_frame_samples() const {
+        return frame_data[(current_frame + frame_data.size() - 1) %
+                          frame_data.size()]
+            ->sample_index;
+    }
+
+    // Copies the most recently submitted frame's image, or its denoised
+    // image if the denoiser was on, to the host as r_width x r_height RGBA8
+    // pixels
+    std::vector<uint8_t> read_image(bool denoised) {
+        if (denoised && !denoiser.enabled) {
+            throw std::runtime_error("The denoiser is off");
+        }
+        wait_idle();
+        auto &frame = *frame_data[(current_frame + frame_data.size() - 1) %
+                                  frame_data.size()];
+        const vk::Image image =
+            denoised ? frame.denoised.image : frame.rt_image;
+
+        const vk::DeviceSize size = vk::DeviceSize(r_width) * r_height * 4;
+        vk::BufferCreateInfo buffer_info{};
+        buffer_info.size = size;
+        buffer_info.usage = vk::BufferUsageFlagBits::eTransferDst;
+        buffer_info.sharingMode = vk::SharingMode::eExclusive;
+        VmaAllocationCreateInfo alloc_info{};
+        alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+        alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                           VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        vk::Buffer buffer;
+        VmaAllocation allocation;
+        VmaAllocationInfo allocation_info;
+        if (vmaCreateBuffer(
+                allocator,
+                reinterpret_cast<VkBufferCreateInfo *>(&buffer_info),
+                &alloc_info, reinterpret_cast<VkBuffer *>(&buffer),
+                &allocation, &allocation_info) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create image readback "
+                                     "buffer");
+        }
+
+        auto cmd_buffer =
+            device
+                .allocateCommandBuffers(vk::CommandBufferAllocateInfo(
+                    general_command_pool, vk::CommandBufferLevel::ePrimary,
+                    1))
+                .front();
+        cmd_buffer.begin(vk::CommandBufferBeginInfo(
+            vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+        vk::ImageSubresourceRange subresource_range(
+            vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+        vk::ImageMemoryBarrier barrier(
+            vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eTransferRead,
+            vk::ImageLayout::eGeneral, vk::ImageLayout::eTransferSrcOptimal,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image,
+            subresource_range);
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
+                                   vk::PipelineStageFlagBits::eTransfer,
+                                   vk::DependencyFlags(), nullptr, nullptr,
+                                   barrier);
+        const vk::BufferImageCopy region(
+            0, 0, 0,
+            vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0,
+                                       1),
+            vk::Offset3D{0, 0, 0},
+            vk::Extent3D{uint32_t(r_width), uint32_t(r_height), 1});
+        cmd_buffer.copyImageToBuffer(
+            image, vk::ImageLayout::eTransferSrcOptimal, buffer, region);
+        barrier = vk::ImageMemoryBarrier(
+            vk::AccessFlagBits::eTransferRead, vk::AccessFlagBits::eShaderRead,
+            vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eGeneral,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image,
+            subresource_range);
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eAllCommands,
+                                   vk::DependencyFlags(), nullptr, nullptr,
+                                   barrier);
+        const vk::MemoryBarrier host_barrier(vk::AccessFlagBits::eTransferWrite,
+                                             vk::AccessFlagBits::eHostRead);
+        cmd_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eHost,
+                                   vk::DependencyFlags(), host_barrier,
+                                   nullptr, nullptr);
+        cmd_buffer.end();
+
+        auto q = device.getQueue(graphics_queue_family_index, 0);
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd_buffer;
+        q.submit(1, &submit_info, nullptr);
+        q.waitIdle();
+        device.freeCommandBuffers(general_command_pool, cmd_buffer);
+
+        vmaInvalidateAllocation(allocator, allocation, 0, VK_WHOLE_SIZE);
+        const auto *pixels =
+            static_cast<const uint8_t *>(allocation_info.pMappedData);
+        std::vector<uint8_t> result(pixels, pixels + size);
+        vmaDestroyBuffer(allocator, buffer, allocation);
+        return result;
+    }
+
+    // Traces only the tiles whose pixels have not converged, once every
+    // pixel has a sample. Restarts accumulation.
+    void set_adaptive_sampling(const AdaptiveSettings &settings) {
+        if (settings.enabled && !trace_rays_indirect) {
+            throw std::runtime_error("Adaptive sampling needs "
+                                     "rayTracingPipelineTraceRaysIndirect");
+        }
+        if (settings.enabled && tile_settings.tiles_per_frame > 0) {
+            throw std::runtime_error("Adaptive sampling needs every frame "
+                                     "to complete a pass");
+        }
+        if (settings.enabled && reprojection) {
+            throw std::runtime_error("Adaptive sampling does not work with "
+                                     "reprojection");
+        }
+        adaptive = settings;
+        set_camera_changed(true);
+    }
+
+    const AdaptiveSettings &get_adaptive_sampling() const { return adaptive; }
+
+    // Convergence of the most recently submitted frame, not valid unless it
+    // ran the mask pass. Call wait_idle() first.
+    AdaptiveStats read_adaptive_stats() {
+        auto &frame =
+            *frame_data[(current_frame + frame_data.size() - 1) %
+                        frame_data.size()];
+        if (!frame.adaptive_frame) {
+            return {};
+        }
+        vmaInvalidateAllocation(allocator, frame.adaptive_readback_allocation,
+                                0, VK_WHOLE_SIZE);
+        return AdaptiveStats::compute(*frame.adaptive_header,
+                                      frame.adaptive_tiles);
+    }
+
+    // Prints GPU load-time totals, rolling per-scope frame averages and the
+    // latest tile times
+    void print_gpu_profile() {
+        device.waitIdle();
+        profiler->resolve_all();
+        profiler->print_stats();
+        tile_timer->resolve_all();
+        tile_timer->print_stats(tiles);
+    }
+
+    // Most recent GPU time of each tile in ms, indexed like get_tiles()
+    const std::vector<double> &get_tile_ms() {
+        device.waitIdle();
+        tile_timer->resolve_all();
+        return tile_timer->get_last_ms();
+    }
+
+    const std::vector<Tile> &get_tiles() const { return tiles; }
+
+    // Samples recorded so far, each traced pixel of a tile is one. Adaptive
+    // frames are counted once they have finished, see wait_idle().
+    uint64_t get_traced_pixels() const { return traced_pixels; }
+
+    // Writes the GPU scopes recorded so far as a Chrome trace
+    void write_gpu_trace(const std::filesystem::path &path) {
+        device.waitIdle();
+        profiler->resolve_all();
+        profiler->write_chrome_trace(path);
+    }
+
+    const RendererLoadStats &get_load_stats() const { return load_stats; }
+
+    // GPU time of load-time scopes, resolved once the scene has loaded
+    const std::map<std::string, GpuProfiler::ScopeStats> &
+    get_gpu_load_stats() const {
+        return profiler->get_load_stats();
+    }
+
+    // Bytes of all device memory allocated through VMA
+    uint64_t get_allocated_bytes() {
+        VmaTotalStatistics stats;
+        vmaCalculateStatistics(allocator, &stats);
+        return stats.total.statistics.allocationBytes;
+    }
+
+    // Caps the memory of resident textures, 0 follows the VMA heap budgets
+    void set_texture_budget(uint64_t bytes) { texture_budget_override = bytes; }
+
+    const StreamingStats &get_streaming_stats() const {
+        return streaming_stats;
+    }
+
     RTCamera &get_camera() { return camera; }
+
+    Scene &get_scene() { return *scene; }
 };
@@ -2,51 +2,61 @@
 #include <fstream>
 #include <renderer/vulkan.hpp>
 
-class RTPipeline {
-  private:
-    vk::ShaderModule load_module(std::string file_name) {
-        std::ifstream file(file_name, std::ios::ate | std::ios::binary);
-        if (!file.is_open()) {
-            throw std::runtime_error("Failed to open " + file_name);
-        }
+// Bindings of one descriptor set. flags is either empty or has one entry per
+// binding; sets with update-after-bind bindings need a pool created with
+// eUpdateAfterBind.
+struct DescriptorSetBindings {
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    std::vector<vk::DescriptorBindingFlags> flags;
+};
 
-        std::streampos size = file.tellg();
-        if (size == std::streampos(-1)) {
-            throw std::runtime_error("Failed to read the size of " + file_name);
-        }
+// Reads a SPIR-V file into a shader module
+inline vk::ShaderModule load_shader_module(vk::Device &device,
+                                          const std::string &file_name) {
+    std::ifstream file(file_name, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open " + file_name);
+    }
 
-        std::vector<char> buffer(static_cast<size_t>(size));
+    std::streampos size = file.tellg();
+    if (size == std::streampos(-1)) {
+        throw std::runtime_error("Failed to read the size of " + file_name);
+    }
 
-        file.seekg(0);
-        file.read(buffer.data(), size);
+    std::vector<char> buffer(static_cast<size_t>(size));
 
-        file.close();
+    file.seekg(0);
+    file.read(buffer.data(), size);
 
-        vk::ShaderModuleCreateInfo createInfo{};
-        createInfo.codeSize = buffer.size();
-        createInfo.pCode = reinterpret_cast<const uint32_t *>(buffer.data());
+    file.close();
 
-        vk::ShaderModule shaderModule;
-        if (device.createShaderModule(&createInfo, nullptr, &shaderModule) !=
-            vk::Result::eSuccess) {
-            throw std::runtime_error("Failed to create shader module: " +
-                                     file_name);
-        }
+    vk::ShaderModuleCreateInfo createInfo{};
+    createInfo.codeSize = buffer.size();
+    createInfo.pCode = reinterpret_cast<const uint32_t *>(buffer.data());
 
-        return shaderModule;
+    vk::ShaderModule shaderModule;
+    if (device.createShaderModule(&createInfo, nullptr, &shaderModule) !=
+        vk::Result::eSuccess) {
+        throw std::runtime_error("Failed to create shader module: " +
+                                 file_name);
     }
 
+    return shaderModule;
+}
+
+class RTPipeline {
   public:
     vk::Device &device;
     VmaAllocator &allocator;
     vk::detail::DispatchLoaderDynamic &dl;
     vk::Pipeline pipeline;
     vk::PipelineLayout layout;
-    vk::DescriptorSetLayout descriptor_set_layout;
+    // One layout per set, in set order
+    std::vector<vk::DescriptorSetLayout> descriptor_set_layouts;
 
     RTPipeline(vk::Device &device, VmaAllocator &allocator,
                vk::detail::DispatchLoaderDynamic &dl,
-               const std::vector<vk::DescriptorSetLayoutBinding> &bindings,
+               const std::vector<DescriptorSetBindings> &sets,
                std::string rgen_path, const std::string miss_path,
                const std::string chit_path)
         : device(device), allocator(allocator), dl(dl) {
@@ -55,13 +65,13 @@ class RTPipeline {
         std::vector<vk::ShaderModule> modules;
 
         if (!rgen_path.empty()) {
-            modules.push_back(load_module(rgen_path));
+            modules.push_back(load_shader_module(device, rgen_path));
         }
         if (!miss_path.empty()) {
-            modules.push_back(load_module(miss_path));
+            modules.push_back(load_shader_module(device, miss_path));
         }
         if (!chit_path.empty()) {
-            modules.push_back(load_module(chit_path));
+            modules.push_back(load_shader_module(device, chit_path));
         }
 
         if (modules.size() != 3) {
@@ -69,30 +79,47 @@ class RTPipeline {
                 "Not enough shader modules provided for pipeline creation");
         }
 
-        // Create descriptor set layout
-        vk::DescriptorSetLayoutCreateInfo ds_info;
-        ds_info.bindingCount = static_cast<uint32_t>(bindings.size());
-        ds_info.pBindings = bindings.data();
-        ds_info.flags = vk::DescriptorSetLayoutCreateFlags();
-        device.createDescriptorSetLayout(&ds_info, nullptr,
-                                         &descriptor_set_layout);
-
-        vk::DescriptorBindingFlags binding_flags =
-            vk::DescriptorBindingFlagBits::ePartiallyBound |
-            vk::DescriptorBindingFlagBits::eVariableDescriptorCount |
-            vk::DescriptorBindingFlagBits::eUpdateAfterBind;
-
-        vk::DescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info;
-        std::vector<vk::DescriptorBindingFlags> flags(bindings.size(),
-                                                      binding_flags);
-        binding_flags_info.bindingCount =
-            static_cast<uint32_t>(bindings.size());
-        binding_flags_info.pBindingFlags = flags.data();
+        // Create descriptor set layouts
+        for (const auto &set : sets) {
+            vk::DescriptorSetLayoutCreateInfo ds_info;
+            ds_info.bindingCount = static_cast<uint32_t>(set.bindings.size());
+            ds_info.pBindings = set.bindings.data();
+
+            vk::DescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info;
+            if (!set.flags.empty()) {
+                if (set.flags.size() != set.bindings.size()) {
+                    throw std::runtime_error(
+                        "Descriptor binding flags do not match the bindings");
+                }
+                binding_flags_info.bindingCount =
+                    static_cast<uint32_t>(set.flags.size());
+                binding_flags_info.pBindingFlags = set.flags.data();
+                ds_info.pNext = &binding_flags_info;
+
+                for (auto flags : set.flags) {
+                    if (flags &
+                        vk::DescriptorBindingFlagBits::eUpdateAfterBind) {
+                        ds_info.flags = vk::DescriptorSetLayoutCreateFlagBits::
+                            eUpdateAfterBindPool;
+                    }
+                }
+            }
+
+            vk::DescriptorSetLayout set_layout;
+            if (device.createDescriptorSetLayout(&ds_info, nullptr,
+                                                 &set_layout) !=
+                vk::Result::eSuccess) {
+                throw std::runtime_error(
+                    "Failed to create descriptor set layout");
+            }
+            descriptor_set_layouts.push_back(set_layout);
+        }
 
         // Create pipeline layout
         vk::PipelineLayoutCreateInfo layout_info;
-        layout_info.setLayoutCount = 1;
-        layout_info.pSetLayouts = &descriptor_set_layout;
+        layout_info.setLayoutCount =
+            static_cast<uint32_t>(descriptor_set_layouts.size());
+        layout_info.pSetLayouts = descriptor_set_layouts.data();
         layout_info.pushConstantRangeCount = 1;
         vk::PushConstantRange push_constant_range;
         push_constant_range.offset = 0;
@@ -102,7 +129,6 @@ class RTPipeline {
             vk::ShaderStageFlagBits::eMissKHR |
             vk::ShaderStageFlagBits::eClosestHitKHR;
         layout_info.pPushConstantRanges = &push_constant_range;
-        layout_info.pNext = &binding_flags_info;
 
         if (device.createPipelineLayout(&layout_info, nullptr, &layout) !=
             vk::Result::eSuccess) {
@@ -164,6 +190,8 @@ class RTPipeline {
         std::cout << "Destroying pipeline" << std::endl;
         device.destroyPipeline(pipeline);
         device.destroyPipelineLayout(layout);
-        device.destroyDescriptorSetLayout(descriptor_set_layout);
+        for (auto &set_layout : descriptor_set_layouts) {
+            device.destroyDescriptorSetLayout(set_layout);
+        }
     }
 };
@@ -0,0 +1,73 @@
+#pragma once
+#include <renderer/vulkan.hpp>
+
+#include <cstdint>
+#include <stdexcept>
+
+// Persistently mapped host-visible buffer that uploads are written into
+// directly, handing out aligned ranges until it is reset
+class StagingArena {
+  private:
+    VmaAllocator &allocator;
+
+    vk::Buffer buffer;
+    VmaAllocation allocation;
+    uint8_t *mapped;
+    vk::DeviceSize capacity;
+    vk::DeviceSize alignment;
+    vk::DeviceSize offset = 0;
+
+  public:
+    StagingArena(VmaAllocator &allocator, vk::DeviceSize capacity,
+                 vk::DeviceSize alignment)
+        : allocator(allocator), capacity(capacity), alignment(alignment) {
+        vk::BufferCreateInfo buffer_info{};
+        buffer_info.size = capacity;
+        buffer_info.usage = vk::BufferUsageFlagBits::eTransferSrc;
+        buffer_info.sharingMode = vk::SharingMode::eExclusive;
+
+        VmaAllocationCreateInfo alloc_info{};
+        alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+        alloc_info.flags =
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+            VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+        VmaAllocationInfo info{};
+        if (vmaCreateBuffer(
+                allocator, reinterpret_cast<VkBufferCreateInfo *>(&buffer_info),
+                &alloc_info, reinterpret_cast<VkBuffer *>(&buffer), &allocation,
+                &info) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create staging arena");
+        }
+        mapped = static_cast<uint8_t *>(info.pMappedData);
+    }
+
+    ~StagingArena() { vmaDestroyBuffer(allocator, buffer, allocation); }
+
+    StagingArena(const StagingArena &) = delete;
+    StagingArena &operator=(const StagingArena &) = delete;
+
+    // Returns the offset of a size byte range, or -1 if the arena is full
+    vk::DeviceSize allocate(vk::DeviceSize size) {
+        vk::DeviceSize start = (offset + alignment - 1) / alignment * alignment;
+        if (start + size > capacity) {
+            return static_cast<vk::DeviceSize>(-1);
+        }
+        offset = start + size;
+        return start;
+    }
+
+    uint8_t *data(vk::DeviceSize at) { return mapped + at; }
+
+    // Makes everything written since the last reset visible to the device
+    void flush() { vmaFlushAllocation(allocator, allocation, 0, offset); }
+
+    // Only call once the device has finished reading the arena
+    void reset() { offset = 0; }
+
+    bool empty() const { return offset == 0; }
+
+    vk::Buffer get_buffer() const { return buffer; }
+
+    vk::DeviceSize get_capacity() const { return capacity; }
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <renderer/image.hpp>
+#include <renderer/staging.hpp>
+#include <renderer/vulkan.hpp>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+
+// Feedback entries hold the finest mip level a texture was sampled at,
+// relative to its resident image, plus this bias. Entries are cleared to
+// streaming_feedback_unused every frame. Mirrored in common.glsl.
+constexpr uint32_t streaming_feedback_bias = 16;
+constexpr uint32_t streaming_feedback_unused = ~0u;
+
+// Shader counters at the start of the feedback buffer, cleared to zero and
+// only written with push_constant_shader_counters set
+struct ShaderCounters {
+    uint32_t hits;
+    uint32_t texture_fetches;
+    uint32_t misses; // every ray ends in exactly one hit or miss
+};
+
+// Residency of one texture. Levels count from the full resolution image, the
+// GPU image holds resident_base and everything below it.
+struct TextureResidency {
+    uint32_t levels = 1; // full mip chain
+    uint32_t resident_base = 0;
+    uint32_t wanted_base = 0; // from the last frame that sampled it
+    uint64_t last_used = 0;   // frame number
+    uint64_t changed = 0;     // frame number the resident image was swapped
+    // A stream job is in flight, or the image it replaced is not retired yet
+    bool pending = false;
+};
+
+// Decode and upload of a texture at a new base level. Evictions re-upload
+// at a coarser level instead of copying on the GPU, so the image in use is
+// never touched while frames may be sampling it.
+struct StreamJob {
+    size_t texture;
+    uint32_t base;
+    bool eviction;
+    TextureLayout layout;
+    std::unique_ptr<StagingArena> staging;
+    std::future<void> decode;
+    ImageStorage::Textures image;
+    vk::CommandBuffer command_buffer; // set once the decode has finished
+    vk::Fence fence;
+};
+
+// Image a finished stream job replaced. The job's image went into the
+// texture's other heap element, so frames still in flight keep sampling
+// this one until their fences pass, see Renderer::update_streaming().
+struct RetiredTexture {
+    uint64_t frame_number; // frame the replacement was swapped in for
+    size_t texture;
+    ImageStorage::Textures image;
+};
+
+// Streaming activity, counters are for the last rendered frame
+struct StreamingStats {
+    uint64_t resident_bytes = 0;
+    uint64_t budget_bytes = 0;
+    uint32_t pending = 0; // jobs in flight plus textures waiting for one
+    uint32_t uploads = 0;
+    uint32_t evictions = 0;
+};
@@ -0,0 +1,283 @@
+#pragma once
+#include <renderer/gpu_profiler.hpp>
+#include <renderer/vulkan.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Order the tiles of a pass are traced in
+enum class TileOrder { scanline, center, morton, random };
+
+inline const char *get_tile_order_name(TileOrder order) {
+    switch (order) {
+    case TileOrder::scanline:
+        return "scanline";
+    case TileOrder::center:
+        return "center";
+    case TileOrder::morton:
+        return "morton";
+    case TileOrder::random:
+        return "random";
+    }
+    return "unknown";
+}
+
+inline TileOrder parse_tile_order(const std::string &name) {
+    for (TileOrder order : {TileOrder::scanline, TileOrder::center,
+                            TileOrder::morton, TileOrder::random}) {
+        if (name == get_tile_order_name(order)) {
+            return order;
+        }
+    }
+    throw std::runtime_error("Unknown tile order: " + name);
+}
+
+// How the rays of a frame are dispatched. A pass traces every tile once and
+// adds one sample to each pixel. A frame traces up to tiles_per_frame tiles
+// of the current pass, split over submits queue submissions, so a pass can
+// take several frames and the GPU is never busy with one long dispatch.
+struct TileSettings {
+    uint32_t tile_size = 0; // pixels per side, 0 traces the frame as one tile
+    TileOrder order = TileOrder::scanline;
+    uint32_t tiles_per_frame = 0; // 0 completes a pass every frame
+    uint32_t submits = 1;         // per frame, at most one per tile
+};
+
+struct Tile {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Interleaves the low 16 bits of value with zeros
+inline uint32_t spread_bits(uint32_t value) {
+    value &= 0xffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+// Covers area, the whole image or a region of it, with tiles of size x size
+// pixels, clipped at its right and bottom edges
+inline std::vector<Tile> make_tiles(const Tile &area, uint32_t size,
+                                    TileOrder order) {
+    if (size == 0) {
+        return {area};
+    }
+    std::vector<Tile> tiles;
+    for (uint32_t y = 0; y < area.height; y += size) {
+        for (uint32_t x = 0; x < area.width; x += size) {
+            tiles.push_back({area.x + x, area.y + y,
+                             std::min(size, area.width - x),
+                             std::min(size, area.height - y)});
+        }
+    }
+
+    switch (order) {
+    case TileOrder::scanline:
+        break;
+    case TileOrder::center: {
+        // Outward from the middle, where the viewer looks first
+        const auto distance2 = [&](const Tile &tile) {
+            const int64_t dx = 2 * int64_t(tile.x - area.x) + tile.width -
+                               area.width;
+            const int64_t dy = 2 * int64_t(tile.y - area.y) + tile.height -
+                               area.height;
+            return dx * dx + dy * dy;
+        };
+        std::stable_sort(tiles.begin(), tiles.end(),
+                         [&](const Tile &a, const Tile &b) {
+                             return distance2(a) < distance2(b);
+                         });
+        break;
+    }
+    case TileOrder::morton: {
+        // Neighbouring tiles are traced together and share cache lines of
+        // the scene
+        const auto code = [&](const Tile &tile) {
+            return spread_bits((tile.x - area.x) / size) |
+                   (spread_bits((tile.y - area.y) / size) << 1);
+        };
+        std::sort(tiles.begin(), tiles.end(),
+                  [&](const Tile &a, const Tile &b) {
+                      return code(a) < code(b);
+                  });
+        break;
+    }
+    case TileOrder::random: {
+        // Fixed seed, runs trace the same tiles in the same frames
+        std::mt19937 random(1);
+        std::shuffle(tiles.begin(), tiles.end(), random);
+        break;
+    }
+    }
+    return tiles;
+}
+
+// GPU time of every tile, from a timestamp pair around its traceRaysKHR.
+// Tiles can outnumber the scopes of GpuProfiler, so they get their own query
+// pool per frame in flight. As with GpuProfiler a slot is resolved when it is
+// reused, after its fence has signalled.
+class TileTimer {
+  public:
+    static constexpr uint32_t untimed = ~0u;
+
+  private:
+    struct Slot {
+        vk::QueryPool pool;
+        std::vector<uint32_t> tiles; // timed in the last use of the slot
+    };
+
+    vk::Device device;
+    double timestamp_period; // ns per tick
+    uint64_t timestamp_mask;
+    bool supported;
+    uint32_t capacity; // tiles per slot
+    std::vector<Slot> slots;
+    uint32_t current = 0;
+
+    std::vector<double> last_ms; // per tile, negative until timed
+    size_t samples = 0;
+    double total_ms = 0.0;
+
+    void resolve(Slot &slot) {
+        const uint32_t queries = static_cast<uint32_t>(slot.tiles.size()) * 2;
+        if (queries == 0) {
+            return;
+        }
+        std::vector<uint64_t> ticks(queries);
+        const auto result = device.getQueryPoolResults(
+            slot.pool, 0, queries, ticks.size() * sizeof(uint64_t),
+            ticks.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+        if (result == vk::Result::eSuccess) {
+            for (size_t i = 0; i < slot.tiles.size(); i++) {
+                const uint64_t begin = ticks[i * 2] & timestamp_mask;
+                const uint64_t end = ticks[i * 2 + 1] & timestamp_mask;
+                const double ms =
+                    static_cast<double>(end >= begin ? end - begin : 0) *
+                    timestamp_period / 1e6;
+                last_ms[slot.tiles[i]] = ms;
+                samples++;
+                total_ms += ms;
+            }
+        }
+        slot.tiles.clear();
+    }
+
+  public:
+    TileTimer(vk::Device device, const GpuProfiler &profiler,
+              uint32_t frame_slots, uint32_t tiles)
+        : device(device), timestamp_period(profiler.get_timestamp_period()),
+          timestamp_mask(profiler.get_timestamp_mask()),
+          supported(profiler.is_supported()), capacity(tiles),
+          last_ms(tiles, -1.0) {
+        if (!supported) {
+            return;
+        }
+        slots.resize(frame_slots);
+        for (auto &slot : slots) {
+            vk::QueryPoolCreateInfo info{};
+            info.queryType = vk::QueryType::eTimestamp;
+            info.queryCount = capacity * 2;
+            slot.pool = device.createQueryPool(info);
+        }
+    }
+
+    ~TileTimer() {
+        for (auto &slot : slots) {
+            device.destroyQueryPool(slot.pool);
+        }
+    }
+
+    TileTimer(const TileTimer &) = delete;
+    TileTimer &operator=(const TileTimer &) = delete;
+
+    // Resolves the slot's previous frame and resets its queries, recorded
+    // into the frame's first command buffer
+    void begin_frame(uint32_t slot_index, vk::CommandBuffer command_buffer) {
+        if (!supported) {
+            return;
+        }
+        auto &slot = slots[slot_index];
+        resolve(slot);
+        command_buffer.resetQueryPool(slot.pool, 0, capacity * 2);
+        current = slot_index;
+    }
+
+    // Returns the query to pass to end(), or untimed
+    uint32_t begin(vk::CommandBuffer command_buffer, uint32_t tile) {
+        if (!supported) {
+            return untimed;
+        }
+        auto &slot = slots[current];
+        if (slot.tiles.size() >= capacity) {
+            return untimed;
+        }
+        const uint32_t query = static_cast<uint32_t>(slot.tiles.size());
+        slot.tiles.push_back(tile);
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                      slot.pool, query * 2);
+        return query;
+    }
+
+    void end(vk::CommandBuffer command_buffer, uint32_t query) {
+        if (query == untimed) {
+            return;
+        }
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                      slots[current].pool, query * 2 + 1);
+    }
+
+    // Resolves every slot, the device must be idle
+    void resolve_all() {
+        for (auto &slot : slots) {
+            resolve(slot);
+        }
+    }
+
+    // Most recent GPU time of each tile in ms, negative if never timed
+    const std::vector<double> &get_last_ms() const { return last_ms; }
+
+    // Latest time of every tile and the average over all timed tiles
+    void print_stats(const std::vector<Tile> &tiles) const {
+        if (!supported || samples == 0) {
+            return;
+        }
+        double sum = 0.0;
+        size_t timed = 0;
+        size_t slowest = 0;
+        size_t fastest = 0;
+        for (size_t i = 0; i < last_ms.size(); i++) {
+            if (last_ms[i] < 0.0) {
+                continue;
+            }
+            if (timed == 0 || last_ms[i] > last_ms[slowest]) {
+                slowest = i;
+            }
+            if (timed == 0 || last_ms[i] < last_ms[fastest]) {
+                fastest = i;
+            }
+            sum += last_ms[i];
+            timed++;
+        }
+        const Tile &tile = tiles[slowest];
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "GPU tiles: " << timed << " of " << tiles.size()
+                  << " timed, pass " << sum << " ms, tile min "
+                  << last_ms[fastest] << " avg " << sum / timed << " max "
+                  << last_ms[slowest] << " ms at (" << tile.x << ", "
+                  << tile.y << ") " << tile.width << "x" << tile.height
+                  << ", " << total_ms / samples << " ms average over "
+                  << samples << " tiles" << std::endl;
+        std::cout << std::defaultfloat;
+    }
+};
@@ -101,6 +101,21 @@ class WindowSystemGLFW final : public WindowSystem {
 
     GLFWwindow *get(WindowHandle window) { return windows[window]; }
 
+    // Hides and locks the cursor for mouse look, or gives it back
+    void set_cursor_captured(WindowHandle window, bool captured) {
+        glfwSetInputMode(windows[window], GLFW_CURSOR,
+                         captured ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
+    }
+
+    // Blocks until an event arrives, or at most timeout seconds if positive
+    void wait_events(double timeout = 0.0) {
+        if (timeout > 0.0) {
+            glfwWaitEventsTimeout(timeout);
+        } else {
+            glfwWaitEvents();
+        }
+    }
+
     static void window_focus_callback(GLFWwindow *window, int focused) {
         auto wud =
             static_cast<WindowUserData *>(glfwGetWindowUserPointer(window));
@@ -0,0 +1,180 @@
+#pragma once
+
+// CPU scope profiler, compiled in with RT_RENDER_PROFILE. Without it the
+// macros expand to nothing.
+//
+//   RT_PROFILE_SCOPE("name");   times the enclosing scope, name must be a
+//                               string literal
+//   RT_PROFILE_FUNCTION();      same, named after the function
+//   RT_PROFILE_THREAD("name");  names the calling thread in the trace
+//   RT_PROFILE_WRITE(path);     writes all events as a Chrome trace
+//
+// Every thread appends to its own fixed-size buffer, so recording takes no
+// locks. Only registering a thread's buffer on its first event does.
+
+#ifdef RT_RENDER_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace profiler {
+
+using clock = std::chrono::steady_clock;
+
+struct Event {
+    const char *name;
+    int64_t start_ns; // since the profiler origin
+    int64_t duration_ns;
+};
+
+// Written by its thread only, read when the trace is written
+struct ThreadBuffer {
+    static constexpr size_t capacity = 1 << 16;
+
+    uint32_t thread_index;
+    std::string name;
+    std::vector<Event> events;
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> dropped{0};
+
+    explicit ThreadBuffer(uint32_t thread_index)
+        : thread_index(thread_index), events(capacity) {}
+};
+
+struct Registry {
+    std::mutex mutex;
+    // Shared so buffers outlive threads that exit before the trace is written
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    const clock::time_point origin = clock::now();
+};
+
+inline Registry &get_registry() {
+    static Registry registry;
+    return registry;
+}
+
+inline ThreadBuffer &get_thread_buffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+        auto &registry = get_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto created = std::make_shared<ThreadBuffer>(
+            static_cast<uint32_t>(registry.buffers.size()));
+        registry.buffers.push_back(created);
+        return created;
+    }();
+    return *buffer;
+}
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               clock::now() - get_registry().origin)
+        .count();
+}
+
+inline void record(const char *name, int64_t start_ns, int64_t end_ns) {
+    auto &buffer = get_thread_buffer();
+    const size_t index = buffer.count.load(std::memory_order_relaxed);
+    if (index >= ThreadBuffer::capacity) {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer.events[index] = {name, start_ns, end_ns - start_ns};
+    buffer.count.store(index + 1, std::memory_order_release);
+}
+
+inline void set_thread_name(const char *name) {
+    // Threads name themselves before recording, the writer only reads names
+    // of threads that have events
+    get_thread_buffer().name = name;
+}
+
+class CpuScope {
+    const char *name;
+    int64_t start_ns;
+
+  public:
+    explicit CpuScope(const char *name) : name(name), start_ns(now_ns()) {}
+
+    ~CpuScope() { record(name, start_ns, now_ns()); }
+
+    CpuScope(const CpuScope &) = delete;
+    CpuScope &operator=(const CpuScope &) = delete;
+};
+
+// Writes every event recorded so far. Threads may keep recording, events
+// they add meanwhile are left out.
+inline void write_chrome_trace(const std::filesystem::path &path) {
+    auto &registry = get_registry();
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        buffers = registry.buffers;
+    }
+
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return;
+    }
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    size_t written = 0;
+    size_t dropped = 0;
+    bool first = true;
+    for (const auto &buffer : buffers) {
+        const size_t count = buffer->count.load(std::memory_order_acquire);
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+        out << (first ? "\n" : ",\n");
+        first = false;
+        const std::string name =
+            buffer->name.empty()
+                ? "thread " + std::to_string(buffer->thread_index)
+                : buffer->name;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"
+            << buffer->thread_index << ",\"args\":{\"name\":\"" << name
+            << "\"}}";
+        for (size_t i = 0; i < count; i++) {
+            const auto &event = buffer->events[i];
+            out << ",\n{\"name\":\"" << event.name
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << buffer->thread_index
+                << ",\"ts\":" << event.start_ns / 1e3
+                << ",\"dur\":" << event.duration_ns / 1e3 << "}";
+        }
+        written += count;
+    }
+    out << "\n]}\n";
+    std::cout << "Wrote " << written << " CPU events from " << buffers.size()
+              << " threads to " << path;
+    if (dropped > 0) {
+        std::cout << " (" << dropped << " dropped)";
+    }
+    std::cout << std::endl;
+}
+
+} // namespace profiler
+
+#define RT_PROFILE_CONCAT_INNER(a, b) a##b
+#define RT_PROFILE_CONCAT(a, b) RT_PROFILE_CONCAT_INNER(a, b)
+#define RT_PROFILE_SCOPE(name)                                                 \
+    ::profiler::CpuScope RT_PROFILE_CONCAT(rt_profile_scope_, __LINE__)(name)
+#define RT_PROFILE_FUNCTION() RT_PROFILE_SCOPE(__func__)
+#define RT_PROFILE_THREAD(name) ::profiler::set_thread_name(name)
+#define RT_PROFILE_WRITE(path) ::profiler::write_chrome_trace(path)
+
+#else
+
+#define RT_PROFILE_SCOPE(name) ((void)0)
+#define RT_PROFILE_FUNCTION() ((void)0)
+#define RT_PROFILE_THREAD(name) ((void)0)
+#define RT_PROFILE_WRITE(path) ((void)0)
+
+#endif
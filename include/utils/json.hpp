@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+
+// Quotes a string for JSON. Control characters become spaces.
+inline std::string json_string(const std::string &value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            quoted += ' ';
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Linear value of every 8-bit sRGB code
+inline const std::array<float, 256> &srgb_to_linear_table() {
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> values{};
+        for (int i = 0; i < 256; i++) {
+            float c = i / 255.0f;
+            values[i] = c <= 0.04045f ? c / 12.92f
+                                      : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return values;
+    }();
+    return table;
+}
+
+// Encodes a linear value to an 8-bit sRGB code through a table instead of
+// pow. 4096 steps keep the result within one code of the exact encoding.
+inline uint8_t linear_to_srgb(float value) {
+    constexpr int steps = 4096;
+    static const std::array<uint8_t, steps + 1> table = [] {
+        std::array<uint8_t, steps + 1> values{};
+        for (int i = 0; i <= steps; i++) {
+            const float c = static_cast<float>(i) / steps;
+            const float encoded =
+                c <= 0.0031308f ? c * 12.92f
+                                : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+            values[i] = static_cast<uint8_t>(std::lround(encoded * 255.0f));
+        }
+        return values;
+    }();
+    return table[static_cast<int>(std::clamp(value, 0.0f, 1.0f) * steps +
+                                  0.5f)];
+}
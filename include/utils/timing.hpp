@@ -0,0 +1,9 @@
+#pragma once
+#include <chrono>
+
+// Milliseconds elapsed since start on the steady clock
+inline double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
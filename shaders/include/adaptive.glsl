@@ -0,0 +1,54 @@
+// Adaptive sampling state of a frame, see adaptive_sampling.hpp
+
+// Tiles of the mask are square, one workgroup of shaders/adaptive.comp each
+const uint ADAPTIVE_TILE_SIZE = 16u;
+
+// Entry i holds the i-th active tile of the compacted list and the error
+// estimate and sample count of tile i
+struct AdaptiveTile {
+    uint active_tile;
+    float error;     // summed over the tile's pixels
+    float max_error; // of any pixel of the tile
+    uint samples;
+};
+
+// The first three members are the VkTraceRaysIndirectCommandKHR of the
+// frame, with one launch layer per active tile
+layout(std430, set = 1, binding = 4) buffer AdaptiveTiles {
+    uint trace_width;
+    uint trace_height;
+    uint active_tiles;
+    uint active_pixels;
+    uvec2 region_origin;
+    uvec2 region_end;
+    uint tiles_x;
+    uint tiles_y;
+    uint adaptive_padding0;
+    uint adaptive_padding1;
+    AdaptiveTile adaptive_tiles[];
+};
+
+// Per pixel sample count, running mean and sum of squared differences of
+// the sample luminance (Welford), and the distance of the surface seen
+layout(binding = 3, set = 1, rgba32f) uniform image2D sample_stats;
+
+// Pixel traced by a launch of the indirect trace, past region_end in the
+// parts of edge tiles outside the region
+uvec2 get_adaptive_pixel(uvec3 launch_id) {
+    uint tile = adaptive_tiles[launch_id.z].active_tile;
+    return region_origin +
+           uvec2(tile % tiles_x, tile / tiles_x) * ADAPTIVE_TILE_SIZE +
+           launch_id.xy;
+}
+
+// Relative standard error of a pixel's mean luminance, large until there
+// are two samples
+float get_relative_error(vec4 stats) {
+    float samples = stats.x;
+    if (samples < 2.0) {
+        return 1.0;
+    }
+    float variance = stats.z / (samples - 1.0);
+    // Dark pixels are judged on an absolute scale instead
+    return sqrt(variance / samples) / max(stats.y, 0.05);
+}
@@ -1,4 +1,24 @@
 
-vec3 decode_sRGB(vec3 color) {
-    return pow(color, vec3(2.2));
-}
\ No newline at end of file
+// Bits of the push constant flags, see push_constants.hpp
+const uint PUSH_CONSTANT_TEXTURE_LOD = 1u;
+const uint PUSH_CONSTANT_MATERIAL_FAST_PATHS = 2u;
+const uint PUSH_CONSTANT_SHADER_COUNTERS = 4u;
+const uint PUSH_CONSTANT_ADAPTIVE = 8u;
+const uint PUSH_CONSTANT_REPROJECTION = 16u;
+const uint PUSH_CONSTANT_CAMERA_MOVED = 32u;
+const uint PUSH_CONSTANT_GBUFFER = 64u;
+
+// Bits of Material::flags, see MaterialFlags in acceleration_structure.hpp
+const uint MATERIAL_ALPHA_MASK = 1u;
+const uint MATERIAL_ALPHA_BLEND = 2u;
+const uint MATERIAL_DOUBLE_SIDED = 4u;
+const uint MATERIAL_BASE_COLOR_TEXTURE = 8u;
+const uint MATERIAL_NORMAL_TEXTURE = 16u;
+const uint MATERIAL_METALLIC_ROUGHNESS_TEXTURE = 32u;
+const uint MATERIAL_EMISSIVE_TEXTURE = 64u;
+const uint MATERIAL_TEXTURED = 128u;
+// Texture features, all set when fast paths are off
+const uint MATERIAL_TEXTURE_FEATURES = 248u;
+
+// Bias of texture streaming feedback entries, see texture_streaming.hpp
+const uint STREAMING_FEEDBACK_BIAS = 16u;
\ No newline at end of file
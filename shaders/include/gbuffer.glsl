@@ -0,0 +1,12 @@
+// First hits of each pixel's samples, the guide of the denoiser, written
+// only while it is on, see denoiser.hpp
+
+// Base color of the surfaces, averaged over the samples with the weights
+// of the color, white for the sky
+layout(binding = 8, set = 1, rgba16f) uniform image2D gbuffer_albedo;
+// Shading normal and distance from the camera of the latest sample, 0 for
+// the sky
+layout(binding = 9, set = 1, rgba16f) uniform image2D gbuffer_normal;
+// Offset in pixels to where the surface of the latest sample was in the
+// previous frame's image, 0 where it was outside the previous view
+layout(binding = 10, set = 1, rgba16f) uniform image2D gbuffer_motion;
@@ -9,4 +9,11 @@ struct RayPayload {
     bool hit;
     float t;
     float transmission;
+    // Ray cone for texture LOD: width at the ray origin and spread angle
+    float cone_width;
+    float cone_spread;
+    // Set for the camera ray until a surface takes the hit, which then
+    // writes the G-buffer and its albedo here
+    bool primary;
+    vec3 albedo;
 };
\ No newline at end of file
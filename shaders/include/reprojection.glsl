@@ -0,0 +1,103 @@
+// History of the previous frame for temporal reprojection, see
+// Renderer::set_reprojection
+
+// Accumulated image and sample statistics of the previous frame, whose w is
+// the distance of each pixel's surface from its camera, 0 for the sky
+layout(binding = 5, set = 1, rgba8) uniform readonly image2D previous_image;
+layout(binding = 6, set = 1, rgba32f) uniform readonly image2D previous_stats;
+// Averaged albedo of the previous frame's G-buffer, see gbuffer.glsl
+layout(binding = 15, set = 1, rgba16f) uniform readonly image2D previous_albedo;
+
+// Camera of the previous frame, laid out like Camera
+layout(std140, binding = 7, set = 1) uniform PreviousCamera {
+    vec4 position;
+    vec4 direction;
+    vec4 up;
+    vec4 right;
+    float fov;
+    float rmin;
+    float rmax;
+    float aspect_ratio;
+    float aperture;
+    float focus_distance;
+    vec2 padding;
+}
+previous_camera;
+
+// Samples a reprojected pixel may count as, reprojection blurs and lags so
+// moving images are refreshed faster
+const float REPROJECTION_MAX_HISTORY = 64.0;
+// Relative difference of distances still taken for the same surface
+const float REPROJECTION_DEPTH_TOLERANCE = 0.05;
+
+// Position in the previous image, in pixels, of a point at offset from the
+// previous camera. Negative if behind it.
+vec2 project_previous(vec3 offset, vec2 resolution) {
+    vec3 forward = previous_camera.direction.xyz;
+    vec3 right = previous_camera.right.xyz;
+    vec3 up = cross(right, forward);
+    float z = dot(offset, forward);
+    if (z <= 0.0) {
+        return vec2(-1.0);
+    }
+    float scale = tan(previous_camera.fov * 0.5);
+    vec2 uv = vec2(
+        dot(offset, right) / (z * previous_camera.aspect_ratio * scale) + 0.5,
+        0.5 - dot(offset, up) / (z * scale));
+    return uv * resolution;
+}
+
+// Accumulated color, albedo and statistics of the surface at position, or
+// of the sky along direction if nothing was hit, in the previous frame.
+// Taps of the bilinear footprint that saw another surface are disoccluded
+// and left out, and a zero sample count means no history.
+vec4 reproject(vec3 position, vec3 direction, bool hit, vec2 resolution,
+               out vec3 history, out vec3 albedo_history) {
+    history = vec3(0.0);
+    albedo_history = vec3(0.0);
+    vec3 offset = hit ? position - previous_camera.position.xyz : direction;
+    vec2 p = project_previous(offset, resolution) - 0.5;
+    if (any(lessThan(p, vec2(-0.5))) ||
+        any(greaterThan(p, resolution - 0.5))) {
+        return vec4(0.0);
+    }
+    float depth = hit ? length(offset) : 0.0;
+
+    ivec2 base = ivec2(floor(p));
+    vec2 f = p - vec2(base);
+    vec4 stats = vec4(0.0);
+    float weight = 0.0;
+    for (int i = 0; i < 4; i++) {
+        ivec2 tap = base + ivec2(i & 1, i >> 1);
+        if (any(lessThan(tap, ivec2(0))) ||
+            any(greaterThanEqual(tap, ivec2(resolution)))) {
+            continue;
+        }
+        vec4 tap_stats = imageLoad(previous_stats, tap);
+        bool same = hit ? abs(tap_stats.w - depth) <=
+                              REPROJECTION_DEPTH_TOLERANCE * depth
+                        : tap_stats.w == 0.0;
+        if (tap_stats.x == 0.0 || !same) {
+            continue;
+        }
+        float w = ((i & 1) != 0 ? f.x : 1.0 - f.x) *
+                  ((i >> 1) != 0 ? f.y : 1.0 - f.y);
+        history += w * imageLoad(previous_image, tap).rgb;
+        albedo_history += w * imageLoad(previous_albedo, tap).rgb;
+        stats += w * tap_stats;
+        weight += w;
+    }
+    if (weight < 1e-3) {
+        history = vec3(0.0);
+        albedo_history = vec3(0.0);
+        return vec4(0.0);
+    }
+    history /= weight;
+    albedo_history /= weight;
+    stats /= weight;
+
+    float samples = min(floor(stats.x), REPROJECTION_MAX_HISTORY);
+    stats.z *= samples / stats.x;
+    stats.x = samples;
+    return stats;
+}
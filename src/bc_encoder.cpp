@@ -0,0 +1,316 @@
+#include <geometry/bc_encoder.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr int bc7_weights4[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                                  34, 38, 43, 47, 51, 55, 60, 64};
+
+// Appends bits LSB first
+class BitWriter {
+    uint8_t *out;
+    int position = 0;
+
+  public:
+    explicit BitWriter(uint8_t *out, size_t bytes) : out(out) {
+        std::memset(out, 0, bytes);
+    }
+
+    void write(uint32_t value, int bits) {
+        for (int i = 0; i < bits; i++, position++) {
+            if (value & (1u << i)) {
+                out[position >> 3] |= static_cast<uint8_t>(1u << (position & 7));
+            }
+        }
+    }
+};
+
+int bc7_interpolate(int e0, int e1, int index) {
+    return ((64 - bc7_weights4[index]) * e0 + bc7_weights4[index] * e1 + 32) >>
+           6;
+}
+
+// Picks the best index per texel for the quantized endpoints, returns the
+// squared error
+int bc7_assign_indices(const uint8_t rgba[64], const int e0[4],
+                       const int e1[4], uint8_t indices[16]) {
+    int palette[16][4];
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 4; c++) {
+            palette[i][c] = bc7_interpolate(e0[c], e1[c], i);
+        }
+    }
+
+    int total = 0;
+    for (int t = 0; t < 16; t++) {
+        int best = 0;
+        int best_error = INT32_MAX;
+        for (int i = 0; i < 16; i++) {
+            int error = 0;
+            for (int c = 0; c < 4; c++) {
+                int d = rgba[t * 4 + c] - palette[i][c];
+                error += d * d;
+            }
+            if (error < best_error) {
+                best_error = error;
+                best = i;
+            }
+        }
+        indices[t] = static_cast<uint8_t>(best);
+        total += best_error;
+    }
+    return total;
+}
+
+// Quantizes an 8-bit endpoint to 7 bits plus the shared p-bit
+int bc7_quantize(float value, int pbit) {
+    int q = static_cast<int>(std::lround((value - pbit) / 2.0f));
+    return std::clamp(q, 0, 127);
+}
+
+struct Bc7Candidate {
+    int q0[4];
+    int q1[4];
+    int p0;
+    int p1;
+    uint8_t indices[16];
+    int error = INT32_MAX;
+};
+
+// Tries all p-bit combinations for the float endpoints and keeps the best
+void bc7_try_endpoints(const uint8_t rgba[64], const float lo[4],
+                       const float hi[4], Bc7Candidate &best) {
+    for (int p0 = 0; p0 < 2; p0++) {
+        for (int p1 = 0; p1 < 2; p1++) {
+            Bc7Candidate candidate;
+            int e0[4], e1[4];
+            for (int c = 0; c < 4; c++) {
+                candidate.q0[c] = bc7_quantize(lo[c], p0);
+                candidate.q1[c] = bc7_quantize(hi[c], p1);
+                e0[c] = (candidate.q0[c] << 1) | p0;
+                e1[c] = (candidate.q1[c] << 1) | p1;
+            }
+            candidate.p0 = p0;
+            candidate.p1 = p1;
+            candidate.error =
+                bc7_assign_indices(rgba, e0, e1, candidate.indices);
+            if (candidate.error < best.error) {
+                best = candidate;
+            }
+        }
+    }
+}
+
+} // namespace
+
+void encode_bc7_block(const uint8_t rgba[64], uint8_t out[16]) {
+    // Principal axis of the texels by power iteration on the covariance
+    float mean[4] = {0, 0, 0, 0};
+    for (int t = 0; t < 16; t++) {
+        for (int c = 0; c < 4; c++) {
+            mean[c] += rgba[t * 4 + c];
+        }
+    }
+    for (int c = 0; c < 4; c++) {
+        mean[c] /= 16.0f;
+    }
+
+    float covariance[4][4] = {};
+    for (int t = 0; t < 16; t++) {
+        float d[4];
+        for (int c = 0; c < 4; c++) {
+            d[c] = rgba[t * 4 + c] - mean[c];
+        }
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                covariance[i][j] += d[i] * d[j];
+            }
+        }
+    }
+
+    float axis[4] = {1, 1, 1, 1};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[4] = {};
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                next[i] += covariance[i][j] * axis[j];
+            }
+        }
+        float length = std::sqrt(next[0] * next[0] + next[1] * next[1] +
+                                 next[2] * next[2] + next[3] * next[3]);
+        if (length < 1e-6f) {
+            break; // flat block
+        }
+        for (int i = 0; i < 4; i++) {
+            axis[i] = next[i] / length;
+        }
+    }
+
+    float t_min = 0.0f, t_max = 0.0f;
+    for (int t = 0; t < 16; t++) {
+        float projection = 0.0f;
+        for (int c = 0; c < 4; c++) {
+            projection += (rgba[t * 4 + c] - mean[c]) * axis[c];
+        }
+        t_min = std::min(t_min, projection);
+        t_max = std::max(t_max, projection);
+    }
+
+    float lo[4], hi[4];
+    for (int c = 0; c < 4; c++) {
+        lo[c] = std::clamp(mean[c] + t_min * axis[c], 0.0f, 255.0f);
+        hi[c] = std::clamp(mean[c] + t_max * axis[c], 0.0f, 255.0f);
+    }
+
+    Bc7Candidate best;
+    bc7_try_endpoints(rgba, lo, hi, best);
+
+    // One least squares refit of the endpoints to the chosen indices
+    float aa = 0, ab = 0, bb = 0;
+    float ax[4] = {}, bx[4] = {};
+    for (int t = 0; t < 16; t++) {
+        float w = bc7_weights4[best.indices[t]] / 64.0f;
+        float a = 1.0f - w;
+        aa += a * a;
+        ab += a * w;
+        bb += w * w;
+        for (int c = 0; c < 4; c++) {
+            ax[c] += a * rgba[t * 4 + c];
+            bx[c] += w * rgba[t * 4 + c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (std::abs(determinant) > 1e-6f) {
+        for (int c = 0; c < 4; c++) {
+            lo[c] = std::clamp((ax[c] * bb - bx[c] * ab) / determinant, 0.0f,
+                               255.0f);
+            hi[c] = std::clamp((bx[c] * aa - ax[c] * ab) / determinant, 0.0f,
+                               255.0f);
+        }
+        bc7_try_endpoints(rgba, lo, hi, best);
+    }
+
+    // The first texel's index is stored with an implicit zero MSB
+    if (best.indices[0] & 8) {
+        std::swap(best.q0, best.q1);
+        std::swap(best.p0, best.p1);
+        for (auto &index : best.indices) {
+            index = static_cast<uint8_t>(15 - index);
+        }
+    }
+
+    BitWriter writer(out, 16);
+    writer.write(1u << 6, 7); // mode 6
+    for (int c = 0; c < 4; c++) {
+        writer.write(best.q0[c], 7);
+        writer.write(best.q1[c], 7);
+    }
+    writer.write(best.p0, 1);
+    writer.write(best.p1, 1);
+    writer.write(best.indices[0], 3);
+    for (int t = 1; t < 16; t++) {
+        writer.write(best.indices[t], 4);
+    }
+}
+
+void encode_bc4_block(const uint8_t rgba[64], int channel, uint8_t out[8]) {
+    int lo = 255, hi = 0;
+    for (int t = 0; t < 16; t++) {
+        lo = std::min<int>(lo, rgba[t * 4 + channel]);
+        hi = std::max<int>(hi, rgba[t * 4 + channel]);
+    }
+
+    // hi > lo selects the eight value mode: codes 0 and 1 are the endpoints,
+    // 2-7 interpolate from hi towards lo
+    int palette[8] = {hi, lo};
+    for (int i = 1; i < 7; i++) {
+        palette[i + 1] = ((7 - i) * hi + i * lo) / 7;
+    }
+
+    BitWriter writer(out, 8);
+    writer.write(hi, 8);
+    writer.write(lo, 8);
+    for (int t = 0; t < 16; t++) {
+        const int value = rgba[t * 4 + channel];
+        int best = 0;
+        for (int i = 1; i < 8; i++) {
+            if (std::abs(palette[i] - value) < std::abs(palette[best] - value)) {
+                best = i;
+            }
+        }
+        writer.write(best, 3);
+    }
+}
+
+void encode_bc5_block(const uint8_t rgba[64], uint8_t out[16]) {
+    encode_bc4_block(rgba, 0, out);
+    encode_bc4_block(rgba, 1, out + 8);
+}
+
+void encode_bc_image(const uint8_t *rgba, uint32_t width, uint32_t height,
+                     PixelFormat format, uint8_t *out, ThreadPool &pool) {
+    const auto info = get_pixel_format_info(format);
+    if (info.block_dim != 4) {
+        throw std::runtime_error("Not a block compressed format");
+    }
+    const uint32_t blocks_x = (width + 3) / 4;
+    const uint32_t blocks_y = (height + 3) / 4;
+
+    auto encode_rows = [=](uint32_t first, uint32_t last) {
+        uint8_t block[64];
+        for (uint32_t by = first; by < last; by++) {
+            for (uint32_t bx = 0; bx < blocks_x; bx++) {
+                for (uint32_t y = 0; y < 4; y++) {
+                    const uint32_t sy = std::min(by * 4 + y, height - 1);
+                    for (uint32_t x = 0; x < 4; x++) {
+                        const uint32_t sx = std::min(bx * 4 + x, width - 1);
+                        std::memcpy(block + (y * 4 + x) * 4,
+                                    rgba + (static_cast<size_t>(sy) * width +
+                                            sx) *
+                                               4,
+                                    4);
+                    }
+                }
+                uint8_t *dst =
+                    out + (static_cast<size_t>(by) * blocks_x + bx) *
+                              info.block_bytes;
+                switch (format) {
+                case PixelFormat::bc4_unorm:
+                    encode_bc4_block(block, 0, dst);
+                    break;
+                case PixelFormat::bc5_unorm:
+                    encode_bc5_block(block, dst);
+                    break;
+                case PixelFormat::bc7_unorm:
+                case PixelFormat::bc7_srgb:
+                    encode_bc7_block(block, dst);
+                    break;
+                default:
+                    throw std::runtime_error("No encoder for format");
+                }
+            }
+        }
+    };
+
+    // A few chunks per worker to even out uneven blocks
+    const uint32_t chunks =
+        std::min<uint32_t>(blocks_y, static_cast<uint32_t>(pool.size()) * 4);
+    std::vector<std::future<void>> tasks;
+    for (uint32_t i = 0; i < chunks; i++) {
+        const uint32_t first = blocks_y * i / chunks;
+        const uint32_t last = blocks_y * (i + 1) / chunks;
+        tasks.push_back(pool.submit([=] { encode_rows(first, last); }));
+    }
+    for (auto &task : tasks) {
+        task.wait();
+    }
+    for (auto &task : tasks) {
+        task.get();
+    }
+}
@@ -0,0 +1,263 @@
+#include <geometry/bvh.hpp>
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+
+namespace {
+
+// Past this depth nodes are split at the median, so no tree is deeper than
+// Bvh::max_depth for up to 2^32 primitives
+constexpr uint32_t median_depth = Bvh::max_depth - 32;
+
+} // namespace
+
+struct Bvh::BuildNode {
+    Aabb bounds;
+    uint32_t begin = 0;
+    uint32_t count = 0; // leaf primitives, 0 for interior nodes
+    std::unique_ptr<BuildNode> left;
+    std::unique_ptr<BuildNode> right;
+};
+
+// Inputs of a build in progress. Tasks write disjoint ranges of indices and
+// their own BuildNodes only.
+struct Bvh::BuildState {
+    std::vector<Aabb> boxes;
+    std::vector<glm::vec3> centers;
+    BvhSplit split = BvhSplit::sah;
+    ThreadPool *pool = nullptr;
+    BuildNode root;
+};
+
+Bvh::Bvh() = default;
+Bvh::~Bvh() = default;
+Bvh::Bvh(Bvh &&other) noexcept = default;
+Bvh &Bvh::operator=(Bvh &&other) noexcept = default;
+
+void Bvh::build(const std::vector<Aabb> &boxes, ThreadPool *pool,
+                BvhSplit split) {
+    if (pool) {
+        start_build(boxes, *pool, split);
+        pool->wait_idle();
+        finish_build();
+        return;
+    }
+
+    state = std::make_unique<BuildState>();
+    state->boxes = boxes;
+    state->split = split;
+    nodes.clear();
+    indices.resize(boxes.size());
+    std::iota(indices.begin(), indices.end(), 0u);
+    if (!boxes.empty()) {
+        state->centers.resize(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++) {
+            state->centers[i] = boxes[i].center();
+        }
+        build_node(state->root, 0, static_cast<uint32_t>(boxes.size()), 0);
+    }
+    finish_build();
+}
+
+void Bvh::start_build(std::vector<Aabb> boxes, ThreadPool &pool,
+                      BvhSplit split) {
+    state = std::make_unique<BuildState>();
+    state->boxes = std::move(boxes);
+    state->split = split;
+    state->pool = &pool;
+    nodes.clear();
+    indices.resize(state->boxes.size());
+    std::iota(indices.begin(), indices.end(), 0u);
+    if (state->boxes.empty()) {
+        return;
+    }
+
+    pool.submit([this] {
+        const size_t count = state->boxes.size();
+        state->centers.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            state->centers[i] = state->boxes[i].center();
+        }
+        build_node(state->root, 0, static_cast<uint32_t>(count), 0);
+    });
+}
+
+void Bvh::finish_build() {
+    if (!state) {
+        return;
+    }
+    if (!state->boxes.empty()) {
+        nodes.reserve(state->boxes.size() * 2);
+        flatten(state->root);
+    }
+    state.reset();
+}
+
+void Bvh::build_node(BuildNode &node, uint32_t begin, uint32_t end,
+                     uint32_t depth) {
+    const auto &boxes = state->boxes;
+    const auto &centers = state->centers;
+
+    Aabb center_bounds;
+    for (uint32_t i = begin; i < end; i++) {
+        node.bounds.grow(boxes[indices[i]]);
+        center_bounds.grow(centers[indices[i]]);
+    }
+    const uint32_t count = end - begin;
+
+    const glm::vec3 extent = center_bounds.max - center_bounds.min;
+    int axis = extent.x > extent.y ? 0 : 1;
+    axis = extent.z > extent[axis] ? 2 : axis;
+
+    // Coincident centers cannot be split
+    if (count == 1 || extent[axis] <= 0.0f) {
+        node.begin = begin;
+        node.count = count;
+        return;
+    }
+
+    uint32_t middle = begin;
+    if (state->split == BvhSplit::sah && depth < median_depth) {
+        struct Bin {
+            Aabb bounds;
+            uint32_t count = 0;
+        };
+
+        // Cost of every plane between bins on every axis, as the summed
+        // area times count of both sides
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = -1;
+        uint32_t best_plane = 0;
+        for (int a = 0; a < 3; a++) {
+            if (extent[a] <= 0.0f) {
+                continue;
+            }
+            std::array<Bin, bins> axis_bins{};
+            const float scale = bins / extent[a];
+            for (uint32_t i = begin; i < end; i++) {
+                const uint32_t index = indices[i];
+                const uint32_t bin = std::min(
+                    bins - 1, static_cast<uint32_t>(
+                                  (centers[index][a] - center_bounds.min[a]) *
+                                  scale));
+                axis_bins[bin].count++;
+                axis_bins[bin].bounds.grow(boxes[index]);
+            }
+
+            std::array<float, bins> right_area{};
+            std::array<uint32_t, bins> right_count{};
+            Aabb right;
+            uint32_t right_total = 0;
+            for (uint32_t bin = bins - 1; bin > 0; bin--) {
+                right.grow(axis_bins[bin].bounds);
+                right_total += axis_bins[bin].count;
+                right_area[bin] = right.surface_area();
+                right_count[bin] = right_total;
+            }
+
+            Aabb left;
+            uint32_t left_total = 0;
+            for (uint32_t plane = 1; plane < bins; plane++) {
+                left.grow(axis_bins[plane - 1].bounds);
+                left_total += axis_bins[plane - 1].count;
+                if (left_total == 0 || right_count[plane] == 0) {
+                    continue;
+                }
+                const float cost = left.surface_area() * left_total +
+                                   right_area[plane] * right_count[plane];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_plane = plane;
+                }
+            }
+        }
+
+        if (best_axis >= 0) {
+            const float split_cost =
+                traversal_cost + intersection_cost * best_cost /
+                                     std::max(node.bounds.surface_area(),
+                                              std::numeric_limits<float>::min());
+            const float leaf_cost = intersection_cost * count;
+            if (count <= max_leaf_size && leaf_cost <= split_cost) {
+                node.begin = begin;
+                node.count = count;
+                return;
+            }
+
+            const float scale = bins / extent[best_axis];
+            const float axis_min = center_bounds.min[best_axis];
+            middle = static_cast<uint32_t>(
+                std::partition(indices.begin() + begin, indices.begin() + end,
+                               [&](uint32_t index) {
+                                   const uint32_t bin = std::min(
+                                       bins - 1,
+                                       static_cast<uint32_t>(
+                                           (centers[index][best_axis] -
+                                            axis_min) *
+                                           scale));
+                                   return bin < best_plane;
+                               }) -
+                indices.begin());
+        }
+    } else if (count <= max_leaf_size / 2) {
+        // Leaf size of the plain median split
+        node.begin = begin;
+        node.count = count;
+        return;
+    }
+
+    // Median split, also when binning found no plane due to rounding
+    if (middle == begin || middle == end) {
+        middle = begin + count / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + middle,
+                         indices.begin() + end, [&](uint32_t a, uint32_t b) {
+                             return centers[a][axis] < centers[b][axis];
+                         });
+    }
+
+    node.left = std::make_unique<BuildNode>();
+    node.right = std::make_unique<BuildNode>();
+    const std::pair<BuildNode *, std::pair<uint32_t, uint32_t>> children[] = {
+        {node.left.get(), {begin, middle}}, {node.right.get(), {middle, end}}};
+    for (const auto &[child, range] : children) {
+        const auto [child_begin, child_end] = range;
+        if (state->pool && child_end - child_begin >= task_threshold) {
+            state->pool->submit([this, child, child_begin, child_end, depth] {
+                build_node(*child, child_begin, child_end, depth + 1);
+            });
+        } else {
+            build_node(*child, child_begin, child_end, depth + 1);
+        }
+    }
+}
+
+uint32_t Bvh::flatten(const BuildNode &node) {
+    const uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({node.bounds.min, node.begin, node.bounds.max, node.count});
+    if (node.count == 0) {
+        flatten(*node.left);
+        nodes[index].offset = flatten(*node.right);
+    }
+    return index;
+}
+
+float Bvh::sah_cost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    const float root_area =
+        Aabb{nodes[0].min, nodes[0].max}.surface_area();
+    if (root_area <= 0.0f) {
+        return intersection_cost * indices.size();
+    }
+    double cost = 0.0;
+    for (const auto &node : nodes) {
+        const double area =
+            Aabb{node.min, node.max}.surface_area() / root_area;
+        cost += node.is_leaf() ? intersection_cost * node.count * area
+                               : traversal_cost * area;
+    }
+    return static_cast<float>(cost);
+}
@@ -0,0 +1,517 @@
+#include <geometry/cpu_tracer.hpp>
+#include <geometry/pbr.hpp>
+#include <geometry/thread_pool.hpp>
+#include <utils/cpu_profiler.hpp>
+#include <utils/srgb.hpp>
+#include <utils/timing.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Texel coordinate of a sampler address mode
+int wrap_texel(int i, int size, int mode) {
+    switch (mode) {
+    case TINYGLTF_TEXTURE_WRAP_CLAMP_TO_EDGE:
+        return std::clamp(i, 0, size - 1);
+    case TINYGLTF_TEXTURE_WRAP_MIRRORED_REPEAT: {
+        const int period = size * 2;
+        const int m = ((i % period) + period) % period;
+        return m < size ? m : period - 1 - m;
+    }
+    default:
+        return ((i % size) + size) % size;
+    }
+}
+
+// Brings a texture coordinate into one period of its address mode, so it
+// converts to a texel index without overflowing
+float wrap_coordinate(float u, int mode) {
+    if (!std::isfinite(u)) {
+        return 0.0f;
+    }
+    switch (mode) {
+    case TINYGLTF_TEXTURE_WRAP_CLAMP_TO_EDGE:
+        return std::clamp(u, 0.0f, 1.0f);
+    case TINYGLTF_TEXTURE_WRAP_MIRRORED_REPEAT:
+        return u - 2.0f * std::floor(u * 0.5f);
+    default:
+        return u - std::floor(u);
+    }
+}
+
+} // namespace
+
+CpuTracer::CpuTracer(Scene &scene) {
+    RT_PROFILE_FUNCTION();
+    auto start = clock::now();
+
+    for (auto &material : scene.get_materials()) {
+        SurfaceMaterial data;
+        data.base_color_factor = material.get_base_color();
+        data.emissive_factor = material.get_emissive();
+        data.metallic_factor = static_cast<float>(material.get_metallic());
+        data.roughness_factor = static_cast<float>(material.get_roughness());
+        data.transmission = static_cast<float>(material.get_transmission());
+        data.alpha_cutoff = static_cast<float>(material.get_alpha_cutoff());
+        data.normal_scale = static_cast<float>(material.get_normal_scale());
+        data.base_color_texture = material.get_base_color_texture();
+        data.normal_texture = material.get_normal_texture();
+        data.metallic_roughness_texture =
+            material.get_metallic_roughness_texture();
+        data.emissive_texture = material.get_emissive_texture();
+        data.alpha_mask =
+            material.get_alpha_mode() == Material::AlphaMode::mask;
+        data.alpha_blend =
+            material.get_alpha_mode() == Material::AlphaMode::blend;
+        data.double_sided = material.is_double_sided();
+        materials.push_back(data);
+    }
+    if (materials.empty()) {
+        // The renderer's fallback for scenes without materials
+        materials.emplace_back();
+    }
+
+    // Textures are sampled from their top level only, as the GPU does with
+    // texture LOD off
+    auto &registry = scene.get_textures();
+    std::vector<DecodedImage> decoded;
+    for (size_t i = 0; i < registry.size(); i++) {
+        try {
+            decoded.push_back(registry.decode(i));
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping texture " << i << ": " << e.what()
+                      << std::endl;
+            decoded.push_back({});
+        }
+    }
+    textures.resize(registry.size());
+    for (size_t i = 0; i < registry.size(); i++) {
+        const auto &texture = registry[i];
+        textures[i].sampler = texture.sampler_state;
+        textures[i].srgb = texture.color_space == ColorSpace::srgb;
+        if (!decoded[i].valid()) {
+            continue;
+        }
+        try {
+            textures[i].map = decoded[i].get();
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping texture " << i << ": " << e.what()
+                      << std::endl;
+        }
+    }
+    const double texture_ms = ms_since(start);
+
+    start = clock::now();
+    ThreadPool pool;
+    bvh = std::make_unique<SceneBvh>(scene, pool);
+
+    // Materials as the renderer assigns them to primitives
+    size_t world_triangles = 0;
+    for (size_t i = 0; i < bvh->num_instances(); i++) {
+        const auto &instance = bvh->get_instance(i);
+        const auto &mesh = bvh->get_mesh(instance.mesh);
+        const Primitive &primitive = mesh.get_primitive();
+        const uint32_t material =
+            primitive.material_index >= 0 &&
+                    static_cast<size_t>(primitive.material_index) <
+                        materials.size()
+                ? static_cast<uint32_t>(primitive.material_index)
+                : 0;
+        const glm::mat3 normal_world =
+            glm::transpose(glm::mat3(instance.to_object));
+        instances.push_back(
+            {&primitive, instance.to_world, normal_world, material});
+        world_triangles += mesh.size();
+    }
+    std::cout << "CPU tracer: " << world_triangles << " triangles in "
+              << instances.size() << " instances, BVH built in "
+              << ms_since(start) << " ms, " << textures.size()
+              << " textures decoded in " << texture_ms << " ms" << std::endl;
+}
+
+glm::vec4 CpuTracer::sample_texture(int32_t index, glm::vec2 uv) const {
+    if (index < 0 || static_cast<size_t>(index) >= textures.size() ||
+        !textures[index].map) {
+        return glm::vec4(1.0f);
+    }
+    const auto &texture = textures[index];
+    auto &map = *texture.map;
+    const int width = map.width();
+    const int height = map.height();
+    const uint8_t *texels = map.data();
+    const auto &to_linear = srgb_to_linear_table();
+
+    auto fetch = [&](int x, int y) {
+        const int sx = wrap_texel(x, width, texture.sampler.wrap_s);
+        const int sy = wrap_texel(y, height, texture.sampler.wrap_t);
+        const uint8_t *texel =
+            &texels[(static_cast<size_t>(sy) * width + sx) * 4];
+        glm::vec4 color;
+        for (int c = 0; c < 4; c++) {
+            color[c] = texture.srgb && c < 3 ? to_linear[texel[c]]
+                                             : texel[c] / 255.0f;
+        }
+        return color;
+    };
+
+    // Level 0 is magnified, so the sampler's magnification filter applies
+    const float x = wrap_coordinate(uv.x, texture.sampler.wrap_s) * width;
+    const float y = wrap_coordinate(uv.y, texture.sampler.wrap_t) * height;
+    if (texture.sampler.mag_filter == TINYGLTF_TEXTURE_FILTER_NEAREST) {
+        return fetch(static_cast<int>(std::floor(x)),
+                     static_cast<int>(std::floor(y)));
+    }
+    const float fx = x - 0.5f - std::floor(x - 0.5f);
+    const float fy = y - 0.5f - std::floor(y - 0.5f);
+    const int x0 = static_cast<int>(std::floor(x - 0.5f));
+    const int y0 = static_cast<int>(std::floor(y - 0.5f));
+    const glm::vec4 top = fetch(x0, y0) * (1.0f - fx) + fetch(x0 + 1, y0) * fx;
+    const glm::vec4 bottom =
+        fetch(x0, y0 + 1) * (1.0f - fx) + fetch(x0 + 1, y0 + 1) * fx;
+    return top * (1.0f - fy) + bottom * fy;
+}
+
+void CpuTracer::trace(SampleState &state, Payload &payload,
+                      const glm::vec3 &origin, float tmin,
+                      const glm::vec3 &direction, float tmax) const {
+    state.rays++;
+    RayHit hit;
+    if (bvh->intersect(origin, direction, tmin, tmax, hit)) {
+        closest_hit(state, payload, origin, direction, hit);
+    } else {
+        miss(payload, direction);
+    }
+}
+
+void CpuTracer::miss(Payload &payload, const glm::vec3 &direction) const {
+    glm::vec3 dir = glm::normalize(direction);
+    float a = 0.5f * (dir.y + 1.0f);
+    const glm::vec3 sky = glm::clamp(
+        glm::mix(glm::vec3(0.0f), glm::vec3(0.5f, 0.7f, 1.0f), a), 0.0f,
+        1.0f);
+    payload.color = glm::vec4(sky, payload.color.a);
+    payload.hit = false;
+    payload.t = 0.0f;
+    payload.transmission = 1.0f;
+}
+
+void CpuTracer::closest_hit(SampleState &state, Payload &payload,
+                            const glm::vec3 &origin,
+                            const glm::vec3 &direction,
+                            const RayHit &hit) const {
+    const Instance &instance = instances[hit.instance];
+    const Primitive &primitive = *instance.primitive;
+    const SurfaceMaterial &material = materials[instance.material];
+
+    const Vertex &v0 = primitive.vertices[primitive.indices[hit.triangle * 3]];
+    const Vertex &v1 =
+        primitive.vertices[primitive.indices[hit.triangle * 3 + 1]];
+    const Vertex &v2 =
+        primitive.vertices[primitive.indices[hit.triangle * 3 + 2]];
+
+    const glm::vec3 weights(1.0f - hit.bary.x - hit.bary.y, hit.bary.x,
+                            hit.bary.y);
+
+    const glm::vec3 local_normal =
+        glm::normalize(v0.normal * weights.x + v1.normal * weights.y +
+                       v2.normal * weights.z);
+    const glm::vec3 local_position = v0.position * weights.x +
+                                     v1.position * weights.y +
+                                     v2.position * weights.z;
+    const glm::vec2 uv =
+        v0.uvmap * weights.x + v1.uvmap * weights.y + v2.uvmap * weights.z;
+    const glm::vec3 position(instance.to_world *
+                             glm::vec4(local_position, 1.0f));
+
+    glm::vec4 base_color_alpha = material.base_color_factor;
+    if (material.base_color_texture >= 0) {
+        base_color_alpha =
+            base_color_alpha * sample_texture(material.base_color_texture, uv);
+    }
+
+    if ((material.alpha_mask || material.alpha_blend) &&
+        payload.depth < max_depth) {
+        float cutoff = material.alpha_cutoff;
+        if (material.alpha_blend) {
+            cutoff = pbr::random_pcg3d(state.rand * state.x,
+                                       state.rand * state.y,
+                                       state.rand * payload.depth)
+                         .z;
+        }
+        if (base_color_alpha.a < cutoff) {
+            payload.depth += 1;
+            trace(state, payload, origin, hit.t + state.rmin, direction,
+                  state.rmax);
+            return;
+        }
+    }
+    const glm::vec3 base_color(base_color_alpha);
+
+    glm::vec3 normal = glm::normalize(instance.normal_world * local_normal);
+    if (material.double_sided && material.transmission == 0.0f &&
+        glm::dot(normal, direction) > 0.0f) {
+        normal = -normal;
+    }
+    if (material.normal_texture >= 0) {
+        const glm::vec3 local_tangent =
+            glm::vec3(v0.tangent) * weights.x +
+            glm::vec3(v1.tangent) * weights.y +
+            glm::vec3(v2.tangent) * weights.z;
+        glm::vec3 tangent = glm::mat3(instance.to_world) * local_tangent;
+        tangent = glm::normalize(tangent - normal * glm::dot(normal, tangent));
+        const glm::vec3 bitangent =
+            glm::cross(normal, tangent) * (v0.tangent.w < 0.0f ? -1.0f : 1.0f);
+
+        const glm::vec4 texel = sample_texture(material.normal_texture, uv);
+        const glm::vec2 normal_xy =
+            glm::vec2(texel.x * 2.0f - 1.0f, texel.y * 2.0f - 1.0f) *
+            material.normal_scale;
+        const float normal_z =
+            std::sqrt(std::max(1.0f - glm::dot(normal_xy, normal_xy), 0.0f));
+        normal = glm::normalize(tangent * normal_xy.x +
+                                bitangent * normal_xy.y + normal * normal_z);
+    }
+
+    float metalness = material.metallic_factor;
+    float roughness = material.roughness_factor;
+    if (material.metallic_roughness_texture >= 0) {
+        const glm::vec4 metalness_roughness =
+            sample_texture(material.metallic_roughness_texture, uv);
+        metalness *= metalness_roughness.b;
+        roughness *= metalness_roughness.g;
+    }
+
+    const float transmission = material.transmission;
+
+    glm::vec3 emissive = material.emissive_factor;
+    if (material.emissive_texture >= 0) {
+        emissive *= glm::vec3(sample_texture(material.emissive_texture, uv));
+    }
+
+    const float reflectance = 0.5f;
+    const glm::vec3 f0 =
+        glm::vec3(0.16f * reflectance * reflectance * (1.0f - metalness)) +
+        base_color * metalness;
+    const glm::vec3 view = -glm::normalize(direction);
+
+    const glm::vec3 random =
+        pbr::random_pcg3d(state.rand * state.x, state.rand * state.y,
+                          state.rand * payload.depth);
+    glm::vec3 contribution(0.0f);
+    glm::vec3 next_ray_dir;
+    {
+        // theta and phi are passed in place of the uniform numbers, as the
+        // shader does
+        float e0 = random.x;
+        float e1 = random.y;
+        float a = roughness * roughness;
+        float a2 = a * a;
+        float theta = std::acos(std::sqrt((1.0f - e0) / ((a2 - 1.0f) * e0 + 1.0f)));
+        float phi = 2.0f * pbr::pi * e1;
+        glm::vec2 xi(phi, theta);
+
+        next_ray_dir = pbr::importanceSampleGGX(normal, view, roughness, xi,
+                                                f0, contribution);
+    }
+    next_ray_dir = glm::normalize(next_ray_dir);
+    const uint32_t depth = payload.depth;
+    glm::vec3 color(0.0f);
+
+    const float eta = 1.5f; // glass
+
+    // Bounce lighting
+    if (depth < max_depth) {
+        payload.depth += 1;
+
+        if (transmission > random.x) {
+            if (glm::dot(normal, direction) < 0.0f) {
+                next_ray_dir = glm::normalize(
+                    glm::refract(direction, normal, 1.0f / eta));
+            } else {
+                next_ray_dir =
+                    glm::normalize(glm::refract(direction, -normal, eta));
+            }
+            trace(state, payload, position, state.rmin, next_ray_dir,
+                  state.rmax);
+
+            const glm::vec3 transmission_color(payload.color);
+            float atten = 1.0f;
+            if (payload.hit) {
+                atten = 1.0f / (1.0f + payload.t * payload.t);
+            }
+            color += atten * transmission_color;
+        } else {
+            trace(state, payload, position, state.rmin, next_ray_dir,
+                  state.rmax);
+            const glm::vec3 indirect_light(payload.color);
+            const float indirect_dist = payload.t;
+
+            float indirect_attenuation = 1.0f;
+            if (payload.hit) {
+                indirect_attenuation =
+                    1.0f / (1.0f + indirect_dist * indirect_dist);
+            }
+            color += pbr::BRDF_Filament(normal, next_ray_dir, view, roughness,
+                                        metalness, f0, base_color,
+                                        indirect_attenuation * indirect_light);
+        }
+    }
+
+    // Point light of shader.rchit, the shadow ray is shaded like any other
+    if (depth < max_depth && transmission <= random.x) {
+        const glm::vec3 light_pos = 3.0f * glm::vec3(3.0f, 3.0f, 3.0f);
+        const glm::vec3 light_color = 300.0f * glm::vec3(1.0f, 1.0f, 1.0f);
+
+        const glm::vec3 to_light = glm::normalize(light_pos - position);
+        const float light_distance = glm::length(light_pos - position);
+
+        payload.depth = depth + 1;
+        payload.hit = true;
+        trace(state, payload, position, state.rmin, to_light, state.rmax);
+
+        if (!payload.hit || payload.t >= light_distance) {
+            const float light_attenuation =
+                1.0f / (1.0f + light_distance * light_distance);
+            color += pbr::BRDF_Filament(normal, to_light, view, roughness,
+                                        metalness, f0, base_color,
+                                        light_attenuation * light_color);
+        } else if (payload.transmission > 0.0f) {
+            const float blocker_distance = payload.t;
+            const float light_attenuation =
+                1.0f / (1.0f + blocker_distance * blocker_distance);
+            color += pbr::BRDF_Filament(
+                normal, to_light, view, roughness, metalness, f0, base_color,
+                payload.transmission * light_attenuation *
+                    glm::vec3(payload.color));
+        }
+    }
+
+    color += emissive;
+
+    payload.color = glm::vec4(color, 1.0f);
+    payload.hit = true;
+    payload.t = hit.t;
+    payload.transmission = transmission;
+}
+
+glm::vec3 CpuTracer::render_sample(SampleState &state, const RTCamera &camera,
+                                   uint32_t width, uint32_t height) const {
+    const glm::vec2 uv((state.x + 0.5f) / static_cast<float>(width),
+                       (state.y + 0.5f) / static_cast<float>(height));
+
+    glm::vec3 origin(camera.position);
+    glm::vec3 ray_direction = camera.get_ray_direction(uv);
+
+    if (camera.aperture > 0.0f) {
+        const glm::vec3 direction(camera.direction);
+        const glm::vec3 right(camera.right);
+        const glm::vec3 focus =
+            origin + ray_direction * (camera.focus_distance /
+                                      glm::dot(ray_direction, direction));
+        const glm::vec3 lens =
+            pbr::random_pcg3d(state.rand * state.x, state.rand * state.y, 0);
+        const float radius = camera.aperture * std::sqrt(lens.x);
+        const float angle = 2.0f * pbr::pi * lens.y;
+        const glm::vec3 up = glm::cross(right, direction);
+        origin += radius * (std::cos(angle) * right + std::sin(angle) * up);
+        ray_direction = glm::normalize(focus - origin);
+    }
+
+    Payload payload{glm::vec4(0.0f), 0, false, 0.0f, 0.0f};
+
+    const glm::vec3 random =
+        pbr::random_pcg3d(state.rand * state.x, state.rand * state.y,
+                          state.rand * (payload.depth + 1));
+    ray_direction += random * 0.0005f; // for anti-aliasing
+
+    trace(state, payload, origin, camera.min, ray_direction, camera.max);
+
+    const glm::vec3 color =
+        glm::clamp(glm::vec3(payload.color), 0.0f, 1.0f);
+    return glm::pow(color, glm::vec3(1.0f / 2.2f));
+}
+
+CpuRenderStats CpuTracer::render(const RTCamera &camera, uint32_t width,
+                                 uint32_t height, uint32_t samples,
+                                 uint32_t seed, unsigned int num_threads,
+                                 std::vector<uint8_t> &rgba) const {
+    RT_PROFILE_FUNCTION();
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The per-frame push constant of Renderer::render()
+    std::minstd_rand random(seed);
+    std::vector<uint32_t> rands(samples);
+    for (auto &rand : rands) {
+        rand = static_cast<uint32_t>(random() % 1000);
+    }
+
+    rgba.assign(static_cast<size_t>(width) * height * 4, 0);
+    const uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+    const uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+    std::vector<uint64_t> rays(num_threads, 0);
+
+    auto start = clock::now();
+    const size_t steals = WorkStealingScheduler::run(
+        static_cast<size_t>(tiles_x) * tiles_y, num_threads,
+        [&](size_t tile, unsigned int thread) {
+            RT_PROFILE_SCOPE("cpu_tile");
+            const uint32_t x0 = static_cast<uint32_t>(tile % tiles_x) * tile_size;
+            const uint32_t y0 = static_cast<uint32_t>(tile / tiles_x) * tile_size;
+            const uint32_t x1 = std::min(x0 + tile_size, width);
+            const uint32_t y1 = std::min(y0 + tile_size, height);
+
+            SampleState state{0, 0, 0, camera.min, camera.max, 0};
+            for (uint32_t y = y0; y < y1; y++) {
+                for (uint32_t x = x0; x < x1; x++) {
+                    state.x = x;
+                    state.y = y;
+                    glm::vec3 sum(0.0f);
+                    for (uint32_t rand : rands) {
+                        state.rand = rand;
+                        const glm::vec3 color =
+                            render_sample(state, camera, width, height);
+                        // Total internal reflection normalizes a zero
+                        // vector, such samples count as black
+                        if (std::isfinite(color.x) && std::isfinite(color.y) &&
+                            std::isfinite(color.z)) {
+                            sum += color;
+                        }
+                    }
+                    if (samples > 0) {
+                        sum /= static_cast<float>(samples);
+                    }
+                    uint8_t *pixel =
+                        &rgba[(static_cast<size_t>(y) * width + x) * 4];
+                    for (int c = 0; c < 3; c++) {
+                        pixel[c] = static_cast<uint8_t>(std::lround(
+                            std::clamp(sum[c], 0.0f, 1.0f) * 255.0f));
+                    }
+                    pixel[3] = 255;
+                }
+            }
+            rays[thread] += state.rays;
+        });
+
+    CpuRenderStats stats;
+    stats.ms = ms_since(start);
+    stats.samples = static_cast<uint64_t>(width) * height * samples;
+    for (uint64_t count : rays) {
+        stats.rays += count;
+    }
+    stats.tiles = static_cast<size_t>(tiles_x) * tiles_y;
+    stats.steals = steals;
+    stats.threads = num_threads;
+    return stats;
+}
@@ -1,65 +1,24 @@
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <future>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <mikktspace.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define TINYGLTF_IMPLEMENTATION
 
 #include <geometry/geometry.hpp>
+#include <geometry/thread_pool.hpp>
+#include <utils/cpu_profiler.hpp>
+#include <utils/timing.hpp>
 
 namespace fs = std::filesystem;
 
-TextureMap::TextureMap(tinygltf::Image &image, TextureType texture_type)
-    : texture_type(texture_type) {
-    map = image.image;
-    w = image.width;
-    h = image.height;
-    c = image.component;
-
-    if (c == 3) {
-        // Convert to RGBA
-        std::vector<unsigned char> rgba_map(w * h * 4);
-        for (int i = 0; i < w * h; ++i) {
-            rgba_map[i * 4] = map[i * 3];
-            rgba_map[i * 4 + 1] = map[i * 3 + 1];
-            rgba_map[i * 4 + 2] = map[i * 3 + 2];
-            rgba_map[i * 4 + 3] = 255; // Set alpha to 255 (opaque)
-        }
-        map = std::move(rgba_map);
-        c = 4;
-    }
-}
-
-TextureMap::TextureMap(glm::vec4 value, TextureType texture_type)
-    : texture_type(texture_type) {
-
-    w = 1;
-    h = 1;
-    c = 4;
-    map.resize(w * h * c);
-
-    if (texture_type == TextureType::normalTexture) {
-        unsigned char out_val = 255;
-        unsigned char zero_val = 128;
-        map[0] = zero_val;
-        map[1] = zero_val;
-        map[2] = out_val;
-        map[3] = zero_val;
-    } else {
-        value *= 255.0f;
-        map[0] = static_cast<unsigned char>(value.r);
-        map[1] = static_cast<unsigned char>(value.g);
-        map[2] = static_cast<unsigned char>(value.b);
-        map[3] = static_cast<unsigned char>(value.a);
-    }
-}
-
-void TextureMap::free_texture_map() {}
-
 static glm::mat4 get_node_transform(const tinygltf::Node &node) {
     glm::mat4 transform = glm::mat4(1.0f); // Identity matrix
 
@@ -91,20 +50,35 @@ static glm::mat4 get_node_transform(const tinygltf::Node &node) {
     return transform;
 }
 
-static glm::mat4 get_node_global_transform(
-    const tinygltf::Node &node,
-    std::unordered_map<const tinygltf::Node *, const tinygltf::Node *>
-        &parents) {
-
-    auto transform = get_node_transform(node);
-    const tinygltf::Node *current = &node;
-    while (parents.find(current) != parents.end()) {
-        current = parents[current];
-        const auto parent_transform = get_node_transform(*current);
-        transform = parent_transform * transform;
-    }
+// Elements of a vertex attribute, byteStride apart when the buffer view
+// interleaves attributes and tightly packed otherwise. Empty if the
+// primitive does not have it.
+struct VertexAttribute {
+    const unsigned char *data = nullptr;
+    size_t stride = 0;
 
-    return transform;
+    const float *operator[](size_t i) const {
+        return reinterpret_cast<const float *>(data + i * stride);
+    }
+};
+
+static VertexAttribute get_attribute(const tinygltf::Model &model,
+                                     const tinygltf::Primitive &primitive,
+                                     const std::string &name) {
+    const auto it = primitive.attributes.find(name);
+    if (it == primitive.attributes.end()) {
+        return {};
+    }
+    const tinygltf::Accessor &accessor = model.accessors[it->second];
+    const tinygltf::BufferView &view = model.bufferViews[accessor.bufferView];
+    const tinygltf::Buffer &buffer = model.buffers[view.buffer];
+    const int stride = accessor.ByteStride(view);
+    if (stride <= 0) {
+        throw std::runtime_error("Invalid byte stride of vertex attribute " +
+                                 name);
+    }
+    return {&buffer.data[view.byteOffset + accessor.byteOffset],
+            static_cast<size_t>(stride)};
 }
 
 static size_t populate_vertex_data(tinygltf::Model &model,
@@ -112,77 +86,44 @@ static size_t populate_vertex_data(tinygltf::Model &model,
                                    std::vector<Vertex> &vertices) {
     const tinygltf::Accessor &posAccessor =
         model.accessors[primitive.attributes.at("POSITION")];
-    const tinygltf::BufferView &posView =
-        model.bufferViews[posAccessor.bufferView];
-    const tinygltf::Buffer &posBuffer = model.buffers[posView.buffer];
-
-    const float *posData = reinterpret_cast<const float *>(
-        &posBuffer.data[posView.byteOffset + posAccessor.byteOffset]);
-
-    const float *normalData = nullptr;
-    if (primitive.attributes.find("NORMAL") != primitive.attributes.end()) {
-        const tinygltf::Accessor &normalAccessor =
-            model.accessors[primitive.attributes.at("NORMAL")];
-        const tinygltf::BufferView &normalView =
-            model.bufferViews[normalAccessor.bufferView];
-        const tinygltf::Buffer &normalBuffer = model.buffers[normalView.buffer];
-
-        normalData = reinterpret_cast<const float *>(
-            &normalBuffer
-                 .data[normalView.byteOffset + normalAccessor.byteOffset]);
-    }
-
-    const float *textureData = nullptr;
-    if (primitive.attributes.find("TEXCOORD_0") != primitive.attributes.end()) {
-        const tinygltf::Accessor &textureAccessor =
-            model.accessors[primitive.attributes.at("TEXCOORD_0")];
-        const tinygltf::BufferView &textureView =
-            model.bufferViews[textureAccessor.bufferView];
-        const tinygltf::Buffer &textureBuffer =
-            model.buffers[textureView.buffer];
-
-        textureData = reinterpret_cast<const float *>(
-            &textureBuffer
-                 .data[textureView.byteOffset + textureAccessor.byteOffset]);
-    }
-
-    const float *colorData = nullptr;
-    if (primitive.attributes.find("COLOR_0") != primitive.attributes.end()) {
-        const tinygltf::Accessor &colorAccessor =
-            model.accessors[primitive.attributes.at("COLOR_0")];
-        const tinygltf::BufferView &colorView =
-            model.bufferViews[colorAccessor.bufferView];
-        const tinygltf::Buffer &colorBuffer = model.buffers[colorView.buffer];
-
-        colorData = reinterpret_cast<const float *>(
-            &colorBuffer.data[colorView.byteOffset + colorAccessor.byteOffset]);
-    }
+    const auto posData = get_attribute(model, primitive, "POSITION");
+    const auto normalData = get_attribute(model, primitive, "NORMAL");
+    const auto textureData = get_attribute(model, primitive, "TEXCOORD_0");
+    const auto colorData = get_attribute(model, primitive, "COLOR_0");
+    const auto tangentData = get_attribute(model, primitive, "TANGENT");
 
     size_t i = 0;
     for (; i < posAccessor.count; i++) {
         Vertex vertex;
-        vertex.position =
-            glm::vec3(posData[i * 3], posData[i * 3 + 1], posData[i * 3 + 2]);
+        const float *position = posData[i];
+        vertex.position = glm::vec3(position[0], position[1], position[2]);
 
-        if (normalData != nullptr) {
-            vertex.normal = glm::vec3(normalData[i * 3], normalData[i * 3 + 1],
-                                      normalData[i * 3 + 2]);
+        if (normalData.data != nullptr) {
+            const float *normal = normalData[i];
+            vertex.normal = glm::vec3(normal[0], normal[1], normal[2]);
         } else {
             vertex.normal = glm::vec3(0.0f);
         }
 
-        if (textureData != nullptr) {
-            vertex.uvmap =
-                glm::vec2(textureData[i * 2], textureData[i * 2 + 1]);
+        if (textureData.data != nullptr) {
+            const float *uv = textureData[i];
+            vertex.uvmap = glm::vec2(uv[0], uv[1]);
         } else {
             vertex.uvmap = glm::vec2(0.0f);
         }
-        if (colorData != nullptr) {
-            vertex.color = glm::vec3(colorData[i * 3], colorData[i * 3 + 1],
-                                     colorData[i * 3 + 2]);
+        if (colorData.data != nullptr) {
+            const float *color = colorData[i];
+            vertex.color = glm::vec3(color[0], color[1], color[2]);
         } else {
             vertex.color = glm::vec3(1.0f);
         }
+        if (tangentData.data != nullptr) {
+            const float *tangent = tangentData[i];
+            vertex.tangent =
+                glm::vec4(tangent[0], tangent[1], tangent[2], tangent[3]);
+        } else {
+            vertex.tangent = glm::vec4(0.0f);
+        }
 
         vertices.push_back(vertex);
     }
@@ -190,6 +131,113 @@ static size_t populate_vertex_data(tinygltf::Model &model,
     return i;
 }
 
+// Unwelded triangle corners of a primitive as MikkTSpace reads them, and
+// the tangent it writes for each corner
+struct TangentSpaceContext {
+    const Primitive *primitive;
+    size_t faces;
+    std::vector<glm::vec4> tangents;
+
+    static TangentSpaceContext &get(const SMikkTSpaceContext *context) {
+        return *static_cast<TangentSpaceContext *>(context->m_pUserData);
+    }
+
+    const Vertex &vertex(int face, int vert) const {
+        const size_t corner = static_cast<size_t>(face) * 3 + vert;
+        return primitive->vertices[primitive->indices.empty()
+                                       ? corner
+                                       : primitive->indices[corner]];
+    }
+};
+
+// MikkTSpace tangents with the bitangent sign in w, which glTF specifies
+// for normal maps without a TANGENT attribute. MikkTSpace splits vertices
+// where the tangent frames of their corners disagree, at UV seams and
+// mirrored UVs, so the corners are welded again afterwards only where
+// they share both the original vertex and the tangent.
+static void generate_tangents(Primitive &primitive) {
+    const size_t corners = primitive.indices.empty()
+                               ? primitive.vertices.size()
+                               : primitive.indices.size();
+    for (uint32_t index : primitive.indices) {
+        if (index >= primitive.vertices.size()) {
+            throw std::runtime_error("Primitive " +
+                                     std::to_string(primitive.primitive_id) +
+                                     " has an index out of range");
+        }
+    }
+
+    TangentSpaceContext context{&primitive, corners / 3, {}};
+    context.tangents.assign(context.faces * 3, glm::vec4(0.0f));
+
+    SMikkTSpaceInterface callbacks{};
+    callbacks.m_getNumFaces = [](const SMikkTSpaceContext *c) {
+        return static_cast<int>(TangentSpaceContext::get(c).faces);
+    };
+    callbacks.m_getNumVerticesOfFace = [](const SMikkTSpaceContext *, int) {
+        return 3;
+    };
+    callbacks.m_getPosition = [](const SMikkTSpaceContext *c, float out[],
+                                 int face, int vert) {
+        const auto &p = TangentSpaceContext::get(c).vertex(face, vert).position;
+        out[0] = p.x;
+        out[1] = p.y;
+        out[2] = p.z;
+    };
+    callbacks.m_getNormal = [](const SMikkTSpaceContext *c, float out[],
+                               int face, int vert) {
+        const auto &n = TangentSpaceContext::get(c).vertex(face, vert).normal;
+        out[0] = n.x;
+        out[1] = n.y;
+        out[2] = n.z;
+    };
+    callbacks.m_getTexCoord = [](const SMikkTSpaceContext *c, float out[],
+                                 int face, int vert) {
+        const auto &uv = TangentSpaceContext::get(c).vertex(face, vert).uvmap;
+        out[0] = uv.x;
+        out[1] = uv.y;
+    };
+    callbacks.m_setTSpaceBasic = [](const SMikkTSpaceContext *c,
+                                    const float tangent[], float sign,
+                                    int face, int vert) {
+        TangentSpaceContext::get(c).tangents[face * 3 + vert] =
+            glm::vec4(tangent[0], tangent[1], tangent[2], sign);
+    };
+
+    SMikkTSpaceContext mikk_context{};
+    mikk_context.m_pInterface = &callbacks;
+    mikk_context.m_pUserData = &context;
+    if (!genTangSpaceDefault(&mikk_context)) {
+        throw std::runtime_error("Failed to generate tangents of primitive " +
+                                 std::to_string(primitive.primitive_id));
+    }
+
+    // Re-index, each original vertex keeps one copy per distinct tangent
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices(context.faces * 3);
+    std::vector<std::vector<uint32_t>> copies(primitive.vertices.size());
+    for (size_t corner = 0; corner < indices.size(); corner++) {
+        const size_t original = primitive.indices.empty()
+                                    ? corner
+                                    : primitive.indices[corner];
+        const glm::vec4 &tangent = context.tangents[corner];
+        auto &candidates = copies[original];
+        auto it = std::find_if(
+            candidates.begin(), candidates.end(),
+            [&](uint32_t copy) { return vertices[copy].tangent == tangent; });
+        if (it == candidates.end()) {
+            Vertex vertex = primitive.vertices[original];
+            vertex.tangent = tangent;
+            candidates.push_back(static_cast<uint32_t>(vertices.size()));
+            vertices.push_back(vertex);
+            it = candidates.end() - 1;
+        }
+        indices[corner] = *it;
+    }
+    primitive.vertices = std::move(vertices);
+    primitive.indices = std::move(indices);
+}
+
 static size_t populate_index_data(tinygltf::Model &model,
                                   const tinygltf::Primitive &primitive,
                                   std::vector<uint32_t> &indices) {
@@ -223,14 +271,34 @@ static size_t populate_index_data(tinygltf::Model &model,
     return i;
 }
 
-Scene::Scene(const std::string &filename) {
+Scene::Scene(const std::string &filename, unsigned int decode_threads,
+             bool use_baked)
+    : textures(decode_threads) {
+    RT_PROFILE_FUNCTION();
     tinygltf::TinyGLTF loader;
     tinygltf::Model model;
     std::string err, warn;
 
-    fs::path base_dir = fs::path(filename).parent_path();
+    // Decoding is deferred to the texture registry's worker pool
+    loader.SetImageLoader(&TextureRegistry::load_image_data, &textures);
 
-    bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    // Prefer textures baked by rt_bake
+    const auto baked_directory = TextureRegistry::baked_directory(filename);
+    if (use_baked) {
+        if (size_t baked = textures.load_baked(baked_directory)) {
+            std::cout << "Using " << baked << " baked textures from "
+                      << baked_directory << std::endl;
+        }
+    }
+
+    using clock = std::chrono::steady_clock;
+    bool ret;
+    auto start = clock::now();
+    {
+        RT_PROFILE_SCOPE("parse glTF");
+        ret = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    }
+    load_stats.parse_ms = ms_since(start);
 
     if (!warn.empty())
         std::cout << "Warning: " << warn << std::endl;
@@ -241,19 +309,13 @@ Scene::Scene(const std::string &filename) {
 
     std::cout << "Successfully loaded GLTF: " << filename << std::endl;
 
-    // Build map of parents
-    std::unordered_map<const tinygltf::Node *, const tinygltf::Node *> parents;
-    for (size_t i = 0; i < model.nodes.size(); i++) {
-        for (auto &child : model.nodes[i].children) {
-            const tinygltf::Node *child_node = &model.nodes[child];
-            parents[child_node] = (const tinygltf::Node *)&model.nodes[i];
-        }
-    }
-
+    start = clock::now();
     geometries.resize(model.meshes.size());
 
     size_t mesh_i = 0;
     primitive_id = 0;
+    // Normal mapped primitives without a TANGENT attribute
+    std::vector<std::pair<size_t, size_t>> missing_tangents;
     for (const auto &mesh : model.meshes) {
         for (auto &primitive : mesh.primitives) {
             if (primitive.mode != TINYGLTF_MODE_TRIANGLES) {
@@ -268,10 +330,20 @@ Scene::Scene(const std::string &filename) {
             size_t n_vertices =
                 populate_vertex_data(model, primitive, p.vertices);
             size_t n_indices = populate_index_data(model, primitive, p.indices);
+            load_stats.vertices += n_vertices;
+            load_stats.indices += n_indices;
 
             p.primitive_id = primitive_id++;
             p.material_index = primitive.material;
 
+            if (primitive.attributes.find("TANGENT") ==
+                    primitive.attributes.end() &&
+                primitive.material >= 0 &&
+                model.materials[primitive.material].normalTexture.index >= 0) {
+                missing_tangents.push_back(
+                    {mesh_i, geometries[mesh_i].primitives.size() - 1});
+            }
+
             std::cout << "Mesh[" << mesh_i << "] Primitive:\n";
             std::cout << "\tVertices:" << n_vertices << std::endl;
             std::cout << "\tIndices:" << n_indices << std::endl;
@@ -279,24 +351,130 @@ Scene::Scene(const std::string &filename) {
         geometries[mesh_i].mesh_id = mesh_i;
         mesh_i++;
     }
+    load_stats.geometry_ms = ms_since(start);
+
+    // Generate the missing tangents once all primitives are in place
+    if (!missing_tangents.empty()) {
+        start = clock::now();
+        ThreadPool pool(decode_threads);
+        std::vector<std::future<void>> tasks;
+        for (auto [mesh, primitive] : missing_tangents) {
+            tasks.push_back(pool.submit([this, mesh, primitive] {
+                RT_PROFILE_SCOPE("generate tangents");
+                generate_tangents(geometries[mesh].primitives[primitive]);
+            }));
+        }
+        for (auto &task : tasks) {
+            task.get();
+        }
+        load_stats.tangent_ms = ms_since(start);
+        std::cout << "Generated tangents for " << missing_tangents.size()
+                  << " primitives in " << load_stats.tangent_ms << " ms"
+                  << std::endl;
+    }
+
+    flatten_nodes(model);
 
     objects.clear();
     size_t obj_i = 0;
-    for (auto &node : model.nodes) {
-        if (node.mesh >= 0) {
-            objects.push_back({&geometries[node.mesh], get_node_transform(node),
-                               get_node_global_transform(node, parents)});
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].mesh >= 0) {
+            objects.push_back({&geometries[nodes[i].mesh],
+                               nodes[i].local_transformation,
+                               nodes[i].global_transformation, i});
             obj_i++;
         }
     }
 
     size_t mat_i = 0;
     for (auto &material : model.materials) {
-        materials.push_back(Material(material, model, base_dir));
+        materials.push_back(Material(material, model, textures));
         mat_i++;
     }
+    textures.finish_acquiring();
 
     std::cout << "Number of meshes: " << mesh_i << std::endl;
     std::cout << "Number of objects: " << obj_i << std::endl;
     std::cout << "Number of materials: " << mat_i << std::endl;
+    std::cout << "Number of textures: " << textures.size() << std::endl;
+}
+
+void Scene::flatten_nodes(const tinygltf::Model &model) {
+    const size_t n = model.nodes.size();
+
+    std::vector<int32_t> gltf_parent(n, -1);
+    for (size_t i = 0; i < n; i++) {
+        for (auto child : model.nodes[i].children) {
+            gltf_parent[child] = static_cast<int32_t>(i);
+        }
+    }
+
+    // Depth-first from the roots so every node is emitted after its parent.
+    // Entries are (glTF node index, flat index of the parent).
+    std::vector<std::pair<int32_t, int32_t>> stack;
+    for (size_t i = n; i-- > 0;) {
+        if (gltf_parent[i] == -1) {
+            stack.push_back({static_cast<int32_t>(i), -1});
+        }
+    }
+
+    nodes.clear();
+    nodes.reserve(n);
+    std::vector<bool> visited(n, false);
+    while (!stack.empty()) {
+        auto [gltf_index, parent] = stack.back();
+        stack.pop_back();
+        if (visited[gltf_index]) {
+            std::cerr << "Node " << gltf_index
+                      << " is reachable more than once, skipping" << std::endl;
+            continue;
+        }
+        visited[gltf_index] = true;
+
+        const auto &gltf_node = model.nodes[gltf_index];
+        const int32_t index = static_cast<int32_t>(nodes.size());
+        nodes.push_back({parent, gltf_node.mesh, get_node_transform(gltf_node),
+                         glm::mat4(1.0f), true});
+
+        for (auto it = gltf_node.children.rbegin();
+             it != gltf_node.children.rend(); it++) {
+            stack.push_back({*it, index});
+        }
+    }
+
+    update_transforms();
+}
+
+bool Scene::update_transforms() {
+    // Parents precede children, so a parent's world matrix is final by the
+    // time its children are visited
+    std::vector<bool> updated(nodes.size(), false);
+    bool changed = false;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto &node = nodes[i];
+        if (node.parent >= 0 && updated[node.parent]) {
+            node.dirty = true;
+        }
+        if (!node.dirty) {
+            continue;
+        }
+
+        node.global_transformation =
+            node.parent >= 0 ? nodes[node.parent].global_transformation *
+                                   node.local_transformation
+                             : node.local_transformation;
+        node.dirty = false;
+        updated[i] = true;
+        changed = true;
+    }
+
+    for (auto &object : objects) {
+        if (updated[object.node_index]) {
+            const auto &node = nodes[object.node_index];
+            object.transformation = node.local_transformation;
+            object.global_transformation = node.global_transformation;
+        }
+    }
+
+    return changed;
 }
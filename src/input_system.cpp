@@ -1,4 +1,5 @@
 #include <renderer/input/input_system.hpp>
+#include <utils/cpu_profiler.hpp>
 
 void InputSystem::reset_actions() {
     for (auto it = actions.begin(); it != actions.end(); it++) {
@@ -119,6 +120,7 @@ input::MousePosition InputSystem::get_mouse_position() {
 }
 
 bool InputSystem::update() {
+    RT_PROFILE_FUNCTION();
     // put all actions to rest
     keyboard_interface->pre_update();
     mouse_interface->pre_update();
@@ -0,0 +1,288 @@
+#include <geometry/ktx2.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef RT_RENDER_BASISU
+#include <basisu_transcoder.h>
+#include <mutex>
+#endif
+
+namespace {
+
+constexpr unsigned char ktx2_identifier[12] = {0xAB, 0x4B, 0x54, 0x58,
+                                               0x20, 0x32, 0x30, 0xBB,
+                                               0x0D, 0x0A, 0x1A, 0x0A};
+constexpr size_t ktx2_header_size = 80;
+constexpr size_t ktx2_level_entry_size = 24;
+
+template <typename T> T read(const unsigned char *bytes, size_t offset) {
+    T value;
+    std::memcpy(&value, bytes + offset, sizeof(T)); // KTX2 is little-endian
+    return value;
+}
+
+} // namespace
+
+std::optional<PixelFormat> Ktx2Info::native_format() const {
+    if (supercompression != none) {
+        return std::nullopt;
+    }
+    // VkFormat values
+    switch (vk_format) {
+    case 16: // VK_FORMAT_R8G8_UNORM
+        return PixelFormat::rg8_unorm;
+    case 37: // VK_FORMAT_R8G8B8A8_UNORM
+        return PixelFormat::rgba8_unorm;
+    case 43: // VK_FORMAT_R8G8B8A8_SRGB
+        return PixelFormat::rgba8_srgb;
+    case 131: // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    case 133: // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+        return PixelFormat::bc1_unorm;
+    case 132: // VK_FORMAT_BC1_RGB_SRGB_BLOCK
+    case 134: // VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+        return PixelFormat::bc1_srgb;
+    case 137: // VK_FORMAT_BC3_UNORM_BLOCK
+        return PixelFormat::bc3_unorm;
+    case 138: // VK_FORMAT_BC3_SRGB_BLOCK
+        return PixelFormat::bc3_srgb;
+    case 139: // VK_FORMAT_BC4_UNORM_BLOCK
+        return PixelFormat::bc4_unorm;
+    case 141: // VK_FORMAT_BC5_UNORM_BLOCK
+        return PixelFormat::bc5_unorm;
+    case 145: // VK_FORMAT_BC7_UNORM_BLOCK
+        return PixelFormat::bc7_unorm;
+    case 146: // VK_FORMAT_BC7_SRGB_BLOCK
+        return PixelFormat::bc7_srgb;
+    default:
+        return std::nullopt;
+    }
+}
+
+bool is_ktx2(const unsigned char *bytes, size_t size) {
+    return size >= sizeof(ktx2_identifier) &&
+           std::memcmp(bytes, ktx2_identifier, sizeof(ktx2_identifier)) == 0;
+}
+
+bool parse_ktx2(const unsigned char *bytes, size_t size, Ktx2Info &info,
+                std::string &error) {
+    if (!is_ktx2(bytes, size) || size < ktx2_header_size) {
+        error = "not a KTX2 file";
+        return false;
+    }
+
+    info.vk_format = read<uint32_t>(bytes, 12);
+    info.width = read<uint32_t>(bytes, 20);
+    info.height = read<uint32_t>(bytes, 24);
+    const uint32_t depth = read<uint32_t>(bytes, 28);
+    const uint32_t layers = read<uint32_t>(bytes, 32);
+    const uint32_t faces = read<uint32_t>(bytes, 36);
+    // 0 asks the loader to generate mips
+    const uint32_t level_count = std::max(read<uint32_t>(bytes, 40), 1u);
+    info.supercompression = read<uint32_t>(bytes, 44);
+
+    if (info.width == 0 || info.height == 0 || depth > 1 || layers > 1 ||
+        faces != 1) {
+        error = "only single-layer 2D KTX2 textures are supported";
+        return false;
+    }
+    if (level_count > 32 ||
+        ktx2_header_size + level_count * ktx2_level_entry_size > size) {
+        error = "truncated KTX2 level index";
+        return false;
+    }
+
+    info.levels.resize(level_count);
+    for (uint32_t i = 0; i < level_count; i++) {
+        const size_t entry = ktx2_header_size + i * ktx2_level_entry_size;
+        info.levels[i].offset = read<uint64_t>(bytes, entry);
+        info.levels[i].length = read<uint64_t>(bytes, entry + 8);
+        if (info.levels[i].offset > size ||
+            info.levels[i].length > size - info.levels[i].offset) {
+            error = "KTX2 level " + std::to_string(i) + " is out of bounds";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool write_ktx2(const std::filesystem::path &path, PixelFormat format,
+                uint32_t width, uint32_t height,
+                const std::vector<std::vector<uint8_t>> &levels,
+                std::string &error) {
+    // VkFormat, Khronos data format model and whether the DFD describes red
+    // and green as separate samples
+    uint32_t vk_format = 0;
+    uint8_t color_model = 0;
+    bool srgb = false;
+    bool two_samples = false;
+    switch (format) {
+    case PixelFormat::bc4_unorm:
+        vk_format = 139;
+        color_model = 131; // KHR_DF_MODEL_BC4
+        break;
+    case PixelFormat::bc5_unorm:
+        vk_format = 141;
+        color_model = 132; // KHR_DF_MODEL_BC5
+        two_samples = true;
+        break;
+    case PixelFormat::bc7_unorm:
+        vk_format = 145;
+        color_model = 134; // KHR_DF_MODEL_BC7
+        break;
+    case PixelFormat::bc7_srgb:
+        vk_format = 146;
+        color_model = 134;
+        srgb = true;
+        break;
+    default:
+        error = "unsupported KTX2 output format";
+        return false;
+    }
+    if (levels.empty()) {
+        error = "no levels to write";
+        return false;
+    }
+
+    // Basic data format descriptor block
+    const uint32_t samples = two_samples ? 2 : 1;
+    const uint32_t block_size = 24 + 16 * samples;
+    std::vector<uint32_t> dfd = {
+        4 + block_size,     // total size
+        0,                  // vendor Khronos, descriptor type basic
+        2u | block_size << 16, // version 2
+        color_model | 1u << 8 | (srgb ? 2u : 1u) << 16, // BT.709 primaries
+        3u | 3u << 8,       // 4x4 texel blocks
+        get_pixel_format_info(format).block_bytes,
+        0,
+    };
+    const uint32_t sample_bits =
+        get_pixel_format_info(format).block_bytes * 8 / samples;
+    for (uint32_t i = 0; i < samples; i++) {
+        // Bit offset, length - 1 and channel (red, green)
+        dfd.push_back(i * sample_bits | (sample_bits - 1) << 16 | i << 24);
+        dfd.push_back(0);          // sample position
+        dfd.push_back(0);          // lower
+        dfd.push_back(0xFFFFFFFF); // upper
+    }
+
+    const size_t level_index_size = levels.size() * ktx2_level_entry_size;
+    const size_t dfd_offset = ktx2_header_size + level_index_size;
+    const size_t dfd_size = dfd.size() * sizeof(uint32_t);
+
+    // Level data is stored smallest first, each aligned to the block size
+    std::vector<uint64_t> offsets(levels.size());
+    size_t end = dfd_offset + dfd_size;
+    for (size_t i = levels.size(); i-- > 0;) {
+        end = (end + 15) / 16 * 16;
+        offsets[i] = end;
+        end += levels[i].size();
+    }
+
+    std::vector<unsigned char> file(end, 0);
+    auto write32 = [&](size_t offset, uint32_t value) {
+        std::memcpy(file.data() + offset, &value, sizeof(value));
+    };
+    auto write64 = [&](size_t offset, uint64_t value) {
+        std::memcpy(file.data() + offset, &value, sizeof(value));
+    };
+
+    std::memcpy(file.data(), ktx2_identifier, sizeof(ktx2_identifier));
+    write32(12, vk_format);
+    write32(16, 1); // type size
+    write32(20, width);
+    write32(24, height);
+    write32(28, 0); // depth
+    write32(32, 0); // layers
+    write32(36, 1); // faces
+    write32(40, static_cast<uint32_t>(levels.size()));
+    write32(44, Ktx2Info::none);
+    write32(48, static_cast<uint32_t>(dfd_offset));
+    write32(52, static_cast<uint32_t>(dfd_size));
+    // No key/value or supercompression global data
+
+    for (size_t i = 0; i < levels.size(); i++) {
+        const size_t entry = ktx2_header_size + i * ktx2_level_entry_size;
+        write64(entry, offsets[i]);
+        write64(entry + 8, levels[i].size());
+        write64(entry + 16, levels[i].size());
+        std::memcpy(file.data() + offsets[i], levels[i].data(),
+                    levels[i].size());
+    }
+    std::memcpy(file.data() + dfd_offset, dfd.data(), dfd_size);
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(file.data()), file.size());
+    if (!out) {
+        error = "failed to write " + path.string();
+        return false;
+    }
+    return true;
+}
+
+#ifdef RT_RENDER_BASISU
+
+bool basisu_transcoder_available() { return true; }
+
+void basisu_transcode(const unsigned char *bytes, size_t size,
+                      PixelFormat format,
+                      const std::vector<size_t> &level_offsets,
+                      unsigned char *out) {
+    static std::once_flag init;
+    std::call_once(init, [] { basist::basisu_transcoder_init(); });
+
+    basist::transcoder_texture_format target;
+    switch (format) {
+    case PixelFormat::rgba8_unorm:
+    case PixelFormat::rgba8_srgb:
+        target = basist::transcoder_texture_format::cTFRGBA32;
+        break;
+    case PixelFormat::bc5_unorm:
+        target = basist::transcoder_texture_format::cTFBC5_RG;
+        break;
+    case PixelFormat::bc7_unorm:
+    case PixelFormat::bc7_srgb:
+        target = basist::transcoder_texture_format::cTFBC7_RGBA;
+        break;
+    default:
+        throw std::runtime_error("Unsupported Basis Universal target format");
+    }
+
+    basist::ktx2_transcoder transcoder;
+    if (!transcoder.init(bytes, static_cast<uint32_t>(size)) ||
+        !transcoder.start_transcoding()) {
+        throw std::runtime_error("Failed to initialize KTX2 transcoder");
+    }
+
+    for (uint32_t level = 0; level < level_offsets.size(); level++) {
+        basist::ktx2_image_level_info level_info;
+        if (!transcoder.get_image_level_info(level_info, level, 0, 0)) {
+            throw std::runtime_error("Missing KTX2 level " +
+                                     std::to_string(level));
+        }
+        // Sized in pixels for uncompressed targets, blocks otherwise
+        const uint32_t out_size =
+            is_block_compressed(format)
+                ? level_info.m_total_blocks
+                : level_info.m_orig_width * level_info.m_orig_height;
+        if (!transcoder.transcode_image_level(level, 0, 0,
+                                              out + level_offsets[level],
+                                              out_size, target)) {
+            throw std::runtime_error("Failed to transcode KTX2 level " +
+                                     std::to_string(level));
+        }
+    }
+}
+
+#else
+
+bool basisu_transcoder_available() { return false; }
+
+void basisu_transcode(const unsigned char *, size_t, PixelFormat,
+                      const std::vector<size_t> &, unsigned char *) {
+    throw std::runtime_error(
+        "Built without Basis Universal, set RT_RENDER_BASISU_DIR");
+}
+
+#endif
@@ -1,44 +1,775 @@
+#include <cctype>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <geometry/scene_query.hpp>
 #include <renderer/app.hpp>
+#include <renderer/camera_path.hpp>
 #include <renderer/input/input_system.hpp>
 #include <renderer/input/keyboard_glfw.hpp>
 #include <renderer/input/mouse_glfw.hpp>
+#include <renderer/reference_image.hpp>
 #include <renderer/window/window_system_glfw.hpp>
+#include <utils/json.hpp>
 
 #define VMA_IMPLEMENTATION
 #include <renderer/renderer.hpp>
 
 #include <glm/gtc/matrix_transform.hpp>
 
+// A/B benchmarks of a renderer feature, rendered from the start camera, or
+// a replay of a recorded camera path
+enum class Benchmark {
+    none,
+    texture_lod,
+    material_fast_paths,
+    camera_path,
+    adaptive_sampling,
+    idle,
+    denoiser
+};
+
+struct PathTracerOptions {
+    Benchmark benchmark = Benchmark::none;
+    unsigned int benchmark_frames = 0; // 0 replays the whole camera path
+    uint64_t texture_budget = 0;
+    std::filesystem::path gpu_trace_path;
+    // Camera path written on exit from interactive frames, if set
+    std::filesystem::path record_path;
+    // Camera path replayed by Benchmark::camera_path and its JSON report
+    std::filesystem::path replay_path;
+    std::filesystem::path report_path = "benchmark.json";
+    uint32_t seed = 1;
+    // Render without a window, only for benchmarks
+    bool headless = false;
+    // Thin lens radius, focused on whatever is at the image center
+    float aperture = 0.0f;
+    TileSettings tiles;
+    // Traced part of the image, width 0 for all of it
+    Tile region{0, 0, 0, 0};
+    AdaptiveSettings adaptive;
+    // Stop tracing once the image reaches it, if set
+    ConvergenceTarget convergence;
+    double idle_benchmark_seconds = 5.0; // per phase
+    bool reprojection = false;
+    DenoiseSettings denoise;
+};
+
+// Parses a rectangle given as x,y,width,height
+Tile parse_region(const std::string &value) {
+    Tile region{};
+    char separator[3];
+    std::istringstream in(value);
+    if (!(in >> region.x >> separator[0] >> region.y >> separator[1] >>
+          region.width >> separator[2] >> region.height) ||
+        separator[0] != ',' || separator[1] != ',' || separator[2] != ',') {
+        throw std::runtime_error("Expected x,y,width,height, got " + value);
+    }
+    return region;
+}
+
 class PathTracer : public App {
   private:
     WindowSystemGLFW window_system;
     InputSystem input_system;
     std::unique_ptr<Renderer> renderer;
+    std::filesystem::path scene_path;
+    bool headless;
 
     std::function<void()> exit_function;
 
     glm::vec3 camera_position;
     glm::vec3 camera_direction;
 
+    WindowHandle window{};
     input::MousePosition last_mouse_position;
     float pitch;
     float yaw;
+    // Held release key, the cursor is free and mouse look paused
+    bool cursor_released = false;
+    // Switching the cursor mode moves it, so the next delta is skipped
+    bool cursor_mode_changed = false;
+
+    // Host copy of the scene geometry for picking and autofocus
+    std::unique_ptr<SceneQuery> scene_query;
+    float aperture;
+
+    static constexpr unsigned int benchmark_warmup_frames = 16;
+    Benchmark benchmark;
+    unsigned int benchmark_frames;
+    unsigned int benchmark_frame;
+    utils::Point benchmark_start;
+    double benchmark_ms[2];
+
+    // Chrome trace of the GPU scopes, written on exit if set
+    std::filesystem::path gpu_trace_path;
+
+    std::filesystem::path record_path;
+    CameraPath recorded_path;
+
+    // Camera path benchmark, timed frame by frame and then replayed again
+    // with shader counters to count its rays
+    std::filesystem::path replay_path;
+    std::filesystem::path report_path;
+    CameraPath replay;
+    uint32_t seed;
+    std::vector<double> replay_ms;
+    uint64_t replay_start_pixels; // Renderer::get_traced_pixels()
+    utils::Point replay_last_frame;
+    CameraPose replay_pose;
+
+    // Reference image of the start camera for the adaptive and denoiser
+    // benchmarks
+    ReferenceImage reference;
+
+    // Adaptive sampling benchmark, the reference is phase 0 and uniform
+    // sampling phase 1
+    AdaptiveSettings adaptive_settings;
+    unsigned int adaptive_phase;
+    unsigned int adaptive_phase_frames;
+    AdaptiveStats adaptive_uniform; // at the end of phase 1
+    ImageError adaptive_uniform_error;
+    double adaptive_uniform_seconds;
+    double adaptive_readback_seconds; // of the current phase
+
+    // Idle mode: converged images are left on screen without tracing
+    bool idle_mode;
+    bool idle; // the image is converged and frames are skipped
+    // Idle benchmark, converging and then measuring with idle mode off and on
+    double idle_seconds;
+    unsigned int idle_phase;
+    unsigned int idle_frames;
+    double idle_busy_start; // Renderer::get_gpu_busy_ms()
+    double idle_busy_ms[2]; // per second
+
+    // Denoiser benchmark, the reference is phase 0
+    unsigned int denoise_phase;
+    uint32_t denoise_samples; // next samples per pixel compared
+
+    void update_projection() {
+        auto &camera = renderer->get_camera();
+        camera.set_fov(110.0f);
+        camera.set_range(0.001f, 10000.0f);
+
+        auto [r_width, r_height] = renderer->get_dimensions();
+        camera.aspect_ratio =
+            static_cast<float>(r_width) / static_cast<float>(r_height);
+    }
+
+    // Prints texture streaming activity for frames that changed residency
+    void print_streaming_stats() {
+        const auto &stats = renderer->get_streaming_stats();
+        if (stats.uploads == 0 && stats.evictions == 0) {
+            return;
+        }
+        constexpr double mib = 1024.0 * 1024.0;
+        std::cout << "Texture streaming: " << stats.resident_bytes / mib
+                  << " / " << stats.budget_bytes / mib << " MiB resident, "
+                  << stats.pending << " pending, " << stats.uploads
+                  << " uploads, " << stats.evictions << " evictions"
+                  << std::endl;
+    }
+
+    const char *get_benchmark_name() const {
+        return benchmark == Benchmark::texture_lod ? "Texture LOD"
+                                                   : "Material fast paths";
+    }
+
+    // Prints what is under a window position, e.g. the released cursor
+    void pick(const input::MousePosition &position) {
+        const auto [width, height] = renderer->get_dimensions();
+        const glm::vec2 uv(static_cast<float>(position.x) / width,
+                           static_cast<float>(position.y) / height);
+        const auto &camera = renderer->get_camera();
+        SceneHit hit;
+        const auto start = utils::get_time();
+        const bool found = scene_query->raycast(
+            glm::vec3(camera.position), camera.get_ray_direction(uv), hit,
+            camera.min, camera.max);
+        const double ms = (utils::get_time() - start) * 1000.0;
+
+        std::cout << "Pick (" << position.x << ", " << position.y << "): ";
+        if (!found) {
+            std::cout << "nothing (" << ms << " ms)" << std::endl;
+            return;
+        }
+        const auto &materials = renderer->get_scene().get_materials();
+        const std::string material =
+            hit.material_index >= 0 &&
+                    static_cast<size_t>(hit.material_index) < materials.size()
+                ? materials[hit.material_index].name
+                : "default";
+        std::cout << "object " << hit.object << ", primitive "
+                  << hit.primitive_id << ", triangle " << hit.triangle
+                  << ", material " << hit.material_index << " \"" << material
+                  << "\", distance " << hit.distance << " at ("
+                  << hit.position.x << ", " << hit.position.y << ", "
+                  << hit.position.z << ") (" << ms << " ms)" << std::endl;
+    }
+
+    // Crops tracing to a square at the image center, where the view points
+    // as the cursor is captured, or goes back to the whole image if already
+    // cropped
+    void toggle_region() {
+        if (renderer->has_region()) {
+            renderer->clear_region();
+            std::cout << "Region off" << std::endl;
+            return;
+        }
+        constexpr int size = 256;
+        const auto [width, height] = renderer->get_dimensions();
+        const int x = std::max((width - size) / 2, 0);
+        const int y = std::max((height - size) / 2, 0);
+        set_region({static_cast<uint32_t>(x), static_cast<uint32_t>(y), size,
+                    size});
+    }
+
+    void set_region(const Tile &rectangle) {
+        renderer->set_region(rectangle);
+        const auto &region = renderer->get_region();
+        const auto [width, height] = renderer->get_dimensions();
+        std::cout << "Region (" << region.x << ", " << region.y << ") "
+                  << region.width << "x" << region.height << ", "
+                  << 100.0 * region.width * region.height / (width * height)
+                  << "% of the image in " << renderer->get_tiles().size()
+                  << " tiles" << std::endl;
+    }
+
+    // Focuses the lens on the surface at the image center, keeping the last
+    // focus if the center ray misses
+    void autofocus() {
+        if (!scene_query || aperture <= 0.0f) {
+            return;
+        }
+        auto &camera = renderer->get_camera();
+        SceneHit hit;
+        if (!scene_query->raycast(glm::vec3(camera.position),
+                                  glm::vec3(camera.direction), hit, camera.min,
+                                  camera.max)) {
+            return;
+        }
+        // Ignore changes too small to see, so accumulation keeps going
+        if (std::abs(hit.distance - camera.focus_distance) >
+            0.01f * camera.focus_distance) {
+            camera.set_lens(aperture, hit.distance);
+            renderer->set_camera_changed(true);
+        }
+    }
+
+    // Points the camera along a pose, restarting accumulation if it moved
+    void set_camera_pose(const CameraPose &pose) {
+        const glm::vec3 up = {0.0f, 1.0f, 0.0f};
+        auto &camera = renderer->get_camera();
+        camera.set_position(pose.position);
+        camera.set_direction(pose.direction);
+        camera.set_up(up);
+        camera.set_right(glm::normalize(glm::cross(pose.direction, up)));
+        if (pose.position != replay_pose.position ||
+            pose.direction != replay_pose.direction) {
+            renderer->set_camera_changed(true);
+        }
+        replay_pose = pose;
+        update_projection();
+        autofocus();
+    }
+
+    // Renders the warmup frames at the first pose, then times every frame of
+    // the path. The same seed and poses are then rendered once more with
+    // shader counters, waiting on each frame, to count the rays traced.
+    void replay_update(const FrameConstants &frame_constants) {
+        const unsigned int frame = benchmark_frame;
+        const bool warmup = frame < benchmark_warmup_frames;
+        const size_t pose =
+            warmup ? 0 : (frame - benchmark_warmup_frames) % replay.size();
+
+        if (frame == 0 || frame == benchmark_warmup_frames) {
+            renderer->set_random_seed(seed);
+            renderer->set_camera_changed(true);
+        }
+        set_camera_pose(replay[pose]);
+        renderer->render(frame_constants);
+        benchmark_frame++;
+
+        const auto now = utils::get_time();
+        if (frame + 1 == benchmark_warmup_frames) {
+            benchmark_start = now;
+            replay_start_pixels = renderer->get_traced_pixels();
+        } else if (!warmup) {
+            replay_ms.push_back((now - replay_last_frame) * 1000.0);
+        }
+        replay_last_frame = now;
+
+        if (frame + 1 < benchmark_warmup_frames + benchmark_frames) {
+            return;
+        }
+        renderer->wait_idle();
+        const double seconds = utils::get_time() - benchmark_start;
+        const uint64_t samples =
+            renderer->get_traced_pixels() - replay_start_pixels;
+
+        uint64_t rays = 0;
+        renderer->set_shader_counters(true);
+        renderer->set_random_seed(seed);
+        renderer->set_camera_changed(true);
+        for (unsigned int i = 0; i < benchmark_frames; i++) {
+            set_camera_pose(replay[i % replay.size()]);
+            renderer->render(frame_constants);
+            renderer->wait_idle();
+            const auto counters = renderer->read_shader_counters();
+            rays += counters.hits + counters.misses;
+        }
+        renderer->set_shader_counters(false);
+
+        write_replay_report(seconds, samples, rays);
+        renderer->print_gpu_profile();
+        exit_function();
+    }
+
+    // Renders single-sample frames of the start camera into the reference
+    // until it has the given samples per pixel, returns whether it has
+    bool reference_update(const FrameConstants &frame_constants,
+                          uint32_t samples) {
+        if (reference.samples == 0) {
+            renderer->set_random_seed(seed);
+            benchmark_start = utils::get_time();
+        }
+        update_projection();
+        renderer->set_camera_changed(true);
+        renderer->render(frame_constants);
+        reference.add(renderer->read_image(false));
+        if (reference.samples < samples) {
+            return false;
+        }
+        std::cout << "Reference: " << reference.samples
+                  << " samples per pixel in "
+                  << utils::get_time() - benchmark_start << " s" << std::endl;
+        return true;
+    }
+
+    // Renders a reference of the start camera with four times the benchmark
+    // frames' samples, then renders with every tile active for the
+    // benchmark frames and with adaptive sampling until its error to the
+    // reference is as low, and prints the samples each needed. Both runs
+    // are measured against the same reference, the error each estimates
+    // for itself is biased towards the tiles adaptive sampling skips. Every
+    // frame is waited on to read its convergence.
+    void adaptive_update(const FrameConstants &frame_constants) {
+        if (adaptive_phase == 0) {
+            if (reference_update(frame_constants, 4 * benchmark_frames)) {
+                adaptive_phase = 1;
+            }
+            return;
+        }
+        if (adaptive_phase_frames == 0) {
+            renderer->set_adaptive_sampling(
+                adaptive_phase == 1 ? get_uniform_settings(adaptive_settings)
+                                    : adaptive_settings);
+            // Samples independent of the reference's
+            renderer->set_random_seed(seed + 1);
+            benchmark_start = utils::get_time();
+            adaptive_readback_seconds = 0.0;
+        }
+        update_projection();
+        renderer->render(frame_constants);
+        renderer->wait_idle();
+        adaptive_phase_frames++;
+
+        // The mask pass measures the samples of the frames before it
+        const auto stats = renderer->read_adaptive_stats();
+        if (!stats.valid) {
+            return;
+        }
+        if (adaptive_phase == 1 && adaptive_phase_frames <= benchmark_frames) {
+            return;
+        }
+        // Reading the image back is not part of the time of either run
+        const auto readback_start = utils::get_time();
+        const double seconds =
+            readback_start - benchmark_start - adaptive_readback_seconds;
+        const ImageError error =
+            compare_images(renderer->read_image(false), reference);
+        adaptive_readback_seconds += utils::get_time() - readback_start;
+        if (adaptive_phase == 1) {
+            adaptive_uniform = stats;
+            adaptive_uniform_error = error;
+            adaptive_uniform_seconds = seconds;
+            print_adaptive_phase("Uniform", stats, error, seconds);
+            adaptive_phase = 2;
+            adaptive_phase_frames = 0;
+            return;
+        }
+        const bool converged = error.rmse <= adaptive_uniform_error.rmse;
+        if (!converged && adaptive_phase_frames <= 8 * benchmark_frames) {
+            return;
+        }
+        print_adaptive_phase("Adaptive", stats, error, seconds);
+        if (converged) {
+            std::cout << "Adaptive sampling saved "
+                      << 100.0 * (1.0 - static_cast<double>(stats.samples) /
+                                            adaptive_uniform.samples)
+                      << "% of the samples at equal error, "
+                      << adaptive_uniform_seconds / seconds << "x the speed"
+                      << std::endl;
+        } else {
+            std::cout << "Adaptive sampling did not reach the uniform "
+                      << "error, try a lower --adaptive-threshold"
+                      << std::endl;
+        }
+        renderer->print_gpu_profile();
+        exit_function();
+    }
+
+    void print_adaptive_phase(const char *name, const AdaptiveStats &stats,
+                              const ImageError &error, double seconds) {
+        std::cout << name << " sampling: " << stats.samples << " samples ("
+                  << static_cast<double>(stats.samples) / stats.pixels
+                  << " per pixel), RMSE " << error.rmse << " to the "
+                  << "reference, estimated mean error " << stats.mean_error
+                  << ", max " << stats.max_error << ", "
+                  << adaptive_phase_frames << " frames in " << seconds
+                  << " s, " << stats.active_tiles << " of " << stats.tiles
+                  << " tiles active" << std::endl;
+    }
+
+    // Renders from the start camera until the image converges, then
+    // measures the GPU time spent per second over idle_seconds, tracing
+    // every frame and then in idle mode
+    void idle_benchmark_update(const FrameConstants &frame_constants) {
+        constexpr unsigned int max_converge_frames = 1 << 14;
+        if (idle_phase == 0) {
+            update_projection();
+            renderer->render(frame_constants);
+            benchmark_frame++;
+            if (renderer->is_converged()) {
+                std::cout << "Converged after " << benchmark_frame
+                          << " frames" << std::endl;
+                start_idle_phase(1);
+            } else if (benchmark_frame >= max_converge_frames) {
+                std::cout << "Not converged after " << benchmark_frame
+                          << " frames, try a lower target" << std::endl;
+                exit_function();
+            }
+            return;
+        }
+
+        const double elapsed = utils::get_time() - benchmark_start;
+        if (elapsed >= idle_seconds) {
+            const double busy_ms = renderer->get_gpu_busy_ms() -
+                                   idle_busy_start;
+            double &busy = idle_busy_ms[idle_phase - 1];
+            busy = busy_ms / elapsed;
+            std::cout << "Idle mode " << (idle_phase == 2 ? "on" : "off")
+                      << ": " << idle_frames << " frames in " << elapsed
+                      << " s, GPU busy " << busy << " ms/s ("
+                      << busy / 10.0 << "%)" << std::endl;
+            if (idle_phase == 1) {
+                start_idle_phase(2);
+                return;
+            }
+            std::cout << "Idle mode saves "
+                      << idle_busy_ms[0] - idle_busy_ms[1]
+                      << " GPU ms/s on a converged image" << std::endl;
+            exit_function();
+            return;
+        }
+        if (idle_phase == 2 && renderer->is_converged()) {
+            window_system.wait_events(idle_seconds - elapsed);
+            return;
+        }
+        update_projection();
+        renderer->render(frame_constants);
+        idle_frames++;
+    }
+
+    void start_idle_phase(unsigned int phase) {
+        idle_phase = phase;
+        idle_frames = 0;
+        idle_busy_start = renderer->get_gpu_busy_ms();
+        benchmark_start = utils::get_time();
+    }
+
+    // Renders the benchmark frames' samples per pixel of the start camera
+    // as the reference, then restarts with the denoiser on and compares the
+    // noisy and denoised images to it at 1, 4, 16, ... samples per pixel,
+    // up to a quarter of the reference's
+    void denoise_benchmark_update(const FrameConstants &frame_constants) {
+        if (denoise_phase == 0) {
+            if (!reference_update(frame_constants, benchmark_frames)) {
+                return;
+            }
+            // Samples independent of the reference's
+            DenoiseSettings settings = renderer->get_denoiser();
+            settings.enabled = true;
+            renderer->set_denoiser(settings);
+            renderer->set_random_seed(seed + 1);
+            renderer->set_camera_changed(true);
+            denoise_phase = 1;
+            return;
+        }
+        update_projection();
+        renderer->render(frame_constants);
+        renderer->wait_idle();
+        const uint32_t samples = renderer->get_frame_samples();
+        if (samples < denoise_samples) {
+            return;
+        }
+        const ImageError noisy =
+            compare_images(renderer->read_image(false), reference);
+        const ImageError denoised =
+            compare_images(renderer->read_image(true), reference);
+        std::cout << samples << " spp: noisy RMSE " << noisy.rmse << " PSNR "
+                  << noisy.psnr << " dB, denoised RMSE " << denoised.rmse
+                  << " PSNR " << denoised.psnr << " dB" << std::endl;
+        denoise_samples *= 4;
+        if (denoise_samples <= benchmark_frames / 4) {
+            return;
+        }
+
+        const auto &stats = renderer->get_gpu_frame_stats();
+        const auto average = [&](const std::string &name) {
+            const auto it = stats.find(name);
+            return it != stats.end() ? it->second.average() : 0.0;
+        };
+        std::cout << "Denoiser: " << renderer->get_denoiser().iterations
+                  << " passes, " << average("denoise") << " ms/frame, "
+                  << "prepare " << average("denoise prepare") << " ms";
+        for (uint32_t i = 0; i < renderer->get_denoiser().iterations; i++) {
+            std::cout << ", pass " << i + 1 << " "
+                      << average(get_denoise_pass_name(i)) << " ms";
+        }
+        std::cout << ", tracing " << average("trace rays") << " ms/frame"
+                  << std::endl;
+        renderer->print_gpu_profile();
+        exit_function();
+    }
+
+    void write_replay_report(double seconds, uint64_t samples,
+                             uint64_t rays) {
+        const auto stats = FrameTimeStats::compute(replay_ms);
+        const auto [width, height] = renderer->get_dimensions();
+        const auto &tiles = renderer->get_tile_settings();
+
+        std::ofstream out(report_path);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + report_path.string());
+        }
+        out << "{\n"
+            << "  \"scene\": " << json_string(scene_path.string()) << ",\n"
+            << "  \"device\": " << json_string(renderer->get_device_name())
+            << ",\n"
+            << "  \"camera_path\": " << json_string(replay_path.string())
+            << ",\n"
+            << "  \"headless\": " << (headless ? "true" : "false") << ",\n"
+            << "  \"seed\": " << seed << ",\n"
+            << "  \"width\": " << width << ",\n"
+            << "  \"height\": " << height << ",\n"
+            << "  \"warmup_frames\": " << benchmark_warmup_frames << ",\n"
+            << "  \"frames\": " << benchmark_frames << ",\n"
+            << "  \"tile_size\": " << tiles.tile_size << ",\n"
+            << "  \"tile_order\": "
+            << json_string(get_tile_order_name(tiles.order)) << ",\n"
+            << "  \"tiles_per_frame\": " << tiles.tiles_per_frame << ",\n"
+            << "  \"tile_submits\": " << tiles.submits << ",\n"
+            << "  \"reprojection\": "
+            << (renderer->get_reprojection() ? "true" : "false") << ",\n"
+            << "  \"seconds\": " << seconds << ",\n"
+            << "  \"frame_ms\": {\"average\": " << stats.average
+            << ", \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95
+            << ", \"p99\": " << stats.p99 << ", \"min\": " << stats.min
+            << ", \"max\": " << stats.max << "},\n"
+            << "  \"samples\": " << samples << ",\n"
+            << "  \"samples_per_second\": " << samples / seconds << ",\n"
+            << "  \"rays\": " << rays << ",\n"
+            << "  \"rays_per_second\": " << rays / seconds << "\n"
+            << "}\n";
+
+        std::cout << "Camera path: " << benchmark_frames << " frames in "
+                  << seconds << " s, " << stats.average << " ms/frame (p50 "
+                  << stats.p50 << ", p95 " << stats.p95 << ", p99 "
+                  << stats.p99 << "), " << samples / seconds / 1e6
+                  << " M samples/s, " << rays / seconds / 1e6
+                  << " M rays/s" << std::endl;
+        std::cout << "Wrote " << report_path << std::endl;
+    }
+
+    // Renders from the start camera with the feature off and then on, and
+    // prints the mean frame time of each after a warmup. The material
+    // benchmark also counts texture fetches per hit during the warmup.
+    void benchmark_update(const FrameConstants &frame_constants) {
+        if (benchmark == Benchmark::camera_path) {
+            replay_update(frame_constants);
+            return;
+        }
+        if (benchmark == Benchmark::adaptive_sampling) {
+            adaptive_update(frame_constants);
+            return;
+        }
+        if (benchmark == Benchmark::idle) {
+            idle_benchmark_update(frame_constants);
+            return;
+        }
+        if (benchmark == Benchmark::denoiser) {
+            denoise_benchmark_update(frame_constants);
+            return;
+        }
+        const unsigned int frames_per_mode =
+            benchmark_warmup_frames + benchmark_frames;
+        const unsigned int mode = benchmark_frame / frames_per_mode;
+        const unsigned int frame = benchmark_frame % frames_per_mode;
+        const bool counters = benchmark == Benchmark::material_fast_paths;
+
+        if (frame == 0) {
+            if (benchmark == Benchmark::texture_lod) {
+                renderer->set_texture_lod(mode == 1);
+            } else {
+                renderer->set_material_fast_paths(mode == 1);
+            }
+            renderer->set_shader_counters(counters);
+        }
+        if (frame == benchmark_warmup_frames) {
+            renderer->wait_idle();
+            if (counters) {
+                const auto stats = renderer->read_shader_counters();
+                renderer->set_shader_counters(false);
+                std::cout << get_benchmark_name() << " "
+                          << (mode == 1 ? "on" : "off") << ": "
+                          << stats.texture_fetches << " texture fetches for "
+                          << stats.hits << " hits ("
+                          << (stats.hits > 0
+                                  ? static_cast<double>(stats.texture_fetches) /
+                                        stats.hits
+                                  : 0.0)
+                          << " per hit)" << std::endl;
+            }
+            benchmark_start = utils::get_time();
+        }
+
+        update_projection();
+        renderer->render(frame_constants);
+        benchmark_frame++;
+
+        if (frame + 1 == frames_per_mode) {
+            renderer->wait_idle();
+            benchmark_ms[mode] =
+                (utils::get_time() - benchmark_start) * 1000.0 /
+                benchmark_frames;
+            std::cout << get_benchmark_name() << " "
+                      << (mode == 1 ? "on" : "off") << ": "
+                      << benchmark_ms[mode] << " ms/frame over "
+                      << benchmark_frames << " frames" << std::endl;
+            if (mode == 1) {
+                std::cout << get_benchmark_name() << " speedup: "
+                          << benchmark_ms[0] / benchmark_ms[1] << "x"
+                          << std::endl;
+                renderer->print_gpu_profile();
+                exit_function();
+            }
+        }
+    }
 
   public:
-    PathTracer(const std::filesystem::path scene_path)
+    PathTracer(const std::filesystem::path scene_path,
+               const PathTracerOptions &options = {})
         : input_system(&window_system, new KeyboardGLFW(&window_system),
                        new MouseGLFW(&window_system)),
-          last_mouse_position(0, 0) {
+          scene_path(scene_path), headless(options.headless),
+          last_mouse_position(0, 0), aperture(options.aperture),
+          benchmark(options.benchmark),
+          benchmark_frames(options.benchmark_frames),
+          benchmark_frame(0), benchmark_ms{0.0, 0.0},
+          gpu_trace_path(options.gpu_trace_path),
+          record_path(options.record_path),
+          replay_path(options.replay_path),
+          report_path(options.report_path), seed(options.seed),
+          replay_start_pixels(0), replay_pose{},
+          adaptive_settings(options.adaptive), adaptive_phase(0),
+          adaptive_phase_frames(0), adaptive_uniform_seconds(0.0),
+          adaptive_readback_seconds(0.0),
+          idle_mode(false), idle(false),
+          idle_seconds(options.idle_benchmark_seconds), idle_phase(0),
+          idle_frames(0), idle_busy_start(0.0), idle_busy_ms{0.0, 0.0},
+          denoise_phase(0), denoise_samples(1) {
         std::cout << "PathTracer created" << std::endl;
 
-        // Hard code the dimensions for now
-        const auto [width, height] = renderer->get_dimensions();
-        auto window = window_system.create_window(width, height);
-        window_system.set_title(window.value(), "Vulkan Path Tracer");
+        if (benchmark == Benchmark::camera_path) {
+            replay = CameraPath::load(replay_path);
+            if (replay.empty()) {
+                throw std::runtime_error("Camera path " +
+                                         replay_path.string() + " is empty");
+            }
+            if (benchmark_frames == 0) {
+                benchmark_frames = static_cast<unsigned int>(replay.size());
+            }
+            replay_ms.reserve(benchmark_frames);
+        }
 
-        renderer = std::make_unique<Renderer>(window.value(), &window_system, scene_path);
+        if (headless) {
+            renderer = std::make_unique<Renderer>(scene_path);
+        } else {
+            // Hard code the dimensions for now
+            const auto [width, height] = renderer->get_dimensions();
+            window = window_system.create_window(width, height).value();
+            window_system.set_title(window, "Vulkan Path Tracer");
+
+            renderer = std::make_unique<Renderer>(window, &window_system,
+                                                  scene_path);
+        }
+        renderer->set_texture_budget(options.texture_budget);
+        if (options.tiles.tile_size > 0) {
+            renderer->set_tile_settings(options.tiles);
+            std::cout << "Tracing " << renderer->get_tiles().size() << " "
+                      << options.tiles.tile_size << " px tiles in "
+                      << get_tile_order_name(options.tiles.order) << " order";
+            if (options.tiles.tiles_per_frame > 0) {
+                std::cout << ", " << options.tiles.tiles_per_frame
+                          << " per frame";
+            }
+            std::cout << ", " << renderer->get_tile_settings().submits
+                      << " submits per frame" << std::endl;
+        }
+        if (options.region.width > 0) {
+            set_region(options.region);
+        }
+        if (adaptive_settings.enabled &&
+            benchmark != Benchmark::adaptive_sampling) {
+            renderer->set_adaptive_sampling(adaptive_settings);
+            std::cout << "Adaptive sampling to a relative error of "
+                      << adaptive_settings.threshold << " after "
+                      << adaptive_settings.min_samples << " samples"
+                      << std::endl;
+        }
+        if (options.reprojection) {
+            renderer->set_reprojection(true);
+            std::cout << "Reprojecting samples on camera motion" << std::endl;
+        }
+        if (options.denoise.enabled || benchmark == Benchmark::denoiser) {
+            // The benchmark turns it on after its reference
+            DenoiseSettings denoise = options.denoise;
+            denoise.enabled = benchmark != Benchmark::denoiser;
+            renderer->set_denoiser(denoise);
+            if (denoise.enabled) {
+                std::cout << "Denoising with " << denoise.iterations
+                          << " a-trous passes" << std::endl;
+            }
+        }
+        ConvergenceTarget convergence = options.convergence;
+        if (benchmark == Benchmark::idle && convergence.samples == 0 &&
+            convergence.error <= 0.0f) {
+            convergence.samples = 64;
+        }
+        if (convergence.samples > 0 || convergence.error > 0.0f) {
+            renderer->set_convergence_target(convergence);
+            idle_mode = benchmark == Benchmark::none;
+        }
+
+        // Benchmarks only need it to focus
+        if (!headless || aperture > 0.0f) {
+            scene_query = std::make_unique<SceneQuery>(renderer->get_scene());
+            std::cout << "Scene query BVH built in "
+                      << scene_query->get_build_ms() << " ms" << std::endl;
+        }
 
         camera_position = {5.0f, 5.0f, 5.0f};
         glm::vec3 target = {0.0f, 0.0f, 0.0f};
@@ -52,8 +783,22 @@ class PathTracer : public App {
         input_system.create_key_action_binding("Right", input::Key::A, true);
         input_system.create_key_action_binding("ToggleAveraging", input::Key::F,
                                                false);
+        input_system.create_key_action_binding("ToggleTextureLod",
+                                               input::Key::L, false);
+        input_system.create_key_action_binding("ToggleReprojection",
+                                               input::Key::T, false);
+        input_system.create_key_action_binding("PrintGpuProfile",
+                                               input::Key::P, false);
+        input_system.create_key_action_binding("ToggleRegion", input::Key::R,
+                                               false);
+        input_system.create_key_action_binding("ReleaseCursor",
+                                               input::Key::LeftAlt, false);
+        input_system.create_mouse_button_action_binding(
+            "Pick", input::MouseButton::LeftMouse);
 
-        last_mouse_position = input_system.get_mouse_position();
+        if (!headless) {
+            last_mouse_position = input_system.get_mouse_position();
+        }
 
         // Compute initial pitch and yaw from camera direction
         pitch = glm::degrees(asin(camera_direction.z));
@@ -67,9 +812,22 @@ class PathTracer : public App {
         camera.set_direction(camera_direction);
         camera.set_up(up);
         camera.set_right(glm::normalize(glm::cross(camera_direction, up)));
+        camera.set_lens(aperture, camera.focus_distance);
+        update_projection();
+        autofocus();
     }
 
-    ~PathTracer() { std::cout << "PathTracer destroyed" << std::endl; }
+    ~PathTracer() {
+        if (!gpu_trace_path.empty()) {
+            renderer->write_gpu_trace(gpu_trace_path);
+        }
+        if (!record_path.empty()) {
+            recorded_path.save(record_path);
+            std::cout << "Recorded " << recorded_path.size()
+                      << " camera poses to " << record_path << std::endl;
+        }
+        std::cout << "PathTracer destroyed" << std::endl;
+    }
 
     void set_exit_function(std::function<void()> function) override {
         exit_function = function;
@@ -78,8 +836,56 @@ class PathTracer : public App {
     void fixed_update(const FrameConstants &frame_constants) override {}
 
     void render_update(const FrameConstants &frame_constants) override {
+        // Headless runs are always benchmarks and take no input
+        if (headless) {
+            benchmark_update(frame_constants);
+            return;
+        }
+
+        // A converged image stays on screen, sleep until there is input
+        // instead of tracing it again
+        if (idle_mode && renderer->is_converged()) {
+            if (!idle) {
+                idle = true;
+                std::cout << "Converged, idle until input" << std::endl;
+            }
+            window_system.wait_events();
+        }
 
         input_system.update();
+        if (benchmark != Benchmark::none) {
+            // Keep the start camera, only allow leaving early
+            if (input_system.get_button_state("Exit") ==
+                input::ButtonState::Pressed) {
+                exit_function();
+            }
+            benchmark_update(frame_constants);
+            return;
+        }
+
+        if (input_system.get_button_state("ToggleTextureLod") ==
+            input::ButtonState::Pressed) {
+            renderer->set_texture_lod(!renderer->get_texture_lod());
+            std::cout << "Texture LOD "
+                      << (renderer->get_texture_lod() ? "on" : "off")
+                      << std::endl;
+        }
+        if (input_system.get_button_state("ToggleReprojection") ==
+            input::ButtonState::Pressed) {
+            try {
+                renderer->set_reprojection(!renderer->get_reprojection());
+                std::cout << "Reprojection "
+                          << (renderer->get_reprojection() ? "on" : "off")
+                          << std::endl;
+            } catch (const std::runtime_error &error) {
+                std::cout << error.what() << std::endl;
+            }
+        }
+        if (input_system.get_button_state("PrintGpuProfile") ==
+            input::ButtonState::Pressed) {
+            renderer->print_gpu_profile();
+        }
+
         // Update camera
         auto &camera = renderer->get_camera();
         auto up = glm::vec3(0.0f, 1.0f, 0.0f);
@@ -91,10 +897,22 @@ class PathTracer : public App {
         last_mouse_position = mouse_position;
 
         // Sometimes jumps after first few frames
-        if (abs(delta_x) > 100.0f || abs(delta_y) > 100.0f) {
+        if (abs(delta_x) > 100.0f || abs(delta_y) > 100.0f ||
+            cursor_released || cursor_mode_changed) {
             delta_x = 0.0f;
             delta_y = 0.0f;
         }
+        cursor_mode_changed = false;
+
+        // Holding the release key frees the cursor for picking
+        const auto release = input_system.get_button_state("ReleaseCursor");
+        const bool released = release == input::ButtonState::Pressed ||
+                              release == input::ButtonState::Held;
+        if (released != cursor_released) {
+            window_system.set_cursor_captured(window, !released);
+            cursor_released = released;
+            cursor_mode_changed = true;
+        }
 
         yaw += delta_x * 0.1f;
         pitch -= delta_y * 0.1f;
@@ -135,31 +953,158 @@ class PathTracer : public App {
         camera.set_direction(camera_direction);
         camera.set_up(up);
         camera.set_right(new_right);
+        if (!record_path.empty()) {
+            recorded_path.add({camera_position, camera_direction});
+        }
 
-        camera.set_fov(110.0f);
-        camera.set_range(0.001f, 10000.0f);
+        update_projection();
+        if (input_system.get_button_state("Pick") ==
+            input::ButtonState::Pressed) {
+            // The captured cursor is not a pixel, the view points at the
+            // image center
+            const auto [width, height] = renderer->get_dimensions();
+            pick(cursor_released
+                     ? mouse_position
+                     : input::MousePosition(width / 2.0, height / 2.0));
+        }
+        if (input_system.get_button_state("ToggleRegion") ==
+            input::ButtonState::Pressed) {
+            toggle_region();
+        }
+        autofocus();
+
+        if (idle && renderer->is_converged()) {
+            return;
+        }
+        idle = false;
 
-        auto [r_width, r_height] = renderer->get_dimensions();
-        camera.aspect_ratio =
-            static_cast<float>(r_width) / static_cast<float>(r_height);
         // Render
         renderer->render(frame_constants);
+        print_streaming_stats();
     }
 };
 
 int main(int argc, char *argv[]) {
+    RT_PROFILE_THREAD("main");
 
     std::filesystem::path scene_path;
-    if (argc < 2) {
+    PathTracerOptions options;
+    std::filesystem::path cpu_trace_path = "cpu_trace.json";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--texture-lod-benchmark" ||
+            arg == "--material-benchmark") {
+            options.benchmark = arg == "--texture-lod-benchmark"
+                                    ? Benchmark::texture_lod
+                                    : Benchmark::material_fast_paths;
+            options.benchmark_frames = 256;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.benchmark_frames = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--adaptive-benchmark") {
+            options.benchmark = Benchmark::adaptive_sampling;
+            options.benchmark_frames = 256;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.benchmark_frames = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--idle-benchmark") {
+            options.benchmark = Benchmark::idle;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.idle_benchmark_seconds = std::stod(argv[++i]);
+            }
+        } else if (arg == "--denoise-benchmark") {
+            options.benchmark = Benchmark::denoiser;
+            options.benchmark_frames = 1024; // reference samples per pixel
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.benchmark_frames = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--replay" && i + 1 < argc) {
+            options.benchmark = Benchmark::camera_path;
+            options.replay_path = argv[++i];
+            options.benchmark_frames = 0;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.benchmark_frames = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--record-path" && i + 1 < argc) {
+            options.record_path = argv[++i];
+        } else if (arg == "--benchmark-json" && i + 1 < argc) {
+            options.report_path = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--aperture" && i + 1 < argc) {
+            options.aperture = std::stof(argv[++i]);
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            options.tiles.tile_size = std::stoi(argv[++i]);
+        } else if (arg == "--tile-order" && i + 1 < argc) {
+            options.tiles.order = parse_tile_order(argv[++i]);
+        } else if (arg == "--tile-budget" && i + 1 < argc) {
+            options.tiles.tiles_per_frame = std::stoi(argv[++i]);
+        } else if (arg == "--tile-submits" && i + 1 < argc) {
+            options.tiles.submits = std::stoi(argv[++i]);
+        } else if (arg == "--region" && i + 1 < argc) {
+            options.region = parse_region(argv[++i]);
+        } else if (arg == "--adaptive") {
+            options.adaptive.enabled = true;
+        } else if (arg == "--adaptive-threshold" && i + 1 < argc) {
+            options.adaptive.threshold = std::stof(argv[++i]);
+        } else if (arg == "--adaptive-min-samples" && i + 1 < argc) {
+            options.adaptive.min_samples = std::stoi(argv[++i]);
+        } else if (arg == "--reprojection") {
+            options.reprojection = true;
+        } else if (arg == "--denoise") {
+            options.denoise.enabled = true;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.denoise.iterations = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--idle-samples" && i + 1 < argc) {
+            options.convergence.samples = std::stoi(argv[++i]);
+        } else if (arg == "--idle-error" && i + 1 < argc) {
+            options.convergence.error = std::stof(argv[++i]);
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--texture-budget" && i + 1 < argc) {
+            // MiB
+            options.texture_budget = std::stoull(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--gpu-trace" && i + 1 < argc) {
+            options.gpu_trace_path = argv[++i];
+        } else if (arg == "--cpu-trace" && i + 1 < argc) {
+            // Only written when built with RT_RENDER_PROFILE
+            cpu_trace_path = argv[++i];
+        } else {
+            scene_path = arg;
+        }
+    }
+
+    if (options.benchmark_frames == 0 &&
+        options.benchmark != Benchmark::camera_path &&
+        options.benchmark != Benchmark::idle) {
+        options.benchmark = Benchmark::none;
+    }
+    if (options.headless && options.benchmark == Benchmark::none) {
+        std::cerr << "--headless needs a benchmark, e.g. --replay <path.txt>"
+                  << std::endl;
+        return 1;
+    }
+    // A frame without tiles is a single dispatch, there is nothing to budget
+    // or split
+    if (options.tiles.tile_size == 0 &&
+        (options.tiles.tiles_per_frame > 0 || options.tiles.submits > 1)) {
+        std::cerr << "--tile-budget and --tile-submits need "
+                     "--tile-size <pixels>"
+                  << std::endl;
+        return 1;
+    }
+
+    if (scene_path.empty()) {
         std::cout << "No scene path provided. Using default scene." << std::endl;
         scene_path = "glTF-Sample-Assets/Models/ABeautifulGame/glTF/ABeautifulGame.gltf";
     }
     else {
-        std::cout << "Using scene path: " << argv[1] << std::endl;
-        scene_path = argv[1];
+        std::cout << "Using scene path: " << scene_path << std::endl;
     }
 
-    PathTracer(scene_path).run();
+    PathTracer(scene_path, options).run();
+    RT_PROFILE_WRITE(cpu_trace_path);
 
     return 0;
 }
@@ -0,0 +1,415 @@
+#include <geometry/ray_kernels.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RAY_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RAY_KERNELS_AVX2 __attribute__((target("avx2")))
+#else
+#define RAY_KERNELS_AVX2
+#endif
+
+namespace {
+
+constexpr float miss = std::numeric_limits<float>::max();
+
+// Moller-Trumbore without culling, as with gl_RayFlagsOpaqueEXT
+template <int W>
+bool intersect_triangles_scalar(const TriangleBlock<W> &block,
+                                const KernelRay &ray, KernelHit &hit) {
+    bool found = false;
+    const glm::vec3 &d = ray.direction;
+    for (int lane = 0; lane < W; lane++) {
+        const glm::vec3 v0(block.v0[0][lane], block.v0[1][lane],
+                           block.v0[2][lane]);
+        const glm::vec3 edge1(block.edge1[0][lane], block.edge1[1][lane],
+                              block.edge1[2][lane]);
+        const glm::vec3 edge2(block.edge2[0][lane], block.edge2[1][lane],
+                              block.edge2[2][lane]);
+        const glm::vec3 p = glm::cross(d, edge2);
+        const float det = glm::dot(edge1, p);
+        if (det == 0.0f) {
+            continue;
+        }
+        const float inv_det = 1.0f / det;
+        const glm::vec3 s = ray.origin - v0;
+        const float u = glm::dot(s, p) * inv_det;
+        if (u < 0.0f || u > 1.0f) {
+            continue;
+        }
+        const glm::vec3 q = glm::cross(s, edge1);
+        const float v = glm::dot(d, q) * inv_det;
+        if (v < 0.0f || u + v > 1.0f) {
+            continue;
+        }
+        const float t = glm::dot(edge2, q) * inv_det;
+        if (t >= ray.tmin && t < hit.t) {
+            hit = {t, u, v, block.index[lane]};
+            found = true;
+        }
+    }
+    return found;
+}
+
+template <int W>
+uint32_t intersect_boxes_scalar(const BoxBlock<W> &block, const KernelRay &ray,
+                                float tmax, float *t) {
+    uint32_t mask = 0;
+    for (int lane = 0; lane < W; lane++) {
+        float t_near = ray.tmin;
+        float t_far = tmax;
+        for (int axis = 0; axis < 3; axis++) {
+            const float t0 = (block.min[axis][lane] - ray.origin[axis]) *
+                             ray.inv_direction[axis];
+            const float t1 = (block.max[axis][lane] - ray.origin[axis]) *
+                             ray.inv_direction[axis];
+            t_near = std::max(t_near, std::min(t0, t1));
+            t_far = std::min(t_far, std::max(t0, t1));
+        }
+        t[lane] = t_near <= t_far ? t_near : miss;
+        mask |= t_near <= t_far ? 1u << lane : 0u;
+    }
+    return mask;
+}
+
+#ifdef RAY_KERNELS_X86
+// 4 lanes at a time, blocks wider than 4 in several passes
+template <int W>
+bool intersect_triangles_sse(const TriangleBlock<W> &block,
+                             const KernelRay &ray, KernelHit &hit) {
+    const __m128 dx = _mm_set1_ps(ray.direction.x);
+    const __m128 dy = _mm_set1_ps(ray.direction.y);
+    const __m128 dz = _mm_set1_ps(ray.direction.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tmin = _mm_set1_ps(ray.tmin);
+    const __m128 none = _mm_set1_ps(miss);
+    bool found = false;
+    for (int base = 0; base < W; base += 4) {
+        const __m128 e1x = _mm_load_ps(&block.edge1[0][base]);
+        const __m128 e1y = _mm_load_ps(&block.edge1[1][base]);
+        const __m128 e1z = _mm_load_ps(&block.edge1[2][base]);
+        const __m128 e2x = _mm_load_ps(&block.edge2[0][base]);
+        const __m128 e2y = _mm_load_ps(&block.edge2[1][base]);
+        const __m128 e2z = _mm_load_ps(&block.edge2[2][base]);
+
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        const __m128 det = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+            _mm_mul_ps(e1z, pz));
+        const __m128 inv_det = _mm_div_ps(one, det);
+
+        const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x),
+                                      _mm_load_ps(&block.v0[0][base]));
+        const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y),
+                                      _mm_load_ps(&block.v0[1][base]));
+        const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z),
+                                      _mm_load_ps(&block.v0[2][base]));
+        const __m128 u = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                       _mm_mul_ps(sz, pz)),
+            inv_det);
+
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        const __m128 v = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                       _mm_mul_ps(dz, qz)),
+            inv_det);
+        const __m128 t = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                       _mm_mul_ps(e2z, qz)),
+            inv_det);
+
+        __m128 valid = _mm_cmpneq_ps(det, zero);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(t, tmin));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
+        if (_mm_movemask_ps(valid) == 0) {
+            continue;
+        }
+
+        // Lowest lane with the smallest t, as the scalar loop picks
+        const __m128 masked_t =
+            _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, none));
+        __m128 closest =
+            _mm_min_ps(masked_t, _mm_shuffle_ps(masked_t, masked_t,
+                                                _MM_SHUFFLE(2, 3, 0, 1)));
+        closest = _mm_min_ps(
+            closest, _mm_shuffle_ps(closest, closest, _MM_SHUFFLE(1, 0, 3, 2)));
+        const int lane = std::countr_zero(
+            static_cast<unsigned int>(_mm_movemask_ps(
+                _mm_and_ps(valid, _mm_cmpeq_ps(masked_t, closest)))));
+
+        alignas(16) float ts[4], us[4], vs[4];
+        _mm_store_ps(ts, t);
+        _mm_store_ps(us, u);
+        _mm_store_ps(vs, v);
+        hit = {ts[lane], us[lane], vs[lane], block.index[base + lane]};
+        found = true;
+    }
+    return found;
+}
+
+template <int W>
+uint32_t intersect_boxes_sse(const BoxBlock<W> &block, const KernelRay &ray,
+                             float tmax, float *t) {
+    const __m128 origin[3] = {_mm_set1_ps(ray.origin.x),
+                              _mm_set1_ps(ray.origin.y),
+                              _mm_set1_ps(ray.origin.z)};
+    const __m128 inv_direction[3] = {_mm_set1_ps(ray.inv_direction.x),
+                                     _mm_set1_ps(ray.inv_direction.y),
+                                     _mm_set1_ps(ray.inv_direction.z)};
+    uint32_t mask = 0;
+    for (int base = 0; base < W; base += 4) {
+        __m128 t_near = _mm_set1_ps(ray.tmin);
+        __m128 t_far = _mm_set1_ps(tmax);
+        for (int axis = 0; axis < 3; axis++) {
+            const __m128 t0 = _mm_mul_ps(
+                _mm_sub_ps(_mm_load_ps(&block.min[axis][base]), origin[axis]),
+                inv_direction[axis]);
+            const __m128 t1 = _mm_mul_ps(
+                _mm_sub_ps(_mm_load_ps(&block.max[axis][base]), origin[axis]),
+                inv_direction[axis]);
+            t_near = _mm_max_ps(t_near, _mm_min_ps(t0, t1));
+            t_far = _mm_min_ps(t_far, _mm_max_ps(t0, t1));
+        }
+        const __m128 overlap = _mm_cmple_ps(t_near, t_far);
+        _mm_storeu_ps(t + base,
+                      _mm_or_ps(_mm_and_ps(overlap, t_near),
+                                _mm_andnot_ps(overlap, _mm_set1_ps(miss))));
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(overlap)) << base;
+    }
+    return mask;
+}
+
+RAY_KERNELS_AVX2
+bool intersect_triangles8_avx2(const TriangleBlock<8> &block,
+                               const KernelRay &ray, KernelHit &hit) {
+    const __m256 dx = _mm256_set1_ps(ray.direction.x);
+    const __m256 dy = _mm256_set1_ps(ray.direction.y);
+    const __m256 dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    const __m256 e1x = _mm256_load_ps(block.edge1[0]);
+    const __m256 e1y = _mm256_load_ps(block.edge1[1]);
+    const __m256 e1z = _mm256_load_ps(block.edge1[2]);
+    const __m256 e2x = _mm256_load_ps(block.edge2[0]);
+    const __m256 e2y = _mm256_load_ps(block.edge2[1]);
+    const __m256 e2z = _mm256_load_ps(block.edge2[2]);
+
+    const __m256 px =
+        _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    const __m256 py =
+        _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    const __m256 pz =
+        _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    const __m256 det = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+        _mm256_mul_ps(e1z, pz));
+    const __m256 inv_det = _mm256_div_ps(one, det);
+
+    const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x),
+                                    _mm256_load_ps(block.v0[0]));
+    const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y),
+                                    _mm256_load_ps(block.v0[1]));
+    const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z),
+                                    _mm256_load_ps(block.v0[2]));
+    const __m256 u = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px),
+                                    _mm256_mul_ps(sy, py)),
+                      _mm256_mul_ps(sz, pz)),
+        inv_det);
+
+    const __m256 qx =
+        _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    const __m256 qy =
+        _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    const __m256 qz =
+        _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    const __m256 v = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx),
+                                    _mm256_mul_ps(dy, qy)),
+                      _mm256_mul_ps(dz, qz)),
+        inv_det);
+    const __m256 t = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx),
+                                    _mm256_mul_ps(e2y, qy)),
+                      _mm256_mul_ps(e2z, qz)),
+        inv_det);
+
+    __m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(t, _mm256_set1_ps(ray.tmin), _CMP_GE_OQ));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(t, _mm256_set1_ps(hit.t), _CMP_LT_OQ));
+    if (_mm256_movemask_ps(valid) == 0) {
+        return false;
+    }
+
+    const __m256 masked_t = _mm256_blendv_ps(_mm256_set1_ps(miss), t, valid);
+    __m256 closest = _mm256_min_ps(
+        masked_t, _mm256_permute2f128_ps(masked_t, masked_t, 0x01));
+    closest = _mm256_min_ps(
+        closest, _mm256_shuffle_ps(closest, closest, _MM_SHUFFLE(1, 0, 3, 2)));
+    closest = _mm256_min_ps(
+        closest, _mm256_shuffle_ps(closest, closest, _MM_SHUFFLE(2, 3, 0, 1)));
+    const int lane = std::countr_zero(static_cast<unsigned int>(
+        _mm256_movemask_ps(_mm256_and_ps(
+            valid, _mm256_cmp_ps(masked_t, closest, _CMP_EQ_OQ)))));
+
+    alignas(32) float ts[8], us[8], vs[8];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(us, u);
+    _mm256_store_ps(vs, v);
+    hit = {ts[lane], us[lane], vs[lane], block.index[lane]};
+    return true;
+}
+
+RAY_KERNELS_AVX2
+uint32_t intersect_boxes8_avx2(const BoxBlock<8> &block, const KernelRay &ray,
+                               float tmax, float *t) {
+    __m256 t_near = _mm256_set1_ps(ray.tmin);
+    __m256 t_far = _mm256_set1_ps(tmax);
+    for (int axis = 0; axis < 3; axis++) {
+        const __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+        const __m256 inv_direction = _mm256_set1_ps(ray.inv_direction[axis]);
+        const __m256 t0 = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_load_ps(block.min[axis]), origin),
+            inv_direction);
+        const __m256 t1 = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_load_ps(block.max[axis]), origin),
+            inv_direction);
+        t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+        t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+    }
+    const __m256 overlap = _mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ);
+    _mm256_storeu_ps(t,
+                     _mm256_blendv_ps(_mm256_set1_ps(miss), t_near, overlap));
+    return static_cast<uint32_t>(_mm256_movemask_ps(overlap));
+}
+
+bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    // The OS saves the upper halves of the ymm registers
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+const RayKernels scalar_kernels = {
+    SimdLevel::scalar, intersect_triangles_scalar<4>,
+    intersect_triangles_scalar<8>, intersect_boxes_scalar<4>,
+    intersect_boxes_scalar<8>};
+
+#ifdef RAY_KERNELS_X86
+const RayKernels sse_kernels = {SimdLevel::sse, intersect_triangles_sse<4>,
+                                intersect_triangles_sse<8>,
+                                intersect_boxes_sse<4>, intersect_boxes_sse<8>};
+
+const RayKernels avx2_kernels = {
+    SimdLevel::avx2, intersect_triangles_sse<4>, intersect_triangles8_avx2,
+    intersect_boxes_sse<4>, intersect_boxes8_avx2};
+#endif
+
+} // namespace
+
+template <int W>
+std::vector<TriangleBlock<W>> make_triangle_blocks(const Primitive &primitive) {
+    const auto &indices = primitive.indices;
+    const auto &vertices = primitive.vertices;
+    const size_t count = indices.size() / 3;
+    std::vector<TriangleBlock<W>> blocks((count + W - 1) / W);
+    for (size_t i = 0; i < count; i++) {
+        blocks[i / W].set(static_cast<int>(i % W),
+                          vertices[indices[i * 3]].position,
+                          vertices[indices[i * 3 + 1]].position,
+                          vertices[indices[i * 3 + 2]].position,
+                          static_cast<uint32_t>(i));
+    }
+    return blocks;
+}
+
+template std::vector<TriangleBlock<4>>
+make_triangle_blocks<4>(const Primitive &primitive);
+template std::vector<TriangleBlock<8>>
+make_triangle_blocks<8>(const Primitive &primitive);
+
+const char *get_simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::sse:
+        return "sse";
+    case SimdLevel::avx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+SimdLevel get_simd_level() {
+#ifdef RAY_KERNELS_X86
+    static const SimdLevel level =
+        cpu_has_avx2() ? SimdLevel::avx2 : SimdLevel::sse;
+    return level;
+#else
+    return SimdLevel::scalar;
+#endif
+}
+
+bool is_simd_level_supported(SimdLevel level) {
+    return static_cast<int>(level) <= static_cast<int>(get_simd_level());
+}
+
+const RayKernels &get_ray_kernels(SimdLevel level) {
+    if (!is_simd_level_supported(level)) {
+        throw std::runtime_error(std::string("SIMD level not supported: ") +
+                                 get_simd_level_name(level));
+    }
+#ifdef RAY_KERNELS_X86
+    if (level == SimdLevel::avx2) {
+        return avx2_kernels;
+    }
+    if (level == SimdLevel::sse) {
+        return sse_kernels;
+    }
+#endif
+    return scalar_kernels;
+}
+
+const RayKernels &get_ray_kernels() {
+    static const RayKernels &kernels = get_ray_kernels(get_simd_level());
+    return kernels;
+}
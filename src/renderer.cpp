@@ -1,4 +1,5 @@
 #include <renderer/renderer.hpp>
+#include <utils/timing.hpp>
 
 static vk::TransformMatrixKHR from_mat4(const glm::mat4 &mat) {
     // glm::mat4 should be column major but vk::TransformMatrixKHR appears to be
@@ -97,6 +98,7 @@ void Renderer::create_mesh_buffer(TopLevelAccelerationStructure *tlas,
 
 void Renderer::create_BLAS(TopLevelAccelerationStructure *tlas,
                            const MeshBuffer *mesh) {
+    RT_PROFILE_FUNCTION();
     vk::BufferUsageFlags usage;
 
     vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
@@ -167,7 +169,13 @@ void Renderer::create_BLAS(TopLevelAccelerationStructure *tlas,
     cmd_buffer.begin(vk::CommandBufferBeginInfo(
         vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
-    cmd_buffer.buildAccelerationStructuresKHR(scratch_info, range_infos, dl);
+    profiler->begin_frame(profiler->get_load_slot(profiler_blas_slot),
+                          cmd_buffer);
+    {
+        GpuScope scope(*profiler, cmd_buffer, "BLAS build");
+        cmd_buffer.buildAccelerationStructuresKHR(scratch_info, range_infos,
+                                                  dl);
+    }
     cmd_buffer.end();
 
     auto q = device.getQueue(graphics_queue_family_index, 0);
@@ -189,6 +197,7 @@ void Renderer::create_BLAS(TopLevelAccelerationStructure *tlas,
 }
 
 void Renderer::create_TLAS(TopLevelAccelerationStructure *tlas) {
+    RT_PROFILE_FUNCTION();
     vk::BufferUsageFlags usage;
 
     std::vector<vk::AccelerationStructureInstanceKHR> instances;
@@ -289,7 +298,13 @@ void Renderer::create_TLAS(TopLevelAccelerationStructure *tlas) {
             .front();
     cmd_buffer.begin(vk::CommandBufferBeginInfo(
         vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-    cmd_buffer.buildAccelerationStructuresKHR(scratch_info, range_infos, dl);
+    profiler->begin_frame(profiler->get_load_slot(profiler_tlas_slot),
+                          cmd_buffer);
+    {
+        GpuScope scope(*profiler, cmd_buffer, "TLAS build");
+        cmd_buffer.buildAccelerationStructuresKHR(scratch_info, range_infos,
+                                                  dl);
+    }
     cmd_buffer.end();
 
     auto q = device.getQueue(graphics_queue_family_index, 0);
@@ -308,7 +323,12 @@ void Renderer::create_TLAS(TopLevelAccelerationStructure *tlas) {
 }
 
 void Renderer::load_scene(std::string file_path) {
+    RT_PROFILE_FUNCTION();
+    const auto load_start = std::chrono::steady_clock::now();
+    load_stats = {};
+    auto start = load_start;
     scene = std::make_unique<Scene>(file_path);
+    load_stats.scene_ms = ms_since(start);
 
     tlas = std::make_unique<TopLevelAccelerationStructure>(
         device, allocator, dl, general_command_pool,
@@ -320,7 +340,9 @@ void Renderer::load_scene(std::string file_path) {
         for (auto &primitive : object.mesh->primitives) {
             auto it = meshes.find(&primitive);
             if (it == meshes.end()) {
+                start = std::chrono::steady_clock::now();
                 create_mesh_buffer(tlas.get(), &primitive);
+                load_stats.buffer_ms += ms_since(start);
                 it = meshes.find(&primitive);
                 if (it == meshes.end()) {
                     throw std::runtime_error("Failed to create mesh buffer");
@@ -341,7 +363,9 @@ void Renderer::load_scene(std::string file_path) {
                         std::max(0, primitive.material_index)),
                 };
 
+                start = std::chrono::steady_clock::now();
                 create_BLAS(tlas.get(), &it->second);
+                load_stats.blas_ms += ms_since(start);
             }
 
             tlas->instance_buffers.emplace_back(
@@ -352,6 +376,7 @@ void Renderer::load_scene(std::string file_path) {
     }
 
     // Create instance data buffer
+    start = std::chrono::steady_clock::now();
     auto [instance_data_buffer, instance_data_allocation] =
         create_device_buffer_with_data(
             tlas->instance_data.data(),
@@ -369,14 +394,25 @@ void Renderer::load_scene(std::string file_path) {
                 vk::BufferUsageFlagBits::eShaderDeviceAddress);
     tlas->mesh_data_buffer = mesh_data_buffer;
     tlas->mesh_data_allocation = mesh_data_allocation;
+    load_stats.buffer_ms += ms_since(start);
 
+    start = std::chrono::steady_clock::now();
     create_TLAS(tlas.get());
+    load_stats.tlas_ms = ms_since(start);
 
     // Upload texture data
+    start = std::chrono::steady_clock::now();
     create_textures();
+    device.waitIdle();
+    load_stats.texture_ms = ms_since(start);
+    load_stats.total_ms = ms_since(load_start);
+
+    profiler->resolve_all();
+    profiler->print_stats();
 }
 
 void Renderer::create_sbt() {
+    RT_PROFILE_FUNCTION();
     vk::PhysicalDeviceProperties2 properties;
     vk::PhysicalDeviceRayTracingPipelinePropertiesKHR rt_properties;
 
@@ -0,0 +1,234 @@
+// Bakes the textures of a glTF scene to block compressed, mipmapped KTX2
+// files. The renderer loads them from <scene>.gltf.baked instead of the source
+// images when the directory exists.
+#include <geometry/bc_encoder.hpp>
+#include <geometry/geometry.hpp>
+#include <geometry/ktx2.hpp>
+#include <utils/srgb.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+uint8_t to_unorm8(float c) {
+    return static_cast<uint8_t>(std::lround(std::clamp(c, 0.0f, 1.0f) * 255.0f));
+}
+
+// Halves an RGBA8 image with a 2x2 box filter. Color is averaged in linear
+// space for sRGB formats and normals are renormalized.
+std::vector<uint8_t> downsample(const std::vector<uint8_t> &rgba, uint32_t width,
+                                uint32_t height, PixelFormat format,
+                                bool normal_map) {
+    const uint32_t out_width = std::max(width / 2, 1u);
+    const uint32_t out_height = std::max(height / 2, 1u);
+    const bool srgb = format == PixelFormat::bc7_srgb;
+    const auto &to_linear = srgb_to_linear_table();
+
+    std::vector<uint8_t> out(static_cast<size_t>(out_width) * out_height * 4);
+    for (uint32_t y = 0; y < out_height; y++) {
+        for (uint32_t x = 0; x < out_width; x++) {
+            float sum[4] = {0, 0, 0, 0};
+            for (uint32_t dy = 0; dy < 2; dy++) {
+                for (uint32_t dx = 0; dx < 2; dx++) {
+                    const uint32_t sx = std::min(x * 2 + dx, width - 1);
+                    const uint32_t sy = std::min(y * 2 + dy, height - 1);
+                    const uint8_t *texel =
+                        &rgba[(static_cast<size_t>(sy) * width + sx) * 4];
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += (srgb && c < 3) ? to_linear[texel[c]]
+                                  : normal_map && c < 3
+                                      ? texel[c] / 127.5f - 1.0f
+                                      : texel[c] / 255.0f;
+                    }
+                }
+            }
+            for (float &c : sum) {
+                c *= 0.25f;
+            }
+
+            uint8_t *texel = &out[(static_cast<size_t>(y) * out_width + x) * 4];
+            if (normal_map) {
+                float length = std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] +
+                                         sum[2] * sum[2]);
+                if (length < 1e-6f) {
+                    sum[0] = sum[1] = 0.0f;
+                    sum[2] = length = 1.0f;
+                }
+                for (int c = 0; c < 3; c++) {
+                    texel[c] = to_unorm8(sum[c] / length * 0.5f + 0.5f);
+                }
+            } else {
+                for (int c = 0; c < 3; c++) {
+                    texel[c] = srgb ? linear_to_srgb(sum[c]) : to_unorm8(sum[c]);
+                }
+            }
+            texel[3] = to_unorm8(sum[3]);
+        }
+    }
+    return out;
+}
+
+PixelFormat get_bake_format(ColorSpace color_space) {
+    switch (color_space) {
+    case ColorSpace::normal:
+        return PixelFormat::bc5_unorm;
+    case ColorSpace::srgb:
+        return PixelFormat::bc7_srgb;
+    default:
+        return PixelFormat::bc7_unorm;
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: rt_bake <scene.gltf> [threads]" << std::endl;
+        return 1;
+    }
+    const std::string scene_path = argv[1];
+    unsigned int threads = argc > 2 ? std::stoi(argv[2]) : 0;
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // Bake from the source images, not a previous bake
+    Scene scene(scene_path, threads, false);
+    auto &registry = scene.get_textures();
+    ThreadPool pool(threads);
+
+    const auto directory = TextureRegistry::baked_directory(scene_path);
+    std::filesystem::create_directories(directory);
+
+    // One bake per glTF image and color space it is used in
+    std::vector<size_t> bake_textures;
+    std::set<std::pair<int32_t, ColorSpace>> seen;
+    for (size_t i = 0; i < registry.size(); i++) {
+        if (seen.insert({registry[i].image, registry[i].color_space}).second) {
+            bake_textures.push_back(i);
+        }
+    }
+
+    // Decodes run one image ahead of the encoder, so only two decoded
+    // images are held at a time
+    auto submit_decode = [&](size_t n) -> DecodedImage {
+        if (n >= bake_textures.size()) {
+            return {};
+        }
+        try {
+            return registry.decode(bake_textures[n]);
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping texture " << bake_textures[n] << ": "
+                      << e.what() << std::endl;
+            return {};
+        }
+    };
+    DecodedImage next = submit_decode(0);
+
+    std::ofstream manifest(directory / TextureRegistry::baked_manifest);
+    manifest << "# glTF image, color space, source image bytes, KTX2 file"
+             << std::endl;
+
+    using clock = std::chrono::steady_clock;
+    clock::duration encode_time{};
+    size_t encoded_pixels = 0;
+    size_t source_bytes = 0;
+    size_t rgba_bytes = 0;
+    size_t baked_bytes = 0;
+    size_t baked_count = 0;
+
+    for (size_t n = 0; n < bake_textures.size(); n++) {
+        DecodedImage decoded = std::move(next);
+        next = submit_decode(n + 1);
+        if (!decoded.valid()) {
+            continue;
+        }
+        auto &texture = registry[bake_textures[n]];
+        std::shared_ptr<TextureMap> map;
+        try {
+            map = decoded.get();
+            decoded = {};
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping texture " << bake_textures[n] << ": "
+                      << e.what() << std::endl;
+            continue;
+        }
+
+        const PixelFormat format = get_bake_format(texture.color_space);
+        const bool normal_map = texture.color_space == ColorSpace::normal;
+        uint32_t width = map->width();
+        uint32_t height = map->height();
+        const uint32_t base_width = width;
+        const uint32_t base_height = height;
+        std::vector<uint8_t> rgba(map->data(),
+                                  map->data() + static_cast<size_t>(width) *
+                                                    height * 4);
+        map.reset();
+
+        std::vector<std::vector<uint8_t>> levels;
+        while (true) {
+            levels.emplace_back(get_level_size(format, width, height));
+            auto start = clock::now();
+            encode_bc_image(rgba.data(), width, height, format,
+                            levels.back().data(), pool);
+            encode_time += clock::now() - start;
+            encoded_pixels += static_cast<size_t>(width) * height;
+            rgba_bytes += static_cast<size_t>(width) * height * 4;
+            baked_bytes += levels.back().size();
+
+            if (width == 1 && height == 1) {
+                break;
+            }
+            rgba = downsample(rgba, width, height, format, normal_map);
+            width = std::max(width / 2, 1u);
+            height = std::max(height / 2, 1u);
+        }
+
+        const std::string file_name =
+            "image_" + std::to_string(texture.image) + "_" +
+            get_color_space_name(texture.color_space) + ".ktx2";
+        std::string error;
+        if (!write_ktx2(directory / file_name, format, base_width, base_height,
+                        levels, error)) {
+            std::cerr << "Failed to bake texture " << bake_textures[n] << ": "
+                      << error << std::endl;
+            continue;
+        }
+        manifest << texture.image << " "
+                 << get_color_space_name(texture.color_space) << " "
+                 << texture.encoded->bytes.size() << " " << file_name
+                 << std::endl;
+        source_bytes += texture.encoded->bytes.size();
+        baked_count++;
+    }
+
+    const double seconds = std::chrono::duration<double>(encode_time).count();
+    const double mib = 1024.0 * 1024.0;
+    std::cout << "Baked " << baked_count << " textures to " << directory
+              << std::endl;
+    if (seconds > 0.0) {
+        std::cout << "Encoded " << encoded_pixels / 1e6 << " MP in " << seconds
+                  << " s on " << threads << " threads: "
+                  << encoded_pixels / 1e6 / seconds / threads
+                  << " MP/s per core" << std::endl;
+    }
+    if (baked_bytes > 0) {
+        std::cout << "Source images " << source_bytes / mib << " MiB, RGBA8 "
+                  << rgba_bytes / mib << " MiB, baked " << baked_bytes / mib
+                  << " MiB (" << static_cast<double>(source_bytes) / baked_bytes
+                  << "x vs source, "
+                  << static_cast<double>(rgba_bytes) / baked_bytes
+                  << "x vs RGBA8 with mips)" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Builds the host BVH of every glTF file under a directory and reports build
+// times on one and on all threads, and the SAH cost of the trees against a
+// median split.
+#include <geometry/geometry.hpp>
+#include <geometry/scene_bvh.hpp>
+#include <utils/json.hpp>
+#include <utils/timing.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+struct BvhResult {
+    std::string asset;
+    std::string error; // empty if the asset loaded
+    size_t triangles = 0; // in distinct primitives
+    size_t meshes = 0;
+    size_t instances = 0;
+    size_t nodes = 0;
+    double single_ms = 0.0;   // best SAH build on one thread
+    double parallel_ms = 0.0; // best SAH build on all threads
+    double top_ms = 0.0;
+    double mesh_sah = 0.0; // triangle-weighted over the mesh BVHs
+    double median_mesh_sah = 0.0;
+    double top_sah = 0.0;
+};
+
+// Mean SAH cost of the mesh BVHs, weighted by their triangles
+double get_mesh_sah(const SceneBvh &bvh) {
+    double cost = 0.0;
+    size_t triangles = 0;
+    for (size_t i = 0; i < bvh.num_meshes(); i++) {
+        const auto &mesh = bvh.get_mesh(i);
+        cost += mesh.get_bvh().sah_cost() * mesh.size();
+        triangles += mesh.size();
+    }
+    return triangles > 0 ? cost / triangles : 0.0;
+}
+
+// Best of repeat builds, keeping the last tree
+double time_build(Scene &scene, ThreadPool &pool, BvhSplit split,
+                  unsigned int repeat, std::unique_ptr<SceneBvh> &bvh) {
+    double best = 0.0;
+    for (unsigned int i = 0; i < repeat; i++) {
+        bvh.reset();
+        const auto start = clock::now();
+        bvh = std::make_unique<SceneBvh>(scene, pool, split);
+        const double ms = ms_since(start);
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+BvhResult benchmark_asset(const std::filesystem::path &asset,
+                          unsigned int threads, unsigned int repeat) {
+    BvhResult result;
+    result.asset = asset.generic_string();
+    try {
+        Scene scene(asset.string(), threads, false);
+        if (scene.empty()) {
+            throw std::runtime_error("no geometry loaded");
+        }
+
+        std::unique_ptr<SceneBvh> bvh;
+        {
+            ThreadPool pool(1);
+            result.single_ms =
+                time_build(scene, pool, BvhSplit::sah, repeat, bvh);
+        }
+        ThreadPool pool(threads);
+        result.parallel_ms =
+            time_build(scene, pool, BvhSplit::sah, repeat, bvh);
+        result.top_ms = bvh->get_stats().top_ms;
+        result.meshes = bvh->num_meshes();
+        result.instances = bvh->num_instances();
+        result.nodes = bvh->get_top().nodes.size();
+        for (size_t i = 0; i < bvh->num_meshes(); i++) {
+            result.triangles += bvh->get_mesh(i).size();
+            result.nodes += bvh->get_mesh(i).get_bvh().nodes.size();
+        }
+        result.mesh_sah = get_mesh_sah(*bvh);
+        result.top_sah = bvh->get_top().sah_cost();
+
+        bvh = std::make_unique<SceneBvh>(scene, pool, BvhSplit::median);
+        result.median_mesh_sah = get_mesh_sah(*bvh);
+    } catch (const std::exception &e) {
+        result.error = e.what();
+        std::replace(result.error.begin(), result.error.end(), '\n', ' ');
+    }
+    return result;
+}
+
+void write_json(const std::filesystem::path &path,
+                const std::vector<BvhResult> &results, unsigned int threads) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path.string());
+    }
+    out << std::fixed << std::setprecision(3);
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &result = results[i];
+        out << "  {\"asset\": " << json_string(result.asset)
+            << ", \"status\": "
+            << (result.error.empty() ? "\"pass\"" : "\"fail\"");
+        if (!result.error.empty()) {
+            out << ", \"error\": " << json_string(result.error);
+        } else {
+            out << ", \"threads\": " << threads
+                << ", \"triangles\": " << result.triangles
+                << ", \"meshes\": " << result.meshes
+                << ", \"instances\": " << result.instances
+                << ", \"nodes\": " << result.nodes
+                << ", \"build_1_thread_ms\": " << result.single_ms
+                << ", \"build_ms\": " << result.parallel_ms
+                << ", \"top_ms\": " << result.top_ms
+                << ", \"mesh_sah_cost\": " << result.mesh_sah
+                << ", \"median_mesh_sah_cost\": " << result.median_mesh_sah
+                << ", \"top_sah_cost\": " << result.top_sah;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+void print_table(const std::vector<BvhResult> &results, unsigned int threads) {
+    const std::string parallel = std::to_string(threads) + "T ms";
+    std::cout << std::left << std::setw(40) << "asset" << std::right
+              << std::setw(11) << "triangles" << std::setw(10) << "instances"
+              << std::setw(10) << "1T ms" << std::setw(10) << parallel
+              << std::setw(9) << "speedup" << std::setw(10) << "SAH"
+              << std::setw(11) << "median SAH" << std::setw(10) << "top SAH"
+              << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (const auto &result : results) {
+        std::string asset =
+            std::filesystem::path(result.asset).filename().string();
+        if (asset.size() > 38) {
+            asset = asset.substr(0, 35) + "...";
+        }
+        std::cout << std::left << std::setw(40) << asset << std::right;
+        if (!result.error.empty()) {
+            std::cout << "  failed: " << result.error << std::endl;
+            continue;
+        }
+        std::cout << std::setw(11) << result.triangles << std::setw(10)
+                  << result.instances << std::setw(10) << result.single_ms
+                  << std::setw(10) << result.parallel_ms << std::setw(9)
+                  << (result.parallel_ms > 0.0
+                          ? result.single_ms / result.parallel_ms
+                          : 0.0)
+                  << std::setw(10) << result.mesh_sah << std::setw(11)
+                  << result.median_mesh_sah << std::setw(10) << result.top_sah
+                  << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::filesystem::path input;
+    std::filesystem::path json_path = "bvh_benchmark.json";
+    unsigned int threads = 0;
+    unsigned int repeat = 3;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::stoi(argv[++i]);
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::max(1, std::stoi(argv[++i]));
+        } else {
+            input = arg;
+        }
+    }
+
+    if (input.empty()) {
+        std::cerr << "Usage: rt_bvh_benchmark <assets directory | scene.gltf> "
+                     "[--json <file>] [--threads <n>] [--repeat <n>]"
+                  << std::endl;
+        return 1;
+    }
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // Skip the KTX2 files rt_bake writes next to the assets
+    std::vector<std::filesystem::path> assets;
+    if (std::filesystem::is_directory(input)) {
+        for (const auto &entry :
+             std::filesystem::recursive_directory_iterator(input)) {
+            if (entry.is_regular_file() &&
+                entry.path().extension() == ".gltf" &&
+                entry.path().string().find(".baked") == std::string::npos) {
+                assets.push_back(entry.path());
+            }
+        }
+        std::sort(assets.begin(), assets.end());
+    } else {
+        assets.push_back(input);
+    }
+    if (assets.empty()) {
+        std::cerr << "No .gltf files found in " << input << std::endl;
+        return 1;
+    }
+
+    std::vector<BvhResult> results;
+    for (const auto &asset : assets) {
+        std::cout << "[" << results.size() + 1 << "/" << assets.size() << "] "
+                  << asset.generic_string() << std::endl;
+        results.push_back(benchmark_asset(asset, threads, repeat));
+    }
+
+    std::cout << std::endl;
+    print_table(results, threads);
+    write_json(json_path, results, threads);
+    std::cout << "Wrote " << json_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Renders a glTF scene with CpuTracer, the CPU port of the ray tracing
+// shaders. Gives reference images to compare the GPU against and renders on
+// machines without a ray tracing GPU.
+#include <geometry/cpu_tracer.hpp>
+#include <geometry/geometry.hpp>
+#include <renderer/camera.hpp>
+#include <renderer/camera_path.hpp>
+
+#include <stb_image_write.h>
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// The renderer's camera for a pose, see PathTracer::set_camera_pose
+RTCamera make_camera(const CameraPose &pose, uint32_t width, uint32_t height) {
+    const glm::vec3 up = {0.0f, 1.0f, 0.0f};
+    RTCamera camera;
+    camera.set_position(pose.position);
+    camera.set_direction(pose.direction);
+    camera.set_up(up);
+    camera.set_right(glm::normalize(glm::cross(pose.direction, up)));
+    camera.set_fov(110.0f);
+    camera.set_range(0.001f, 10000.0f);
+    camera.set_aspect_ratio(static_cast<float>(width) /
+                            static_cast<float>(height));
+    return camera;
+}
+
+// One row of the scaling table, speedup is against the single thread run
+void print_stats(const CpuRenderStats &stats, const CpuRenderStats &single) {
+    const double per_second = stats.samples_per_second();
+    const double speedup =
+        stats.ms > 0.0 && single.ms > 0.0 ? single.ms / stats.ms : 0.0;
+    std::cout << std::setw(8) << stats.threads << std::setw(12) << stats.ms
+              << std::setw(14) << per_second / 1e3 << std::setw(14)
+              << per_second / stats.threads / 1e3 << std::setw(12)
+              << stats.rays / (stats.ms / 1e3) / 1e6 << std::setw(10)
+              << speedup << std::setw(14) << speedup / stats.threads * 100.0
+              << std::setw(8) << stats.steals << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::filesystem::path scene_path;
+    std::filesystem::path output_path = "cpu_reference.png";
+    std::filesystem::path camera_path;
+    size_t pose_index = 0;
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t samples = 16;
+    uint32_t seed = 1;
+    unsigned int threads = 0;
+    bool scaling = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--samples" && i + 1 < argc) {
+            samples = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::stoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--size" && i + 2 < argc) {
+            width = static_cast<uint32_t>(std::stoul(argv[++i]));
+            height = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--camera-path" && i + 1 < argc) {
+            camera_path = argv[++i];
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                pose_index = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--scaling") {
+            scaling = true;
+        } else {
+            scene_path = arg;
+        }
+    }
+
+    if (scene_path.empty() || width == 0 || height == 0) {
+        std::cerr << "Usage: rt_cpu <scene.gltf> [--samples <n>] [--threads "
+                     "<n>] [--seed <n>] [--size <width> <height>] "
+                     "[--camera-path <path.txt> [pose]] [--output <file.png>] "
+                     "[--scaling]"
+                  << std::endl;
+        return 1;
+    }
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // The renderer's start camera, or a pose recorded with --record-path
+    CameraPose pose{{5.0f, 5.0f, 5.0f},
+                    glm::normalize(glm::vec3(0.0f) -
+                                   glm::vec3(5.0f, 5.0f, 5.0f))};
+    if (!camera_path.empty()) {
+        const auto path = CameraPath::load(camera_path);
+        if (pose_index >= path.size()) {
+            std::cerr << camera_path << " has " << path.size() << " poses"
+                      << std::endl;
+            return 1;
+        }
+        pose = path[pose_index];
+    }
+    const RTCamera camera = make_camera(pose, width, height);
+
+    // Baked KTX2 textures are block compressed and cannot be decoded here
+    Scene scene(scene_path.string(), threads, false);
+    CpuTracer tracer(scene);
+
+    std::cout << "Rendering " << width << "x" << height << " at " << samples
+              << " samples per pixel in " << CpuTracer::tile_size << "x"
+              << CpuTracer::tile_size << " tiles" << std::endl;
+    std::vector<uint8_t> rgba;
+    std::cout << std::fixed << std::setprecision(2);
+    if (!scaling) {
+        const auto stats =
+            tracer.render(camera, width, height, samples, seed, threads, rgba);
+        const double per_second = stats.samples_per_second();
+        std::cout << "Rendered in " << stats.ms << " ms on " << stats.threads
+                  << " threads: " << per_second / 1e3 << " ksamples/s, "
+                  << per_second / stats.threads / 1e3
+                  << " ksamples/s per core, "
+                  << stats.rays / (stats.ms / 1e3) / 1e6 << " Mrays/s, "
+                  << stats.steals << " of " << stats.tiles
+                  << " tiles stolen" << std::endl;
+    } else {
+        // Powers of two, then all threads. The last run's image is written.
+        std::vector<unsigned int> thread_counts;
+        for (unsigned int count = 1; count < threads; count *= 2) {
+            thread_counts.push_back(count);
+        }
+        thread_counts.push_back(threads);
+
+        std::cout << std::setw(8) << "threads" << std::setw(12) << "ms"
+                  << std::setw(14) << "ksamples/s" << std::setw(14)
+                  << "per core" << std::setw(12) << "Mrays/s" << std::setw(10)
+                  << "speedup" << std::setw(14) << "efficiency %"
+                  << std::setw(8) << "steals" << std::endl;
+        CpuRenderStats single;
+        for (unsigned int count : thread_counts) {
+            const auto stats = tracer.render(camera, width, height, samples,
+                                             seed, count, rgba);
+            if (count == 1) {
+                single = stats;
+            }
+            print_stats(stats, single);
+        }
+    }
+    std::cout << std::defaultfloat;
+
+    if (!stbi_write_png(output_path.string().c_str(), width, height, 4,
+                        rgba.data(), width * 4)) {
+        std::cerr << "Failed to write " << output_path << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << output_path << std::endl;
+    return 0;
+}
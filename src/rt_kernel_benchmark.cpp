@@ -0,0 +1,364 @@
+// Measures the ray-triangle and ray-box kernels at every SIMD level the CPU
+// supports, on the triangles of a glTF scene or on random triangles.
+#include <geometry/geometry.hpp>
+#include <geometry/ray_kernels.hpp>
+#include <utils/timing.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Blocks of both widths over the same triangles and their boxes
+struct KernelInput {
+    std::vector<TriangleBlock<4>> triangles4;
+    std::vector<TriangleBlock<8>> triangles8;
+    std::vector<BoxBlock<4>> boxes4;
+    std::vector<BoxBlock<8>> boxes8;
+    size_t triangles = 0;
+    Aabb bounds;
+
+    void add(const Primitive &primitive) {
+        auto blocks4 = make_triangle_blocks<4>(primitive);
+        auto blocks8 = make_triangle_blocks<8>(primitive);
+        triangles4.insert(triangles4.end(), blocks4.begin(), blocks4.end());
+        triangles8.insert(triangles8.end(), blocks8.begin(), blocks8.end());
+
+        const size_t count = primitive.indices.size() / 3;
+        std::vector<BoxBlock<4>> box_blocks4((count + 3) / 4);
+        std::vector<BoxBlock<8>> box_blocks8((count + 7) / 8);
+        for (size_t i = 0; i < count; i++) {
+            Aabb box;
+            for (size_t corner = 0; corner < 3; corner++) {
+                box.grow(
+                    primitive.vertices[primitive.indices[i * 3 + corner]]
+                        .position);
+            }
+            box_blocks4[i / 4].set(static_cast<int>(i % 4), box);
+            box_blocks8[i / 8].set(static_cast<int>(i % 8), box);
+            bounds.grow(box);
+        }
+        boxes4.insert(boxes4.end(), box_blocks4.begin(), box_blocks4.end());
+        boxes8.insert(boxes8.end(), box_blocks8.begin(), box_blocks8.end());
+        triangles += count;
+    }
+};
+
+// Small triangles scattered through the unit cube
+Primitive make_random_primitive(size_t count, std::mt19937 &random) {
+    std::uniform_real_distribution<float> position(0.0f, 1.0f);
+    std::uniform_real_distribution<float> offset(-0.02f, 0.02f);
+    Primitive primitive{};
+    for (size_t i = 0; i < count; i++) {
+        const glm::vec3 center(position(random), position(random),
+                               position(random));
+        for (int corner = 0; corner < 3; corner++) {
+            Vertex vertex{};
+            vertex.position =
+                center + glm::vec3(offset(random), offset(random),
+                                   offset(random));
+            primitive.indices.push_back(
+                static_cast<uint32_t>(primitive.vertices.size()));
+            primitive.vertices.push_back(vertex);
+        }
+    }
+    return primitive;
+}
+
+// Rays from around the bounds towards points inside them
+std::vector<KernelRay> make_rays(const Aabb &bounds, size_t count,
+                                 std::mt19937 &random) {
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const glm::vec3 extent = bounds.max - bounds.min;
+    std::vector<KernelRay> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        const glm::vec3 origin =
+            bounds.min +
+            extent * (glm::vec3(unit(random), unit(random), unit(random)) *
+                          3.0f -
+                      glm::vec3(1.0f));
+        const glm::vec3 target =
+            bounds.min +
+            extent * glm::vec3(unit(random), unit(random), unit(random));
+        rays.emplace_back(origin, target - origin);
+    }
+    return rays;
+}
+
+struct KernelResult {
+    std::string kernel;
+    SimdLevel level;
+    int width;
+    double ms;
+    size_t hits; // closest hits for triangles, overlaps for boxes
+};
+
+template <typename Function>
+double best_of(unsigned int repeat, Function &&function) {
+    double best = 0.0;
+    for (unsigned int i = 0; i < repeat; i++) {
+        const auto start = clock::now();
+        function();
+        const double ms = ms_since(start);
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+template <typename Block, typename Kernel>
+KernelResult run_triangles(const char *kernel_name, const RayKernels &kernels,
+                           int width, Kernel kernel,
+                           const std::vector<Block> &blocks,
+                           const std::vector<KernelRay> &rays,
+                           unsigned int repeat) {
+    size_t hits = 0;
+    const double ms = best_of(repeat, [&] {
+        hits = 0;
+        for (const auto &ray : rays) {
+            KernelHit hit{std::numeric_limits<float>::max(), 0.0f, 0.0f, 0};
+            bool found = false;
+            for (const auto &block : blocks) {
+                found |= kernel(block, ray, hit);
+            }
+            hits += found ? 1 : 0;
+        }
+    });
+    return {kernel_name, kernels.level, width, ms, hits};
+}
+
+template <typename Block, typename Kernel>
+KernelResult run_boxes(const char *kernel_name, const RayKernels &kernels,
+                       int width, Kernel kernel,
+                       const std::vector<Block> &blocks,
+                       const std::vector<KernelRay> &rays,
+                       unsigned int repeat) {
+    size_t hits = 0;
+    const double ms = best_of(repeat, [&] {
+        hits = 0;
+        float t[8];
+        for (const auto &ray : rays) {
+            for (const auto &block : blocks) {
+                hits += std::popcount(
+                    kernel(block, ray, std::numeric_limits<float>::max(), t));
+            }
+        }
+    });
+    return {kernel_name, kernels.level, width, ms, hits};
+}
+
+// Relative tolerance of distances and barycentrics against scalar
+constexpr float verify_epsilon = 1e-4f;
+
+bool nearly_equal(float a, float b) {
+    return std::abs(a - b) <=
+           verify_epsilon * std::max({1.0f, std::abs(a), std::abs(b)});
+}
+
+// Rays whose closest triangle hit differs from the scalar kernel's: found or
+// not, triangle index, or t and barycentrics beyond verify_epsilon. A
+// different index only counts if t differs too, ties may go either way.
+template <typename Block, typename Kernel>
+size_t verify_triangles(Kernel kernel, Kernel scalar,
+                        const std::vector<Block> &blocks,
+                        const std::vector<KernelRay> &rays) {
+    size_t mismatches = 0;
+    for (const auto &ray : rays) {
+        KernelHit hit{std::numeric_limits<float>::max(), 0.0f, 0.0f, 0};
+        KernelHit expected = hit;
+        bool found = false;
+        bool expected_found = false;
+        for (const auto &block : blocks) {
+            found |= kernel(block, ray, hit);
+            expected_found |= scalar(block, ray, expected);
+        }
+        if (found != expected_found) {
+            mismatches++;
+        } else if (found && (!nearly_equal(hit.t, expected.t) ||
+                             (hit.index == expected.index &&
+                              (!nearly_equal(hit.u, expected.u) ||
+                               !nearly_equal(hit.v, expected.v))))) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+// Ray and block pairs whose overlap mask or entry distances differ from the
+// scalar kernel's
+template <typename Block, typename Kernel>
+size_t verify_boxes(int width, Kernel kernel, Kernel scalar,
+                    const std::vector<Block> &blocks,
+                    const std::vector<KernelRay> &rays) {
+    size_t mismatches = 0;
+    float t[8];
+    float expected_t[8];
+    for (const auto &ray : rays) {
+        for (const auto &block : blocks) {
+            const float tmax = std::numeric_limits<float>::max();
+            const uint32_t mask = kernel(block, ray, tmax, t);
+            const uint32_t expected = scalar(block, ray, tmax, expected_t);
+            bool equal = mask == expected;
+            for (int lane = 0; equal && lane < width; lane++) {
+                equal = !(mask & (1u << lane)) ||
+                        nearly_equal(t[lane], expected_t[lane]);
+            }
+            mismatches += equal ? 0 : 1;
+        }
+    }
+    return mismatches;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string scene_path;
+    size_t tests = 64; // millions per kernel
+    size_t random_triangles = 65536;
+    unsigned int repeat = 3;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--tests" && i + 1 < argc) {
+            tests = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--triangles" && i + 1 < argc) {
+            random_triangles = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--help") {
+            std::cout << "Usage: rt_kernel_benchmark [scene.gltf] [--tests "
+                         "<millions>] [--triangles <n>] [--repeat <n>]"
+                      << std::endl;
+            return 0;
+        } else {
+            scene_path = arg;
+        }
+    }
+
+    std::mt19937 random(1);
+    KernelInput input;
+    if (!scene_path.empty()) {
+        Scene scene(scene_path, 0, false);
+        // Each mesh once, however many objects place it
+        std::unordered_set<const Mesh *> meshes;
+        for (auto &object : scene) {
+            if (!meshes.insert(object.mesh).second) {
+                continue;
+            }
+            for (const auto &primitive : object.mesh->primitives) {
+                input.add(primitive);
+            }
+        }
+    } else {
+        input.add(make_random_primitive(random_triangles, random));
+    }
+    if (input.triangles == 0) {
+        std::cerr << "No triangles to test" << std::endl;
+        return 1;
+    }
+
+    const size_t ray_count =
+        std::max<size_t>(1, tests * 1000000 / input.triangles);
+    const auto rays = make_rays(input.bounds, ray_count, random);
+    std::cout << input.triangles << " triangles, " << rays.size()
+              << " rays, selected level: "
+              << get_simd_level_name(get_simd_level()) << std::endl;
+
+    // Every SIMD kernel must find what the scalar one does before it is
+    // timed
+    const RayKernels &scalar = get_ray_kernels(SimdLevel::scalar);
+    bool verified = true;
+    for (SimdLevel level : {SimdLevel::sse, SimdLevel::avx2}) {
+        if (!is_simd_level_supported(level)) {
+            continue;
+        }
+        const RayKernels &kernels = get_ray_kernels(level);
+        const std::pair<const char *, size_t> checks[] = {
+            {"triangles4",
+             verify_triangles(kernels.intersect_triangles4,
+                              scalar.intersect_triangles4, input.triangles4,
+                              rays)},
+            {"triangles8",
+             verify_triangles(kernels.intersect_triangles8,
+                              scalar.intersect_triangles8, input.triangles8,
+                              rays)},
+            {"boxes4", verify_boxes(4, kernels.intersect_boxes4,
+                                    scalar.intersect_boxes4, input.boxes4,
+                                    rays)},
+            {"boxes8", verify_boxes(8, kernels.intersect_boxes8,
+                                    scalar.intersect_boxes8, input.boxes8,
+                                    rays)},
+        };
+        for (const auto &[name, mismatches] : checks) {
+            if (mismatches > 0) {
+                std::cerr << get_simd_level_name(level) << " " << name
+                          << " differs from scalar for " << mismatches
+                          << " rays" << std::endl;
+                verified = false;
+            }
+        }
+    }
+    if (!verified) {
+        return 1;
+    }
+    std::cout << "SIMD kernels match scalar" << std::endl;
+
+    std::vector<KernelResult> results;
+    for (SimdLevel level :
+         {SimdLevel::scalar, SimdLevel::sse, SimdLevel::avx2}) {
+        if (!is_simd_level_supported(level)) {
+            continue;
+        }
+        const RayKernels &kernels = get_ray_kernels(level);
+        results.push_back(run_triangles("triangles", kernels, 4,
+                                        kernels.intersect_triangles4,
+                                        input.triangles4, rays, repeat));
+        results.push_back(run_triangles("triangles", kernels, 8,
+                                        kernels.intersect_triangles8,
+                                        input.triangles8, rays, repeat));
+        results.push_back(run_boxes("boxes", kernels, 4,
+                                    kernels.intersect_boxes4, input.boxes4,
+                                    rays, repeat));
+        results.push_back(run_boxes("boxes", kernels, 8,
+                                    kernels.intersect_boxes8, input.boxes8,
+                                    rays, repeat));
+    }
+
+    // Padding lanes are not counted as intersections
+    const double intersections =
+        static_cast<double>(input.triangles) * rays.size();
+    std::cout << std::endl
+              << std::left << std::setw(11) << "kernel" << std::setw(8)
+              << "level" << std::right << std::setw(6) << "width"
+              << std::setw(10) << "ms" << std::setw(10) << "M/s"
+              << std::setw(9) << "speedup" << std::setw(12) << "hits"
+              << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (const auto &result : results) {
+        // Against the scalar kernel of the same shape
+        const auto scalar = std::find_if(
+            results.begin(), results.end(), [&](const KernelResult &other) {
+                return other.level == SimdLevel::scalar &&
+                       other.kernel == result.kernel &&
+                       other.width == result.width;
+            });
+        std::cout << std::left << std::setw(11) << result.kernel
+                  << std::setw(8) << get_simd_level_name(result.level)
+                  << std::right << std::setw(6) << result.width
+                  << std::setw(10) << result.ms << std::setw(10)
+                  << intersections / (result.ms * 1000.0) << std::setw(9)
+                  << scalar->ms / result.ms << std::setw(12) << result.hits
+                  << std::endl;
+    }
+    return 0;
+}
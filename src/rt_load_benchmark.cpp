@@ -0,0 +1,381 @@
+// Loads every glTF file under a directory and reports where the load time
+// and memory go. Each asset is loaded in a child process running this
+// executable with --asset, so peak RSS is per asset and a crash only fails
+// its own row.
+#include <geometry/geometry.hpp>
+
+#define VMA_IMPLEMENTATION
+#include <renderer/renderer.hpp>
+#include <utils/json.hpp>
+#include <utils/timing.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+uint64_t get_peak_rss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss); // bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // KiB
+#endif
+#endif
+}
+
+// The renderer needs a discrete GPU with ray tracing pipelines
+bool has_ray_tracing_device() {
+    try {
+        vk::ApplicationInfo app_info("rt_load_benchmark", 1, nullptr, 1,
+                                     VK_API_VERSION_1_3);
+        vk::InstanceCreateInfo create_info({}, &app_info);
+        vk::Instance instance = vk::createInstance(create_info);
+        bool found = false;
+        for (const auto &device : instance.enumeratePhysicalDevices()) {
+            if (device.getProperties().deviceType !=
+                vk::PhysicalDeviceType::eDiscreteGpu) {
+                continue;
+            }
+            for (const auto &extension :
+                 device.enumerateDeviceExtensionProperties()) {
+                if (std::string(extension.extensionName.data()) ==
+                    VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) {
+                    found = true;
+                }
+            }
+        }
+        instance.destroy();
+        return found;
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+// Result of one asset as "key value" lines, written by the child and read
+// by the parent. asset, status and error are strings, the rest numbers.
+using Result = std::map<std::string, std::string>;
+
+const std::vector<std::string> string_fields = {"asset", "status", "error"};
+
+void write_result(const std::filesystem::path &path, const Result &result) {
+    std::ofstream out(path);
+    for (const auto &[key, value] : result) {
+        out << key << " " << value << "\n";
+    }
+}
+
+Result read_result(const std::filesystem::path &path) {
+    Result result;
+    std::ifstream in(path);
+    std::string key, value;
+    while (in >> key && std::getline(in >> std::ws, value)) {
+        result[key] = value;
+    }
+    return result;
+}
+
+std::string to_field(double value) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3) << value;
+    return out.str();
+}
+
+// Scene parse and geometry statistics and the registry's decode totals
+void add_scene_stats(Result &result, Scene &scene) {
+    const auto &stats = scene.get_load_stats();
+    result["parse_ms"] = to_field(stats.parse_ms);
+    result["geometry_ms"] = to_field(stats.geometry_ms);
+    result["tangent_ms"] = to_field(stats.tangent_ms);
+    result["vertices"] = std::to_string(stats.vertices);
+    result["indices"] = std::to_string(stats.indices);
+    auto &registry = scene.get_textures();
+    const auto decode_stats = registry.get_decode_stats();
+    result["decode_cpu_ms"] = to_field(decode_stats.decode_ms);
+    result["decode_mpix"] = to_field(decode_stats.pixels / 1e6);
+    result["textures"] = std::to_string(registry.size());
+    if (scene.empty()) {
+        throw std::runtime_error("no geometry loaded");
+    }
+}
+
+// Loads one asset through Renderer::load_scene, or without a device through
+// Scene followed by a host decode of every texture. The scene is parsed
+// once either way, and with a device the textures are only decoded into
+// staging memory, so peak RSS is what the renderer itself needs.
+Result load_asset(const std::filesystem::path &asset, unsigned int threads,
+                  bool device) {
+    Result result;
+    result["asset"] = asset.generic_string();
+    result["status"] = "pass";
+    result["device"] = device ? "1" : "0";
+    try {
+        if (device) {
+            Renderer renderer(asset);
+            const auto &stats = renderer.get_load_stats();
+            result["scene_ms"] = to_field(stats.scene_ms);
+            add_scene_stats(result, renderer.get_scene());
+            // Decoding overlaps the uploads, this is its wall time
+            result["decode_ms"] = to_field(renderer.get_scene()
+                                               .get_textures()
+                                               .get_decode_stats()
+                                               .wall_ms);
+            result["load_ms"] = to_field(stats.total_ms);
+            result["texture_ms"] = to_field(stats.texture_ms);
+            result["upload_ms"] = to_field(stats.buffer_ms);
+            result["blas_ms"] = to_field(stats.blas_ms);
+            result["tlas_ms"] = to_field(stats.tlas_ms);
+            result["as_ms"] = to_field(stats.blas_ms + stats.tlas_ms);
+            for (const auto &[name, gpu] : renderer.get_gpu_load_stats()) {
+                std::string key = "gpu_" + name + "_ms";
+                std::replace(key.begin(), key.end(), ' ', '_');
+                result[key] = to_field(gpu.total_ms);
+            }
+            result["gpu_bytes"] =
+                std::to_string(renderer.get_allocated_bytes());
+        } else {
+            auto start = clock::now();
+            Scene scene(asset.string(), threads);
+            result["scene_ms"] = to_field(ms_since(start));
+
+            // Host decode of every texture to RGBA8
+            auto &registry = scene.get_textures();
+            start = clock::now();
+            std::vector<DecodedImage> decoded;
+            size_t failed = 0;
+            for (size_t i = 0; i < registry.size(); i++) {
+                try {
+                    decoded.push_back(registry.decode(i));
+                } catch (const std::exception &) {
+                    failed++;
+                }
+            }
+            for (auto &image : decoded) {
+                try {
+                    image.get();
+                } catch (const std::exception &) {
+                    failed++;
+                }
+            }
+            result["decode_ms"] = to_field(ms_since(start));
+            add_scene_stats(result, scene);
+            result["textures_failed"] = std::to_string(failed);
+            if (failed > 0) {
+                throw std::runtime_error(std::to_string(failed) +
+                                         " textures failed to decode");
+            }
+        }
+    } catch (const std::exception &e) {
+        std::string error = e.what();
+        std::replace(error.begin(), error.end(), '\n', ' ');
+        result["status"] = "fail";
+        result["error"] = error;
+    }
+    result["peak_rss_bytes"] = std::to_string(get_peak_rss());
+    return result;
+}
+
+void write_json(const std::filesystem::path &path,
+                const std::vector<Result> &results) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path.string());
+    }
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        out << "  {";
+        bool first = true;
+        for (const auto &[key, value] : results[i]) {
+            const bool is_string =
+                std::find(string_fields.begin(), string_fields.end(), key) !=
+                string_fields.end();
+            out << (first ? "" : ", ") << json_string(key) << ": "
+                << (is_string ? json_string(value) : value);
+            first = false;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+std::string get_field(const Result &result, const std::string &key) {
+    auto it = result.find(key);
+    return it != result.end() ? it->second : "-";
+}
+
+std::string get_mib(const Result &result, const std::string &key) {
+    auto it = result.find(key);
+    return it != result.end()
+               ? to_field(std::stod(it->second) / (1024.0 * 1024.0))
+               : "-";
+}
+
+void print_table(const std::vector<Result> &results) {
+    const std::vector<std::pair<const char *, int>> columns = {
+        {"status", 7},      {"parse ms", 10}, {"decode ms", 10},
+        {"texture ms", 11}, {"upload ms", 10}, {"AS ms", 9},
+        {"RSS MiB", 10},    {"GPU MiB", 10}};
+    std::cout << std::left << std::setw(40) << "asset" << std::right;
+    for (const auto &[name, width] : columns) {
+        std::cout << std::setw(width) << name;
+    }
+    std::cout << std::endl;
+    for (const auto &result : results) {
+        std::string asset =
+            std::filesystem::path(get_field(result, "asset")).filename()
+                .string();
+        if (asset.size() > 38) {
+            asset = asset.substr(0, 35) + "...";
+        }
+        const std::vector<std::string> values = {
+            get_field(result, "status"),     get_field(result, "parse_ms"),
+            get_field(result, "decode_ms"),  get_field(result, "texture_ms"),
+            get_field(result, "upload_ms"),  get_field(result, "as_ms"),
+            get_mib(result, "peak_rss_bytes"), get_mib(result, "gpu_bytes")};
+        std::cout << std::left << std::setw(40) << asset << std::right;
+        for (size_t i = 0; i < columns.size(); i++) {
+            std::cout << std::setw(columns[i].second) << values[i];
+        }
+        std::cout << std::endl;
+        if (result.count("error")) {
+            std::cout << "    " << result.at("error") << std::endl;
+        }
+    }
+}
+
+std::string quote(const std::string &value) { return "\"" + value + "\""; }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::filesystem::path directory;
+    std::filesystem::path asset;
+    std::filesystem::path result_path;
+    std::filesystem::path json_path = "load_benchmark.json";
+    unsigned int threads = 0;
+    bool device = true;
+    bool strict = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--asset" && i + 1 < argc) {
+            asset = argv[++i];
+        } else if (arg == "--result" && i + 1 < argc) {
+            result_path = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::stoi(argv[++i]);
+        } else if (arg == "--no-device") {
+            device = false;
+        } else if (arg == "--strict") {
+            strict = true;
+        } else {
+            directory = arg;
+        }
+    }
+
+    // Child: load one asset and write its result
+    if (!asset.empty()) {
+        write_result(result_path, load_asset(asset, threads, device));
+        return 0;
+    }
+
+    if (directory.empty()) {
+        std::cerr << "Usage: rt_load_benchmark <assets directory> [--json "
+                     "<file>] [--threads <n>] [--no-device] [--strict]"
+                  << std::endl;
+        return 1;
+    }
+
+    // Skip the KTX2 files rt_bake writes next to the assets
+    std::vector<std::filesystem::path> assets;
+    for (const auto &entry :
+         std::filesystem::recursive_directory_iterator(directory)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".gltf" &&
+            entry.path().string().find(".baked") == std::string::npos) {
+            assets.push_back(entry.path());
+        }
+    }
+    std::sort(assets.begin(), assets.end());
+    if (assets.empty()) {
+        std::cerr << "No .gltf files in " << directory << std::endl;
+        return 1;
+    }
+
+    if (device && !has_ray_tracing_device()) {
+        std::cout << "No ray tracing device, only loading through Scene"
+                  << std::endl;
+        device = false;
+    }
+
+    const auto work_directory =
+        std::filesystem::temp_directory_path() / "rt_load_benchmark";
+    std::filesystem::create_directories(work_directory);
+
+    std::vector<Result> results;
+    size_t failed = 0;
+    for (size_t i = 0; i < assets.size(); i++) {
+        const auto result_file =
+            work_directory / (std::to_string(i) + ".txt");
+        const auto log_file = work_directory / (std::to_string(i) + ".log");
+        std::filesystem::remove(result_file);
+
+        std::cout << "[" << i + 1 << "/" << assets.size() << "] "
+                  << assets[i].string() << std::endl;
+        std::string command =
+            quote(argv[0]) + " --asset " + quote(assets[i].string()) +
+            " --result " + quote(result_file.string()) + " --threads " +
+            std::to_string(threads) + (device ? "" : " --no-device") + " > " +
+            quote(log_file.string()) + " 2>&1";
+#ifdef _WIN32
+        // cmd strips the outer quotes of the whole line
+        command = quote(command);
+#endif
+        const int exit_code = std::system(command.c_str());
+
+        Result result = read_result(result_file);
+        if (result.empty()) {
+            result["asset"] = assets[i].generic_string();
+            result["status"] = "fail";
+            result["error"] = "crashed with exit code " +
+                              std::to_string(exit_code) + ", see " +
+                              log_file.string();
+        }
+        if (result["status"] != "pass") {
+            failed++;
+        }
+        results.push_back(result);
+    }
+
+    std::cout << std::endl;
+    print_table(results);
+    write_json(json_path, results);
+    std::cout << std::endl
+              << assets.size() - failed << " of " << assets.size()
+              << " assets passed, wrote " << json_path << std::endl;
+    return strict && failed > 0 ? 1 : 0;
+}
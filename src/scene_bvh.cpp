@@ -0,0 +1,225 @@
+#include <geometry/scene_bvh.hpp>
+#include <utils/cpu_profiler.hpp>
+#include <utils/timing.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Lanes of a block straight from the precomputed edges
+void set_lane(TriangleBlock<4> &block, int lane,
+              const MeshBvh::Triangle &triangle) {
+    for (int axis = 0; axis < 3; axis++) {
+        block.v0[axis][lane] = triangle.v0[axis];
+        block.edge1[axis][lane] = triangle.edge1[axis];
+        block.edge2[axis][lane] = triangle.edge2[axis];
+    }
+    block.index[lane] = triangle.index;
+}
+
+} // namespace
+
+void MeshBvh::start_build(ThreadPool &pool, BvhSplit split) {
+    const auto &indices = primitive->indices;
+    const auto &vertices = primitive->vertices;
+    const size_t count = indices.size() / 3;
+    triangles.clear();
+    triangles.reserve(count);
+    std::vector<Aabb> boxes(count);
+    for (size_t i = 0; i < count; i++) {
+        const glm::vec3 &p0 = vertices[indices[i * 3]].position;
+        const glm::vec3 &p1 = vertices[indices[i * 3 + 1]].position;
+        const glm::vec3 &p2 = vertices[indices[i * 3 + 2]].position;
+        triangles.push_back({p0, p1 - p0, p2 - p0, static_cast<uint32_t>(i)});
+        boxes[i].grow(p0);
+        boxes[i].grow(p1);
+        boxes[i].grow(p2);
+    }
+    bvh.start_build(std::move(boxes), pool, split);
+}
+
+void MeshBvh::finish_build() {
+    bvh.finish_build();
+    // Leaves index straight into the triangles
+    std::vector<Triangle> ordered;
+    ordered.reserve(triangles.size());
+    for (uint32_t index : bvh.indices) {
+        ordered.push_back(triangles[index]);
+    }
+    triangles = std::move(ordered);
+
+    blocks.clear();
+    leaf_blocks.assign(triangles.size(), 0);
+    for (const auto &node : bvh.nodes) {
+        if (!node.is_leaf()) {
+            continue;
+        }
+        leaf_blocks[node.offset] = static_cast<uint32_t>(blocks.size());
+        for (uint32_t i = 0; i < node.count; i++) {
+            if (i % 4 == 0) {
+                blocks.emplace_back();
+            }
+            set_lane(blocks.back(), i % 4, triangles[node.offset + i]);
+        }
+    }
+}
+
+bool MeshBvh::intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+                        float tmin, RayHit &hit) const {
+    const RayKernels &kernels = get_ray_kernels();
+    const KernelRay ray(origin, direction, tmin);
+    KernelHit closest{hit.t, 0.0f, 0.0f, 0};
+    bool found = false;
+    bvh.traverse(origin, ray.inv_direction, tmin, hit.t,
+                 [&](uint32_t first, uint32_t count) {
+                     const uint32_t begin = leaf_blocks[first];
+                     for (uint32_t i = begin; i < begin + (count + 3) / 4;
+                          i++) {
+                         found |= kernels.intersect_triangles4(blocks[i], ray,
+                                                               closest);
+                     }
+                     return closest.t;
+                 });
+    if (found) {
+        hit.t = closest.t;
+        hit.bary = glm::vec2(closest.u, closest.v);
+        hit.triangle = closest.index;
+    }
+    return found;
+}
+
+bool MeshBvh::occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                       float tmin, float tmax) const {
+    const RayKernels &kernels = get_ray_kernels();
+    const KernelRay ray(origin, direction, tmin);
+    // Kernels take hits below hit.t, tmax itself counts
+    const float limit =
+        std::nextafter(tmax, std::numeric_limits<float>::max());
+    bool found = false;
+    bvh.traverse(origin, ray.inv_direction, tmin, tmax,
+                 [&](uint32_t first, uint32_t count) {
+                     KernelHit any{limit, 0.0f, 0.0f, 0};
+                     const uint32_t begin = leaf_blocks[first];
+                     for (uint32_t i = begin; i < begin + (count + 3) / 4;
+                          i++) {
+                         if (kernels.intersect_triangles4(blocks[i], ray,
+                                                          any)) {
+                             // Below tmin ends the traversal
+                             found = true;
+                             return -std::numeric_limits<float>::max();
+                         }
+                     }
+                     return tmax;
+                 });
+    return found;
+}
+
+SceneBvh::SceneBvh(Scene &scene, ThreadPool &pool, BvhSplit split) {
+    RT_PROFILE_FUNCTION();
+    auto start = clock::now();
+
+    // One MeshBvh per distinct primitive, all building at once
+    std::unordered_map<const Primitive *, uint32_t> mesh_lookup;
+    for (auto &object : scene) {
+        for (const auto &primitive : object.mesh->primitives) {
+            if (primitive.indices.size() < 3 ||
+                mesh_lookup.count(&primitive) > 0) {
+                continue;
+            }
+            mesh_lookup[&primitive] = static_cast<uint32_t>(meshes.size());
+            meshes.emplace_back(primitive);
+        }
+    }
+    // Builds hold on to their MeshBvh, so start them once meshes is final
+    for (auto &mesh : meshes) {
+        mesh.start_build(pool, split);
+    }
+    pool.wait_idle();
+    for (auto &mesh : meshes) {
+        mesh.finish_build();
+    }
+    stats.mesh_ms = ms_since(start);
+
+    start = clock::now();
+    std::vector<Aabb> boxes;
+    uint32_t object_index = 0;
+    for (auto &object : scene) {
+        const glm::mat4 &to_world = object.global_transformation;
+        const glm::mat4 to_object = glm::inverse(to_world);
+        for (const auto &primitive : object.mesh->primitives) {
+            auto it = mesh_lookup.find(&primitive);
+            if (it == mesh_lookup.end()) {
+                continue;
+            }
+            // World box around the transformed corners of the object box
+            const Aabb local = meshes[it->second].get_bounds();
+            Aabb bounds;
+            for (int corner = 0; corner < 8; corner++) {
+                const glm::vec3 point(corner & 1 ? local.max.x : local.min.x,
+                                      corner & 2 ? local.max.y : local.min.y,
+                                      corner & 4 ? local.max.z : local.min.z);
+                bounds.grow(glm::vec3(to_world * glm::vec4(point, 1.0f)));
+            }
+            instances.push_back(
+                {it->second, object_index, to_world, to_object, bounds});
+            boxes.push_back(bounds);
+        }
+        object_index++;
+    }
+    top.build(boxes, nullptr, split);
+    stats.top_ms = ms_since(start);
+}
+
+bool SceneBvh::intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+                         float tmin, float tmax, RayHit &hit) const {
+    bool found = false;
+    hit.t = tmax;
+    top.traverse(origin, 1.0f / direction, tmin, tmax,
+                 [&](uint32_t first, uint32_t count) {
+                     for (uint32_t i = first; i < first + count; i++) {
+                         const uint32_t index = top.indices[i];
+                         const Instance &instance = instances[index];
+                         // Same t in object space, the direction is not
+                         // renormalized
+                         const glm::vec3 object_origin(
+                             instance.to_object * glm::vec4(origin, 1.0f));
+                         const glm::vec3 object_direction(
+                             instance.to_object * glm::vec4(direction, 0.0f));
+                         if (meshes[instance.mesh].intersect(
+                                 object_origin, object_direction, tmin, hit)) {
+                             hit.instance = index;
+                             found = true;
+                         }
+                     }
+                     return hit.t;
+                 });
+    return found;
+}
+
+bool SceneBvh::occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                        float tmin, float tmax) const {
+    bool found = false;
+    top.traverse(origin, 1.0f / direction, tmin, tmax,
+                 [&](uint32_t first, uint32_t count) {
+                     for (uint32_t i = first; i < first + count; i++) {
+                         const Instance &instance = instances[top.indices[i]];
+                         const glm::vec3 object_origin(
+                             instance.to_object * glm::vec4(origin, 1.0f));
+                         const glm::vec3 object_direction(
+                             instance.to_object * glm::vec4(direction, 0.0f));
+                         if (meshes[instance.mesh].occluded(
+                                 object_origin, object_direction, tmin,
+                                 tmax)) {
+                             found = true;
+                             return -std::numeric_limits<float>::max();
+                         }
+                     }
+                     return tmax;
+                 });
+    return found;
+}
@@ -0,0 +1,197 @@
+#include <geometry/scene_query.hpp>
+#include <utils/cpu_profiler.hpp>
+
+#include <chrono>
+#include <cmath>
+
+namespace {
+
+// Closest point of a triangle to p with the weights of b and c (Ericson,
+// "Real-Time Collision Detection", 5.1.5)
+glm::vec3 closest_point_triangle(const glm::vec3 &p, const glm::vec3 &a,
+                                 const glm::vec3 &b, const glm::vec3 &c,
+                                 glm::vec2 &bary) {
+    const glm::vec3 ab = b - a;
+    const glm::vec3 ac = c - a;
+    const glm::vec3 ap = p - a;
+    const float d1 = glm::dot(ab, ap);
+    const float d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        bary = glm::vec2(0.0f, 0.0f);
+        return a;
+    }
+
+    const glm::vec3 bp = p - b;
+    const float d3 = glm::dot(ab, bp);
+    const float d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) {
+        bary = glm::vec2(1.0f, 0.0f);
+        return b;
+    }
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        const float v = d1 / (d1 - d3);
+        bary = glm::vec2(v, 0.0f);
+        return a + v * ab;
+    }
+
+    const glm::vec3 cp = p - c;
+    const float d5 = glm::dot(ab, cp);
+    const float d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) {
+        bary = glm::vec2(0.0f, 1.0f);
+        return c;
+    }
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        const float w = d2 / (d2 - d6);
+        bary = glm::vec2(0.0f, w);
+        return a + w * ac;
+    }
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        const float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        bary = glm::vec2(1.0f - w, w);
+        return b + w * (c - b);
+    }
+
+    // Inside the face, degenerate triangles end up at a
+    const float sum = va + vb + vc;
+    if (sum == 0.0f) {
+        bary = glm::vec2(0.0f, 0.0f);
+        return a;
+    }
+    const float v = vb / sum;
+    const float w = vc / sum;
+    bary = glm::vec2(v, w);
+    return a + ab * v + ac * w;
+}
+
+// Squared Frobenius norm, an upper bound of how much m stretches a vector
+float norm2(const glm::mat3 &m) {
+    return glm::dot(m[0], m[0]) + glm::dot(m[1], m[1]) + glm::dot(m[2], m[2]);
+}
+
+} // namespace
+
+SceneQuery::SceneQuery(Scene &scene, unsigned int threads) {
+    RT_PROFILE_FUNCTION();
+    const auto start = std::chrono::steady_clock::now();
+    ThreadPool pool(threads);
+    bvh = std::make_unique<SceneBvh>(scene, pool);
+    build_ms = std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+}
+
+SceneHit SceneQuery::make_hit(uint32_t instance_index, uint32_t triangle,
+                              glm::vec2 bary, const glm::vec3 &toward) const {
+    const SceneBvh::Instance &instance = bvh->get_instance(instance_index);
+    const Primitive &primitive = bvh->get_mesh(instance.mesh).get_primitive();
+    glm::vec3 p[3];
+    for (int i = 0; i < 3; i++) {
+        p[i] = glm::vec3(
+            instance.to_world *
+            glm::vec4(primitive.vertices[primitive.indices[triangle * 3 + i]]
+                          .position,
+                      1.0f));
+    }
+
+    SceneHit hit;
+    hit.distance = 0.0f;
+    hit.position = p[0] + bary.x * (p[1] - p[0]) + bary.y * (p[2] - p[0]);
+    hit.normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+    const float length = glm::length(hit.normal);
+    hit.normal = length > 0.0f ? hit.normal / length : glm::vec3(0.0f);
+    if (glm::dot(hit.normal, toward) < 0.0f) {
+        hit.normal = -hit.normal;
+    }
+    hit.bary = bary;
+    hit.object = instance.object;
+    hit.primitive_id = primitive.primitive_id;
+    hit.triangle = triangle;
+    hit.material_index = primitive.material_index;
+    return hit;
+}
+
+bool SceneQuery::raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                         SceneHit &hit, float tmin, float tmax) const {
+    const glm::vec3 unit = glm::normalize(direction);
+    RayHit ray_hit;
+    if (!bvh->intersect(origin, unit, tmin, tmax, ray_hit)) {
+        return false;
+    }
+    hit = make_hit(ray_hit.instance, ray_hit.triangle, ray_hit.bary, -unit);
+    hit.distance = ray_hit.t;
+    return true;
+}
+
+bool SceneQuery::occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+                          float tmin, float tmax) const {
+    return bvh->occluded(origin, glm::normalize(direction), tmin, tmax);
+}
+
+bool SceneQuery::closest_point(const glm::vec3 &point, SceneHit &hit,
+                               float max_distance) const {
+    float best2 = max_distance < std::numeric_limits<float>::max()
+                      ? max_distance * max_distance
+                      : std::numeric_limits<float>::max();
+    bool found = false;
+    uint32_t best_instance = 0;
+    uint32_t best_triangle = 0;
+    glm::vec2 best_bary(0.0f);
+    glm::vec3 best_position(0.0f);
+
+    const Bvh &top = bvh->get_top();
+    top.traverse_nearest(point, best2, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            const uint32_t index = top.indices[i];
+            const SceneBvh::Instance &instance = bvh->get_instance(index);
+            const MeshBvh &mesh = bvh->get_mesh(instance.mesh);
+            const auto &triangles = mesh.get_triangles();
+            const glm::mat3 to_world(instance.to_world);
+            // Object space distances are at most stretch times the world
+            // ones, so bounds are scaled by it rather than recomputed
+            const float stretch = norm2(glm::mat3(instance.to_object));
+            const glm::vec3 object_point(instance.to_object *
+                                         glm::vec4(point, 1.0f));
+            mesh.get_bvh().traverse_nearest(
+                object_point, best2 * stretch,
+                [&](uint32_t leaf_first, uint32_t leaf_count) {
+                    for (uint32_t j = leaf_first; j < leaf_first + leaf_count;
+                         j++) {
+                        const MeshBvh::Triangle &triangle = triangles[j];
+                        const glm::vec3 a(instance.to_world *
+                                          glm::vec4(triangle.v0, 1.0f));
+                        glm::vec2 bary;
+                        const glm::vec3 closest = closest_point_triangle(
+                            point, a, a + to_world * triangle.edge1,
+                            a + to_world * triangle.edge2, bary);
+                        const glm::vec3 offset = closest - point;
+                        const float distance2 = glm::dot(offset, offset);
+                        if (distance2 < best2) {
+                            best2 = distance2;
+                            best_instance = index;
+                            best_triangle = triangle.index;
+                            best_bary = bary;
+                            best_position = closest;
+                            found = true;
+                        }
+                    }
+                    return best2 * stretch;
+                });
+        }
+        return best2;
+    });
+
+    if (!found) {
+        return false;
+    }
+    hit = make_hit(best_instance, best_triangle, best_bary,
+                   point - best_position);
+    hit.distance = std::sqrt(best2);
+    return true;
+}
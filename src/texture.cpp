@@ -0,0 +1,647 @@
+#include <geometry/texture.hpp>
+#include <utils/srgb.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stb_image.h>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||             \
+    defined(_M_IX86)
+#define TEXTURE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+using decode_clock = std::chrono::steady_clock;
+
+void expand_rgb_to_rgba_scalar(const uint8_t *rgb, uint8_t *rgba,
+                               size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) {
+        rgba[i * 4] = rgb[i * 3];
+        rgba[i * 4 + 1] = rgb[i * 3 + 1];
+        rgba[i * 4 + 2] = rgb[i * 3 + 2];
+        rgba[i * 4 + 3] = 255; // Set alpha to 255 (opaque)
+    }
+}
+
+#ifdef TEXTURE_X86
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("ssse3")))
+#endif
+size_t expand_rgb_to_rgba_ssse3(const uint8_t *rgb, uint8_t *rgba,
+                                size_t pixels) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8,
+                                          -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+
+    // Every load reads 16 bytes but only consumes 12 (4 pixels), so keep two
+    // pixels of slack for the last load of a block
+    size_t i = 0;
+    for (; i + 18 <= pixels; i += 16) {
+        const uint8_t *src = rgb + i * 3;
+        uint8_t *dst = rgba + i * 4;
+        for (int j = 0; j < 4; j++) {
+            __m128i in = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + j * 12));
+            __m128i out = _mm_or_si128(_mm_shuffle_epi8(in, shuffle), alpha);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j * 16), out);
+        }
+    }
+    return i;
+}
+
+bool cpu_has_ssse3() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+// Box filters an uncompressed level 2^shift times smaller in both
+// dimensions in one pass, like shift 2x2 reductions but without rounding
+// every intermediate level to 8 bits. sRGB texels are averaged in linear
+// space.
+void downsample_level(const uint8_t *in, uint32_t width, uint32_t height,
+                      PixelFormat format, uint32_t shift, uint8_t *out) {
+    const auto &to_linear = srgb_to_linear_table();
+    const uint32_t channels = get_pixel_format_info(format).block_bytes;
+    const bool srgb = format == PixelFormat::rgba8_srgb;
+    const uint32_t out_width = std::max(width >> shift, 1u);
+    const uint32_t out_height = std::max(height >> shift, 1u);
+    const uint32_t box = 1u << shift;
+    std::array<float, 4> sum{};
+    for (uint32_t y = 0; y < out_height; y++) {
+        const uint32_t y_end = std::min((y + 1) * box, height);
+        for (uint32_t x = 0; x < out_width; x++) {
+            const uint32_t x_end = std::min((x + 1) * box, width);
+            sum.fill(0.0f);
+            for (uint32_t sy = y * box; sy < y_end; sy++) {
+                const uint8_t *row =
+                    in + (static_cast<size_t>(sy) * width + x * box) * channels;
+                for (uint32_t sx = x * box; sx < x_end; sx++) {
+                    for (uint32_t c = 0; c < channels; c++) {
+                        sum[c] += srgb && c < 3 ? to_linear[row[c]]
+                                                : row[c] / 255.0f;
+                    }
+                    row += channels;
+                }
+            }
+            const uint32_t texels = (x_end - x * box) * (y_end - y * box);
+            const float scale = 1.0f / static_cast<float>(texels);
+            uint8_t *texel =
+                out + (static_cast<size_t>(y) * out_width + x) * channels;
+            for (uint32_t c = 0; c < channels; c++) {
+                const float value = sum[c] * scale;
+                texel[c] = srgb && c < 3
+                               ? linear_to_srgb(value)
+                               : static_cast<uint8_t>(std::lround(
+                                     std::clamp(value, 0.0f, 1.0f) * 255.0f));
+            }
+        }
+    }
+}
+
+} // namespace
+
+TextureLayout TextureLayout::from_level(uint32_t base_level, uint32_t width,
+                                        uint32_t height) const {
+    if (base_level == 0) {
+        return *this;
+    }
+    if (!generate_mips && base_level >= stored_levels()) {
+        throw std::runtime_error("Texture has no level " +
+                                 std::to_string(base_level));
+    }
+
+    TextureLayout layout;
+    layout.format = format;
+    layout.generate_mips = generate_mips;
+    const uint32_t levels = generate_mips ? 1 : stored_levels() - base_level;
+    for (uint32_t level = base_level; level < base_level + levels; level++) {
+        layout.size = (layout.size + 15) / 16 * 16;
+        layout.level_offsets.push_back(layout.size);
+        layout.size += get_level_size(format, std::max(width >> level, 1u),
+                                      std::max(height >> level, 1u));
+    }
+    return layout;
+}
+
+void expand_rgb_to_rgba(const uint8_t *rgb, uint8_t *rgba, size_t pixels) {
+    size_t done = 0;
+#if defined(TEXTURE_X86)
+    static const bool has_ssse3 = cpu_has_ssse3();
+    if (has_ssse3) {
+        done = expand_rgb_to_rgba_ssse3(rgb, rgba, pixels);
+    }
+#elif defined(__ARM_NEON)
+    for (; done + 16 <= pixels; done += 16) {
+        uint8x16x3_t in = vld3q_u8(rgb + done * 3);
+        uint8x16x4_t out;
+        out.val[0] = in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[2];
+        out.val[3] = vdupq_n_u8(255);
+        vst4q_u8(rgba + done * 4, out);
+    }
+#endif
+    expand_rgb_to_rgba_scalar(rgb + done * 3, rgba + done * 4, pixels - done);
+}
+
+void TextureMap::free_texture_map() {
+    map.clear();
+    map.shrink_to_fit();
+}
+
+TextureRegistry::TextureRegistry(unsigned int decode_threads)
+    : pool(std::make_unique<ThreadPool>(decode_threads)) {}
+
+void TextureRegistry::record_decode(
+    std::chrono::steady_clock::time_point start, size_t pixels) {
+    auto finish = decode_clock::now();
+    decode_ns +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start)
+            .count();
+    decoded_pixels += pixels;
+    const int64_t finish_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(finish -
+                                                             first_submit)
+            .count();
+    int64_t last = last_finish_ns.load();
+    while (finish_ns > last &&
+           !last_finish_ns.compare_exchange_weak(last, finish_ns)) {
+    }
+}
+
+void TextureRegistry::decode_plain(const EncodedImage &image,
+                                   uint32_t channels, uint8_t *out) {
+    RT_PROFILE_FUNCTION();
+    const auto &bytes = image.bytes;
+    int w = 0, h = 0, c = 0;
+    stbi_info_from_memory(bytes.data(), static_cast<int>(bytes.size()), &w, &h,
+                          &c);
+    // Let stb convert grey and grey-alpha, expand RGB ourselves
+    const int req_comp = c == 3 ? 3 : 4;
+    unsigned char *decoded =
+        stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()), &w,
+                              &h, &c, req_comp);
+    if (decoded == nullptr) {
+        throw std::runtime_error(std::string("Failed to decode image: ") +
+                                 stbi_failure_reason());
+    }
+    if (w != image.width || h != image.height) {
+        stbi_image_free(decoded);
+        throw std::runtime_error("Decoded image size does not match header");
+    }
+
+    // stb only decodes into buffers it allocates, so its output is expanded
+    // or packed straight into out
+    const size_t pixels = static_cast<size_t>(w) * h;
+    if (channels == 2) {
+        for (size_t i = 0; i < pixels; i++) {
+            out[i * 2] = decoded[i * req_comp];
+            out[i * 2 + 1] = decoded[i * req_comp + 1];
+        }
+    } else if (req_comp == 3) {
+        expand_rgb_to_rgba(decoded, out, pixels);
+    } else {
+        std::memcpy(out, decoded, pixels * 4);
+    }
+    stbi_image_free(decoded);
+}
+
+void TextureRegistry::decode_layout(const EncodedImage &image,
+                                    const TextureLayout &layout,
+                                    uint8_t *out) {
+    RT_PROFILE_FUNCTION();
+    auto start = decode_clock::now();
+    const size_t pixels = static_cast<size_t>(image.width) * image.height;
+
+    if (image.ktx2 && image.ktx2->is_basis()) {
+        basisu_transcode(image.bytes.data(), image.bytes.size(), layout.format,
+                         layout.level_offsets, out);
+    } else if (image.ktx2) {
+        // Already in the GPU format, only copy the levels. RGBA8 normal maps
+        // are packed to RG.
+        const PixelFormat native = *image.ktx2->native_format();
+        const bool pack_rg = layout.format == PixelFormat::rg8_unorm &&
+                             native != PixelFormat::rg8_unorm;
+        for (uint32_t level = 0; level < layout.stored_levels(); level++) {
+            const auto &source = image.ktx2->levels[level];
+            const uint32_t width = std::max(image.width >> level, 1);
+            const uint32_t height = std::max(image.height >> level, 1);
+            const size_t expected = get_level_size(native, width, height);
+            if (source.length != expected) {
+                throw std::runtime_error("KTX2 level " + std::to_string(level) +
+                                         " has an unexpected size");
+            }
+            const uint8_t *in = image.bytes.data() + source.offset;
+            uint8_t *level_out = out + layout.level_offsets[level];
+            if (!pack_rg) {
+                std::memcpy(level_out, in, expected);
+                continue;
+            }
+            for (size_t i = 0; i < size_t(width) * height; i++) {
+                level_out[i * 2] = in[i * 4];
+                level_out[i * 2 + 1] = in[i * 4 + 1];
+            }
+        }
+    } else {
+        decode_plain(image, layout.format == PixelFormat::rg8_unorm ? 2 : 4,
+                     out);
+    }
+
+    record_decode(start, pixels);
+}
+
+std::optional<TextureLayout>
+TextureRegistry::plan_layout(const EncodedImage &image,
+                             ColorSpace color_space,
+                             bool block_compression) {
+    const bool srgb = color_space == ColorSpace::srgb;
+    const bool normal = color_space == ColorSpace::normal;
+
+    TextureLayout layout;
+    uint32_t levels = 1;
+    if (!image.ktx2) {
+        layout.format = normal ? PixelFormat::rg8_unorm
+                        : srgb ? PixelFormat::rgba8_srgb
+                               : PixelFormat::rgba8_unorm;
+        layout.generate_mips = true;
+    } else if (auto native = image.ktx2->native_format()) {
+        if (is_block_compressed(*native) && !block_compression) {
+            return std::nullopt;
+        }
+        // The stored format says nothing about the slot, sample it the way
+        // the slot's color space needs. Normal maps are read as RG, RGBA8
+        // ones are packed on upload and other formats are not usable.
+        if (!normal) {
+            layout.format = with_srgb(*native, srgb);
+        } else if (*native == PixelFormat::rg8_unorm ||
+                   *native == PixelFormat::bc5_unorm) {
+            layout.format = *native;
+        } else if (*native == PixelFormat::rgba8_unorm ||
+                   *native == PixelFormat::rgba8_srgb) {
+            layout.format = PixelFormat::rg8_unorm;
+        } else {
+            return std::nullopt;
+        }
+        levels = static_cast<uint32_t>(image.ktx2->levels.size());
+        // BCn formats cannot be blitted, they keep the levels they ship with
+        layout.generate_mips = levels == 1 && !is_block_compressed(*native);
+    } else if (image.ktx2->is_basis() && basisu_transcoder_available()) {
+        if (block_compression) {
+            layout.format = normal ? PixelFormat::bc5_unorm
+                            : srgb ? PixelFormat::bc7_srgb
+                                   : PixelFormat::bc7_unorm;
+        } else {
+            layout.format =
+                srgb ? PixelFormat::rgba8_srgb : PixelFormat::rgba8_unorm;
+        }
+        levels = static_cast<uint32_t>(image.ktx2->levels.size());
+        layout.generate_mips = levels == 1 && !block_compression;
+    } else {
+        return std::nullopt;
+    }
+
+    // Keep every level aligned to the largest block size
+    size_t offset = 0;
+    for (uint32_t level = 0; level < levels; level++) {
+        offset = (offset + 15) / 16 * 16;
+        layout.level_offsets.push_back(offset);
+        offset += get_level_size(
+            layout.format,
+            std::max(static_cast<uint32_t>(image.width) >> level, 1u),
+            std::max(static_cast<uint32_t>(image.height) >> level, 1u));
+    }
+    layout.size = offset;
+    return layout;
+}
+
+void TextureRegistry::choose_layouts(bool block_compression) {
+    for (size_t i = 0; i < textures.size(); i++) {
+        auto &texture = textures[i];
+        bool found = false;
+        for (const auto &candidate : {texture.encoded, texture.fallback}) {
+            if (!candidate) {
+                continue;
+            }
+            if (auto layout =
+                    plan_layout(*candidate, texture.color_space,
+                                block_compression)) {
+                texture.layout = std::move(*layout);
+                texture.encoded = candidate;
+                texture.width = candidate->width;
+                texture.height = candidate->height;
+                found = true;
+                break;
+            }
+        }
+        texture.fallback.reset();
+        if (!found) {
+            throw std::runtime_error("Texture " + std::to_string(i) +
+                                     " has no image the device can use");
+        }
+    }
+}
+
+DecodedImage TextureRegistry::decode(size_t i) {
+    if (submitted++ == 0) {
+        first_submit = decode_clock::now();
+    }
+
+    auto image = textures[i].encoded;
+    if (image && image->ktx2 && textures[i].fallback) {
+        image = textures[i].fallback;
+    }
+    if (!image) {
+        throw std::runtime_error("Texture " + std::to_string(i) +
+                                 " was already released");
+    }
+    if (image->ktx2 &&
+        !(image->ktx2->is_basis() && basisu_transcoder_available())) {
+        throw std::runtime_error("Texture " + std::to_string(i) +
+                                 " cannot be decoded on the host");
+    }
+
+    auto task = [this, image]() {
+        auto start = decode_clock::now();
+        const size_t pixels =
+            static_cast<size_t>(image->width) * image->height;
+        std::vector<unsigned char> rgba(pixels * 4);
+        if (image->ktx2) {
+            basisu_transcode(image->bytes.data(), image->bytes.size(),
+                             PixelFormat::rgba8_unorm, {0}, rgba.data());
+        } else {
+            decode_plain(*image, 4, rgba.data());
+        }
+        record_decode(start, pixels);
+        return std::make_shared<TextureMap>(std::move(rgba), image->width,
+                                            image->height);
+    };
+    return pool->submit(std::move(task)).share();
+}
+
+std::future<void> TextureRegistry::decode_into(size_t i, uint8_t *out,
+                                               uint32_t base_level) {
+    if (submitted++ == 0) {
+        first_submit = decode_clock::now();
+    }
+
+    auto image = textures[i].encoded;
+    if (!image) {
+        throw std::runtime_error("Texture " + std::to_string(i) +
+                                 " was already released");
+    }
+    if (base_level == 0) {
+        return pool->submit([this, image, layout = textures[i].layout, out]() {
+            decode_layout(*image, layout, out);
+        });
+    }
+
+    // Decode everything, then keep the levels from base_level down. A
+    // generated chain reduces level 0 straight to base_level.
+    return pool->submit([this, image, layout = textures[i].layout, out,
+                         base_level]() {
+        const uint32_t width = image->width;
+        const uint32_t height = image->height;
+        const auto partial = layout.from_level(base_level, width, height);
+        std::vector<uint8_t> full(layout.size);
+        decode_layout(*image, layout, full.data());
+
+        if (!layout.generate_mips) {
+            for (uint32_t level = 0; level < partial.stored_levels();
+                 level++) {
+                std::memcpy(out + partial.level_offsets[level],
+                            full.data() +
+                                layout.level_offsets[base_level + level],
+                            get_level_size(
+                                layout.format,
+                                std::max(width >> (base_level + level), 1u),
+                                std::max(height >> (base_level + level), 1u)));
+            }
+            return;
+        }
+
+        downsample_level(full.data(), width, height, layout.format,
+                         base_level, out);
+    });
+}
+
+bool TextureRegistry::load_image_data(tinygltf::Image *image,
+                                      const int image_index, std::string *err,
+                                      std::string *warn, int req_width,
+                                      int req_height,
+                                      const unsigned char *bytes, int size,
+                                      void *user_pointer) {
+    auto registry = static_cast<TextureRegistry *>(user_pointer);
+
+    // Only parse the header here, the pixels are decoded once they have
+    // somewhere to go
+    EncodedImage encoded;
+    if (is_ktx2(bytes, size)) {
+        Ktx2Info info;
+        std::string error;
+        if (!parse_ktx2(bytes, size, info, error)) {
+            if (err) {
+                *err += "Invalid KTX2 image " + std::to_string(image_index) +
+                        ": " + error + "\n";
+            }
+            return false;
+        }
+        encoded.width = static_cast<int>(info.width);
+        encoded.height = static_cast<int>(info.height);
+        encoded.ktx2 = std::move(info);
+    } else {
+        int c = 0;
+        if (!stbi_info_from_memory(bytes, size, &encoded.width,
+                                   &encoded.height, &c)) {
+            if (err) {
+                *err += "Unknown image format for image " +
+                        std::to_string(image_index) + ": " +
+                        stbi_failure_reason() + "\n";
+            }
+            return false;
+        }
+    }
+
+    image->width = encoded.width;
+    image->height = encoded.height;
+    image->component = 4; // always expanded to RGBA
+    image->bits = 8;
+    image->pixel_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+
+    if (registry->images.size() <= static_cast<size_t>(image_index)) {
+        registry->images.resize(image_index + 1);
+    }
+    // tinygltf frees the file contents after this returns
+    encoded.bytes.assign(bytes, bytes + size);
+    registry->images[image_index] =
+        std::make_shared<const EncodedImage>(std::move(encoded));
+    return true;
+}
+
+int32_t TextureRegistry::acquire(tinygltf::Model &model, int texture_index,
+                                 TextureMap::TextureType texture_type) {
+    if (texture_index < 0) {
+        return -1;
+    }
+
+    const auto &texture = model.textures[texture_index];
+    auto has_image = [this](int source) {
+        return source >= 0 && static_cast<size_t>(source) < images.size() &&
+               images[source];
+    };
+
+    // KHR_texture_basisu points at a KTX2 image, source is then the fallback
+    int source = texture.source;
+    int fallback = -1;
+    auto basisu = texture.extensions.find("KHR_texture_basisu");
+    if (basisu != texture.extensions.end() && basisu->second.Has("source")) {
+        const int ktx2_source = basisu->second.Get("source").GetNumberAsInt();
+        if (has_image(ktx2_source)) {
+            fallback = source;
+            source = ktx2_source;
+        }
+    }
+
+    // Image, sampler + 1 (-1 is the default sampler) and color space
+    const ColorSpace color_space = get_color_space(texture_type);
+    const uint64_t key =
+        (static_cast<uint64_t>(source) << 32) |
+        (static_cast<uint64_t>(texture.sampler + 1) << 2) |
+        static_cast<uint64_t>(color_space);
+    auto it = lookup.find(key);
+    if (it != lookup.end()) {
+        return it->second;
+    }
+
+    if (!has_image(source)) {
+        throw std::runtime_error("Texture " + std::to_string(texture_index) +
+                                 " has no decodable image");
+    }
+
+    auto encoded = images[source];
+    auto fallback_image = has_image(fallback) ? images[fallback] : nullptr;
+
+    // A baked image replaces the one it was baked from, unless that changed
+    auto baked_image = baked.find({source, color_space});
+    if (baked_image != baked.end() &&
+        baked_image->second.source_size == encoded->bytes.size()) {
+        fallback_image = encoded;
+        encoded = baked_image->second.image;
+    }
+
+    SamplerState sampler_state;
+    if (texture.sampler >= 0) {
+        const auto &sampler = model.samplers[texture.sampler];
+        if (sampler.magFilter != -1) {
+            sampler_state.mag_filter = sampler.magFilter;
+        }
+        if (sampler.minFilter != -1) {
+            sampler_state.min_filter = sampler.minFilter;
+        }
+        sampler_state.wrap_s = sampler.wrapS;
+        sampler_state.wrap_t = sampler.wrapT;
+    }
+
+    const auto &image = model.images[source];
+    const int32_t index = static_cast<int32_t>(textures.size());
+    textures.push_back({source, texture.sampler, sampler_state, color_space,
+                        encoded->width, encoded->height, encoded,
+                        fallback_image, TextureLayout{}});
+    lookup[key] = index;
+
+    std::cout << "Texture[" << index << "]: " << image.uri << std::endl;
+    return index;
+}
+
+size_t TextureRegistry::load_baked(const std::filesystem::path &directory) {
+    std::ifstream manifest(directory / baked_manifest);
+    if (!manifest) {
+        return 0;
+    }
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        int image_index = -1;
+        std::string space_name;
+        size_t source_size = 0;
+        std::string file_name;
+        if (!(fields >> image_index >> space_name >> source_size >>
+              file_name)) {
+            std::cerr << "Skipping malformed baked manifest line: " << line
+                      << std::endl;
+            continue;
+        }
+        std::optional<ColorSpace> color_space;
+        for (auto space :
+             {ColorSpace::srgb, ColorSpace::linear, ColorSpace::normal}) {
+            if (space_name == get_color_space_name(space)) {
+                color_space = space;
+            }
+        }
+        if (!color_space) {
+            std::cerr << "Skipping baked texture with unknown color space: "
+                      << line << std::endl;
+            continue;
+        }
+
+        std::ifstream file(directory / file_name, std::ios::binary);
+        EncodedImage image;
+        image.bytes.assign(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+        Ktx2Info info;
+        std::string error;
+        if (!parse_ktx2(image.bytes.data(), image.bytes.size(), info, error)) {
+            std::cerr << "Skipping baked texture " << file_name << ": "
+                      << error << std::endl;
+            continue;
+        }
+        image.width = static_cast<int>(info.width);
+        image.height = static_cast<int>(info.height);
+        image.ktx2 = std::move(info);
+        baked[{image_index, *color_space}] = {
+            source_size, std::make_shared<const EncodedImage>(std::move(image))};
+    }
+    return baked.size();
+}
+
+DecodeStats TextureRegistry::get_decode_stats() {
+    pool->wait_idle();
+
+    DecodeStats stats;
+    stats.images = submitted;
+    stats.pixels = decoded_pixels.load();
+    stats.wall_ms = last_finish_ns.load() / 1.0e6;
+    stats.decode_ms = decode_ns.load() / 1.0e6;
+    stats.threads = static_cast<unsigned int>(pool->size());
+    return stats;
+}
+
+void TextureRegistry::print_decode_stats() {
+    const auto stats = get_decode_stats();
+    std::cout << "Decoded " << stats.images << " images ("
+              << stats.pixels / 1.0e6 << " MPix) on " << stats.threads
+              << " threads: " << stats.wall_ms << " ms wall, "
+              << stats.decode_ms << " ms total decode time" << std::endl;
+}